@@ -0,0 +1,487 @@
+/*
+ * Benchmarks for libspndarray
+ *
+ * build with optimizations, e.g. `make bench CFLAGS=-O2`, and run
+ * as `./bench [nonzeros] [probes]`
+ *
+ * every measurement is printed as one line of JSON:
+ *
+ *  {"op": ..., "dist": ..., "ndim": ..., "nz": ..., "density": ...,
+ *   "items": ..., "seconds": ..., "throughput": ..., "unit": ...,
+ *   "p50_ns": ..., "p90_ns": ..., "p99_ns": ..., "check": ...}
+ *
+ * throughput counts calls (point operations) or input elements (bulk
+ * operations) per second over every sample; the percentiles are of
+ * the time per call or per element within one sample, a batch of
+ * calls or a run of the operation. check is a value computed from the
+ * results, so that nothing is optimized away, and must not change
+ * between runs of the same build
+ */
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "spndarray.h"
+
+/* calls timed together by the point operations */
+#define BENCH_BATCH 256
+/* samples taken of each bulk operation, at most */
+#define BENCH_REPS 9
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ull;
+
+static uint64_t rng_next() {
+  // xorshift64*
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return rng_state * 0x2545f4914f6cdd1dull;
+}
+
+/* uniform in [0, 1) */
+static double rng_unit() { return (rng_next() >> 11) * 0x1p-53; }
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * a synthetic tensor: its shape, and coordinates and values to store
+ */
+typedef struct {
+  const char *dist; /* uniform, powerlaw or frostt */
+  double density;   /* requested nz over the number of cells, or 0 */
+  size_t ndim;
+  size_t dimsizes[4];
+  size_t n;      /* coordinates generated, repeats included */
+  size_t *idxs;  /* ndim indices per coordinate */
+  double *vals;  /* value of each coordinate */
+} bench_data;
+
+static int compare_double(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+/*
+ * report()
+ * Prints a measurement made of n samples of items each, taking the
+ * given seconds
+ */
+static void report(const char *op, const bench_data *d, const size_t nz,
+                   const size_t items, double *seconds, const size_t n,
+                   const char *unit, const double check) {
+  double total = 0, pct[3];
+  const double at[3] = {0.5, 0.9, 0.99};
+
+  for (size_t i = 0; i < n; i++)
+    total += seconds[i];
+  qsort(seconds, n, sizeof(double), compare_double);
+  for (size_t p = 0; p < 3; p++) {
+    size_t k = (size_t)ceil(at[p] * n);
+    pct[p] = seconds[k ? k - 1 : 0] * 1e9 / (items ? items : 1);
+  }
+
+  printf("{\"op\": \"%s\", \"dist\": \"%s\", \"ndim\": %zu, \"nz\": %zu, "
+         "\"density\": %g, \"items\": %zu, \"seconds\": %.6f, "
+         "\"throughput\": %.1f, \"unit\": \"%s\", \"p50_ns\": %.1f, "
+         "\"p90_ns\": %.1f, \"p99_ns\": %.1f, \"check\": %.17g}\n",
+         op, d->dist, d->ndim, nz, d->density, n * items, total,
+         total > 0 ? n * items / total : 0, unit, pct[0], pct[1], pct[2],
+         check);
+  fflush(stdout);
+}
+
+/*
+ * bench_generate()
+ *
+ * Draws n coordinates of a tensor
+ *
+ * Notes
+ *  uniform tensors are cubes with every coordinate equally likely;
+ *  powerlaw tensors have the same shape, with each index drawn as
+ *  size * u^3, which crowds the elements toward the origin like the
+ *  degree distributions of real data. frostt tensors are shaped like
+ *  the NIPS tensor of the FROSTT collection (2482 x 2862 x 14036 x
+ *  17) with power-law indices
+ */
+static void bench_generate(bench_data *d, const char *dist, const size_t n,
+                           const double density) {
+  d->dist = dist;
+  d->density = density;
+  d->n = n;
+  if (!strcmp(dist, "frostt")) {
+    const size_t nips[] = {2482, 2862, 14036, 17};
+    d->ndim = 4;
+    memcpy(d->dimsizes, nips, sizeof(nips));
+    d->density = 0;
+  } else {
+    size_t side = (size_t)ceil(cbrt(n / density));
+    d->ndim = 3;
+    for (size_t i = 0; i < 3; i++)
+      d->dimsizes[i] = side;
+  }
+
+  const int skewed = strcmp(dist, "uniform") != 0;
+  d->idxs = malloc(d->ndim * n * sizeof(size_t));
+  d->vals = malloc(n * sizeof(double));
+  if (!d->idxs || !d->vals) {
+    fprintf(stderr, "not enough space for the benchmark data\n");
+    exit(1);
+  }
+  for (size_t e = 0; e < n; e++) {
+    for (size_t i = 0; i < d->ndim; i++) {
+      double u = rng_unit();
+      d->idxs[e * d->ndim + i] =
+          (size_t)(d->dimsizes[i] * (skewed ? u * u * u : u));
+    }
+    d->vals[e] = (double)(rng_next() % 1000) + 1;
+  }
+}
+
+static void bench_data_free(bench_data *d) {
+  free(d->idxs);
+  free(d->vals);
+}
+
+static spndarray *bench_build(const bench_data *d) {
+  spndarray *m =
+      spndarray_alloc_nzmax(d->ndim, d->dimsizes, d->n, SPNDARRAY_NTUPLE);
+  spndarray_set_batch(m, d->n, d->vals, d->idxs);
+  return m;
+}
+
+static double array_sum(const spndarray *m) {
+  double sum = 0;
+  for (size_t n = 0; m && n < m->nz; n++)
+    sum += m->data[n];
+  return sum;
+}
+
+/*
+ * bench_points()
+ * set, get and incr, one call at a time, timed in batches
+ */
+static void bench_points(const bench_data *d) {
+  const size_t nbatch = d->n / BENCH_BATCH;
+  if (!nbatch)
+    return;
+
+  double *seconds = malloc(nbatch * sizeof(double));
+  spndarray *m =
+      spndarray_alloc_nzmax(d->ndim, d->dimsizes, d->n, SPNDARRAY_NTUPLE);
+  size_t *probes = malloc(d->ndim * d->n * sizeof(size_t));
+  double check = 0;
+
+  for (size_t b = 0; b < nbatch; b++) {
+    double t = now();
+    for (size_t e = b * BENCH_BATCH; e < (b + 1) * BENCH_BATCH; e++)
+      spndarray_set(m, d->vals[e], &d->idxs[e * d->ndim]);
+    seconds[b] = now() - t;
+  }
+  report("set", d, m->nz, BENCH_BATCH, seconds, nbatch, "calls/s",
+         array_sum(m));
+
+  // half of the probes hit a stored element, the other half are drawn
+  // from the whole shape and mostly miss
+  for (size_t e = 0; e < d->n; e++)
+    for (size_t i = 0; i < d->ndim; i++)
+      probes[e * d->ndim + i] =
+          e % 2 ? d->idxs[(rng_next() % d->n) * d->ndim + i]
+                : rng_next() % d->dimsizes[i];
+  for (size_t b = 0; b < nbatch; b++) {
+    double t = now();
+    for (size_t e = b * BENCH_BATCH; e < (b + 1) * BENCH_BATCH; e++)
+      check += spndarray_get(m, &probes[e * d->ndim]);
+    seconds[b] = now() - t;
+  }
+  report("get", d, m->nz, BENCH_BATCH, seconds, nbatch, "calls/s", check);
+
+  for (size_t b = 0; b < nbatch; b++) {
+    double t = now();
+    for (size_t e = b * BENCH_BATCH; e < (b + 1) * BENCH_BATCH; e++)
+      spndarray_incr(m, &probes[e * d->ndim]);
+    seconds[b] = now() - t;
+  }
+  report("incr", d, m->nz, BENCH_BATCH, seconds, nbatch, "calls/s",
+         array_sum(m));
+
+  spndarray_free(m);
+  free(probes);
+  free(seconds);
+}
+
+/*
+ * bench_bulk()
+ * Every whole-array operation, on arrays built from d and from e, a
+ * second draw of the same distribution
+ */
+static void bench_bulk(const bench_data *d, const bench_data *e) {
+  spndarray *m = bench_build(d), *n = bench_build(e), *r;
+  const size_t reps = d->n >= (1 << 20) ? 3 : BENCH_REPS;
+  double seconds[BENCH_REPS], check, t;
+  char path[64];
+
+  spndarray *v = spndarray_alloc_nzmax(1, &d->dimsizes[1], d->dimsizes[1],
+                                       SPNDARRAY_NTUPLE);
+  for (size_t k = 0; k < d->dimsizes[1]; k += 3)
+    spndarray_set(v, 1.0 + k % 7, &k);
+  snprintf(path, sizeof(path), "/tmp/spndarray-bench-%d", (int)getpid());
+
+  // each macro runs an expression reps times, keeping the last result
+#define BENCH_ARRAY(name, expr, items)                                     \
+  do {                                                                     \
+    for (size_t k = 0; k < reps; k++) {                                    \
+      t = now();                                                           \
+      r = (expr);                                                          \
+      seconds[k] = now() - t;                                              \
+      check = array_sum(r);                                                \
+      if (r && r != m)                                                     \
+        spndarray_free(r);                                                 \
+    }                                                                      \
+    report(name, d, m->nz, (items), seconds, reps, "elements/s", check);   \
+  } while (0)
+
+  BENCH_ARRAY("alloc",
+              spndarray_alloc_nzmax(d->ndim, d->dimsizes, m->nz,
+                                    SPNDARRAY_NTUPLE),
+              m->nz);
+  BENCH_ARRAY("add", spndarray_add(m, n), m->nz + n->nz);
+  BENCH_ARRAY("sub", spndarray_sub(m, n), m->nz + n->nz);
+  BENCH_ARRAY("mul", spndarray_mul(m, n, -1), m->nz + n->nz);
+  BENCH_ARRAY("mul_vec", spndarray_mul_vec(m, v, 1), m->nz);
+  BENCH_ARRAY("reduce", spndarray_reduce(m, 1, reduce_sum), m->nz);
+  BENCH_ARRAY("reduce_dimension", spndarray_reduce_dimension(m, 0, 0),
+              m->nz);
+  BENCH_ARRAY("memcpy", spndarray_memcpy(m, NULL), m->nz);
+#undef BENCH_ARRAY
+
+  for (size_t k = 0; k < reps; k++) {
+    t = now();
+    spndarray_fwrite(m, NULL, path, SPNDARRAY_FWRITE_SPARSE);
+    seconds[k] = now() - t;
+  }
+  report("fwrite", d, m->nz, m->nz, seconds, reps, "elements/s", m->nz);
+  for (size_t k = 0; k < reps; k++) {
+    t = now();
+    spndarray_fwrite_binary(m, path);
+    seconds[k] = now() - t;
+  }
+  report("fwrite_binary", d, m->nz, m->nz, seconds, reps, "elements/s",
+         m->nz);
+  unlink(path);
+
+  spndarray_free(m);
+  spndarray_free(n);
+  spndarray_free(v);
+}
+
+/*
+ * bench_suite()
+ * Point and bulk operations over three distributions, at three sizes
+ * up to nz and, for the cubes, two densities
+ */
+static void bench_suite(const size_t nz) {
+  const char *dists[] = {"uniform", "powerlaw", "frostt"};
+  const double densities[] = {1e-3, 1e-5};
+
+  for (size_t size = nz / 64; size <= nz; size *= 8)
+    for (size_t k = 0; k < 3; k++)
+      for (size_t p = 0; p < (k < 2 ? 2 : 1); p++) {
+        bench_data d, e;
+        bench_generate(&d, dists[k], size, densities[p]);
+        bench_generate(&e, dists[k], size, densities[p]);
+        bench_points(&d);
+        bench_bulk(&d, &e);
+        bench_data_free(&d);
+        bench_data_free(&e);
+      }
+}
+
+/*
+ * random point queries on an array far larger than the caches;
+ * half of the probes hit an element, the other half miss
+ */
+static void bench_get(const size_t nz, const size_t nprobes) {
+  bench_data d = {"uniform", 0, 3, {1 << 16, 1 << 16, 1 << 16}, nz};
+  size_t *idxs = malloc(3 * nz * sizeof(size_t));
+  size_t *probes = malloc(3 * nprobes * sizeof(size_t));
+  double *vals = malloc(nz * sizeof(double));
+  double *out = malloc(nprobes * sizeof(double));
+
+  for (size_t i = 0; i < nz; i++) {
+    for (size_t j = 0; j < 3; j++)
+      idxs[3 * i + j] = rng_next() % d.dimsizes[j];
+    vals[i] = (double)(i % 1000) + 1;
+  }
+  spndarray *m = spndarray_alloc_nzmax(3, d.dimsizes, nz, SPNDARRAY_NTUPLE);
+  spndarray_set_batch(m, nz, vals, idxs);
+
+  for (size_t i = 0; i < nprobes; i++) {
+    size_t e = rng_next() % nz;
+    for (size_t j = 0; j < 3; j++)
+      probes[3 * i + j] =
+          (i % 2) ? idxs[3 * e + j] : rng_next() % d.dimsizes[j];
+  }
+
+  double t = now(), sum = 0;
+  for (size_t i = 0; i < nprobes; i++)
+    sum += spndarray_get(m, &probes[3 * i]);
+  t = now() - t;
+  report("get_probe", &d, m->nz, nprobes, &t, 1, "calls/s", sum);
+
+  t = now(), sum = 0;
+  spndarray_get_interleaved(m, nprobes, probes, out);
+  t = now() - t;
+  for (size_t i = 0; i < nprobes; i++)
+    sum += out[i];
+  report("get_interleaved", &d, m->nz, nprobes, &t, 1, "calls/s", sum);
+
+  t = now(), sum = 0;
+  spndarray_get_batch(m, nprobes, probes, out);
+  t = now() - t;
+  for (size_t i = 0; i < nprobes; i++)
+    sum += out[i];
+  report("get_batch", &d, m->nz, nprobes, &t, 1, "calls/s", sum);
+
+  spndarray_frozen *f = spndarray_freeze(m);
+  t = now(), sum = 0;
+  spndarray_frozen_get_batch(f, nprobes, probes, out);
+  t = now() - t;
+  for (size_t i = 0; i < nprobes; i++)
+    sum += out[i];
+  report("frozen_get_batch", &d, m->nz, nprobes, &t, 1, "calls/s", sum);
+  spndarray_frozen_free(f);
+
+  spndarray_free(m);
+  free(idxs);
+  free(probes);
+  free(vals);
+  free(out);
+}
+
+/*
+ * lookups of absent coordinates with and without a membership filter
+ */
+static void bench_filter(const size_t nz, const size_t nprobes) {
+  bench_data d = {"uniform", 0, 3, {1 << 20, 1 << 20, 1 << 20}, nz};
+  size_t *idxs = malloc(3 * nz * sizeof(size_t));
+  double *vals = malloc(nz * sizeof(double));
+  size_t probe[3];
+
+  for (size_t i = 0; i < nz; i++) {
+    for (size_t j = 0; j < 3; j++)
+      idxs[3 * i + j] = rng_next() % d.dimsizes[j];
+    vals[i] = 1;
+  }
+  spndarray *m = spndarray_alloc_nzmax(3, d.dimsizes, nz, SPNDARRAY_NTUPLE);
+  spndarray_set_batch(m, nz, vals, idxs);
+
+  for (int filtered = 0; filtered < 2; filtered++) {
+    if (filtered)
+      spndarray_filter_enable(m, 0.01, 0);
+
+    uint64_t seed = rng_state;
+    double t = now(), sum = 0;
+    for (size_t i = 0; i < nprobes; i++) {
+      for (size_t j = 0; j < 3; j++)
+        probe[j] = rng_next() % d.dimsizes[j];
+      sum += spndarray_get(m, probe);
+    }
+    t = now() - t;
+    rng_state = seed;
+    report(filtered ? "get_miss_filtered" : "get_miss", &d, m->nz, nprobes,
+           &t, 1, "calls/s", sum);
+  }
+
+  spndarray_free(m);
+  free(idxs);
+  free(vals);
+}
+
+typedef struct {
+  spndarray *m;
+  spndarray_sharded *s;
+  pthread_mutex_t lock;
+  const size_t *idxs;
+} incr_ctx;
+
+static void locked_incr_range(void *param, size_t begin, size_t end) {
+  incr_ctx *c = param;
+  for (size_t i = begin; i < end; i++) {
+    pthread_mutex_lock(&c->lock);
+    spndarray_incr(c->m, &c->idxs[3 * i]);
+    pthread_mutex_unlock(&c->lock);
+  }
+}
+
+static void sharded_incr_range(void *param, size_t begin, size_t end) {
+  incr_ctx *c = param;
+  for (size_t i = begin; i < end; i++)
+    spndarray_sharded_incr(c->s, &c->idxs[3 * i]);
+}
+
+static void accum_incr_range(void *param, size_t begin, size_t end) {
+  incr_ctx *c = param;
+  spndarray_accum *a = spndarray_accum_alloc(c->s, 0);
+  for (size_t i = begin; i < end; i++)
+    spndarray_accum_incr(a, &c->idxs[3 * i]);
+  spndarray_accum_free(a);
+}
+
+/*
+ * multithreaded histogramming: one global lock around spndarray_incr
+ * against a sharded array, directly and through thread-local buffers
+ */
+static void bench_incr_threads(const size_t nincr) {
+  bench_data d = {"uniform", 0, 3, {1 << 10, 1 << 10, 1 << 10}, nincr};
+  size_t *idxs = malloc(3 * nincr * sizeof(size_t));
+  incr_ctx c = {NULL, NULL, PTHREAD_MUTEX_INITIALIZER, idxs};
+
+  for (size_t i = 0; i < nincr; i++)
+    for (size_t j = 0; j < 3; j++)
+      idxs[3 * i + j] = rng_next() % d.dimsizes[j];
+
+  c.m = spndarray_alloc_nzmax(3, d.dimsizes, 1024, SPNDARRAY_NTUPLE);
+  double t = now();
+  spndarray_parallel_for(nincr, 1024, locked_incr_range, &c);
+  t = now() - t;
+  report("incr_locked", &d, c.m->nz, nincr, &t, 1, "calls/s",
+         array_sum(c.m));
+  spndarray_free(c.m);
+
+  c.s = spndarray_sharded_alloc(3, d.dimsizes, 0, SPNDARRAY_SHARD_HASH);
+  t = now();
+  spndarray_parallel_for(nincr, 1024, sharded_incr_range, &c);
+  t = now() - t;
+  report("incr_sharded", &d, spndarray_sharded_nnz(c.s), nincr, &t, 1,
+         "calls/s", spndarray_get_num_threads());
+  spndarray_sharded_free(c.s);
+
+  c.s = spndarray_sharded_alloc(3, d.dimsizes, 0, SPNDARRAY_SHARD_HASH);
+  t = now();
+  spndarray_parallel_for(nincr, 1024, accum_incr_range, &c);
+  t = now() - t;
+  report("incr_buffered", &d, spndarray_sharded_nnz(c.s), nincr, &t, 1,
+         "calls/s", spndarray_get_num_threads());
+  spndarray_sharded_free(c.s);
+  free(idxs);
+}
+
+int main(int argc, char **argv) {
+  size_t nz = argc > 1 ? strtoull(argv[1], NULL, 10) : 1 << 20;
+  size_t nprobes = argc > 2 ? strtoull(argv[2], NULL, 10) : 1 << 20;
+
+  bench_suite(nz);
+  bench_get(2 * nz, nprobes);
+  bench_filter(2 * nz, nprobes);
+  bench_incr_threads(nprobes);
+  return 0;
+}
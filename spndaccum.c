@@ -0,0 +1,197 @@
+#include "spndarray.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Per-thread accumulation buffer in front of a sharded array
+ *
+ * increments are aggregated in a private open-addressing hash table
+ * keyed by coordinates; nothing is shared until the table holds
+ * `threshold` distinct coordinates or the owner calls
+ * spndarray_accum_flush(), at which point the aggregated counts are
+ * pushed as one batch
+ */
+struct spndarray_accum {
+  spndarray_sharded *target; /* array receiving the flushed counts */
+  size_t ndim;               /* number of dimensions */
+  size_t threshold;          /* distinct coordinates buffered before a flush */
+  size_t mask;               /* number of hash slots - 1 */
+  size_t *keys;              /* coordinates of each slot, ndim per slot */
+  double *counts;            /* accumulated increment of each slot */
+  unsigned char *full;       /* whether each slot is occupied */
+  size_t *used;              /* occupied slots, in insertion order */
+  size_t n;                  /* number of occupied slots */
+  size_t *batch_idxs;        /* flush workspace: coordinates */
+  double *batch_deltas;      /* flush workspace: increments */
+  size_t *shard_seen;        /* flush workspace: shards touched */
+  size_t pending;            /* increments received since the last flush */
+  size_t absorbed;           /* increments covered by past flushes */
+  spndarray_accum_stats stats;
+};
+
+/*
+ * spndarray_accum_alloc()
+ *
+ * Allocate a thread-local accumulation buffer
+ *
+ * Inputs
+ *  target    - the shared array the counts are flushed into
+ *  threshold - number of distinct coordinates to buffer before
+ *              flushing, 0 for a default of 4096
+ *
+ * Notes
+ *  a buffer must only be used by one thread; give every thread its
+ *  own, and flush (or free) them all at the end of the counting phase
+ */
+spndarray_accum *spndarray_accum_alloc(spndarray_sharded *target,
+                                       const size_t threshold) {
+  spndarray_accum *a = calloc(1, sizeof(*a));
+  if (!a) {
+    fprintf(stderr, "not enough space for accumulation buffer");
+    abort();
+  }
+
+  a->target = target;
+  a->ndim = spndarray_sharded_ndim(target);
+  a->threshold = threshold ? threshold : 4096;
+
+  // keep the table at most half full
+  size_t slots = 16;
+  while (slots < 2 * a->threshold)
+    slots *= 2;
+  a->mask = slots - 1;
+
+  a->keys = malloc(slots * a->ndim * sizeof(size_t));
+  a->counts = malloc(slots * sizeof(double));
+  a->full = calloc(slots, 1);
+  a->used = malloc(a->threshold * sizeof(size_t));
+  a->batch_idxs = malloc(a->threshold * a->ndim * sizeof(size_t));
+  a->batch_deltas = malloc(a->threshold * sizeof(double));
+  a->shard_seen = calloc(spndarray_sharded_nshards(target), sizeof(size_t));
+  if (!a->keys || !a->counts || !a->full || !a->used || !a->batch_idxs ||
+      !a->batch_deltas || !a->shard_seen) {
+    fprintf(stderr, "not enough space for accumulation buffer");
+    abort();
+  }
+  return a;
+} /* spndarray_accum_alloc() */
+
+/*
+ * spndarray_accum_free()
+ * Flushes and frees the given buffer
+ */
+void spndarray_accum_free(spndarray_accum *a) {
+  spndarray_accum_flush(a);
+  free(a->keys);
+  free(a->counts);
+  free(a->full);
+  free(a->used);
+  free(a->batch_idxs);
+  free(a->batch_deltas);
+  free(a->shard_seen);
+  free(a);
+}
+
+/*
+ * spndarray_accum_flush()
+ *
+ * Pushes the buffered counts into the shared array
+ *
+ * Notes
+ *  the counts go out through spndarray_sharded_incr_batch(), which
+ *  takes every shard lock involved once and applies each shard's
+ *  part as a sorted batch
+ */
+int spndarray_accum_flush(spndarray_accum *a) {
+  const size_t ndim = a->ndim;
+  size_t shards = 0;
+  int r;
+
+  if (a->n == 0)
+    return 0;
+
+  a->stats.flushes++;
+  for (size_t k = 0; k < a->n; k++) {
+    size_t slot = a->used[k];
+    memcpy(&a->batch_idxs[k * ndim], &a->keys[slot * ndim],
+           ndim * sizeof(size_t));
+    a->batch_deltas[k] = a->counts[slot];
+    a->full[slot] = 0;
+
+    size_t shard = spndarray_sharded_shard(a->target, &a->keys[slot * ndim]);
+    if (a->shard_seen[shard] != a->stats.flushes) {
+      a->shard_seen[shard] = a->stats.flushes;
+      shards++;
+    }
+  }
+
+  r = spndarray_sharded_incr_batch(a->target, a->n, a->batch_idxs,
+                                   a->batch_deltas);
+  a->stats.flushed += a->n;
+  a->stats.locks += shards;
+  a->absorbed += a->pending;
+  a->pending = 0;
+  a->n = 0;
+  return r;
+}
+
+/*
+ * spndarray_accum_add()
+ * Adds delta to the given coordinates in the buffer, flushing it first
+ * if it is full
+ */
+int spndarray_accum_add(spndarray_accum *a, const double delta,
+                        const size_t *idxs) {
+  const size_t ndim = a->ndim;
+  const size_t home = spndarray_hash_idx(ndim, idxs) & a->mask;
+  size_t slot = home;
+
+  a->stats.incrs++;
+  for (;; slot = (slot + 1) & a->mask) {
+    if (!a->full[slot])
+      break;
+    if (!spndarray_compare_idx(ndim, &a->keys[slot * ndim], idxs)) {
+      a->counts[slot] += delta;
+      a->pending++;
+      return 0;
+    }
+  }
+
+  int r = 0;
+  if (a->n == a->threshold) {
+    r = spndarray_accum_flush(a);
+    // the table is empty again: the key goes to its home slot, where
+    // the next probe for it starts
+    slot = home;
+  }
+
+  memcpy(&a->keys[slot * ndim], idxs, ndim * sizeof(size_t));
+  a->counts[slot] = delta;
+  a->full[slot] = 1;
+  a->used[a->n++] = slot;
+  a->pending++;
+  return r;
+}
+
+int spndarray_accum_incr(spndarray_accum *a, const size_t *idxs) {
+  return spndarray_accum_add(a, 1.0, idxs);
+}
+
+/*
+ * spndarray_accum_get_stats()
+ *
+ * Reports how much traffic the buffer kept off the shared array
+ *
+ * Notes
+ *  without the buffer, every flushed increment would have taken a
+ *  shard lock and updated the shared index; `locks` and `flushed` are
+ *  what was done instead
+ */
+void spndarray_accum_get_stats(const spndarray_accum *a,
+                               spndarray_accum_stats *stats) {
+  *stats = a->stats;
+  stats->buffered = a->n;
+  stats->locks_avoided = a->absorbed - a->stats.locks;
+  stats->updates_avoided = a->absorbed - a->stats.flushed;
+}
@@ -0,0 +1,253 @@
+#define _GNU_SOURCE
+#include "spndarray.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+/* alignment of the blocks handed out by the arena */
+#define SPNDARRAY_ARENA_ALIGN 64
+/* default size of the arena's blocks of memory */
+#define SPNDARRAY_ARENA_BLOCK ((size_t)64 << 20)
+/* huge page size, and smallest buffer given huge pages */
+#define SPNDARRAY_HUGEPAGE ((size_t)2 << 20)
+
+typedef struct arena_block {
+  struct arena_block *next; /* block filled before this one */
+  size_t size;              /* bytes in data */
+  size_t used;              /* bytes handed out from data */
+  char *data;               /* the memory, aligned */
+} arena_block;
+
+typedef struct {
+  spndarray_allocator allocator; /* must come first */
+  arena_block *head;             /* block being filled */
+  size_t block_size;             /* size of new blocks */
+  size_t used;                   /* bytes handed out and not given back */
+} spnd_arena;
+
+static inline size_t arena_round(const size_t size) {
+  const size_t mask = SPNDARRAY_ARENA_ALIGN - 1;
+  return (size + mask) & ~mask;
+}
+
+static arena_block *arena_block_alloc(const size_t size) {
+  arena_block *b = malloc(sizeof(*b));
+  if (!b)
+    return NULL;
+  b->data = aligned_alloc(SPNDARRAY_ARENA_ALIGN, arena_round(size));
+  if (!b->data) {
+    free(b);
+    return NULL;
+  }
+  b->size = arena_round(size);
+  b->used = 0;
+  b->next = NULL;
+  return b;
+}
+
+static void *arena_alloc(size_t size, void *state) {
+  spnd_arena *a = (spnd_arena *)state;
+  arena_block *b = a->head;
+
+  size = arena_round(size);
+  if (!b || b->size - b->used < size) {
+    b = arena_block_alloc(size > a->block_size ? size : a->block_size);
+    if (!b)
+      return NULL;
+    b->next = a->head;
+    a->head = b;
+  }
+  void *p = b->data + b->used;
+  b->used += size;
+  a->used += size;
+  return p;
+}
+
+/* whether ptr is the last block handed out */
+static inline int arena_is_last(const spnd_arena *a, const void *ptr,
+                                const size_t size) {
+  const arena_block *b = a->head;
+  return b && (const char *)ptr + arena_round(size) == b->data + b->used;
+}
+
+static void arena_free(void *ptr, size_t size, void *state) {
+  spnd_arena *a = (spnd_arena *)state;
+
+  // only the last block can be taken back; the rest waits for a reset
+  if (arena_is_last(a, ptr, size))
+    a->head->used -= arena_round(size);
+  a->used -= arena_round(size);
+}
+
+static void *arena_realloc(void *ptr, size_t old_size, size_t size,
+                           void *state) {
+  spnd_arena *a = (spnd_arena *)state;
+  arena_block *b = a->head;
+
+  // the last block grows or shrinks in place when it fits
+  if (arena_is_last(a, ptr, old_size) &&
+      (char *)ptr + arena_round(size) <= b->data + b->size) {
+    b->used = (char *)ptr - b->data + arena_round(size);
+    a->used += arena_round(size) - arena_round(old_size);
+    return ptr;
+  }
+
+  void *p = arena_alloc(size, state);
+  if (!p)
+    return NULL;
+  memcpy(p, ptr, old_size < size ? old_size : size);
+  arena_free(ptr, old_size, state);
+  return p;
+}
+
+/*
+ * spndarray_arena_create()
+ *
+ * Creates an arena allocator, for arrays that live for a short time
+ *
+ * Inputs
+ *  block_size - bytes taken from malloc at a time, 0 for 64MB
+ *
+ * Notes
+ *  buffers are handed out by bumping a pointer through large blocks,
+ *  and their memory is only reclaimed by spndarray_arena_reset() or
+ *  spndarray_arena_destroy(), after the arrays using the arena are
+ *  freed. An arena must only be used by one thread at a time
+ */
+spndarray_allocator *spndarray_arena_create(const size_t block_size) {
+  spnd_arena *a = calloc(1, sizeof(*a));
+  if (!a) {
+    fprintf(stderr, "not enough space for arena");
+    abort();
+  }
+  a->allocator.alloc = arena_alloc;
+  a->allocator.realloc = arena_realloc;
+  a->allocator.free = arena_free;
+  a->allocator.state = a;
+  a->block_size = block_size ? block_size : SPNDARRAY_ARENA_BLOCK;
+  return &a->allocator;
+}
+
+/*
+ * spndarray_arena_reset()
+ * Takes back every buffer of the arena at once, keeping its most recent
+ * block for reuse
+ */
+void spndarray_arena_reset(spndarray_allocator *allocator) {
+  spnd_arena *a = (spnd_arena *)allocator->state;
+
+  if (!a->head)
+    return;
+  for (arena_block *b = a->head->next, *next; b; b = next) {
+    next = b->next;
+    free(b->data);
+    free(b);
+  }
+  a->head->next = NULL;
+  a->head->used = 0;
+  a->used = 0;
+}
+
+void spndarray_arena_destroy(spndarray_allocator *allocator) {
+  spnd_arena *a = (spnd_arena *)allocator->state;
+
+  spndarray_arena_reset(allocator);
+  if (a->head) {
+    free(a->head->data);
+    free(a->head);
+  }
+  free(a);
+}
+
+/*
+ * spndarray_arena_used()
+ * Bytes of the arena handed out and not given back
+ */
+size_t spndarray_arena_used(const spndarray_allocator *allocator) {
+  return ((const spnd_arena *)allocator->state)->used;
+}
+
+static inline size_t huge_round(const size_t size) {
+  return (size + SPNDARRAY_HUGEPAGE - 1) & ~(SPNDARRAY_HUGEPAGE - 1);
+}
+
+/*
+ * huge_map()
+ *
+ * Maps len bytes, a multiple of the huge page size, backed by huge
+ * pages if possible
+ *
+ * Notes
+ *  reserved huge pages (MAP_HUGETLB) are tried first; otherwise the
+ *  mapping is aligned to a huge page and left to transparent huge
+ *  pages
+ */
+static void *huge_map(const size_t len) {
+  void *p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (p != MAP_FAILED)
+    return p;
+
+  // over-map by one huge page and trim both ends to align
+  char *q = mmap(NULL, len + SPNDARRAY_HUGEPAGE, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (q == MAP_FAILED)
+    return NULL;
+  char *aligned = (char *)huge_round((uintptr_t)q);
+  if (aligned > q)
+    munmap(q, aligned - q);
+  munmap(aligned + len, q + SPNDARRAY_HUGEPAGE - aligned);
+  madvise(aligned, len, MADV_HUGEPAGE);
+  return aligned;
+}
+
+static void *huge_alloc(size_t size, void *state) {
+  (void)state;
+  if (size < SPNDARRAY_HUGEPAGE)
+    return malloc(size);
+  return huge_map(huge_round(size));
+}
+
+static void huge_free(void *ptr, size_t size, void *state) {
+  (void)state;
+  if (size < SPNDARRAY_HUGEPAGE)
+    free(ptr);
+  else
+    munmap(ptr, huge_round(size));
+}
+
+static void *huge_realloc(void *ptr, size_t old_size, size_t size,
+                          void *state) {
+  if (old_size < SPNDARRAY_HUGEPAGE && size < SPNDARRAY_HUGEPAGE)
+    return realloc(ptr, size);
+
+  if (old_size >= SPNDARRAY_HUGEPAGE && size >= SPNDARRAY_HUGEPAGE) {
+    if (huge_round(old_size) == huge_round(size))
+      return ptr;
+    void *p = mremap(ptr, huge_round(old_size), huge_round(size),
+                     MREMAP_MAYMOVE);
+    if (p == MAP_FAILED)
+      return NULL;
+    madvise(p, huge_round(size), MADV_HUGEPAGE);
+    return p;
+  }
+
+  // crossing the threshold moves the buffer between malloc and mmap
+  void *p = huge_alloc(size, state);
+  if (!p)
+    return NULL;
+  memcpy(p, ptr, old_size < size ? old_size : size);
+  huge_free(ptr, old_size, state);
+  return p;
+}
+
+/*
+ * spndarray_hugepage_allocator
+ *
+ * Allocator backing buffers of 2MB and more with huge pages, which
+ * cuts the TLB misses of lookups and kernels over large arrays;
+ * smaller buffers come from malloc
+ */
+const spndarray_allocator spndarray_hugepage_allocator = {
+    huge_alloc, huge_realloc, huge_free, NULL};
@@ -1,24 +1,106 @@
+#define _GNU_SOURCE
 #include "spndarray.h"
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "avl.c"
 
-static int compare_ntuple(const void *pa, const void *pb, void *param);
 static void *avl_spmalloc(size_t size, void *param);
 static void avl_spfree(void *block, void *param);
 
 static struct libavl_allocator avl_allocator_spndarray = {avl_spmalloc,
                                                           avl_spfree};
 
-__attribute__((always_inline)) static inline size_t
-array_mul(const size_t len, const size_t *arr) {
-  size_t prod = 1;
-  for (size_t i = 0; i < len; i++)
-    prod *= arr[i];
-  return prod;
+/* smallest request checked against the memory budget */
+#define SPNDARRAY_BUDGET_LARGE ((size_t)1 << 20)
+
+/* bytes of array buffers held by the process, at most, and soft limit */
+static size_t spnd_mem_in_use, spnd_mem_peak, spnd_mem_budget;
+
+static inline void mem_charge(const size_t bytes) {
+  size_t cur = __atomic_add_fetch(&spnd_mem_in_use, bytes, __ATOMIC_RELAXED);
+  size_t peak = __atomic_load_n(&spnd_mem_peak, __ATOMIC_RELAXED);
+  while (cur > peak && !__atomic_compare_exchange_n(&spnd_mem_peak, &peak, cur,
+                                                     1, __ATOMIC_RELAXED,
+                                                     __ATOMIC_RELAXED))
+    ;
+}
+
+static inline void mem_release(const size_t bytes) {
+  __atomic_sub_fetch(&spnd_mem_in_use, bytes, __ATOMIC_RELAXED);
+}
+
+/*
+ * mem_admit()
+ * Whether bytes more of array buffers fit in the memory budget;
+ * requests under SPNDARRAY_BUDGET_LARGE always do
+ */
+static int mem_admit(const size_t bytes) {
+  const size_t budget = __atomic_load_n(&spnd_mem_budget, __ATOMIC_RELAXED);
+  const size_t cur = __atomic_load_n(&spnd_mem_in_use, __ATOMIC_RELAXED);
+
+  if (!budget || bytes < SPNDARRAY_BUDGET_LARGE || cur + bytes <= budget)
+    return 1;
+  fprintf(stderr, "%zd more bytes would exceed the memory budget of %zd "
+                  "(%zd in use)\n", bytes, budget, cur);
+  return 0;
+}
+
+/*
+ * buf_alloc(), buf_realloc(), buf_free()
+ * Manage the large buffers of an array through its allocator, keeping
+ * the process-wide tally of spndarray_memory_in_use()
+ */
+static inline void *buf_alloc(const spndarray *m, const size_t size) {
+  const spndarray_allocator *a = m->allocator;
+  void *p = a ? a->alloc(size, a->state) : malloc(size);
+  if (p)
+    mem_charge(size);
+  return p;
+}
+
+static inline void *buf_realloc(const spndarray *m, void *ptr,
+                                const size_t old_size, const size_t size) {
+  const spndarray_allocator *a = m->allocator;
+  void *p = a ? a->realloc(ptr, old_size, size, a->state)
+              : realloc(ptr, size);
+  if (p) {
+    mem_release(old_size);
+    mem_charge(size);
+  }
+  return p;
+}
+
+static inline void buf_free(const spndarray *m, void *ptr, const size_t size) {
+  const spndarray_allocator *a = m->allocator;
+  if (a)
+    a->free(ptr, size, a->state);
+  else
+    free(ptr);
+  mem_release(size);
 }
 
+/* bytes of the buffers of an array of nzmax elements */
+static inline size_t buf_bytes(const size_t ndim, const size_t nzmax,
+                               const size_t flags) {
+  size_t per = ndim * sizeof(size_t) +
+               spndarray_vsize(flags & SPNDARRAY_VTYPE_MASK);
+  if ((flags & ~(size_t)SPNDARRAY_VTYPE_MASK) == SPNDARRAY_NTUPLE)
+    per += sizeof(struct avl_node);
+  return nzmax > SIZE_MAX / per ? SIZE_MAX : nzmax * per;
+}
+
+/* nzmax of arrays allocated without one, at most */
+#define SPNDARRAY_ALLOC_NZMAX 1024
+
+/*
+ * growth policy of spndarray_reserve(); like the thread count, it is
+ * set once, before any array grows
+ */
+static int spnd_growth = SPNDARRAY_GROWTH_FACTOR;
+static double spnd_growth_param = 2.0;
+
 /*
  * spndarray_alloc()
  *
@@ -31,13 +113,18 @@ array_mul(const size_t len, const size_t *arr) {
  * Notes
  *   if the dim sizes are not known at allocation time, they can all
  *   be set to 1, and they will be expanded as elements are added
+ *
+ *   the density of the array is not known either, so room is made for
+ *   at most SPNDARRAY_ALLOC_NZMAX elements, and the array grows with
+ *   the policy of spndarray_set_growth(). Use spndarray_alloc_nzmax()
+ *   when the number of elements is known
  */
 spndarray *spndarray_alloc(const size_t ndims, const size_t *dims) {
-  const double density = 0.1; // estimate
-  size_t nzmax = (size_t)floor(array_mul(ndims, dims) * density);
-
-  if (nzmax == 0)
-    nzmax = 10;
+  size_t nzmax = 1;
+  for (size_t i = 0; i < ndims && nzmax < SPNDARRAY_ALLOC_NZMAX; i++)
+    nzmax *= dims[i] ? dims[i] : 1;
+  if (nzmax > SPNDARRAY_ALLOC_NZMAX)
+    nzmax = SPNDARRAY_ALLOC_NZMAX;
 
   return spndarray_alloc_nzmax(ndims, dims, nzmax, SPNDARRAY_NTUPLE);
 }
@@ -46,12 +133,56 @@ spndarray *spndarray_alloc(const size_t ndims, const size_t *dims) {
  * spndarray_alloc_nzmax()
  *
  * Allocate a sparse nd array with given nzmax
- *
- * TODO
  */
 spndarray *spndarray_alloc_nzmax(const size_t ndims, const size_t *dimsizes,
                                  const size_t nzmax, const size_t flags) {
+  return spndarray_alloc_with(ndims, dimsizes, nzmax, flags, NULL);
+}
+
+/*
+ * spndarray_alloc_with()
+ *
+ * Allocate a sparse nd array with given nzmax, taking its buffers from
+ * the given allocator
+ *
+ * Inputs
+ *  flags     - the storage type, SPNDARRAY_NTUPLE, or'ed with the value
+ *              type: SPNDARRAY_FLOAT64 (the default), SPNDARRAY_FLOAT32,
+ *              SPNDARRAY_INT64, SPNDARRAY_UINT32, SPNDARRAY_PATTERN,
+ *              SPNDARRAY_DICT8 or SPNDARRAY_DICT16
+ *  allocator - source of the index columns, data, tree nodes and
+ *              rebuild workspaces, NULL for malloc; it must outlive
+ *              the array and its clones
+ *
+ * Notes
+ *  returns NULL if the buffers would exceed the memory budget, see
+ *  spndarray_set_memory_budget()
+ *
+ *  arrays of a value type other than double work with the routines of
+ *  this file and of spndgetset.c, and with spndarray_reduce() and
+ *  spndarray_reduce_dimension(); convert them with spndarray_convert()
+ *  for the others. Pattern arrays keep no data array at all.
+ *  Dictionary arrays hold at most 256 (SPNDARRAY_DICT8) or 65536
+ *  (SPNDARRAY_DICT16) distinct values at a time; storing one more
+ *  fails. spndarray_fmap(), spndarray_negate() and
+ *  spndarray_mulinverse() take O(distinct values) on them
+ *
+ *  arrays computed from an array, by its clones, the arithmetic of
+ *  spndop.c, reductions and reshapes, take their buffers from its
+ *  allocator too
+ */
+spndarray *spndarray_alloc_with(const size_t ndims, const size_t *dimsizes,
+                                const size_t nzmax, const size_t flags,
+                                const spndarray_allocator *allocator) {
   spndarray *m;
+  const size_t vtype = flags & SPNDARRAY_VTYPE_MASK;
+  if (vtype > SPNDARRAY_DICT16) {
+    fprintf(stderr, "unknown value type %zd\n", vtype);
+    return NULL;
+  }
+  if (!mem_admit(buf_bytes(ndims, nzmax < 1 ? 1 : nzmax, flags)))
+    return NULL;
+
   size_t *dimss = calloc(ndims, sizeof(size_t));
   for (size_t i = 0; i < ndims; i++)
     if (dimsizes[i] == 0) {
@@ -70,7 +201,10 @@ spndarray *spndarray_alloc_nzmax(const size_t ndims, const size_t *dimsizes,
   m->dimsizes = dimss;
   m->nz = 0;
   m->nzmax = (nzmax < 1) ? 1 : nzmax;
-  m->sptype = flags;
+  m->sptype = flags & ~(size_t)SPNDARRAY_VTYPE_MASK;
+  m->vtype = vtype;
+  m->allocator = allocator;
+  m->rank = spndarray_rank_ops_for(ndims);
 
   m->dims = calloc(ndims, sizeof(size_t *));
   if (!m->dims) {
@@ -78,7 +212,7 @@ spndarray *spndarray_alloc_nzmax(const size_t ndims, const size_t *dimsizes,
     abort();
   }
 
-  if (flags == SPNDARRAY_NTUPLE) {
+  if (m->sptype == SPNDARRAY_NTUPLE) {
     m->tree_data = malloc(sizeof(spndarray_tree));
     if (!m->tree_data) {
       fprintf(stderr, "not enough space for AVL tree");
@@ -86,37 +220,43 @@ spndarray *spndarray_alloc_nzmax(const size_t ndims, const size_t *dimsizes,
     }
     m->tree_data->n = 0;
     m->tree_data->tree =
-        avl_create(compare_ntuple, (void *)m, &avl_allocator_spndarray);
+        avl_create(m->rank->compare, (void *)m, &avl_allocator_spndarray);
     if (!m->tree_data->tree) {
       fprintf(stderr, "Not enough space for AVL tree");
       abort();
     }
 
-    m->tree_data->node_array = malloc(m->nzmax * sizeof(struct avl_node));
+    m->tree_data->node_array =
+        buf_alloc(m, m->nzmax * sizeof(struct avl_node));
     if (!m->tree_data->node_array) {
       fprintf(stderr, "Not enough space for AVL tree nodes");
       abort();
     }
     for (size_t i = 0; i < ndims; i++) {
-      m->dims[i] = malloc(m->nzmax * sizeof(size_t));
+      m->dims[i] = buf_alloc(m, m->nzmax * sizeof(size_t));
       if (!m->dims[i]) {
         fprintf(stderr, "Not enough space for dimension %zd indices", i);
         abort();
       }
     }
-  } else if (flags == SPNDARRAY_CCS) {
+  } else if (m->sptype == SPNDARRAY_CCS) {
     // TODO
     fprintf(stderr, "SPNDARRAY_CCS not implemented");
     abort();
   }
-  m->data = malloc(m->nzmax * sizeof(double));
-  if (!m->data) {
-    fprintf(stderr, "Not enough space for the data");
-    abort();
+  if (spndarray_vsize(vtype)) {
+    m->values = buf_alloc(m, m->nzmax * spndarray_vsize(vtype));
+    if (!m->values) {
+      fprintf(stderr, "Not enough space for the data");
+      abort();
+    }
   }
+  if ((vtype == SPNDARRAY_DICT8 || vtype == SPNDARRAY_DICT16) &&
+      spndarray_dict_create(m))
+    abort();
 
   return m;
-} /* spndarray_alloc_nzmax() */
+} /* spndarray_alloc_with() */
 
 /*
  * spndarray_set_fillvalue()
@@ -132,16 +272,31 @@ void spndarray_set_fillvalue(spndarray *m, const double fill) {
 /*
  * spndarray_free()
  * Frees the given array
+ *
+ * Notes
+ *  buffers shared with copy-on-write clones are only freed along with
+ *  the last array using them
  */
 void spndarray_free(spndarray *m) {
+  int owner = 1;
+
+  if (m->shared) {
+    owner = __atomic_sub_fetch(&m->shared->refs, 1, __ATOMIC_ACQ_REL) == 0;
+    if (owner)
+      free(m->shared);
+    else if (m->tree_data)
+      // avl_destroy() relinks the nodes as it walks them
+      ((struct avl_table *)m->tree_data->tree)->avl_root = NULL;
+  }
+
   if (m->dims) {
-    for (size_t i = 0; i < m->ndim; i++)
+    for (size_t i = 0; i < m->ndim && owner; i++)
       if (m->dims[i])
-        free(m->dims[i]);
+        buf_free(m, m->dims[i], m->nzmax * sizeof(size_t));
     free(m->dims);
   }
-  if (m->data)
-    free(m->data);
+  if (m->values && owner)
+    buf_free(m, m->values, m->nzmax * spndarray_vsize(m->vtype));
   if (m->dimsizes)
     free(m->dimsizes);
   if (m->work)
@@ -150,82 +305,613 @@ void spndarray_free(spndarray *m) {
     if (m->tree_data->tree)
       avl_destroy(m->tree_data->tree, NULL);
 
-    if (m->tree_data->node_array)
-      free(m->tree_data->node_array);
+    if (m->tree_data->node_array && owner)
+      buf_free(m, m->tree_data->node_array,
+               m->nzmax * sizeof(struct avl_node));
 
     free(m->tree_data);
   }
+  spndarray_filter_disable(m);
+  spndarray_dict_free(m);
   free(m);
 } /* spndarray_free() */
 
+typedef struct {
+  spndarray *m;
+  uintptr_t old_nodes; /* address the nodes were copied or moved from */
+  uintptr_t old_keys;  /* address dims[0] was copied or moved from */
+} spndarray_relocate;
+
+static inline struct avl_node *relocate_node(const spndarray_relocate *r,
+                                             const struct avl_node *p) {
+  struct avl_node *nodes = (struct avl_node *)r->m->tree_data->node_array;
+  return p ? &nodes[((uintptr_t)p - r->old_nodes) / sizeof(struct avl_node)]
+           : NULL;
+}
+
+static void relocate_range(void *param, size_t begin, size_t end) {
+  const spndarray_relocate *r = (const spndarray_relocate *)param;
+  struct avl_node *nodes = (struct avl_node *)r->m->tree_data->node_array;
+
+  for (size_t k = begin; k < end; k++) {
+    struct avl_node *p = &nodes[k];
+    p->avl_link[0] = relocate_node(r, p->avl_link[0]);
+    p->avl_link[1] = relocate_node(r, p->avl_link[1]);
+    p->avl_data =
+        &r->m->dims[0][((uintptr_t)p->avl_data - r->old_keys) / sizeof(size_t)];
+  }
+}
+
+/*
+ * tree_relocate()
+ * Repoints the tree of m at its node array and first index column
+ * after they were copied or moved from old_nodes and old_keys, in one
+ * linear pass over the nodes; the shape of the tree is kept
+ */
+static void tree_relocate(spndarray *m, const uintptr_t old_nodes,
+                          const uintptr_t old_keys) {
+  struct avl_table *tree = (struct avl_table *)m->tree_data->tree;
+  spndarray_relocate r = {m, old_nodes, old_keys};
+
+  spndarray_parallel_for(m->tree_data->n, spndarray_get_grain_size(),
+                         relocate_range, &r);
+  tree->avl_root = relocate_node(&r, tree->avl_root);
+}
+
 /*
  * spndarray_realloc()
  * As elements are added to the sparse array, it's possible that they
  * will exceed the previously specified nzmax - reallocate the array
  * with a new nzmax
+ *
+ * Notes
+ *  fails when growing the array would exceed the memory budget
  */
 int spndarray_realloc(const size_t nzmax, spndarray *m) {
-  int s = 0;
   void *ptr;
 
   if (nzmax < m->nz) {
     fprintf(stderr, "new nzmax is smaller than the current nz");
     return 1;
   }
+  const size_t flags = m->sptype | m->vtype;
+  if (nzmax > m->nzmax &&
+      !mem_admit(buf_bytes(m->ndim, nzmax, flags) -
+                 buf_bytes(m->ndim, m->nzmax, flags)))
+    return 1;
+  SPNDARRAY_STATS_ADD(reallocs, 1);
+  SPNDARRAY_STATS_ADD(realloc_bytes, buf_bytes(m->ndim, m->nzmax, flags));
+  spndarray_unshare(m);
+
+  const uintptr_t old_keys = (uintptr_t)m->dims[0];
+  const size_t vsize = spndarray_vsize(m->vtype);
 
   for (size_t i = 0; i < m->ndim; i++) {
-    ptr = realloc(m->dims[i], nzmax * sizeof(size_t));
+    ptr = buf_realloc(m, m->dims[i], m->nzmax * sizeof(size_t),
+                      nzmax * sizeof(size_t));
     if (!ptr) {
       fprintf(stderr, "failed to allocate space for dimension %zd indices", i);
       abort();
     }
     m->dims[i] = ptr;
   }
-  ptr = realloc(m->data, nzmax * sizeof(double));
-  if (!ptr) {
-    fprintf(stderr, "failed to allocate space for data");
-    abort();
+  if (vsize) {
+    ptr = buf_realloc(m, m->values, m->nzmax * vsize, nzmax * vsize);
+    if (!ptr) {
+      fprintf(stderr, "failed to allocate space for data");
+      abort();
+    }
+    m->values = ptr;
   }
-  m->data = ptr;
 
-  /* rebuild binary tree */
+  /* move binary tree */
   if (SPNDARRAY_ISNTUPLE(m)) {
-    size_t n;
-
-    // reset tree to empty state, but don't free it
-    avl_empty(m->tree_data->tree, NULL);
-    m->tree_data->n = 0;
+    const uintptr_t old_nodes = (uintptr_t)m->tree_data->node_array;
 
-    ptr = realloc(m->tree_data->node_array, nzmax * sizeof(struct avl_node));
+    ptr = buf_realloc(m, m->tree_data->node_array,
+                      m->nzmax * sizeof(struct avl_node),
+                      nzmax * sizeof(struct avl_node));
     if (!ptr) {
       fprintf(stderr, "failed to allocate space for AVL tree nodes");
       abort();
     }
     m->tree_data->node_array = ptr;
-    for (n = 0; n < m->nz; ++n) {
-      ptr = avl_insert(m->tree_data->tree, &m->data[n]);
-      if (ptr != NULL) {
-        fprintf(stderr, "detected duplicate entry while reallocating array");
-        abort();
-      }
-    }
+    tree_relocate(m, old_nodes, old_keys);
   }
   // update to new nzmax
   m->nzmax = nzmax;
-  return s;
+  return spndarray_filter_rebuild(m);
 } /* spndarray_realloc() */
 
+/*
+ * spndarray_set_growth()
+ *
+ * Sets how arrays grow when elements are added past their nzmax
+ *
+ * Inputs
+ *  policy - SPNDARRAY_GROWTH_FACTOR to multiply nzmax by param (more
+ *           than 1, 2 by default), SPNDARRAY_GROWTH_CHUNKED to add
+ *           param elements at a time, SPNDARRAY_GROWTH_EXACT to grow
+ *           to the size needed and no more
+ *  param  - factor or chunk size; 0 for the default of the policy
+ *
+ * Notes
+ *  the factor policy keeps appends amortized constant time; chunked
+ *  growth bounds the memory left unused on very large arrays, and
+ *  exact growth suits arrays filled by a known number of batches.
+ *  This must not be called while arrays are growing
+ *
+ * Return
+ *  0 on success
+ */
+int spndarray_set_growth(const int policy, const double param) {
+  switch (policy) {
+  case SPNDARRAY_GROWTH_FACTOR:
+    if (param != 0 && !(param > 1)) {
+      fprintf(stderr, "growth factor must be more than 1\n");
+      return 1;
+    }
+    spnd_growth_param = param ? param : 2.0;
+    break;
+  case SPNDARRAY_GROWTH_CHUNKED:
+    if (param != 0 && !(param >= 1)) {
+      fprintf(stderr, "growth chunk must be at least one element\n");
+      return 1;
+    }
+    spnd_growth_param = param ? floor(param) : 65536;
+    break;
+  case SPNDARRAY_GROWTH_EXACT:
+    spnd_growth_param = 0;
+    break;
+  default:
+    fprintf(stderr, "unknown growth policy %d\n", policy);
+    return 1;
+  }
+  spnd_growth = policy;
+  return 0;
+}
+
+/*
+ * spndarray_grown_nzmax()
+ * The nzmax the growth policy gives an array of nzmax elements that
+ * needs room for need of them
+ */
+size_t spndarray_grown_nzmax(const size_t nzmax, const size_t need) {
+  size_t grown = need;
+
+  if (spnd_growth == SPNDARRAY_GROWTH_FACTOR) {
+    double g = ceil(nzmax * spnd_growth_param);
+    if (g < (double)SIZE_MAX && (size_t)g > grown)
+      grown = (size_t)g;
+  } else if (spnd_growth == SPNDARRAY_GROWTH_CHUNKED && need > nzmax) {
+    size_t chunk = (size_t)spnd_growth_param;
+    size_t steps = (need - nzmax + chunk - 1) / chunk;
+    if (steps <= (SIZE_MAX - nzmax) / chunk)
+      grown = nzmax + steps * chunk;
+  }
+  return grown;
+}
+
+/*
+ * spndarray_reserve()
+ *
+ * Makes room for need elements in the array, growing it with the
+ * policy of spndarray_set_growth() when it is too small
+ *
+ * Return
+ *  0 on success
+ */
+int spndarray_reserve(spndarray *m, const size_t need) {
+  if (need <= m->nzmax)
+    return 0;
+  return spndarray_realloc(spndarray_grown_nzmax(m->nzmax, need), m);
+}
+
 int spndarray_set_zero(spndarray *m) {
+  if (m->shared && SPNDARRAY_ISNTUPLE(m)) {
+    // drop the elements first, so that there is nothing to copy
+    ((struct avl_table *)m->tree_data->tree)->avl_root = NULL;
+    m->tree_data->n = 0;
+    m->nz = 0;
+    spndarray_unshare(m);
+  }
   m->nz = 0;
   if (SPNDARRAY_ISNTUPLE(m)) {
     avl_empty(m->tree_data->tree, NULL);
     m->tree_data->n = 0;
   }
-  return 0;
+  spndarray_dict_clear(m);
+  return spndarray_filter_rebuild(m);
 }
 
 size_t spndarray_nnz(const spndarray *m) { return m->nz; }
 
+/*
+ * spndarray_memory_stats()
+ *
+ * Reports the memory held by an array, per component
+ *
+ * Notes
+ *  the buffers of copy-on-write clones are counted in full by each of
+ *  them, and also reported as shared
+ */
+void spndarray_memory_stats(const spndarray *m, spndarray_memory *stats) {
+  spndarray_filter_stats f;
+
+  memset(stats, 0, sizeof(*stats));
+  stats->dims = m->ndim * m->nzmax * sizeof(size_t);
+  stats->data =
+      m->nzmax * spndarray_vsize(m->vtype) + spndarray_dict_bytes(m);
+  stats->header = sizeof(*m) + m->ndim * (sizeof(size_t) + sizeof(size_t *));
+  if (m->tree_data) {
+    stats->nodes = m->nzmax * sizeof(struct avl_node);
+    stats->header += sizeof(spndarray_tree) + sizeof(struct avl_table);
+  }
+  if (!spndarray_filter_get_stats(m, &f))
+    stats->filter = f.bytes + sizeof(spndarray_filter);
+  stats->total = stats->dims + stats->data + stats->nodes + stats->filter +
+                 stats->header;
+
+  stats->slack = m->nzmax - m->nz;
+  stats->slack_bytes =
+      stats->slack * (m->ndim * sizeof(size_t) + spndarray_vsize(m->vtype) +
+                      (m->tree_data ? sizeof(struct avl_node) : 0));
+  if (m->shared &&
+      __atomic_load_n(&m->shared->refs, __ATOMIC_ACQUIRE) > 1)
+    stats->shared = stats->dims + stats->data + stats->nodes;
+}
+
+/*
+ * spndarray_set_memory_budget()
+ *
+ * Sets a soft limit on the bytes of array buffers held by the process
+ *
+ * Inputs
+ *  bytes - the limit, 0 for none
+ *
+ * Notes
+ *  allocating or growing an array by 1MB or more fails, with NULL or
+ *  an error, when it would take spndarray_memory_in_use() past the
+ *  limit. Smaller requests and the temporary copies made by
+ *  copy-on-write and tree rebuilds are counted but never refused, and
+ *  concurrent requests are checked independently, so the limit can be
+ *  overshot by a little
+ */
+void spndarray_set_memory_budget(const size_t bytes) {
+  __atomic_store_n(&spnd_mem_budget, bytes, __ATOMIC_RELAXED);
+}
+
+size_t spndarray_get_memory_budget(void) {
+  return __atomic_load_n(&spnd_mem_budget, __ATOMIC_RELAXED);
+}
+
+/*
+ * spndarray_memory_in_use()
+ * Bytes of index columns, data, tree nodes and rebuild workspaces held
+ * by every array of the process, whatever their allocator
+ */
+size_t spndarray_memory_in_use(void) {
+  return __atomic_load_n(&spnd_mem_in_use, __ATOMIC_RELAXED);
+}
+
+/*
+ * spndarray_memory_peak()
+ * Highest spndarray_memory_in_use() seen so far
+ */
+size_t spndarray_memory_peak(void) {
+  return __atomic_load_n(&spnd_mem_peak, __ATOMIC_RELAXED);
+}
+
+/*
+ * convert_*()
+ * Copy the values of the elements of src into the data of dst, one
+ * routine per value type of dst
+ */
+#define SPND_CONVERT(V, T, S)                                              \
+  static void convert_##S(T *restrict dst, const spndarray *src) {         \
+    switch (src->vtype) {                                                  \
+    case SPNDARRAY_FLOAT64:                                                \
+      for (size_t n = 0; n < src->nz; n++)                                 \
+        dst[n] = (T)src->data[n];                                          \
+      break;                                                               \
+    case SPNDARRAY_FLOAT32:                                                \
+      for (size_t n = 0; n < src->nz; n++)                                 \
+        dst[n] = (T)src->data_f32[n];                                      \
+      break;                                                               \
+    case SPNDARRAY_INT64:                                                  \
+      for (size_t n = 0; n < src->nz; n++)                                 \
+        dst[n] = (T)src->data_i64[n];                                      \
+      break;                                                               \
+    case SPNDARRAY_UINT32:                                                 \
+      for (size_t n = 0; n < src->nz; n++)                                 \
+        dst[n] = (T)src->data_u32[n];                                      \
+      break;                                                               \
+    case SPNDARRAY_PATTERN:                                                \
+      for (size_t n = 0; n < src->nz; n++)                                 \
+        dst[n] = 1;                                                        \
+      break;                                                               \
+    case SPNDARRAY_DICT8:                                                  \
+      for (size_t n = 0; n < src->nz; n++)                                 \
+        dst[n] = (T)src->dict->values[src->codes8[n]];                     \
+      break;                                                               \
+    case SPNDARRAY_DICT16:                                                 \
+      for (size_t n = 0; n < src->nz; n++)                                 \
+        dst[n] = (T)src->dict->values[src->codes16[n]];                    \
+    }                                                                      \
+  }
+SPNDARRAY_FOREACH_VTYPE(SPND_CONVERT)
+#undef SPND_CONVERT
+
+/*
+ * copy_values()
+ * Copies the values of the elements of src into the data of dst, and
+ * sets the element count of dst
+ *
+ * Return
+ *  0, or 1 if the dictionary of dst has no room for the values
+ */
+static int copy_values(spndarray *dst, const spndarray *src) {
+  if (dst->vtype == src->vtype) {
+    if (dst->values)
+      memcpy(dst->values, src->values,
+             src->nz * spndarray_vsize(src->vtype));
+    dst->nz = src->nz;
+    return src->dict ? spndarray_dict_copy(dst, src) : 0;
+  }
+  if (dst->dict) {
+    // the elements are counted as they are encoded, so that compacting
+    // a full dictionary keeps the codes given so far
+    for (dst->nz = 0; dst->nz < src->nz; dst->nz++)
+      if (spndarray_store(dst, dst->nz, spndarray_value(src, dst->nz)))
+        return 1;
+    return 0;
+  }
+  switch (dst->vtype) {
+#define SPND_CONVERT_CASE(V, T, S)                                         \
+  case V:                                                                  \
+    convert_##S((T *)dst->values, src);                                    \
+    break;
+    SPNDARRAY_FOREACH_VTYPE(SPND_CONVERT_CASE)
+#undef SPND_CONVERT_CASE
+  }
+  dst->nz = src->nz;
+  return 0;
+}
+
+/*
+ * spndarray_copy_into()
+ *
+ * Replaces the elements of dst with those of src
+ *
+ * Notes
+ *  the index arrays, the data and the tree nodes are copied wholesale
+ *  and the copied tree is repointed in one linear pass, so nothing is
+ *  searched or sorted. Elements holding the fill value are copied as
+ *  well; dst is expected to have the same fill value. The dimension
+ *  sizes of dst grow to those of src if needed. Values are converted
+ *  when the value types differ, which fails if dst is a dictionary
+ *  array without room for the values of src
+ *
+ * Return
+ *  0 on success
+ */
+int spndarray_copy_into(spndarray *dst, const spndarray *src) {
+  if (!SPNDARRAY_ISNTUPLE(dst) || !SPNDARRAY_ISNTUPLE(src) ||
+      dst->ndim != src->ndim) {
+    fprintf(stderr, "copy requires ntuple arrays of the same dimensionality");
+    return 1;
+  }
+
+  spndarray_set_zero(dst);
+  if (dst->nzmax < src->nz && spndarray_realloc(src->nz, dst))
+    return 1;
+
+  for (size_t i = 0; i < src->ndim; i++) {
+    memcpy(dst->dims[i], src->dims[i], src->nz * sizeof(size_t));
+    if (src->dimsizes[i] > dst->dimsizes[i])
+      dst->dimsizes[i] = src->dimsizes[i];
+  }
+  if (copy_values(dst, src)) {
+    spndarray_set_zero(dst);
+    return 1;
+  }
+
+  const spndarray_tree *t = src->tree_data;
+  struct avl_table *tree = (struct avl_table *)dst->tree_data->tree;
+  memcpy(dst->tree_data->node_array, t->node_array,
+         t->n * sizeof(struct avl_node));
+  dst->tree_data->n = t->n;
+  tree->avl_root = ((struct avl_table *)t->tree)->avl_root;
+  tree->avl_count = ((struct avl_table *)t->tree)->avl_count;
+  tree_relocate(dst, (uintptr_t)t->node_array, (uintptr_t)src->dims[0]);
+
+  return spndarray_filter_rebuild(dst);
+} /* spndarray_copy_into() */
+
+/*
+ * spndarray_clone()
+ *
+ * Makes an exact copy of an array, fill value and membership filter
+ * included, in O(nnz) time
+ */
+spndarray *spndarray_clone(const spndarray *m) {
+  spndarray *c = spndarray_alloc_with(m->ndim, m->dimsizes, m->nzmax,
+                                      m->sptype | m->vtype, m->allocator);
+  if (!c)
+    return NULL;
+  c->fill = m->fill;
+  if (spndarray_copy_into(c, m) || spndarray_filter_copy(c, m)) {
+    spndarray_free(c);
+    return NULL;
+  }
+  return c;
+}
+
+/*
+ * spndarray_convert()
+ *
+ * Copies an array into a new one of another value type
+ *
+ * Inputs
+ *  vtype - the value type of the copy, SPNDARRAY_FLOAT64 and so on
+ *
+ * Notes
+ *  values are converted as by a C cast, so they must be representable
+ *  in the new type; converting to SPNDARRAY_PATTERN keeps only the
+ *  coordinates, and converting from it gives every element the value 1.
+ *  Arrays of other types go through this to reach the routines that
+ *  only handle double values. Converting to a dictionary type fails if
+ *  m has more distinct values than the dictionary can hold
+ */
+spndarray *spndarray_convert(const spndarray *m, const size_t vtype) {
+  if (!SPNDARRAY_ISNTUPLE(m)) {
+    fprintf(stderr, "array must be in the ntuple format");
+    return NULL;
+  }
+  spndarray *c = spndarray_alloc_with(m->ndim, m->dimsizes,
+                                      m->nz ? m->nz : 1, m->sptype | vtype,
+                                      m->allocator);
+  if (!c)
+    return NULL;
+  c->fill = m->fill;
+  if (spndarray_copy_into(c, m)) {
+    spndarray_free(c);
+    return NULL;
+  }
+  return c;
+}
+
+/*
+ * spndarray_clone_cow()
+ *
+ * Makes a copy-on-write clone of an array
+ *
+ * Output
+ *  a new array sharing the index arrays, data and tree nodes of m;
+ *  only the dimension sizes, fill value, membership filter and value
+ *  dictionary are copied
+ *
+ * Notes
+ *  whichever of the arrays is modified first copies the shared
+ *  buffers (see spndarray_unshare()), so the clone is cheap as long
+ *  as it is only read. m and its clones may be read from different
+ *  threads, and freed in any order
+ */
+spndarray *spndarray_clone_cow(spndarray *m) {
+  if (!SPNDARRAY_ISNTUPLE(m)) {
+    fprintf(stderr, "array must be in the ntuple format");
+    return NULL;
+  }
+
+  if (!m->shared) {
+    m->shared = calloc(1, sizeof(spndarray_shared));
+    if (!m->shared) {
+      fprintf(stderr, "not enough space for array");
+      abort();
+    }
+    m->shared->refs = 1;
+  }
+
+  spndarray *c = calloc(1, sizeof(*c));
+  if (!c) {
+    fprintf(stderr, "not enough space for array");
+    abort();
+  }
+  *c = *m;
+  c->filter = NULL;
+  c->dict = NULL;
+  c->work = NULL;
+  c->dimsizes = malloc(m->ndim * sizeof(size_t));
+  c->dims = malloc(m->ndim * sizeof(size_t *));
+  c->tree_data = malloc(sizeof(spndarray_tree));
+  if (!c->dimsizes || !c->dims || !c->tree_data) {
+    fprintf(stderr, "not enough space for array");
+    abort();
+  }
+  memcpy(c->dimsizes, m->dimsizes, m->ndim * sizeof(size_t));
+  memcpy(c->dims, m->dims, m->ndim * sizeof(size_t *));
+
+  // the clone gets its own tree header, comparing through the clone,
+  // over the shared nodes
+  *c->tree_data = *m->tree_data;
+  struct avl_table *tree =
+      avl_create(c->rank->compare, (void *)c, &avl_allocator_spndarray);
+  if (!tree) {
+    fprintf(stderr, "Not enough space for AVL tree");
+    abort();
+  }
+  tree->avl_root = ((struct avl_table *)m->tree_data->tree)->avl_root;
+  tree->avl_count = ((struct avl_table *)m->tree_data->tree)->avl_count;
+  c->tree_data->tree = tree;
+
+  __atomic_add_fetch(&m->shared->refs, 1, __ATOMIC_ACQ_REL);
+  if (spndarray_filter_copy(c, m) ||
+      (m->dict && spndarray_dict_copy(c, m))) {
+    spndarray_free(c);
+    return NULL;
+  }
+  return c;
+} /* spndarray_clone_cow() */
+
+/*
+ * spndarray_unshare()
+ *
+ * Gives an array its own copy of buffers it shares with copy-on-write
+ * clones; called by every routine that modifies an array
+ *
+ * Return
+ *  0 on success
+ */
+int spndarray_unshare(spndarray *m) {
+  spndarray_shared *sh = m->shared;
+
+  if (!sh)
+    return 0;
+  m->shared = NULL;
+  if (__atomic_load_n(&sh->refs, __ATOMIC_ACQUIRE) == 1) {
+    // the clones are gone, the buffers are ours alone
+    free(sh);
+    return 0;
+  }
+
+  size_t *old_dims[m->ndim];
+  void *old_values = m->values;
+  void *old_nodes = m->tree_data->node_array;
+  const size_t vsize = spndarray_vsize(m->vtype);
+
+  for (size_t i = 0; i < m->ndim; i++) {
+    old_dims[i] = m->dims[i];
+    m->dims[i] = buf_alloc(m, m->nzmax * sizeof(size_t));
+    if (!m->dims[i]) {
+      fprintf(stderr, "Not enough space for dimension %zd indices", i);
+      abort();
+    }
+    memcpy(m->dims[i], old_dims[i], m->nz * sizeof(size_t));
+  }
+  m->values = vsize ? buf_alloc(m, m->nzmax * vsize) : NULL;
+  m->tree_data->node_array = buf_alloc(m, m->nzmax * sizeof(struct avl_node));
+  if ((vsize && !m->values) || !m->tree_data->node_array) {
+    fprintf(stderr, "Not enough space for the data");
+    abort();
+  }
+  if (vsize)
+    memcpy(m->values, old_values, m->nz * vsize);
+  memcpy(m->tree_data->node_array, old_nodes,
+         m->tree_data->n * sizeof(struct avl_node));
+  tree_relocate(m, (uintptr_t)old_nodes, (uintptr_t)old_dims[0]);
+
+  // the other arrays may have let go of the buffers meanwhile
+  if (__atomic_sub_fetch(&sh->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    for (size_t i = 0; i < m->ndim; i++)
+      buf_free(m, old_dims[i], m->nzmax * sizeof(size_t));
+    if (vsize)
+      buf_free(m, old_values, m->nzmax * vsize);
+    buf_free(m, old_nodes, m->nzmax * sizeof(struct avl_node));
+    free(sh);
+  }
+  return 0;
+} /* spndarray_unshare() */
+
 /*
  * spndarray_compare_idx()
  * Comparison function for searching the binary tree
@@ -233,8 +919,8 @@ size_t spndarray_nnz(const spndarray *m) { return m->nz; }
  *
  * To detect duplicate elements in the tree, we want to determine
  * if there already exists an entry for (i0,i1,...) in the tree.
- * Since the actual tree node stores only the data elements data[n],
- * we will do pointer magick to get from the given data[n] to the
+ * Since the actual tree node stores only a pointer to the first
+ * index dims[0][n], we will do pointer magick to get from it to the
  * indices in dims[...][n].
  *
  * This compare function will sort the tree first by dim 0,
@@ -262,61 +948,220 @@ int spndarray_compare_idx(const size_t ndims, const size_t *ipa,
 }
 
 /*
- * spndarray_tree_rebuild()
- * When copying a ntuple array, it is necessary to rebuild
- * the binary tree for element searches
+ * spndarray_hash_idx()
+ * Hashes a set of indices, for use by filters and hash tables
  *
- * Input : m - ntuple array
+ * Inputs
+ *   ndims - number of dimensions
+ *   idxs  - the indices
  */
-int spndarray_tree_rebuild(spndarray *m) {
+uint64_t spndarray_hash_idx(const size_t ndims, const size_t *idxs) {
+  uint64_t h = 0x9e3779b97f4a7c15ull ^ ndims;
+  for (size_t dim = 0; dim < ndims; dim++) {
+    h = (h ^ idxs[dim]) * 0xbf58476d1ce4e5b9ull;
+    h ^= h >> 32;
+  }
+  // splitmix64 finalizer
+  h ^= h >> 30;
+  h *= 0xbf58476d1ce4e5b9ull;
+  h ^= h >> 27;
+  h *= 0x94d049bb133111ebull;
+  h ^= h >> 31;
+  return h;
+}
+
+/*
+ * tree_build_balanced()
+ * Links the nodes lo...hi-1 of the node array, whose elements are in
+ * sorted order, into a perfectly balanced subtree and returns its root
+ */
+static struct avl_node *tree_build_balanced(spndarray *m, const size_t lo,
+                                            const size_t hi, int *height) {
+  struct avl_node *nodes = (struct avl_node *)m->tree_data->node_array;
+  int lh, rh;
+
+  if (lo == hi) {
+    *height = 0;
+    return NULL;
+  }
+
+  const size_t mid = lo + (hi - lo) / 2;
+  struct avl_node *p = &nodes[mid];
+  p->avl_data = &m->dims[0][mid];
+  p->avl_link[0] = tree_build_balanced(m, lo, mid, &lh);
+  p->avl_link[1] = tree_build_balanced(m, mid + 1, hi, &rh);
+  p->avl_balance = rh - lh;
+  *height = 1 + (lh > rh ? lh : rh);
+  return p;
+}
+
+typedef struct {
+  const size_t *order;
+  void *src;
+  void *dst;
+} spndarray_permute;
+
+static void permute_idx_range(void *param, size_t begin, size_t end) {
+  const spndarray_permute *p = (const spndarray_permute *)param;
+  for (size_t n = begin; n < end; n++)
+    ((size_t *)p->dst)[n] = ((const size_t *)p->src)[p->order[n]];
+}
+
+#define SPND_PERMUTE(V, T, S)                                              \
+  static void permute_##S##_range(void *param, size_t begin, size_t end) { \
+    const spndarray_permute *p = (const spndarray_permute *)param;         \
+    for (size_t n = begin; n < end; n++)                                   \
+      ((T *)p->dst)[n] = ((const T *)p->src)[p->order[n]];                 \
+  }
+SPNDARRAY_FOREACH_VTYPE(SPND_PERMUTE)
+SPNDARRAY_FOREACH_DICT(SPND_PERMUTE)
+#undef SPND_PERMUTE
+
+/* permute_*_range() of a value type */
+static spndarray_task_fn permute_data_range(const size_t vtype) {
+  switch (vtype) {
+#define SPND_PERMUTE_CASE(V, T, S)                                         \
+  case V:                                                                  \
+    return permute_##S##_range;
+    SPNDARRAY_FOREACH_VTYPE(SPND_PERMUTE_CASE)
+    SPNDARRAY_FOREACH_DICT(SPND_PERMUTE_CASE)
+#undef SPND_PERMUTE_CASE
+  }
+  return NULL;
+}
+
+/* tree_rebuild() does the work of spndarray_tree_rebuild() */
+static int tree_rebuild(spndarray *m) {
   if (!SPNDARRAY_ISNTUPLE(m)) {
     fprintf(stderr, "m must be in ntuple format");
     return 1;
   }
+  struct avl_table *tree = (struct avl_table *)m->tree_data->tree;
   size_t n;
+  int height;
+
+  spndarray_unshare(m);
 
   // reset tree to be empty, but leave the root ptr;
-  avl_empty(m->tree_data->tree, NULL);
+  avl_empty(tree, NULL);
   m->tree_data->n = 0;
 
-  // insert all tree elements
-  for (n = 0; n < m->nz; m++) {
-    void *ptr = avl_insert(m->tree_data->tree, &m->data[n]);
-    if (ptr != NULL) {
-      fprintf(stderr, "duplicate entry detected while rebuilding tree");
+  for (n = 1; n < m->nz; n++) {
+    size_t a = n - 1, b = n;
+    if (m->rank->compare_element(&a, &b, m) >= 0)
+      break;
+  }
+
+  if (n < m->nz) {
+    const size_t order_size = m->nz * sizeof(size_t);
+    size_t *order = buf_alloc(m, order_size);
+    if (!order) {
+      fprintf(stderr, "not enough space to sort the elements");
+      return 1;
+    }
+    for (n = 0; n < m->nz; n++)
+      order[n] = n;
+    if (spndarray_sort_indices(order, m->nz, m->rank->compare_element, m)) {
+      buf_free(m, order, order_size);
       return 1;
     }
+
+    for (n = 1; n < m->nz; n++)
+      if (m->rank->compare_element(&order[n - 1], &order[n], m) == 0) {
+        fprintf(stderr, "duplicate entry detected while rebuilding tree");
+        buf_free(m, order, order_size);
+        return 1;
+      }
+
+    // apply the permutation to every column
+    spndarray_permute perm = {order};
+    for (size_t i = 0; i < m->ndim; i++) {
+      perm.src = m->dims[i];
+      perm.dst = buf_alloc(m, m->nzmax * sizeof(size_t));
+      if (!perm.dst) {
+        fprintf(stderr, "not enough space for dimension %zd indices", i);
+        abort();
+      }
+      spndarray_parallel_for(m->nz, spndarray_get_grain_size(),
+                             permute_idx_range, &perm);
+      buf_free(m, m->dims[i], m->nzmax * sizeof(size_t));
+      m->dims[i] = perm.dst;
+    }
+    const size_t vsize = spndarray_vsize(m->vtype);
+    if (vsize) {
+      perm.src = m->values;
+      perm.dst = buf_alloc(m, m->nzmax * vsize);
+      if (!perm.dst) {
+        fprintf(stderr, "not enough space for the data");
+        abort();
+      }
+      spndarray_parallel_for(m->nz, spndarray_get_grain_size(),
+                             permute_data_range(m->vtype), &perm);
+      buf_free(m, m->values, m->nzmax * vsize);
+      m->values = perm.dst;
+    }
+    buf_free(m, order, order_size);
   }
-  return 0;
+
+  tree->avl_root = tree_build_balanced(m, 0, m->nz, &height);
+  tree->avl_count = m->nz;
+  m->tree_data->n = m->nz;
+
+  return spndarray_filter_rebuild(m);
 }
 
 /*
- * compare_ntuple()
- * Comparison function for searching binary tree in
- * ntuple format representation.
+ * spndarray_tree_rebuild()
+ * When copying a ntuple array, it is necessary to rebuild
+ * the binary tree for element searches
  *
- * To detect duplicate entries in the tree, we want
- * to determine if there already exists an entry for (i0,i1,...)
- * in the tree. Since the actual tree node stores only the data
- * elements data[n], we will do pointer magick to get from the
- * given data[n] to the indices dims[...][n]
+ * Input : m - ntuple array
  *
- * This compare function will sort the tree first by dim 0,
- * then dim1, and so on.
+ * Notes
+ *  the elements are first sorted in place (unless they already are),
+ *  after which the tree is linked up in a single linear pass; this
+ *  makes it the way to index elements appended in bulk to dims/data.
+ *  The sort and the permutation run on the thread pool
  */
+int spndarray_tree_rebuild(spndarray *m) {
+  SPNDARRAY_OP_BEGIN();
+  SPNDARRAY_STATS_ADD(rebuilds, 1);
+  int s = tree_rebuild(m);
+  SPNDARRAY_OP_END(SPNDARRAY_OP_TREE_REBUILD);
+  return s;
+}
 
-static int compare_ntuple(const void *pa, const void *pb, void *params) {
-  spndarray *m = (spndarray *)params;
-
-  const size_t idxa = (const double *)pa - m->data;
-  const size_t idxb = (const double *)pb - m->data;
+/*
+ * spndarray_tree_order()
+ * Lists the elements of a ntuple array in coordinate order by walking
+ * the binary tree in order
+ *
+ * Inputs
+ *  m     - ntuple array
+ *  order - array of size m->nz receiving the data index of each
+ *          element, sorted by dim 0, then dim 1, and so on
+ *
+ * Return
+ *  number of indices written
+ */
+size_t spndarray_tree_order(const spndarray *m, size_t *order) {
+  const struct avl_table *tree = (struct avl_table *)m->tree_data->tree;
+  const struct avl_node *stack[AVL_MAX_HEIGHT];
+  const struct avl_node *p = tree->avl_root;
+  size_t height = 0, k = 0;
 
-  size_t ipa[m->ndim], ipb[m->ndim];
-  for (size_t i = 0; i < m->ndim; i++) {
-    ipa[i] = m->dims[i][idxa];
-    ipb[i] = m->dims[i][idxb];
+  for (;;) {
+    while (p) {
+      stack[height++] = p;
+      p = p->avl_link[0];
+    }
+    if (!height)
+      break;
+    p = stack[--height];
+    order[k++] = (size_t *)p->avl_data - m->dims[0];
+    p = p->avl_link[1];
   }
-  return spndarray_compare_idx(m->ndim, ipa, ipb);
+  return k;
 }
 
 static void *avl_spmalloc(size_t size, void *param) {
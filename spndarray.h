@@ -1,6 +1,8 @@
 #ifndef __SPNDARRAY_H__
 #define __SPNDARRAY_H__
 
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 
 #ifdef __cplusplus
@@ -24,6 +26,149 @@ typedef struct {
   size_t n;         /* number of tree nodes in use (<= nzmax) */
 } spndarray_tree;
 
+/*
+ * Blocked Bloom filter over the coordinates of the stored elements,
+ * see spndarray_filter_enable()
+ */
+typedef struct {
+  uint64_t *blocks;       /* nblocks blocks of 512 bits */
+  size_t nblocks;         /* number of blocks */
+  unsigned k;             /* bits set per element */
+  size_t capacity;        /* number of elements the filter is sized for */
+  double fp_rate;         /* target false positive rate */
+  size_t lookups;         /* lookups checked against the filter */
+  size_t negatives;       /* lookups the filter answered as absent */
+  size_t false_positives; /* lookups that passed but found nothing */
+} spndarray_filter;
+
+typedef struct {
+  double fp_rate;
+  size_t capacity;
+  size_t bytes;  /* memory used by the filter bits */
+  size_t hashes; /* bits set per element */
+  size_t lookups;
+  size_t negatives;
+  size_t false_positives;
+} spndarray_filter_stats;
+
+/*
+ * Value table of dictionary arrays (SPNDARRAY_DICT8, SPNDARRAY_DICT16),
+ * whose data holds a code per element; see spnddict.c
+ */
+typedef struct {
+  double *values;  /* value of each code */
+  size_t n;        /* codes in use */
+  size_t size;     /* room in values */
+  size_t max;      /* most codes the array can hold, 256 or 65536 */
+  uint32_t *slots; /* codes hashed by value, code + 1 or 0 when free */
+  size_t nslots;   /* power of two, at least twice size */
+} spndarray_dict;
+
+/* operations timed by the statistics counters */
+#define SPNDARRAY_OP_ADD (0)
+#define SPNDARRAY_OP_SUB (1)
+#define SPNDARRAY_OP_MUL (2)
+#define SPNDARRAY_OP_MUL_VEC (3)
+#define SPNDARRAY_OP_REDUCE (4)
+#define SPNDARRAY_OP_MEMCPY (5)
+#define SPNDARRAY_OP_GET_BATCH (6)
+#define SPNDARRAY_OP_SET_BATCH (7)
+#define SPNDARRAY_OP_INCR_BATCH (8)
+#define SPNDARRAY_OP_TREE_REBUILD (9)
+#define SPNDARRAY_NOPS (10)
+
+/*
+ * Counters of the hot paths, kept when the library is built with
+ * SPNDARRAY_STATS defined; see spndarray_get_stats()
+ */
+typedef struct {
+  uint64_t compares;       /* calls to the tree comparator */
+  uint64_t finds;          /* tree lookups */
+  uint64_t find_depth;     /* nodes visited by the lookups */
+  uint64_t find_depth_max; /* nodes visited by the deepest lookup */
+  uint64_t reallocs;       /* calls to spndarray_realloc() */
+  uint64_t realloc_bytes;  /* bytes of buffers they reallocated */
+  uint64_t rebuilds;       /* calls to spndarray_tree_rebuild() */
+  uint64_t op_calls[SPNDARRAY_NOPS]; /* calls to each operation */
+  uint64_t op_ns[SPNDARRAY_NOPS];    /* nanoseconds spent in them */
+} spndarray_stats;
+
+/*
+ * SPNDARRAY_STATS_ADD() and friends count into the block of the
+ * calling thread; they compile to nothing without SPNDARRAY_STATS
+ */
+#ifdef SPNDARRAY_STATS
+extern __thread spndarray_stats *spndarray_stats_tls
+    __attribute__((tls_model("initial-exec")));
+spndarray_stats *spndarray_stats_thread(void);
+uint64_t spndarray_stats_now(void);
+void spndarray_stats_op(const size_t op, const uint64_t start);
+
+#define SPNDARRAY_STATS_ADD(field, n)                                      \
+  do {                                                                     \
+    spndarray_stats *s_ = spndarray_stats_tls;                             \
+    if (!s_)                                                               \
+      s_ = spndarray_stats_thread();                                       \
+    __atomic_store_n(&s_->field, s_->field + (n), __ATOMIC_RELAXED);       \
+  } while (0)
+#define SPNDARRAY_STATS_MAX(field, n)                                      \
+  do {                                                                     \
+    spndarray_stats *s_ = spndarray_stats_tls;                             \
+    if (!s_)                                                               \
+      s_ = spndarray_stats_thread();                                       \
+    if ((uint64_t)(n) > s_->field)                                         \
+      __atomic_store_n(&s_->field, (n), __ATOMIC_RELAXED);                 \
+  } while (0)
+#define SPNDARRAY_OP_BEGIN() const uint64_t spnd_op_start_ = spndarray_stats_now()
+#define SPNDARRAY_OP_END(op) spndarray_stats_op((op), spnd_op_start_)
+#else
+#define SPNDARRAY_STATS_ADD(field, n) ((void)0)
+#define SPNDARRAY_STATS_MAX(field, n) ((void)0)
+#define SPNDARRAY_OP_BEGIN() ((void)0)
+#define SPNDARRAY_OP_END(op) ((void)0)
+#endif
+
+/*
+ * Memory held by an array, in bytes; see spndarray_memory_stats()
+ */
+typedef struct {
+  size_t dims;        /* index columns */
+  size_t data;        /* element values */
+  size_t nodes;       /* tree nodes */
+  size_t filter;      /* membership filter */
+  size_t header;      /* array struct, dimension sizes and tree header */
+  size_t total;       /* all of the above */
+  size_t slack;       /* elements allocated but not stored, nzmax - nz */
+  size_t slack_bytes; /* bytes of those elements */
+  size_t shared;      /* bytes of total shared with copy-on-write clones */
+} spndarray_memory;
+
+/*
+ * Reference count of the buffers (dims, data and tree nodes) shared
+ * by copy-on-write clones, see spndarray_clone_cow()
+ */
+typedef struct {
+  size_t refs; /* number of arrays using the buffers */
+} spndarray_shared;
+
+/*
+ * Source of the large buffers of an array: the index columns, the data,
+ * the tree nodes and the workspaces of spndarray_tree_rebuild(). The
+ * size of a block is passed back on realloc and free, so allocators
+ * need not track it. See spndarray_alloc_with()
+ */
+typedef struct {
+  void *(*alloc)(size_t size, void *state);
+  void *(*realloc)(void *ptr, size_t old_size, size_t size, void *state);
+  void (*free)(void *ptr, size_t size, void *state);
+  void *state; /* passed to every call */
+} spndarray_allocator;
+
+/*
+ * Routines specialized for the rank of an array, see spndrank.c
+ */
+typedef struct spndarray_rank_ops spndarray_rank_ops;
+
 /*
  * N-tuple format:
  *
@@ -43,7 +188,17 @@ typedef struct {
 typedef struct {
   size_t *sizes; /* number of indices */
   size_t ndim;   /* number of dimensions */
-  double *data;  /* space for elements */
+
+  /* space for elements, of the value type of the array */
+  union {
+    double *data;       /* SPNDARRAY_FLOAT64 */
+    float *data_f32;    /* SPNDARRAY_FLOAT32 */
+    int64_t *data_i64;  /* SPNDARRAY_INT64 */
+    uint32_t *data_u32; /* SPNDARRAY_UINT32 */
+    uint8_t *codes8;    /* SPNDARRAY_DICT8 */
+    uint16_t *codes16;  /* SPNDARRAY_DICT16 */
+    void *values;       /* any of them; NULL for SPNDARRAY_PATTERN */
+  };
 
   /* dimsizes (size ndim) contains
    *
@@ -61,6 +216,11 @@ typedef struct {
   size_t nz;    /* current number of non-fillvalue elements */
   double fill;  /* fill value of the array */
   spndarray_tree *tree_data; /* binary tree for sorting N-Tuple data */
+  spndarray_filter *filter;  /* optional membership filter, or NULL */
+  spndarray_dict *dict;      /* value table of dictionary arrays, or NULL */
+  const spndarray_rank_ops *rank; /* routines for ndim, set at alloc */
+  spndarray_shared *shared;  /* set while the buffers may be shared */
+  const spndarray_allocator *allocator; /* of the buffers, NULL for malloc */
 
   /*
    * workspace of size MAX{sizes} * MAX{sizeof(double), sizeof(size_t)}
@@ -73,16 +233,259 @@ typedef struct {
   };
 
   size_t sptype; /* storage type */
+  size_t vtype;  /* value type */
 } spndarray;
 
+/*
+ * Immutable snapshot of an array, see spndarray_freeze()
+ *
+ * keys[k * width ...] is the key of data[k] for k = 1...nz, laid out
+ * in Eytzinger order (the children of slot k are 2k and 2k+1)
+ */
+typedef struct {
+  size_t ndim;      /* number of dimensions */
+  size_t *dimsizes; /* dimension sizes */
+  double fill;      /* fill value of the array */
+  size_t nz;        /* number of elements */
+  size_t width;     /* words per key: 1 (linear index) or ndim */
+  size_t *keys;     /* element keys */
+  double *data;     /* element values */
+} spndarray_frozen;
+
+/*
+ * Read-only array served from a file mapped in memory, see
+ * spndarray_mmap_open(); every pointer points into the mapping
+ */
+typedef struct {
+  size_t ndim;          /* number of dimensions */
+  const size_t *dimsizes; /* dimension sizes */
+  double fill;          /* fill value of the array */
+  size_t nz;            /* number of elements */
+  const size_t **dims;  /* sorted index columns, one per dimension */
+  const double *data;   /* element values */
+  void *base;           /* start of the mapping */
+  size_t length;        /* length of the mapping */
+} spndarray_mapped;
+
+/*
+ * Array split into independently locked shards, which can be updated
+ * from many threads at once; see spndarray_sharded_alloc()
+ */
+typedef struct spndarray_sharded spndarray_sharded;
+
+/*
+ * Thread-local buffer aggregating increments before they reach a
+ * sharded array; see spndarray_accum_alloc()
+ */
+typedef struct spndarray_accum spndarray_accum;
+
+/*
+ * Array tiled into hyper-blocks, each stored sparse or dense by how
+ * full it is; see spndarray_blocked_alloc()
+ */
+typedef struct spndarray_blocked spndarray_blocked;
+
+/*
+ * Array kept on disk as a directory of sorted chunks, which are mapped
+ * a few at a time; see spndarray_chunked_create()
+ */
+typedef struct spndarray_chunked spndarray_chunked;
+
+typedef struct {
+  size_t incrs;           /* increments received */
+  size_t flushes;         /* number of flushes */
+  size_t flushed;         /* aggregated elements pushed to the array */
+  size_t locks;           /* shard locks taken by the flushes */
+  size_t buffered;        /* distinct coordinates waiting to be flushed */
+  size_t locks_avoided;   /* lock acquisitions saved against direct incr */
+  size_t updates_avoided; /* increments merged before reaching the array */
+} spndarray_accum_stats;
+
+#define SPNDARRAY_SHARD_HASH (0)
+#define SPNDARRAY_SHARD_RANGE (1)
+
+#define SPNDARRAY_FWRITE_SPARSE (0)
+#define SPNDARRAY_FWRITE_FULL (1)
+#define SPNDARRAY_FWRITE_NPY (2)
+
+#define SPNDARRAY_TNS_ONE_BASED (0)
+#define SPNDARRAY_TNS_ZERO_BASED (1)
+
+#define SPNDARRAY_PACK_DICT (1)
+
+#define SPNDARRAY_GROWTH_FACTOR (0)
+#define SPNDARRAY_GROWTH_CHUNKED (1)
+#define SPNDARRAY_GROWTH_EXACT (2)
+
 #define SPNDARRAY_NTUPLE (0)
 #define SPNDARRAY_CCS (1)
 
+/*
+ * value types, or'ed into the flags of spndarray_alloc_nzmax(); values
+ * are converted to and from double at the interface, as by a cast.
+ * Pattern arrays store no values: every element reads as 1.
+ * Dictionary arrays store a 8 or 16 bit code per element, indexing a
+ * table of their distinct values
+ */
+#define SPNDARRAY_FLOAT64 (0 << 4)
+#define SPNDARRAY_FLOAT32 (1 << 4)
+#define SPNDARRAY_INT64 (2 << 4)
+#define SPNDARRAY_UINT32 (3 << 4)
+#define SPNDARRAY_PATTERN (4 << 4)
+#define SPNDARRAY_DICT8 (5 << 4)
+#define SPNDARRAY_DICT16 (6 << 4)
+#define SPNDARRAY_VTYPE_MASK (7 << 4)
+
 #define SPNDARRAY_ISNTUPLE(m) ((m)->sptype == SPNDARRAY_NTUPLE)
 #define SPNDARRAY_ISCCS(m) ((m)->sptype == SPNDARRAY_CCS)
+#define SPNDARRAY_ISFLOAT64(m) ((m)->vtype == SPNDARRAY_FLOAT64)
+#define SPNDARRAY_ISDICT(m) ((m)->dict != NULL)
+
+/*
+ * SPNDARRAY_FOREACH_VTYPE(X) expands X(vtype, C type, suffix) for
+ * every value type that has values, to generate one kernel per type
+ */
+#define SPNDARRAY_FOREACH_VTYPE(X)                                         \
+  X(SPNDARRAY_FLOAT64, double, f64)                                        \
+  X(SPNDARRAY_FLOAT32, float, f32)                                         \
+  X(SPNDARRAY_INT64, int64_t, i64)                                         \
+  X(SPNDARRAY_UINT32, uint32_t, u32)
+
+/* the same for the codes of dictionary arrays */
+#define SPNDARRAY_FOREACH_DICT(X)                                          \
+  X(SPNDARRAY_DICT8, uint8_t, d8)                                          \
+  X(SPNDARRAY_DICT16, uint16_t, d16)
+
+/*
+ * SPNDARRAY_FOREACH_TYPE(X) expands X(vtype, C type, suffix, read) for
+ * every value type, where read(T, m, n) reads element n as a double
+ * (T is the type of the codes for dictionary arrays); kernels generated
+ * with it resolve the value type once per call, not once per element
+ * as spndarray_value() does
+ */
+#define SPNDARRAY_READ_VALUE(T, m, n) ((double)((const T *)(m)->values)[n])
+#define SPNDARRAY_READ_PATTERN(T, m, n) 1.0
+#define SPNDARRAY_READ_DICT(T, m, n)                                       \
+  ((m)->dict->values[((const T *)(m)->values)[n]])
+
+#define SPNDARRAY_FOREACH_TYPE(X)                                          \
+  X(SPNDARRAY_FLOAT64, double, f64, SPNDARRAY_READ_VALUE)                  \
+  X(SPNDARRAY_FLOAT32, float, f32, SPNDARRAY_READ_VALUE)                   \
+  X(SPNDARRAY_INT64, int64_t, i64, SPNDARRAY_READ_VALUE)                   \
+  X(SPNDARRAY_UINT32, uint32_t, u32, SPNDARRAY_READ_VALUE)                 \
+  X(SPNDARRAY_PATTERN, uint8_t, pattern, SPNDARRAY_READ_PATTERN)           \
+  X(SPNDARRAY_DICT8, uint8_t, d8, SPNDARRAY_READ_DICT)                     \
+  X(SPNDARRAY_DICT16, uint16_t, d16, SPNDARRAY_READ_DICT)
 
 typedef double (*reduction_function)(double acc, double x, int count);
 typedef double (*double_mapper)(double value);
+typedef void (*spndarray_task_fn)(void *ctx, size_t begin, size_t end);
+typedef int (*spndarray_compare_fn)(const void *a, const void *b, void *param);
+typedef int (*spndarray_visit_fn)(void *ctx, const size_t *idxs, double x);
+
+/* data index of an element that is not stored */
+#define SPNDARRAY_NOTFOUND ((size_t)-1)
+
+/*
+ * the loops over the dimensions of these routines unroll for ranks up
+ * to SPNDARRAY_RANK_MAX; other ranks get generic ones
+ */
+#define SPNDARRAY_RANK_MAX 4
+
+struct spndarray_rank_ops {
+  size_t ndim;                          /* rank handled, 0 for any */
+  spndarray_compare_fn compare;         /* tree comparator of &dims[0][n] */
+  spndarray_compare_fn compare_element; /* sort comparator of data indices */
+  /* data index of the element at idxs, or SPNDARRAY_NOTFOUND */
+  size_t (*find)(const spndarray *m, const size_t *idxs);
+};
+
+/*
+ * spndarray_vsize()
+ * Bytes per value of a value type, 0 for pattern arrays
+ */
+static inline size_t spndarray_vsize(const size_t vtype) {
+  switch (vtype) {
+  case SPNDARRAY_FLOAT32:
+  case SPNDARRAY_UINT32:
+    return 4;
+  case SPNDARRAY_DICT8:
+    return 1;
+  case SPNDARRAY_DICT16:
+    return 2;
+  case SPNDARRAY_PATTERN:
+    return 0;
+  default:
+    return 8;
+  }
+}
+
+/*
+ * spndarray_value()
+ * Reads the value of the element at data index n, as a double
+ */
+static inline double spndarray_value(const spndarray *m, const size_t n) {
+  switch (m->vtype) {
+  case SPNDARRAY_FLOAT32:
+    return m->data_f32[n];
+  case SPNDARRAY_INT64:
+    return (double)m->data_i64[n];
+  case SPNDARRAY_UINT32:
+    return m->data_u32[n];
+  case SPNDARRAY_PATTERN:
+    return 1.0;
+  case SPNDARRAY_DICT8:
+    return m->dict->values[m->codes8[n]];
+  case SPNDARRAY_DICT16:
+    return m->dict->values[m->codes16[n]];
+  default:
+    return m->data[n];
+  }
+}
+
+/* code of a value that does not fit in the dictionary of an array */
+#define SPNDARRAY_DICT_FULL ((size_t)-1)
+
+size_t spndarray_dict_code(spndarray *m, const double x);
+
+/*
+ * spndarray_store()
+ * Writes the value of the element at data index n; a no-op for
+ * pattern arrays
+ *
+ * Return
+ *  0, or 1 if the dictionary of the array has no room for x
+ */
+static inline int spndarray_store(spndarray *m, const size_t n,
+                                  const double x) {
+  size_t code;
+  switch (m->vtype) {
+  case SPNDARRAY_FLOAT32:
+    m->data_f32[n] = (float)x;
+    break;
+  case SPNDARRAY_INT64:
+    m->data_i64[n] = (int64_t)x;
+    break;
+  case SPNDARRAY_UINT32:
+    m->data_u32[n] = (uint32_t)x;
+    break;
+  case SPNDARRAY_PATTERN:
+    break;
+  case SPNDARRAY_DICT8:
+  case SPNDARRAY_DICT16:
+    code = spndarray_dict_code(m, x);
+    if (code == SPNDARRAY_DICT_FULL)
+      return 1;
+    if (m->vtype == SPNDARRAY_DICT8)
+      m->codes8[n] = (uint8_t)code;
+    else
+      m->codes16[n] = (uint16_t)code;
+    break;
+  default:
+    m->data[n] = x;
+  }
+  return 0;
+}
 
 /*
  * Prototypes
@@ -91,17 +494,42 @@ typedef double (*double_mapper)(double value);
 spndarray *spndarray_alloc(const size_t ndims, const size_t *dimsizes);
 spndarray *spndarray_alloc_nzmax(const size_t ndims, const size_t *dimsizes,
                                  const size_t nzmax, const size_t flags);
+spndarray *spndarray_alloc_with(const size_t ndims, const size_t *dimsizes,
+                                const size_t nzmax, const size_t flags,
+                                const spndarray_allocator *allocator);
 
 void spndarray_set_fillvalue(spndarray *m, const double fill);
 
 void spndarray_free(spndarray *m);
 int spndarray_realloc(const size_t nzmax, spndarray *m);
+int spndarray_reserve(spndarray *m, const size_t need);
+int spndarray_set_growth(const int policy, const double param);
+size_t spndarray_grown_nzmax(const size_t nzmax, const size_t need);
 int spndarray_set_zero(spndarray *m);
 size_t spndarray_nnz(const spndarray *m);
+void spndarray_memory_stats(const spndarray *m, spndarray_memory *stats);
+void spndarray_set_memory_budget(const size_t bytes);
+size_t spndarray_get_memory_budget(void);
+size_t spndarray_memory_in_use(void);
+size_t spndarray_memory_peak(void);
 
 int spndarray_compare_idx(const size_t ndims, const size_t *adims,
                           const size_t *bdims);
+uint64_t spndarray_hash_idx(const size_t ndims, const size_t *idxs);
 int spndarray_tree_rebuild(spndarray *m);
+size_t spndarray_tree_order(const spndarray *m, size_t *order);
+spndarray *spndarray_clone(const spndarray *m);
+spndarray *spndarray_clone_cow(spndarray *m);
+int spndarray_unshare(spndarray *m);
+int spndarray_copy_into(spndarray *dst, const spndarray *src);
+spndarray *spndarray_convert(const spndarray *m, const size_t vtype);
+
+/* spndalloc.c */
+spndarray_allocator *spndarray_arena_create(const size_t block_size);
+void spndarray_arena_reset(spndarray_allocator *allocator);
+void spndarray_arena_destroy(spndarray_allocator *allocator);
+size_t spndarray_arena_used(const spndarray_allocator *allocator);
+extern const spndarray_allocator spndarray_hugepage_allocator;
 
 /* spndcopy.c */
 spndarray *spndarray_memcpy(const spndarray *src, spndarray *dst);
@@ -113,11 +541,21 @@ double spndarray_getv(const spndarray *m, ...);
 int spndarray_set(spndarray *m, double val, const size_t *idxs);
 int spndarray_setv(spndarray *m, double val, ...);
 
-double *spndarray_ptr(const spndarray *m, const size_t *idxs);
-double *spndarray_ptrv(const spndarray *m, ...);
+double *spndarray_ptr(spndarray *m, const size_t *idxs);
+double *spndarray_ptrv(spndarray *m, ...);
+int spndarray_contains(const spndarray *m, const size_t *idxs);
+
+int spndarray_incr(spndarray *m, const size_t *idxs);
+int spndarray_incrv(spndarray *m, ...);
 
-void spndarray_incr(spndarray *m, const size_t *idxs);
-void spndarray_incrv(spndarray *m, ...);
+int spndarray_get_batch(const spndarray *m, const size_t count,
+                        const size_t *idxs, double *out);
+int spndarray_get_interleaved(const spndarray *m, const size_t count,
+                              const size_t *idxs, double *out);
+int spndarray_set_batch(spndarray *m, const size_t count, const double *vals,
+                        const size_t *idxs);
+int spndarray_incr_batch(spndarray *m, const size_t count, const size_t *idxs,
+                         const double *deltas);
 
 /* spreduce.c */
 
@@ -129,13 +567,189 @@ spndarray *spndarray_reduce_dimension(spndarray *m, const size_t dim, const size
 // TODO compress, io, operations, prop, swap
 
 /* spndio.c */
-int spndarray_fwrite(const spndarray* m, const char* fmt, const char* filepath, const int sparse);
+int spndarray_fwrite(const spndarray* m, const char* fmt, const char* filepath, const int full);
+int spndarray_fwrite_binary(const spndarray *m, const char *filepath);
+spndarray *spndarray_fread(const char *filepath);
+spndarray_mapped *spndarray_mmap_open(const char *filepath);
+void spndarray_mmap_close(spndarray_mapped *f);
+size_t spndarray_mapped_nnz(const spndarray_mapped *f);
+double spndarray_mapped_get(const spndarray_mapped *f, const size_t *idxs);
+void spndarray_mapped_get_batch(const spndarray_mapped *f, const size_t count,
+                                const size_t *idxs, double *out);
+spndarray *spndarray_read_tns(const char *filepath, const size_t flags);
+
+/* spndblock.c */
+spndarray_blocked *spndarray_blocked_alloc(const size_t ndims,
+                                           const size_t *dimsizes,
+                                           const size_t edge,
+                                           const double threshold);
+void spndarray_blocked_free(spndarray_blocked *b);
+int spndarray_blocked_set_fillvalue(spndarray_blocked *b, const double fill);
+size_t spndarray_blocked_ndim(const spndarray_blocked *b);
+const size_t *spndarray_blocked_dimsizes(const spndarray_blocked *b);
+size_t spndarray_blocked_edge(const spndarray_blocked *b);
+size_t spndarray_blocked_nnz(const spndarray_blocked *b);
+size_t spndarray_blocked_nblocks(const spndarray_blocked *b);
+size_t spndarray_blocked_ndense(const spndarray_blocked *b);
+size_t spndarray_blocked_bytes(const spndarray_blocked *b);
+double spndarray_blocked_get(const spndarray_blocked *b, const size_t *idxs);
+int spndarray_blocked_set(spndarray_blocked *b, const double x,
+                          const size_t *idxs);
+void spndarray_blocked_incr(spndarray_blocked *b, const size_t *idxs);
+int spndarray_blocked_foreach(const spndarray_blocked *b,
+                              const spndarray_visit_fn fn, void *ctx);
+spndarray_blocked *spndarray_blocked_from_array(const spndarray *m,
+                                                const size_t edge,
+                                                const double threshold);
+spndarray *spndarray_blocked_to_array(const spndarray_blocked *b);
+spndarray_blocked *spndarray_blocked_add(const spndarray_blocked *a,
+                                         const spndarray_blocked *b);
+spndarray_blocked *spndarray_blocked_mul(const spndarray_blocked *a,
+                                         const spndarray_blocked *b);
+spndarray *spndarray_blocked_reduce(const spndarray_blocked *b,
+                                    const size_t dim,
+                                    const reduction_function reduce_fn);
+
+/* spndchunk.c */
+spndarray_chunked *spndarray_chunked_create(const char *dirpath,
+                                            const size_t ndim,
+                                            const size_t *dimsizes,
+                                            const double fill,
+                                            const size_t chunk_nz);
+int spndarray_chunked_append(spndarray_chunked *c, const double x,
+                             const size_t *idxs);
+int spndarray_chunked_write(const spndarray *m, const char *dirpath,
+                            const size_t chunk_nz);
+spndarray_chunked *spndarray_chunked_open(const char *dirpath,
+                                          const size_t max_mapped);
+int spndarray_chunked_close(spndarray_chunked *c);
+size_t spndarray_chunked_ndim(const spndarray_chunked *c);
+const size_t *spndarray_chunked_dimsizes(const spndarray_chunked *c);
+double spndarray_chunked_fill(const spndarray_chunked *c);
+size_t spndarray_chunked_nnz(const spndarray_chunked *c);
+size_t spndarray_chunked_nchunks(const spndarray_chunked *c);
+size_t spndarray_chunked_nmapped(const spndarray_chunked *c);
+double spndarray_chunked_get(spndarray_chunked *c, const size_t *idxs);
+int spndarray_chunked_lookup(spndarray_chunked *c, const size_t *idxs,
+                             double *x);
+int spndarray_chunked_foreach(spndarray_chunked *c,
+                              const spndarray_visit_fn fn, void *ctx);
+spndarray *spndarray_chunked_reduce(spndarray_chunked *c, const size_t dim,
+                                    const reduction_function reduce_fn);
+int spndarray_chunked_add(spndarray_chunked *a, spndarray_chunked *b,
+                          const char *dirpath, const size_t chunk_nz);
+
+/* spnddense.c */
+spndarray *spndarray_from_dense(const double *buf, const size_t ndim,
+                                const size_t *dimsizes, const double fill,
+                                const double tol);
+spndarray *spndarray_from_dense_with(const double *buf, const size_t ndim,
+                                     const size_t *dimsizes,
+                                     const double fill, const double tol,
+                                     const spndarray_allocator *allocator);
+int spndarray_to_dense(const spndarray *m, double *buf);
+
+/* spndpack.c */
+int spndarray_pack(const spndarray *m, FILE *fp, const size_t flags);
+spndarray *spndarray_unpack(FILE *fp);
 
 /* spndop.c */
 spndarray *spndarray_mul(const spndarray *m, const spndarray *n, const size_t d);
 spndarray *spndarray_mul_vec(const spndarray *m, const spndarray *n, const size_t d);
 spndarray *spndarray_add(const spndarray *m, const spndarray *n);
+spndarray *spndarray_sub(const spndarray *m, const spndarray *n);
+void spndarray_fmap(spndarray *m, double_mapper f);
+void spndarray_negate(spndarray *m);
 void spndarray_mulinverse(spndarray *m);
 
+/* spndaccum.c */
+spndarray_accum *spndarray_accum_alloc(spndarray_sharded *target,
+                                       const size_t threshold);
+void spndarray_accum_free(spndarray_accum *a);
+int spndarray_accum_flush(spndarray_accum *a);
+int spndarray_accum_add(spndarray_accum *a, const double delta,
+                        const size_t *idxs);
+int spndarray_accum_incr(spndarray_accum *a, const size_t *idxs);
+void spndarray_accum_get_stats(const spndarray_accum *a,
+                               spndarray_accum_stats *stats);
+
+/* spndfilter.c */
+int spndarray_filter_enable(spndarray *m, const double fp_rate,
+                            const size_t capacity);
+void spndarray_filter_disable(spndarray *m);
+int spndarray_filter_rebuild(spndarray *m);
+int spndarray_filter_copy(spndarray *dst, const spndarray *src);
+void spndarray_filter_insert(spndarray *m, const size_t *idxs);
+int spndarray_filter_contains(const spndarray *m, const size_t *idxs);
+void spndarray_filter_false_positive(const spndarray *m);
+int spndarray_filter_get_stats(const spndarray *m,
+                               spndarray_filter_stats *stats);
+
+/* spnddict.c */
+int spndarray_dict_create(spndarray *m);
+void spndarray_dict_free(spndarray *m);
+int spndarray_dict_copy(spndarray *dst, const spndarray *src);
+void spndarray_dict_clear(spndarray *m);
+size_t spndarray_dict_compact(spndarray *m);
+void spndarray_dict_map(spndarray *m, const double_mapper f);
+size_t spndarray_dict_size(const spndarray *m);
+size_t spndarray_dict_bytes(const spndarray *m);
+
+/* spndrank.c */
+const spndarray_rank_ops *spndarray_rank_ops_for(const size_t ndim);
+
+/* spndfreeze.c */
+spndarray_frozen *spndarray_freeze(const spndarray *m);
+void spndarray_frozen_free(spndarray_frozen *f);
+size_t spndarray_frozen_nnz(const spndarray_frozen *f);
+double spndarray_frozen_get(const spndarray_frozen *f, const size_t *idxs);
+void spndarray_frozen_get_batch(const spndarray_frozen *f, const size_t count,
+                                const size_t *idxs, double *out);
+
+/* spndshape.c */
+int spndarray_partition_points(const spndarray *m, const size_t dim,
+                               const size_t k, size_t *bounds);
+spndarray **spndarray_partition(const spndarray *m, const size_t dim,
+                                const size_t k);
+spndarray *spndarray_concat(spndarray *const *arrays, const size_t k,
+                            const size_t dim);
+spndarray *spndarray_stack(spndarray *const *arrays, const size_t k);
+
+/* spndshard.c */
+spndarray_sharded *spndarray_sharded_alloc(const size_t ndims,
+                                           const size_t *dimsizes,
+                                           const size_t nshards,
+                                           const size_t flags);
+void spndarray_sharded_free(spndarray_sharded *s);
+void spndarray_sharded_set_fillvalue(spndarray_sharded *s, const double fill);
+size_t spndarray_sharded_ndim(const spndarray_sharded *s);
+size_t spndarray_sharded_nshards(const spndarray_sharded *s);
+size_t spndarray_sharded_shard(const spndarray_sharded *s,
+                               const size_t *idxs);
+size_t spndarray_sharded_nnz(spndarray_sharded *s);
+double spndarray_sharded_get(spndarray_sharded *s, const size_t *idxs);
+int spndarray_sharded_set(spndarray_sharded *s, const double x,
+                          const size_t *idxs);
+int spndarray_sharded_incr(spndarray_sharded *s, const size_t *idxs);
+int spndarray_sharded_incr_batch(spndarray_sharded *s, const size_t count,
+                                 const size_t *idxs, const double *deltas);
+spndarray *spndarray_sharded_merge(spndarray_sharded *s);
+
+/* spndthread.c */
+void spndarray_set_num_threads(const size_t n);
+size_t spndarray_get_num_threads(void);
+void spndarray_set_grain_size(const size_t grain);
+size_t spndarray_get_grain_size(void);
+void spndarray_parallel_for(const size_t count, const size_t grain,
+                            const spndarray_task_fn fn, void *ctx);
+int spndarray_sort_indices(size_t *a, const size_t count,
+                           const spndarray_compare_fn cmp, void *param);
+size_t spndarray_parallel_scan(size_t *a, const size_t count);
+
+/* spndstats.c */
+int spndarray_get_stats(spndarray_stats *stats);
+void spndarray_reset_stats(void);
+int spndarray_fwrite_stats(FILE *fp);
+
 __END_DECLS
 #endif
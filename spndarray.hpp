@@ -0,0 +1,133 @@
+#ifndef __SPNDARRAY_HPP__
+#define __SPNDARRAY_HPP__
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <stdexcept>
+#include <utility>
+
+#include "spndarray.h"
+
+/*
+ * Typed C++ view of spndarray, for arrays whose rank N and value type
+ * T are known at compile time
+ *
+ * Every call goes straight to the C routines, or to the rank routines
+ * spndarray_alloc_with() picked for N (see spndrank.c), and reads
+ * values in their own type; nothing is copied or converted on the way
+ */
+namespace spnd {
+
+/* value type flag of each C type */
+template <typename T> struct value_type;
+template <> struct value_type<double> {
+  static constexpr size_t flag = SPNDARRAY_FLOAT64;
+};
+template <> struct value_type<float> {
+  static constexpr size_t flag = SPNDARRAY_FLOAT32;
+};
+template <> struct value_type<int64_t> {
+  static constexpr size_t flag = SPNDARRAY_INT64;
+};
+template <> struct value_type<uint32_t> {
+  static constexpr size_t flag = SPNDARRAY_UINT32;
+};
+
+template <size_t N, typename T = double> class array {
+  static_assert(N > 0, "arrays have at least one dimension");
+
+public:
+  using index = std::array<size_t, N>;
+
+  /*
+   * Allocates an array of the given dimension sizes, with room for
+   * nzmax elements; it grows past them as needed. Throws
+   * std::bad_alloc when the memory budget refuses it
+   */
+  explicit array(const index &dimsizes, const size_t nzmax = 1)
+      : array(spndarray_alloc_nzmax(N, dimsizes.data(), nzmax,
+                                    SPNDARRAY_NTUPLE | value_type<T>::flag)) {}
+
+  /*
+   * Takes ownership of m, which must be a ntuple array of rank N
+   * holding values of type T. Throws std::bad_alloc when m is NULL, and
+   * std::invalid_argument, after freeing m, when it does not match
+   */
+  explicit array(spndarray *m) : m_(m) {
+    if (!m_)
+      throw std::bad_alloc();
+    if (m_->ndim != N || m_->vtype != value_type<T>::flag ||
+        !SPNDARRAY_ISNTUPLE(m_) || SPNDARRAY_ISDICT(m_)) {
+      spndarray_free(m_);
+      throw std::invalid_argument(
+          "spnd::array: not a ntuple array of this rank and value type");
+    }
+  }
+
+  array(const array &) = delete;
+  array &operator=(const array &) = delete;
+  array(array &&o) noexcept : m_(std::exchange(o.m_, nullptr)) {}
+  array &operator=(array &&o) noexcept {
+    std::swap(m_, o.m_);
+    return *this;
+  }
+  ~array() {
+    if (m_)
+      spndarray_free(m_);
+  }
+
+  /* a copy-on-write clone, see spndarray_clone_cow() */
+  array clone() const { return array(spndarray_clone_cow(m_)); }
+
+  T get(const index &idx) const {
+    const size_t n = m_->rank->find(m_, idx.data());
+    return n == SPNDARRAY_NOTFOUND ? static_cast<T>(m_->fill) : data()[n];
+  }
+
+  template <typename... I> T operator()(const I... i) const {
+    static_assert(sizeof...(I) == N, "one index per dimension");
+    return get(index{static_cast<size_t>(i)...});
+  }
+
+  bool contains(const index &idx) const {
+    return m_->rank->find(m_, idx.data()) != SPNDARRAY_NOTFOUND;
+  }
+
+  /* 0 on success, like spndarray_set() */
+  int set(const index &idx, const T x) {
+    return spndarray_set(m_, static_cast<double>(x), idx.data());
+  }
+
+  /* 0 on success, like spndarray_incr() */
+  int incr(const index &idx) { return spndarray_incr(m_, idx.data()); }
+
+  /* calls f(idx, value) for every stored element, in storage order */
+  template <typename F> void for_each(F &&f) const {
+    index idx;
+    for (size_t n = 0; n < m_->nz; n++) {
+      for (size_t i = 0; i < N; i++)
+        idx[i] = m_->dims[i][n];
+      f(static_cast<const index &>(idx), data()[n]);
+    }
+  }
+
+  size_t nnz() const { return m_->nz; }
+  T fill() const { return static_cast<T>(m_->fill); }
+  void set_fill(const T fill) {
+    spndarray_set_fillvalue(m_, static_cast<double>(fill));
+  }
+
+  spndarray *raw() { return m_; }
+  const spndarray *raw() const { return m_; }
+
+private:
+  const T *data() const { return static_cast<const T *>(m_->values); }
+
+  spndarray *m_;
+};
+
+} // namespace spnd
+
+#endif
@@ -0,0 +1,1005 @@
+#include "spndarray.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* cells per block aimed for when no edge is given */
+#define SPNDARRAY_BLOCK_CELLS 4096
+/* fill ratio at which a sparse block turns dense, by default */
+#define SPNDARRAY_BLOCK_DENSE 0.5
+/* doubles per vector in the dense kernels */
+#define SPNDARRAY_BLOCK_LANES 4
+
+/*
+ * the dense kernels work on GCC vector types, which the compiler
+ * lowers to whatever SIMD unit the target has (two SSE2 registers,
+ * one AVX register, NEON pairs, ...)
+ */
+typedef double spnd_vec
+    __attribute__((vector_size(SPNDARRAY_BLOCK_LANES * sizeof(double))));
+
+/*
+ * one hyper-block of edge^ndim cells; local offsets are row-major
+ * within the block
+ */
+typedef struct {
+  int dense;      /* whether vals holds every cell */
+  size_t nz;      /* cells not holding the fill value */
+  size_t cap;     /* sparse: room in offs and vals */
+  uint32_t *offs; /* sparse: sorted offsets of the stored cells */
+  double *vals;   /* sparse: values of the stored cells; dense: cells */
+  size_t key[];   /* block coordinates, ndim of them */
+} spnd_block;
+
+struct spndarray_blocked {
+  size_t ndim;        /* number of dimensions */
+  size_t *dimsizes;   /* dimension sizes, grown by set() as in arrays */
+  double fill;        /* fill value of the array */
+  size_t edge;        /* indices per block along every dimension */
+  size_t shift;       /* log2 of edge */
+  size_t cells;       /* cells per block, edge^ndim */
+  double threshold;   /* fill ratio at which blocks turn dense */
+  size_t dense_nz;    /* stored cells at which a sparse block turns dense */
+  size_t sparse_nz;   /* cells under which a dense block turns sparse */
+  size_t mask;        /* number of hash slots - 1 */
+  spnd_block **slots; /* the blocks, by a hash of their coordinates */
+  size_t nblocks;     /* number of blocks */
+  size_t ndense;      /* number of dense blocks */
+  size_t nz;          /* cells not holding the fill value */
+};
+
+static inline size_t block_hash(const spndarray_blocked *b,
+                                const size_t *key) {
+  return (size_t)spndarray_hash_idx(b->ndim, key) & b->mask;
+}
+
+/*
+ * block_split()
+ * Splits coordinates into the coordinates of their block and their
+ * offset within it
+ */
+static inline uint32_t block_split(const spndarray_blocked *b,
+                                   const size_t *idxs, size_t *key) {
+  size_t off = 0;
+  for (size_t i = 0; i < b->ndim; i++) {
+    key[i] = idxs[i] >> b->shift;
+    off = (off << b->shift) | (idxs[i] & (b->edge - 1));
+  }
+  return (uint32_t)off;
+}
+
+/* the inverse of block_split() */
+static inline void block_join(const spndarray_blocked *b,
+                              const spnd_block *blk, size_t off,
+                              size_t *idxs) {
+  for (size_t i = b->ndim; i-- > 0;) {
+    idxs[i] = (blk->key[i] << b->shift) | (off & (b->edge - 1));
+    off >>= b->shift;
+  }
+}
+
+static spnd_block *block_find(const spndarray_blocked *b, const size_t *key) {
+  for (size_t h = block_hash(b, key);; h = (h + 1) & b->mask) {
+    spnd_block *blk = b->slots[h];
+    if (!blk || !memcmp(blk->key, key, b->ndim * sizeof(size_t)))
+      return blk;
+  }
+}
+
+/*
+ * block_grow_table()
+ * Doubles the hash table, keeping it at most half full
+ */
+static void block_grow_table(spndarray_blocked *b) {
+  spnd_block **old = b->slots;
+  const size_t nslots = b->mask + 1;
+
+  b->slots = calloc(2 * nslots, sizeof(spnd_block *));
+  if (!b->slots) {
+    fprintf(stderr, "not enough space for blocked array");
+    abort();
+  }
+  b->mask = 2 * nslots - 1;
+  for (size_t s = 0; s < nslots; s++) {
+    if (!old[s])
+      continue;
+    size_t h = block_hash(b, old[s]->key);
+    while (b->slots[h])
+      h = (h + 1) & b->mask;
+    b->slots[h] = old[s];
+  }
+  free(old);
+}
+
+/*
+ * block_create()
+ * Adds an empty sparse block with the given coordinates
+ */
+static spnd_block *block_create(spndarray_blocked *b, const size_t *key) {
+  if (2 * (b->nblocks + 1) > b->mask + 1)
+    block_grow_table(b);
+
+  spnd_block *blk = calloc(1, sizeof(*blk) + b->ndim * sizeof(size_t));
+  if (!blk) {
+    fprintf(stderr, "not enough space for block");
+    abort();
+  }
+  memcpy(blk->key, key, b->ndim * sizeof(size_t));
+
+  size_t h = block_hash(b, key);
+  while (b->slots[h])
+    h = (h + 1) & b->mask;
+  b->slots[h] = blk;
+  b->nblocks++;
+  return blk;
+}
+
+static void block_free(spnd_block *blk) {
+  free(blk->offs);
+  free(blk->vals);
+  free(blk);
+}
+
+/*
+ * dense_cells()
+ * Allocates the cells of a dense block, aligned to a cache line
+ */
+static double *dense_cells(const spndarray_blocked *b) {
+  size_t bytes = (b->cells * sizeof(double) + 63) & ~(size_t)63;
+  double *cells = aligned_alloc(64, bytes);
+  if (!cells) {
+    fprintf(stderr, "not enough space for dense block");
+    abort();
+  }
+  return cells;
+}
+
+/* position of off in a sparse block, or of the first offset above it */
+static inline size_t sparse_search(const spnd_block *blk, const uint32_t off) {
+  size_t lo = 0, hi = blk->nz;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (blk->offs[mid] < off)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/*
+ * sparse_reserve()
+ * Makes room for n cells in a sparse block
+ */
+static void sparse_reserve(spnd_block *blk, const size_t n) {
+  if (n <= blk->cap)
+    return;
+  size_t cap = blk->cap ? 2 * blk->cap : 4;
+  while (cap < n)
+    cap *= 2;
+  uint32_t *offs = realloc(blk->offs, cap * sizeof(uint32_t));
+  if (offs)
+    blk->offs = offs;
+  double *vals = realloc(blk->vals, cap * sizeof(double));
+  if (!offs || !vals) {
+    fprintf(stderr, "not enough space for block");
+    abort();
+  }
+  blk->vals = vals;
+  blk->cap = cap;
+}
+
+/*
+ * block_densify()
+ * Turns a sparse block into a dense one
+ */
+static void block_densify(spndarray_blocked *b, spnd_block *blk) {
+  double *cells = dense_cells(b);
+  for (size_t c = 0; c < b->cells; c++)
+    cells[c] = b->fill;
+  for (size_t n = 0; n < blk->nz; n++)
+    cells[blk->offs[n]] = blk->vals[n];
+
+  free(blk->offs);
+  free(blk->vals);
+  blk->offs = NULL;
+  blk->vals = cells;
+  blk->cap = 0;
+  blk->dense = 1;
+  b->ndense++;
+}
+
+/*
+ * block_sparsify()
+ * Turns a dense block into a sparse one, keeping the cells that do
+ * not hold the fill value
+ */
+static void block_sparsify(spndarray_blocked *b, spnd_block *blk) {
+  double *cells = blk->vals;
+  const size_t nz = blk->nz;
+
+  blk->vals = NULL;
+  blk->nz = 0;
+  blk->dense = 0;
+  sparse_reserve(blk, nz ? nz : 1);
+  for (size_t c = 0; c < b->cells; c++)
+    if (cells[c] != b->fill) {
+      blk->offs[blk->nz] = (uint32_t)c;
+      blk->vals[blk->nz++] = cells[c];
+    }
+  free(cells);
+  b->ndense--;
+}
+
+/*
+ * block_settle()
+ * Converts a block whose fill ratio crossed a threshold
+ *
+ * Notes
+ *  a block turns dense at the threshold and back to sparse only under
+ *  half of it, so that a block hovering around the threshold is not
+ *  converted back and forth
+ */
+static inline void block_settle(spndarray_blocked *b, spnd_block *blk) {
+  if (!blk->dense && blk->nz >= b->dense_nz)
+    block_densify(b, blk);
+  else if (blk->dense && blk->nz < b->sparse_nz)
+    block_sparsify(b, blk);
+}
+
+static inline double block_load(const spndarray_blocked *b,
+                                const spnd_block *blk, const uint32_t off) {
+  if (blk->dense)
+    return blk->vals[off];
+  size_t n = sparse_search(blk, off);
+  return n < blk->nz && blk->offs[n] == off ? blk->vals[n] : b->fill;
+}
+
+/*
+ * block_store()
+ * Writes a cell of a block, dropping cells that take the fill value
+ * from sparse blocks
+ */
+static void block_store(spndarray_blocked *b, spnd_block *blk,
+                        const uint32_t off, const double x) {
+  if (blk->dense) {
+    const double old = blk->vals[off];
+    blk->vals[off] = x;
+    const ssize_t d = (x != b->fill) - (old != b->fill);
+    blk->nz += d;
+    b->nz += d;
+  } else {
+    size_t n = sparse_search(blk, off);
+    if (n < blk->nz && blk->offs[n] == off) {
+      if (x != b->fill) {
+        blk->vals[n] = x;
+        return;
+      }
+      memmove(&blk->offs[n], &blk->offs[n + 1],
+              (blk->nz - n - 1) * sizeof(uint32_t));
+      memmove(&blk->vals[n], &blk->vals[n + 1],
+              (blk->nz - n - 1) * sizeof(double));
+      blk->nz--;
+      b->nz--;
+    } else if (x != b->fill) {
+      sparse_reserve(blk, blk->nz + 1);
+      memmove(&blk->offs[n + 1], &blk->offs[n],
+              (blk->nz - n) * sizeof(uint32_t));
+      memmove(&blk->vals[n + 1], &blk->vals[n],
+              (blk->nz - n) * sizeof(double));
+      blk->offs[n] = off;
+      blk->vals[n] = x;
+      blk->nz++;
+      b->nz++;
+    }
+  }
+  block_settle(b, blk);
+}
+
+/*
+ * spndarray_blocked_alloc()
+ *
+ * Allocate an array stored as hyper-blocks that are each kept sparse
+ * or dense depending on how full they are
+ *
+ * Inputs
+ *  ndims     - number of dimensions
+ *  dimsizes  - list of dimension sizes
+ *  edge      - indices per block along every dimension, a power of two;
+ *              0 picks the largest edge giving at most 4096 cells
+ *  threshold - fraction of the cells of a block that must be set for
+ *              it to be stored dense, in (0, 1]; 0 for one half
+ *
+ * Notes
+ *  the index space is tiled into blocks of edge^ndim cells, and only
+ *  the blocks holding elements are kept, in a hash table. A sparse
+ *  block stores its elements as sorted 32-bit offsets and values, 12
+ *  bytes each against 8 for every cell of a dense block; a dense one
+ *  needs no search and gets vectorized kernels. Blocks are converted
+ *  as their fill ratio crosses the threshold
+ *
+ * Return
+ *  the array, or NULL if the edge is not a power of two or the blocks
+ *  would have more than 2^32 cells
+ */
+spndarray_blocked *spndarray_blocked_alloc(const size_t ndims,
+                                           const size_t *dimsizes,
+                                           const size_t edge,
+                                           const double threshold) {
+  if (ndims == 0 || (edge & (edge - 1)) || threshold < 0 || threshold > 1) {
+    fprintf(stderr, "blocked arrays need a dimension, an edge that is a "
+                    "power of two and a threshold in (0, 1]\n");
+    return NULL;
+  }
+
+  size_t shift = 0, cells = 1;
+  if (edge) {
+    while (((size_t)1 << shift) < edge)
+      shift++;
+    if (shift * ndims > 32) {
+      fprintf(stderr, "blocks may have at most 2^32 cells\n");
+      return NULL;
+    }
+  } else
+    while ((shift + 1) * ndims < 64 &&
+           ((size_t)1 << ((shift + 1) * ndims)) <= SPNDARRAY_BLOCK_CELLS)
+      shift++;
+  for (size_t i = 0; i < ndims; i++)
+    cells <<= shift;
+
+  spndarray_blocked *b = calloc(1, sizeof(*b));
+  if (!b) {
+    fprintf(stderr, "not enough space for blocked array");
+    abort();
+  }
+  b->ndim = ndims;
+  b->edge = (size_t)1 << shift;
+  b->shift = shift;
+  b->cells = cells;
+  b->threshold = threshold ? threshold : SPNDARRAY_BLOCK_DENSE;
+  b->dense_nz = (size_t)(b->threshold * cells);
+  if (b->dense_nz == 0)
+    b->dense_nz = 1;
+  b->sparse_nz = b->dense_nz / 2;
+  b->mask = 15;
+  b->dimsizes = malloc(ndims * sizeof(size_t));
+  b->slots = calloc(b->mask + 1, sizeof(spnd_block *));
+  if (!b->dimsizes || !b->slots) {
+    fprintf(stderr, "not enough space for blocked array");
+    abort();
+  }
+  memcpy(b->dimsizes, dimsizes, ndims * sizeof(size_t));
+  return b;
+} /* spndarray_blocked_alloc() */
+
+/*
+ * spndarray_blocked_free()
+ * Frees the given blocked array
+ */
+void spndarray_blocked_free(spndarray_blocked *b) {
+  for (size_t s = 0; s <= b->mask; s++)
+    if (b->slots[s])
+      block_free(b->slots[s]);
+  free(b->slots);
+  free(b->dimsizes);
+  free(b);
+}
+
+/*
+ * spndarray_blocked_set_fillvalue()
+ * Sets the fill value of an array that holds no element yet
+ *
+ * Return
+ *  0 on success, 1 if the array is not empty
+ */
+int spndarray_blocked_set_fillvalue(spndarray_blocked *b, const double fill) {
+  if (b->nblocks) {
+    fprintf(stderr, "the fill value of a blocked array can only be set "
+                    "while it is empty\n");
+    return 1;
+  }
+  b->fill = fill;
+  return 0;
+}
+
+size_t spndarray_blocked_ndim(const spndarray_blocked *b) { return b->ndim; }
+
+const size_t *spndarray_blocked_dimsizes(const spndarray_blocked *b) {
+  return b->dimsizes;
+}
+
+size_t spndarray_blocked_edge(const spndarray_blocked *b) { return b->edge; }
+
+/*
+ * spndarray_blocked_nnz()
+ * Number of cells not holding the fill value
+ */
+size_t spndarray_blocked_nnz(const spndarray_blocked *b) { return b->nz; }
+
+size_t spndarray_blocked_nblocks(const spndarray_blocked *b) {
+  return b->nblocks;
+}
+
+size_t spndarray_blocked_ndense(const spndarray_blocked *b) {
+  return b->ndense;
+}
+
+/*
+ * spndarray_blocked_bytes()
+ * Memory held by the array: its blocks, their table and the header
+ */
+size_t spndarray_blocked_bytes(const spndarray_blocked *b) {
+  size_t bytes = sizeof(*b) + b->ndim * sizeof(size_t) +
+                 (b->mask + 1) * sizeof(spnd_block *);
+  for (size_t s = 0; s <= b->mask; s++) {
+    const spnd_block *blk = b->slots[s];
+    if (!blk)
+      continue;
+    bytes += sizeof(*blk) + b->ndim * sizeof(size_t);
+    bytes += blk->dense ? b->cells * sizeof(double)
+                        : blk->cap * (sizeof(uint32_t) + sizeof(double));
+  }
+  return bytes;
+}
+
+double spndarray_blocked_get(const spndarray_blocked *b, const size_t *idxs) {
+  size_t key[b->ndim];
+
+  for (size_t i = 0; i < b->ndim; i++)
+    if (idxs[i] >= b->dimsizes[i])
+      return b->fill;
+  const uint32_t off = block_split(b, idxs, key);
+  const spnd_block *blk = block_find(b, key);
+  return blk ? block_load(b, blk, off) : b->fill;
+}
+
+/*
+ * blocked_cell()
+ * Finds the block of the given coordinates, creating it if needed, and
+ * grows the dimensions to hold them
+ */
+static spnd_block *blocked_cell(spndarray_blocked *b, const size_t *idxs,
+                                uint32_t *off) {
+  size_t key[b->ndim];
+
+  for (size_t i = 0; i < b->ndim; i++)
+    if (b->dimsizes[i] < idxs[i] + 1)
+      b->dimsizes[i] = idxs[i] + 1;
+  *off = block_split(b, idxs, key);
+  spnd_block *blk = block_find(b, key);
+  return blk ? blk : block_create(b, key);
+}
+
+int spndarray_blocked_set(spndarray_blocked *b, const double x,
+                          const size_t *idxs) {
+  size_t key[b->ndim];
+  uint32_t off;
+
+  // leave absent blocks absent when clearing a cell
+  if (x == b->fill) {
+    off = block_split(b, idxs, key);
+    spnd_block *blk = block_find(b, key);
+    if (blk)
+      block_store(b, blk, off, x);
+    return 0;
+  }
+  spnd_block *blk = blocked_cell(b, idxs, &off);
+  block_store(b, blk, off, x);
+  return 0;
+}
+
+void spndarray_blocked_incr(spndarray_blocked *b, const size_t *idxs) {
+  uint32_t off;
+  spnd_block *blk = blocked_cell(b, idxs, &off);
+  block_store(b, blk, off, block_load(b, blk, off) + 1.0);
+}
+
+/*
+ * spndarray_blocked_foreach()
+ *
+ * Calls fn on every cell not holding the fill value
+ *
+ * Notes
+ *  cells are visited block by block, in no particular order of the
+ *  blocks and in row-major order within each
+ *
+ * Return
+ *  0 once every cell is visited, or the first nonzero value returned
+ *  by fn, which stops the walk
+ */
+int spndarray_blocked_foreach(const spndarray_blocked *b,
+                              const spndarray_visit_fn fn, void *ctx) {
+  size_t idxs[b->ndim];
+  int r;
+
+  for (size_t s = 0; s <= b->mask; s++) {
+    const spnd_block *blk = b->slots[s];
+    if (!blk)
+      continue;
+    if (blk->dense) {
+      for (size_t c = 0; c < b->cells; c++)
+        if (blk->vals[c] != b->fill) {
+          block_join(b, blk, c, idxs);
+          if ((r = fn(ctx, idxs, blk->vals[c])))
+            return r;
+        }
+    } else
+      for (size_t n = 0; n < blk->nz; n++) {
+        block_join(b, blk, blk->offs[n], idxs);
+        if ((r = fn(ctx, idxs, blk->vals[n])))
+          return r;
+      }
+  }
+  return 0;
+}
+
+/*
+ * from_array_*()
+ * Set every element of m into b, one routine per value type
+ */
+#define SPND_FROM_ARRAY(V, T, S, READ)                                     \
+  static void from_array_##S(const spndarray *m, spndarray_blocked *b) {   \
+    size_t idxs[m->ndim];                                                  \
+                                                                           \
+    for (size_t n = 0; n < m->nz; n++) {                                   \
+      for (size_t i = 0; i < m->ndim; i++)                                 \
+        idxs[i] = m->dims[i][n];                                           \
+      spndarray_blocked_set(b, READ(T, m, n), idxs);                       \
+    }                                                                      \
+  }
+SPNDARRAY_FOREACH_TYPE(SPND_FROM_ARRAY)
+#undef SPND_FROM_ARRAY
+
+/*
+ * spndarray_blocked_from_array()
+ *
+ * Builds a blocked array holding the elements of a ntuple array
+ *
+ * Inputs
+ *  m         - the array, which keeps its fill value
+ *  edge      - as for spndarray_blocked_alloc()
+ *  threshold - as for spndarray_blocked_alloc()
+ *
+ * Notes
+ *  elements holding the fill value are dropped
+ */
+spndarray_blocked *spndarray_blocked_from_array(const spndarray *m,
+                                                const size_t edge,
+                                                const double threshold) {
+  if (!SPNDARRAY_ISNTUPLE(m)) {
+    fprintf(stderr, "array must be in the ntuple format");
+    return NULL;
+  }
+  spndarray_blocked *b =
+      spndarray_blocked_alloc(m->ndim, m->dimsizes, edge, threshold);
+  if (!b)
+    return NULL;
+  b->fill = m->fill;
+
+  switch (m->vtype) {
+#define SPND_FROM_ARRAY_CASE(V, T, S, READ)                                \
+  case V:                                                                  \
+    from_array_##S(m, b);                                                  \
+    break;
+    SPNDARRAY_FOREACH_TYPE(SPND_FROM_ARRAY_CASE)
+#undef SPND_FROM_ARRAY_CASE
+  }
+  return b;
+}
+
+static int gather_visit(void *ctx, const size_t *idxs, const double x) {
+  spndarray *m = (spndarray *)ctx;
+  for (size_t i = 0; i < m->ndim; i++)
+    m->dims[i][m->nz] = idxs[i];
+  m->data[m->nz++] = x;
+  return 0;
+}
+
+/*
+ * spndarray_blocked_to_array()
+ *
+ * Builds a ntuple array holding the elements of a blocked array
+ *
+ * Notes
+ *  the elements are appended as they come and sorted into the tree
+ *  once, by spndarray_tree_rebuild()
+ */
+spndarray *spndarray_blocked_to_array(const spndarray_blocked *b) {
+  spndarray *m = spndarray_alloc_nzmax(b->ndim, b->dimsizes,
+                                       b->nz ? b->nz : 1, SPNDARRAY_NTUPLE);
+  if (!m)
+    return NULL;
+  spndarray_set_fillvalue(m, b->fill);
+  spndarray_blocked_foreach(b, gather_visit, m);
+  if (spndarray_tree_rebuild(m)) {
+    spndarray_free(m);
+    return NULL;
+  }
+  return m;
+}
+
+/*
+ * dense kernels: n is a power of two, but may be below the number of
+ * lanes when blocks are tiny, hence the scalar tails
+ */
+static void dense_add(double *restrict out, const double *restrict x,
+                      const size_t n) {
+  size_t c = 0;
+  for (; c + SPNDARRAY_BLOCK_LANES <= n; c += SPNDARRAY_BLOCK_LANES) {
+    spnd_vec a, b;
+    memcpy(&a, &out[c], sizeof(a));
+    memcpy(&b, &x[c], sizeof(b));
+    a += b;
+    memcpy(&out[c], &a, sizeof(a));
+  }
+  for (; c < n; c++)
+    out[c] += x[c];
+}
+
+static void dense_mul(double *restrict out, const double *restrict x,
+                      const double *restrict y, const size_t n) {
+  size_t c = 0;
+  for (; c + SPNDARRAY_BLOCK_LANES <= n; c += SPNDARRAY_BLOCK_LANES) {
+    spnd_vec a, b;
+    memcpy(&a, &x[c], sizeof(a));
+    memcpy(&b, &y[c], sizeof(b));
+    a *= b;
+    memcpy(&out[c], &a, sizeof(a));
+  }
+  for (; c < n; c++)
+    out[c] = x[c] * y[c];
+}
+
+/* number of nonzero cells */
+static size_t dense_count(const double *x, const size_t n) {
+  size_t nz = 0;
+  for (size_t c = 0; c < n; c++)
+    nz += x[c] != 0.0;
+  return nz;
+}
+
+/*
+ * dense_sum()
+ * Sums the cells of a block viewed as [outer][edge][inner] over the
+ * middle axis into acc, of size outer * inner
+ */
+static void dense_sum(double *restrict acc, const double *restrict x,
+                      const size_t outer, const size_t edge,
+                      const size_t inner) {
+  memset(acc, 0, outer * inner * sizeof(double));
+  for (size_t o = 0; o < outer; o++) {
+    double *a = &acc[o * inner];
+    for (size_t k = 0; k < edge; k++) {
+      const double *row = &x[(o * edge + k) * inner];
+      size_t c = 0;
+      for (; c + SPNDARRAY_BLOCK_LANES <= inner; c += SPNDARRAY_BLOCK_LANES) {
+        spnd_vec s, v;
+        memcpy(&s, &a[c], sizeof(s));
+        memcpy(&v, &row[c], sizeof(v));
+        s += v;
+        memcpy(&a[c], &s, sizeof(s));
+      }
+      for (; c < inner; c++)
+        a[c] += row[c];
+    }
+  }
+}
+
+/*
+ * blocked_like()
+ * Allocates an empty array with the blocking of a and the larger of
+ * the dimension sizes of a and b
+ */
+static spndarray_blocked *blocked_like(const spndarray_blocked *a,
+                                       const spndarray_blocked *b) {
+  size_t dims[a->ndim];
+  for (size_t i = 0; i < a->ndim; i++)
+    dims[i] = a->dimsizes[i] > b->dimsizes[i] ? a->dimsizes[i]
+                                               : b->dimsizes[i];
+  return spndarray_blocked_alloc(a->ndim, dims, a->edge, a->threshold);
+}
+
+static int blocked_compatible(const spndarray_blocked *a,
+                              const spndarray_blocked *b, const char *op) {
+  if (a->ndim != b->ndim || a->edge != b->edge || a->fill != 0.0 ||
+      b->fill != 0.0) {
+    fprintf(stderr, "blocked %s needs arrays of the same dimensions and "
+                    "edge, with a zero fill value\n", op);
+    return 0;
+  }
+  return 1;
+}
+
+/*
+ * block_add_into()
+ * Adds a block of an operand into the result block of the same
+ * coordinates
+ */
+static void block_add_into(spndarray_blocked *r, spnd_block *out,
+                           const spnd_block *x) {
+  if (out->dense && x->dense) {
+    dense_add(out->vals, x->vals, r->cells);
+  } else if (out->dense) {
+    for (size_t n = 0; n < x->nz; n++)
+      out->vals[x->offs[n]] += x->vals[n];
+  } else if (x->dense) {
+    double *cells = dense_cells(r);
+    memcpy(cells, x->vals, r->cells * sizeof(double));
+    for (size_t n = 0; n < out->nz; n++)
+      cells[out->offs[n]] += out->vals[n];
+    free(out->offs);
+    free(out->vals);
+    out->offs = NULL;
+    out->vals = cells;
+    out->cap = 0;
+    out->dense = 1;
+    r->ndense++;
+  } else {
+    // merge the two sorted runs from the back, in place
+    const size_t total = out->nz + x->nz;
+    size_t i = out->nz, j = x->nz, k = total;
+    sparse_reserve(out, total);
+    while (j > 0) {
+      if (i > 0 && out->offs[i - 1] > x->offs[j - 1]) {
+        out->offs[--k] = out->offs[--i];
+        out->vals[k] = out->vals[i];
+      } else if (i > 0 && out->offs[i - 1] == x->offs[j - 1]) {
+        out->offs[--k] = out->offs[--i];
+        out->vals[k] = out->vals[i] + x->vals[--j];
+      } else {
+        out->offs[--k] = x->offs[--j];
+        out->vals[k] = x->vals[j];
+      }
+    }
+    // the merge leaves a gap of one slot per coinciding offset between
+    // the untouched front [0, i) and the merged back [k, total); close
+    // it, dropping the cells that cancelled out
+    size_t n = 0;
+    for (size_t c = 0; c < total; c++) {
+      if (c == i)
+        c = k;
+      if (c < total && out->vals[c] != 0.0) {
+        out->offs[n] = out->offs[c];
+        out->vals[n++] = out->vals[c];
+      }
+    }
+    out->nz = n;
+    return;
+  }
+  out->nz = dense_count(out->vals, r->cells);
+}
+
+/*
+ * block_copy()
+ * Adds a copy of a block to r
+ */
+static spnd_block *block_copy(spndarray_blocked *r, const spnd_block *x) {
+  spnd_block *out = block_create(r, x->key);
+  if (x->dense) {
+    out->vals = dense_cells(r);
+    memcpy(out->vals, x->vals, r->cells * sizeof(double));
+    out->dense = 1;
+    r->ndense++;
+  } else if (x->nz) {
+    sparse_reserve(out, x->nz);
+    memcpy(out->offs, x->offs, x->nz * sizeof(uint32_t));
+    memcpy(out->vals, x->vals, x->nz * sizeof(double));
+  }
+  out->nz = x->nz;
+  return out;
+}
+
+/*
+ * spndarray_blocked_add()
+ *
+ * Calculates the element-wise sum of a and b
+ *
+ * Notes
+ *  both arrays need the same dimensions and edge, and a fill value of
+ *  zero. Blocks dense in both operands are added with vector
+ *  instructions; the result has the blocking of a, and each of its
+ *  blocks is stored sparse or dense according to its own fill ratio
+ */
+spndarray_blocked *spndarray_blocked_add(const spndarray_blocked *a,
+                                         const spndarray_blocked *b) {
+  if (!blocked_compatible(a, b, "add"))
+    return NULL;
+  spndarray_blocked *r = blocked_like(a, b);
+  if (!r)
+    return NULL;
+
+  for (size_t s = 0; s <= a->mask; s++)
+    if (a->slots[s])
+      block_copy(r, a->slots[s]);
+  for (size_t s = 0; s <= b->mask; s++) {
+    const spnd_block *x = b->slots[s];
+    if (!x)
+      continue;
+    spnd_block *out = block_find(r, x->key);
+    if (out)
+      block_add_into(r, out, x);
+    else
+      block_copy(r, x);
+  }
+
+  for (size_t s = 0; s <= r->mask; s++)
+    if (r->slots[s]) {
+      r->nz += r->slots[s]->nz;
+      block_settle(r, r->slots[s]);
+    }
+  return r;
+}
+
+/*
+ * block_mul_sparse()
+ * Multiplies the stored cells of a sparse block by the matching cells
+ * of another block, into out
+ */
+static void block_mul_sparse(spnd_block *out, const spnd_block *x,
+                             const spnd_block *y) {
+  sparse_reserve(out, x->nz ? x->nz : 1);
+  for (size_t n = 0, m = 0; n < x->nz; n++) {
+    double v;
+    if (y->dense)
+      v = y->vals[x->offs[n]];
+    else {
+      while (m < y->nz && y->offs[m] < x->offs[n])
+        m++;
+      if (m == y->nz)
+        break;
+      if (y->offs[m] != x->offs[n])
+        continue;
+      v = y->vals[m];
+    }
+    v *= x->vals[n];
+    if (v != 0.0) {
+      out->offs[out->nz] = x->offs[n];
+      out->vals[out->nz++] = v;
+    }
+  }
+}
+
+/*
+ * spndarray_blocked_mul()
+ *
+ * Calculates the element-wise product of a and b
+ *
+ * Notes
+ *  both arrays need the same dimensions and edge, and a fill value of
+ *  zero. Only blocks present in both operands are visited; blocks
+ *  dense in both are multiplied with vector instructions
+ */
+spndarray_blocked *spndarray_blocked_mul(const spndarray_blocked *a,
+                                         const spndarray_blocked *b) {
+  if (!blocked_compatible(a, b, "mul"))
+    return NULL;
+  spndarray_blocked *r = blocked_like(a, b);
+  if (!r)
+    return NULL;
+
+  for (size_t s = 0; s <= a->mask; s++) {
+    const spnd_block *x = a->slots[s], *y;
+    if (!x || !(y = block_find(b, x->key)) || !x->nz || !y->nz)
+      continue;
+    spnd_block *out = block_create(r, x->key);
+    if (x->dense && y->dense) {
+      out->vals = dense_cells(r);
+      out->dense = 1;
+      r->ndense++;
+      dense_mul(out->vals, x->vals, y->vals, r->cells);
+      out->nz = dense_count(out->vals, r->cells);
+    } else if (x->dense)
+      block_mul_sparse(out, y, x);
+    else
+      block_mul_sparse(out, x, y);
+    r->nz += out->nz;
+    block_settle(r, out);
+  }
+  return r;
+}
+
+/*
+ * blocked_reduce_cell()
+ * Folds x into the element of the result at the coordinates idxs
+ * with dimension dim left out
+ */
+static int blocked_reduce_cell(spndarray *res, const size_t dim,
+                               const reduction_function reduce_fn,
+                               const int rdimsize, const size_t *idxs,
+                               const double x) {
+  size_t key[res->ndim];
+  for (size_t i = 0, j = 0; i <= res->ndim; i++)
+    if (i != dim)
+      key[j++] = idxs[i];
+
+  double *pacc = spndarray_ptr(res, key);
+  if (pacc) {
+    *pacc = reduce_fn(*pacc, x, rdimsize);
+    return 0;
+  }
+  return spndarray_set(res, reduce_fn(0, x, rdimsize), key);
+}
+
+/*
+ * spndarray_blocked_reduce()
+ *
+ * Reduces a dimension of a blocked array, as spndarray_reduce() does
+ *
+ * Output
+ *  the reduced array, in the ntuple format
+ *
+ * Notes
+ *  for reduce_sum and reduce_mean, which are linear in the values,
+ *  every dense block is first summed along the dimension with vector
+ *  instructions and only the partial sums reach the result. Other
+ *  reductions see every element, block by block. Only a zero fill
+ *  value is supported
+ */
+spndarray *spndarray_blocked_reduce(const spndarray_blocked *b,
+                                    const size_t dim,
+                                    const reduction_function reduce_fn) {
+  if (b->fill != 0.0 || b->ndim < 2 || dim >= b->ndim) {
+    fprintf(stderr, "blocked reduce needs a zero fill value and a valid "
+                    "dimension\n");
+    return NULL;
+  }
+
+  size_t dims[b->ndim - 1];
+  for (size_t i = 0, j = 0; i < b->ndim; i++)
+    if (i != dim)
+      dims[j++] = b->dimsizes[i];
+  spndarray *res =
+      spndarray_alloc_nzmax(b->ndim - 1, dims, 16, SPNDARRAY_NTUPLE);
+  if (!res)
+    return NULL;
+
+  const int rdimsize = (int)b->dimsizes[dim];
+  const int linear = reduce_fn == reduce_sum || reduce_fn == reduce_mean;
+  size_t outer = 1, inner = 1, idxs[b->ndim];
+  for (size_t i = 0; i < b->ndim; i++) {
+    if (i < dim)
+      outer *= b->edge;
+    else if (i > dim)
+      inner *= b->edge;
+  }
+  double *acc = linear ? malloc(outer * inner * sizeof(double)) : NULL;
+  if (linear && !acc) {
+    fprintf(stderr, "not enough space for reduction");
+    abort();
+  }
+
+  int s = 0;
+  for (size_t slot = 0; slot <= b->mask && !s; slot++) {
+    const spnd_block *blk = b->slots[slot];
+    if (!blk)
+      continue;
+    if (blk->dense && linear) {
+      dense_sum(acc, blk->vals, outer, b->edge, inner);
+      for (size_t c = 0; c < outer * inner && !s; c++) {
+        if (acc[c] == 0.0)
+          continue;
+        // the cell at index 0 of the block along dim stands for its row
+        block_join(b, blk, (c / inner) * b->edge * inner + c % inner, idxs);
+        s = blocked_reduce_cell(res, dim, reduce_fn, rdimsize, idxs, acc[c]);
+      }
+    } else if (blk->dense) {
+      for (size_t c = 0; c < b->cells && !s; c++)
+        if (blk->vals[c] != 0.0) {
+          block_join(b, blk, c, idxs);
+          s = blocked_reduce_cell(res, dim, reduce_fn, rdimsize, idxs,
+                                  blk->vals[c]);
+        }
+    } else
+      for (size_t n = 0; n < blk->nz && !s; n++) {
+        block_join(b, blk, blk->offs[n], idxs);
+        s = blocked_reduce_cell(res, dim, reduce_fn, rdimsize, idxs,
+                                blk->vals[n]);
+      }
+  }
+  free(acc);
+  if (s) {
+    spndarray_free(res);
+    return NULL;
+  }
+  return res;
+} /* spndarray_blocked_reduce() */
@@ -0,0 +1,681 @@
+#include "spndarray.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+/*
+ * Chunked array directory, version 1
+ *
+ *   index               spndarray_chunked_header, dimsizes (ndim
+ *                       uint64), then per chunk its number of
+ *                       elements and its first and last coordinates
+ *                       (1 + 2 * ndim uint64)
+ *   chunk-000000.spnd   the elements of each chunk, in the binary
+ *   chunk-000001.spnd   format of spndarray_fwrite_binary()
+ *   ...
+ *
+ * The elements are sorted by dimension 0, then 1, and so on across
+ * the whole directory, so the first and last coordinates of the chunks
+ * tell which chunk may hold any given coordinates.
+ */
+
+#define SPNDARRAY_CHUNKED_MAGIC "SPNDCHK"
+#define SPNDARRAY_CHUNKED_VERSION 1
+/* default number of elements per chunk */
+#define SPNDARRAY_CHUNKED_NZ ((size_t)1 << 22)
+
+typedef struct {
+  char magic[8];     /* SPNDARRAY_CHUNKED_MAGIC */
+  uint32_t version;  /* SPNDARRAY_CHUNKED_VERSION */
+  uint32_t reserved;
+  uint64_t ndim;     /* number of dimensions */
+  uint64_t nchunks;  /* number of chunks */
+  uint64_t chunk_nz; /* largest number of elements in a chunk */
+  double fill;       /* fill value */
+} spndarray_chunked_header;
+
+struct spndarray_chunked {
+  char *dirpath;              /* directory of the chunks */
+  size_t ndim;                /* number of dimensions */
+  size_t *dimsizes;           /* dimension sizes */
+  double fill;                /* fill value of the array */
+  size_t chunk_nz;            /* largest number of elements in a chunk */
+  size_t nchunks;             /* number of chunks */
+  size_t *nz;                 /* elements of each chunk */
+  size_t *first;              /* first coordinates of each chunk */
+  size_t *last;               /* last coordinates of each chunk */
+  spndarray_mapped **mapped;  /* mapping of each chunk, or NULL */
+  size_t *used;               /* when each chunk was last used */
+  size_t clock;               /* number of chunk uses so far */
+  size_t nmapped;             /* number of chunks mapped */
+  size_t max_mapped;          /* most chunks mapped at once */
+  size_t pinned;              /* chunk that must stay mapped */
+  spndarray *buf;             /* writer: elements of the next chunk */
+};
+
+static int compare_coords(const size_t ndim, const size_t *a,
+                          const size_t *b) {
+  for (size_t i = 0; i < ndim; i++)
+    if (a[i] != b[i])
+      return a[i] < b[i] ? -1 : 1;
+  return 0;
+}
+
+static void chunk_path(const spndarray_chunked *c, const size_t k,
+                       char *path, const size_t len) {
+  snprintf(path, len, "%s/chunk-%06zu.spnd", c->dirpath, k);
+}
+
+/*
+ * chunked_grow()
+ * Makes room in the directory for one more chunk
+ */
+static void chunked_grow(spndarray_chunked *c) {
+  size_t n = c->nchunks + 1;
+  c->nz = realloc(c->nz, n * sizeof(size_t));
+  c->first = realloc(c->first, n * c->ndim * sizeof(size_t));
+  c->last = realloc(c->last, n * c->ndim * sizeof(size_t));
+  if (!c->nz || !c->first || !c->last) {
+    fprintf(stderr, "not enough space for chunk directory");
+    abort();
+  }
+}
+
+static spndarray_chunked *chunked_alloc(const char *dirpath,
+                                        const size_t ndim) {
+  spndarray_chunked *c = calloc(1, sizeof(*c));
+  if (!c || !(c->dirpath = strdup(dirpath)) ||
+      !(c->dimsizes = malloc(ndim * sizeof(size_t)))) {
+    fprintf(stderr, "not enough space for chunked array");
+    abort();
+  }
+  c->ndim = ndim;
+  c->pinned = SIZE_MAX;
+  return c;
+}
+
+/*
+ * spndarray_chunked_create()
+ *
+ * Starts writing a chunked array to a directory
+ *
+ * Inputs
+ *  dirpath  - directory to write to, created if missing
+ *  ndim     - number of dimensions
+ *  dimsizes - dimension sizes
+ *  fill     - fill value
+ *  chunk_nz - elements per chunk, 0 for 4M
+ *
+ * Notes
+ *  the elements are then given with spndarray_chunked_append(), and
+ *  the directory is complete once spndarray_chunked_close() returns.
+ *  Only one chunk is held in memory at any time
+ */
+spndarray_chunked *spndarray_chunked_create(const char *dirpath,
+                                            const size_t ndim,
+                                            const size_t *dimsizes,
+                                            const double fill,
+                                            const size_t chunk_nz) {
+  if (mkdir(dirpath, 0777) && errno != EEXIST) {
+    fprintf(stderr, "cannot create %s\n", dirpath);
+    return NULL;
+  }
+
+  spndarray_chunked *c = chunked_alloc(dirpath, ndim);
+  memcpy(c->dimsizes, dimsizes, ndim * sizeof(size_t));
+  c->fill = fill;
+  c->chunk_nz = chunk_nz ? chunk_nz : SPNDARRAY_CHUNKED_NZ;
+  c->buf = spndarray_alloc_nzmax(ndim, dimsizes, c->chunk_nz,
+                                 SPNDARRAY_NTUPLE);
+  if (!c->buf) {
+    spndarray_chunked_close(c);
+    return NULL;
+  }
+  spndarray_set_fillvalue(c->buf, fill);
+  return c;
+} /* spndarray_chunked_create() */
+
+/*
+ * chunked_flush()
+ * Writes the buffered elements out as the next chunk
+ */
+static int chunked_flush(spndarray_chunked *c) {
+  spndarray *buf = c->buf;
+  char path[strlen(c->dirpath) + 32];
+
+  if (buf->nz == 0)
+    return 0;
+
+  chunked_grow(c);
+  const size_t k = c->nchunks;
+  c->nz[k] = buf->nz;
+  for (size_t i = 0; i < c->ndim; i++) {
+    c->first[k * c->ndim + i] = buf->dims[i][0];
+    c->last[k * c->ndim + i] = buf->dims[i][buf->nz - 1];
+  }
+
+  // the elements arrived sorted, so this does not sort
+  chunk_path(c, k, path, sizeof(path));
+  if (spndarray_tree_rebuild(buf) || spndarray_fwrite_binary(buf, path))
+    return 1;
+  c->nchunks++;
+  return spndarray_set_zero(buf);
+}
+
+/*
+ * spndarray_chunked_append()
+ *
+ * Appends an element to a chunked array being written
+ *
+ * Notes
+ *  elements must come in increasing coordinate order; fill values are
+ *  skipped
+ */
+int spndarray_chunked_append(spndarray_chunked *c, const double x,
+                             const size_t *idxs) {
+  spndarray *buf = c->buf;
+  const size_t ndim = c->ndim;
+
+  if (!buf) {
+    fprintf(stderr, "chunked array is not open for writing\n");
+    return 1;
+  }
+  for (size_t i = 0; i < ndim; i++)
+    if (idxs[i] >= c->dimsizes[i]) {
+      fprintf(stderr, "index out of range\n");
+      return 1;
+    }
+
+  // against the last element appended, buffered or already written
+  size_t prev[ndim];
+  int have_prev = buf->nz || c->nchunks;
+  for (size_t i = 0; i < ndim && have_prev; i++)
+    prev[i] = buf->nz ? buf->dims[i][buf->nz - 1]
+                      : c->last[(c->nchunks - 1) * ndim + i];
+  if (have_prev && compare_coords(ndim, prev, idxs) >= 0) {
+    fprintf(stderr, "elements must be appended in increasing order\n");
+    return 1;
+  }
+  if (x == c->fill)
+    return 0;
+
+  for (size_t i = 0; i < ndim; i++)
+    buf->dims[i][buf->nz] = idxs[i];
+  buf->data[buf->nz++] = x;
+  return buf->nz == c->chunk_nz ? chunked_flush(c) : 0;
+}
+
+/*
+ * spndarray_chunked_write()
+ * Writes an array to a directory as a chunked array
+ */
+int spndarray_chunked_write(const spndarray *m, const char *dirpath,
+                            const size_t chunk_nz) {
+  if (!SPNDARRAY_ISNTUPLE(m)) {
+    fprintf(stderr, "array must be in the ntuple format");
+    return 1;
+  }
+  if (!SPNDARRAY_ISFLOAT64(m)) {
+    fprintf(stderr, "array must hold double values, see spndarray_convert()\n");
+    return 1;
+  }
+
+  spndarray_chunked *c = spndarray_chunked_create(dirpath, m->ndim,
+                                                  m->dimsizes, m->fill,
+                                                  chunk_nz);
+  size_t *order = malloc((m->nz ? m->nz : 1) * sizeof(size_t));
+  if (!c || !order) {
+    free(order);
+    return c ? spndarray_chunked_close(c) | 1 : 1;
+  }
+
+  size_t nz = spndarray_tree_order(m, order), idxs[m->ndim];
+  int err = 0;
+  for (size_t k = 0; k < nz && !err; k++) {
+    for (size_t i = 0; i < m->ndim; i++)
+      idxs[i] = m->dims[i][order[k]];
+    err = spndarray_chunked_append(c, m->data[order[k]], idxs);
+  }
+  free(order);
+  return spndarray_chunked_close(c) | err;
+}
+
+static int chunked_write_index(const spndarray_chunked *c) {
+  char path[strlen(c->dirpath) + 32];
+  snprintf(path, sizeof(path), "%s/index", c->dirpath);
+
+  FILE *fp = fopen(path, "wb");
+  if (!fp) {
+    fprintf(stderr, "cannot open %s for writing\n", path);
+    return 1;
+  }
+
+  spndarray_chunked_header h = {SPNDARRAY_CHUNKED_MAGIC,
+                                SPNDARRAY_CHUNKED_VERSION, 0, c->ndim,
+                                c->nchunks, c->chunk_nz, c->fill};
+  int err = fwrite(&h, sizeof(h), 1, fp) != 1 ||
+            fwrite(c->dimsizes, sizeof(size_t), c->ndim, fp) != c->ndim;
+  for (size_t k = 0; k < c->nchunks && !err; k++)
+    err = fwrite(&c->nz[k], sizeof(size_t), 1, fp) != 1 ||
+          fwrite(&c->first[k * c->ndim], sizeof(size_t), c->ndim, fp) !=
+              c->ndim ||
+          fwrite(&c->last[k * c->ndim], sizeof(size_t), c->ndim, fp) !=
+              c->ndim;
+  err |= fclose(fp) != 0;
+  if (err)
+    fprintf(stderr, "failed to write %s\n", path);
+  return err;
+}
+
+/*
+ * spndarray_chunked_open()
+ *
+ * Opens a chunked array for reading
+ *
+ * Inputs
+ *  dirpath    - directory written by spndarray_chunked_create() or
+ *               spndarray_chunked_write()
+ *  max_mapped - most chunks mapped at once, at least 2; 0 for 16
+ *
+ * Notes
+ *  only the directory of first and last coordinates is read; chunks
+ *  are mapped when first used, and once max_mapped of them are, the
+ *  least recently used one is unmapped to make room. A chunked array
+ *  must only be used by one thread at a time
+ */
+spndarray_chunked *spndarray_chunked_open(const char *dirpath,
+                                          const size_t max_mapped) {
+  char path[strlen(dirpath) + 32];
+  spndarray_chunked_header h;
+
+  snprintf(path, sizeof(path), "%s/index", dirpath);
+  FILE *fp = fopen(path, "rb");
+  if (!fp) {
+    fprintf(stderr, "cannot open %s\n", path);
+    return NULL;
+  }
+  if (fread(&h, sizeof(h), 1, fp) != 1 ||
+      memcmp(h.magic, SPNDARRAY_CHUNKED_MAGIC, sizeof(h.magic)) ||
+      h.version != SPNDARRAY_CHUNKED_VERSION || h.ndim == 0 ||
+      h.ndim > 1024) {
+    fprintf(stderr, "%s is not a chunked array index\n", path);
+    fclose(fp);
+    return NULL;
+  }
+
+  spndarray_chunked *c = chunked_alloc(dirpath, h.ndim);
+  c->fill = h.fill;
+  c->chunk_nz = h.chunk_nz;
+  c->max_mapped = max_mapped ? max_mapped : 16;
+  if (c->max_mapped < 2)
+    c->max_mapped = 2;
+
+  int err = fread(c->dimsizes, sizeof(size_t), c->ndim, fp) != c->ndim;
+  for (size_t k = 0; k < h.nchunks && !err; k++) {
+    chunked_grow(c);
+    err = fread(&c->nz[k], sizeof(size_t), 1, fp) != 1 ||
+          fread(&c->first[k * c->ndim], sizeof(size_t), c->ndim, fp) !=
+              c->ndim ||
+          fread(&c->last[k * c->ndim], sizeof(size_t), c->ndim, fp) !=
+              c->ndim;
+    c->nchunks += !err;
+  }
+  fclose(fp);
+
+  c->mapped = calloc(c->nchunks + 1, sizeof(spndarray_mapped *));
+  c->used = calloc(c->nchunks + 1, sizeof(size_t));
+  if (!c->mapped || !c->used) {
+    fprintf(stderr, "not enough space for chunked array");
+    abort();
+  }
+  if (err) {
+    fprintf(stderr, "%s is truncated\n", path);
+    spndarray_chunked_close(c);
+    return NULL;
+  }
+  return c;
+} /* spndarray_chunked_open() */
+
+/*
+ * spndarray_chunked_close()
+ *
+ * Closes a chunked array, unmapping its chunks
+ *
+ * Notes
+ *  for an array being written, the buffered elements are written out
+ *  as the last chunk and the index is written
+ *
+ * Return
+ *  0 on success
+ */
+int spndarray_chunked_close(spndarray_chunked *c) {
+  int err = 0;
+
+  if (c->buf) {
+    err = chunked_flush(c);
+    err |= chunked_write_index(c);
+    spndarray_free(c->buf);
+  }
+  for (size_t k = 0; k < c->nchunks && c->mapped; k++)
+    if (c->mapped[k])
+      spndarray_mmap_close(c->mapped[k]);
+  free(c->mapped);
+  free(c->used);
+  free(c->nz);
+  free(c->first);
+  free(c->last);
+  free(c->dimsizes);
+  free(c->dirpath);
+  free(c);
+  return err;
+}
+
+size_t spndarray_chunked_ndim(const spndarray_chunked *c) { return c->ndim; }
+
+const size_t *spndarray_chunked_dimsizes(const spndarray_chunked *c) {
+  return c->dimsizes;
+}
+
+double spndarray_chunked_fill(const spndarray_chunked *c) { return c->fill; }
+
+size_t spndarray_chunked_nnz(const spndarray_chunked *c) {
+  size_t nz = 0;
+  for (size_t k = 0; k < c->nchunks; k++)
+    nz += c->nz[k];
+  return nz;
+}
+
+size_t spndarray_chunked_nchunks(const spndarray_chunked *c) {
+  return c->nchunks;
+}
+
+size_t spndarray_chunked_nmapped(const spndarray_chunked *c) {
+  return c->nmapped;
+}
+
+/*
+ * chunked_map()
+ * Returns the mapping of chunk k, mapping it first if needed, or NULL
+ * if its file is missing or unreadable
+ */
+static const spndarray_mapped *chunked_map(spndarray_chunked *c,
+                                           const size_t k) {
+  c->used[k] = ++c->clock;
+  if (c->mapped[k])
+    return c->mapped[k];
+
+  if (c->nmapped == c->max_mapped) {
+    size_t victim = SIZE_MAX;
+    for (size_t j = 0; j < c->nchunks; j++)
+      if (c->mapped[j] && j != c->pinned &&
+          (victim == SIZE_MAX || c->used[j] < c->used[victim]))
+        victim = j;
+    spndarray_mmap_close(c->mapped[victim]);
+    c->mapped[victim] = NULL;
+    c->nmapped--;
+  }
+
+  char path[strlen(c->dirpath) + 32];
+  chunk_path(c, k, path, sizeof(path));
+  c->mapped[k] = spndarray_mmap_open(path);
+  if (!c->mapped[k]) {
+    fprintf(stderr, "chunk %zu of %s is missing or unreadable\n", k,
+            c->dirpath);
+    return NULL;
+  }
+  c->nmapped++;
+  return c->mapped[k];
+}
+
+/*
+ * spndarray_chunked_lookup()
+ *
+ * Gets an element of a chunked array
+ *
+ * Inputs
+ *  x - receives the value, or the fill value if there is no element
+ *      at the coordinates
+ *
+ * Notes
+ *  the directory is binary searched for the only chunk that may hold
+ *  the coordinates, which is then mapped and searched in place
+ *
+ * Return
+ *  0 on success, 1 if the chunk could not be mapped
+ */
+int spndarray_chunked_lookup(spndarray_chunked *c, const size_t *idxs,
+                             double *x) {
+  const size_t ndim = c->ndim;
+  size_t lo = 0, hi = c->nchunks;
+
+  // last chunk starting at or before idxs
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (compare_coords(ndim, &c->first[mid * ndim], idxs) <= 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  *x = c->fill;
+  if (lo == 0 || compare_coords(ndim, idxs, &c->last[(lo - 1) * ndim]) > 0)
+    return 0;
+
+  const spndarray_mapped *f = chunked_map(c, lo - 1);
+  if (!f)
+    return 1;
+  *x = spndarray_mapped_get(f, idxs);
+  return 0;
+}
+
+/*
+ * spndarray_chunked_get()
+ * Gets an element of a chunked array; the fill value comes back when
+ * the chunk that may hold it cannot be mapped, which
+ * spndarray_chunked_lookup() tells apart
+ */
+double spndarray_chunked_get(spndarray_chunked *c, const size_t *idxs) {
+  double x;
+  spndarray_chunked_lookup(c, idxs, &x);
+  return x;
+}
+
+/*
+ * spndarray_chunked_foreach()
+ *
+ * Calls fn on every element of a chunked array, in coordinate order
+ *
+ * Notes
+ *  the chunks are mapped one after the other, and the one being
+ *  visited stays mapped even if fn looks up other chunks. Iteration
+ *  stops early when fn returns nonzero, which is then returned
+ *
+ * Return
+ *  0 once every element is visited, the nonzero value of fn that
+ *  stopped it, or -1 if a chunk could not be mapped
+ */
+int spndarray_chunked_foreach(spndarray_chunked *c,
+                              const spndarray_visit_fn fn, void *ctx) {
+  size_t idxs[c->ndim];
+  int r = 0;
+
+  for (size_t k = 0; k < c->nchunks && !r; k++) {
+    const spndarray_mapped *f = chunked_map(c, k);
+    if (!f)
+      return -1;
+    c->pinned = k;
+    for (size_t n = 0; n < f->nz && !r; n++) {
+      for (size_t i = 0; i < c->ndim; i++)
+        idxs[i] = f->dims[i][n];
+      r = fn(ctx, idxs, f->data[n]);
+    }
+    c->pinned = SIZE_MAX;
+  }
+  return r;
+}
+
+typedef struct {
+  size_t dim;                   /* reduced dimension */
+  reduction_function reduce_fn; /* the reduction */
+  int rdimsize;                 /* size of the reduced dimension */
+  spndarray *res;               /* the result */
+} chunked_reduce;
+
+static int reduce_visit(void *ctx, const size_t *idxs, const double x) {
+  chunked_reduce *r = (chunked_reduce *)ctx;
+  size_t key[r->res->ndim];
+
+  if (x == 0.0)
+    return 0;
+  for (size_t i = 0, j = 0; i <= r->res->ndim; i++)
+    if (i != r->dim)
+      key[j++] = idxs[i];
+
+  double *pacc = spndarray_ptr(r->res, key);
+  if (pacc)
+    *pacc = r->reduce_fn(*pacc, x, r->rdimsize);
+  else
+    return spndarray_set(r->res, r->reduce_fn(0, x, r->rdimsize), key);
+  return 0;
+}
+
+/*
+ * spndarray_chunked_reduce()
+ *
+ * Reduces a dimension of a chunked array, as spndarray_reduce() does
+ *
+ * Output
+ *  the reduced array, in memory, or NULL on failure, as when a chunk
+ *  cannot be mapped
+ *
+ * Notes
+ *  the chunks are visited one at a time, so only the result needs to
+ *  fit in memory. Within each group the elements are visited in
+ *  increasing order along the reduced dimension, as with
+ *  spndarray_reduce(). Only a zero fill value is supported
+ */
+spndarray *spndarray_chunked_reduce(spndarray_chunked *c, const size_t dim,
+                                    const reduction_function reduce_fn) {
+  if (c->fill != 0.0 || c->ndim < 2 || dim >= c->ndim) {
+    fprintf(stderr, "chunked reduce needs a zero fill value and a valid "
+                    "dimension\n");
+    return NULL;
+  }
+
+  size_t dims[c->ndim - 1];
+  for (size_t i = 0, j = 0; i < c->ndim; i++)
+    if (i != dim)
+      dims[j++] = c->dimsizes[i];
+
+  chunked_reduce r = {dim, reduce_fn, (int)c->dimsizes[dim],
+                      spndarray_alloc_nzmax(c->ndim - 1, dims, 16,
+                                            SPNDARRAY_NTUPLE)};
+  if (!r.res)
+    return NULL;
+  if (spndarray_chunked_foreach(c, reduce_visit, &r)) {
+    spndarray_free(r.res);
+    return NULL;
+  }
+  return r.res;
+}
+
+/*
+ * cursor over the elements of a chunked array, one chunk at a time
+ */
+typedef struct {
+  spndarray_chunked *c;
+  size_t k;                  /* current chunk */
+  size_t n;                  /* current element of the chunk */
+  const spndarray_mapped *f; /* mapping of the current chunk */
+} chunked_cursor;
+
+/*
+ * cursor_valid()
+ * 1 if the cursor is on an element, 0 past the last one, -1 if a
+ * chunk could not be mapped
+ */
+static int cursor_valid(chunked_cursor *it) {
+  while (it->k < it->c->nchunks) {
+    if (!it->f && !(it->f = chunked_map(it->c, it->k)))
+      return -1;
+    if (it->n < it->f->nz)
+      return 1;
+    it->k++, it->n = 0, it->f = NULL;
+  }
+  return 0;
+}
+
+/* compares the current elements of two valid cursors */
+static int cursor_compare(const chunked_cursor *a, const chunked_cursor *b) {
+  for (size_t i = 0; i < a->c->ndim; i++) {
+    size_t x = a->f->dims[i][a->n], y = b->f->dims[i][b->n];
+    if (x != y)
+      return x < y ? -1 : 1;
+  }
+  return 0;
+}
+
+/*
+ * spndarray_chunked_add()
+ *
+ * Adds two chunked arrays into a new one
+ *
+ * Inputs
+ *  a, b     - the operands, with the same number of dimensions; to
+ *             add an array to itself, open it twice
+ *  dirpath  - directory of the result
+ *  chunk_nz - elements per chunk of the result, 0 for 4M
+ *
+ * Notes
+ *  the sorted elements of both operands are merged, so at most one
+ *  chunk of each operand is visited at a time and one chunk of the
+ *  result is held in memory. The fill value of the result is the sum
+ *  of theirs
+ *
+ * Return
+ *  0 on success
+ */
+int spndarray_chunked_add(spndarray_chunked *a, spndarray_chunked *b,
+                          const char *dirpath, const size_t chunk_nz) {
+  const size_t ndim = a->ndim;
+
+  if (b->ndim != ndim || a == b) {
+    fprintf(stderr, "arrays must be distinct handles with the same number "
+                    "of dimensions\n");
+    return 1;
+  }
+
+  size_t dimsizes[ndim], idxs[ndim];
+  for (size_t i = 0; i < ndim; i++)
+    dimsizes[i] = a->dimsizes[i] > b->dimsizes[i] ? a->dimsizes[i]
+                                                  : b->dimsizes[i];
+  spndarray_chunked *res = spndarray_chunked_create(
+      dirpath, ndim, dimsizes, a->fill + b->fill, chunk_nz);
+  if (!res)
+    return 1;
+
+  chunked_cursor ia = {a, 0, 0, NULL}, ib = {b, 0, 0, NULL};
+  int err = 0;
+  while (!err) {
+    int va = cursor_valid(&ia), vb = cursor_valid(&ib), cmp;
+    if (va < 0 || vb < 0) {
+      err = 1;
+      break;
+    }
+    if (!va && !vb)
+      break;
+    cmp = !va ? 1 : !vb ? -1 : cursor_compare(&ia, &ib);
+
+    const chunked_cursor *src = cmp <= 0 ? &ia : &ib;
+    double x = cmp < 0  ? ia.f->data[ia.n] + b->fill
+               : cmp > 0 ? a->fill + ib.f->data[ib.n]
+                         : ia.f->data[ia.n] + ib.f->data[ib.n];
+    for (size_t i = 0; i < ndim; i++)
+      idxs[i] = src->f->dims[i][src->n];
+    err = spndarray_chunked_append(res, x, idxs);
+    ia.n += cmp <= 0;
+    ib.n += cmp >= 0;
+  }
+  return spndarray_chunked_close(res) | err;
+} /* spndarray_chunked_add() */
@@ -0,0 +1,220 @@
+#include "spndarray.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* cells scanned by one task of the dense conversions */
+#define SPNDARRAY_DENSE_BLOCK 65536
+
+typedef struct {
+  const double *buf;  /* dense cells, row-major */
+  size_t cells;       /* number of cells */
+  double fill;        /* value left out of the sparse array */
+  double tol;         /* distance from fill below which a cell is fill */
+  size_t *counts;     /* elements found in each block, then their slot */
+  spndarray *m;       /* the sparse array */
+} spnd_dense;
+
+/*
+ * dense_keep()
+ * Whether a cell holds an element; NaN cells always do
+ */
+static inline int dense_keep(const spnd_dense *d, const double x) {
+  return x != d->fill && !(fabs(x - d->fill) <= d->tol);
+}
+
+static void dense_count_range(void *param, size_t begin, size_t end) {
+  spnd_dense *d = (spnd_dense *)param;
+
+  for (size_t b = begin; b < end; b++) {
+    size_t lo = b * SPNDARRAY_DENSE_BLOCK, hi = lo + SPNDARRAY_DENSE_BLOCK;
+    size_t count = 0;
+    if (hi > d->cells)
+      hi = d->cells;
+    for (size_t c = lo; c < hi; c++)
+      count += dense_keep(d, d->buf[c]);
+    d->counts[b] = count;
+  }
+}
+
+static void dense_gather_range(void *param, size_t begin, size_t end) {
+  spnd_dense *d = (spnd_dense *)param;
+  spndarray *m = d->m;
+  const size_t ndim = m->ndim, row = m->dimsizes[ndim - 1];
+  size_t idxs[ndim], *cells = malloc(SPNDARRAY_DENSE_BLOCK * sizeof(size_t));
+
+  if (!cells) {
+    fprintf(stderr, "not enough space for dense conversion");
+    abort();
+  }
+
+  for (size_t b = begin; b < end; b++) {
+    size_t lo = b * SPNDARRAY_DENSE_BLOCK, hi = lo + SPNDARRAY_DENSE_BLOCK;
+    size_t n = 0, slot = d->counts[b], prev = SIZE_MAX;
+    if (hi > d->cells)
+      hi = d->cells;
+
+    // compress the block: every cell is written, but only those kept
+    // advance the cursor, so the loop has no branch to mispredict
+    for (size_t c = lo; c < hi; c++) {
+      cells[n] = c;
+      n += dense_keep(d, d->buf[c]);
+    }
+
+    for (size_t e = 0; e < n; e++) {
+      size_t c = cells[e];
+      // within a row only the last index moves
+      if (prev != SIZE_MAX && c / row == prev / row)
+        idxs[ndim - 1] += c - prev;
+      else
+        for (size_t i = ndim, r = c; i-- > 0; r /= m->dimsizes[i])
+          idxs[i] = r % m->dimsizes[i];
+      prev = c;
+      for (size_t i = 0; i < ndim; i++)
+        m->dims[i][slot + e] = idxs[i];
+      m->data[slot + e] = d->buf[c];
+    }
+  }
+  free(cells);
+}
+
+/*
+ * spndarray_from_dense()
+ * Builds a sparse array from a dense buffer, see
+ * spndarray_from_dense_with()
+ */
+spndarray *spndarray_from_dense(const double *buf, const size_t ndim,
+                                const size_t *dimsizes, const double fill,
+                                const double tol) {
+  return spndarray_from_dense_with(buf, ndim, dimsizes, fill, tol, NULL);
+}
+
+/*
+ * spndarray_from_dense_with()
+ *
+ * Builds a sparse array from a dense buffer, taking its buffers from
+ * the given allocator
+ *
+ * Inputs
+ *  buf       - the cells, in row-major (C) order
+ *  ndim      - number of dimensions
+ *  dimsizes  - dimension sizes
+ *  fill      - fill value of the result
+ *  tol       - cells within tol of fill are left out, 0 to leave out
+ *              only the cells equal to it
+ *  allocator - see spndarray_alloc_with(), NULL for malloc
+ *
+ * Notes
+ *  the buffer is scanned in blocks on the pool, once to count the
+ *  elements of each block and once to gather them at the slots given
+ *  by a prefix sum of the counts. Elements come out in coordinate
+ *  order, so the tree is linked up in one linear pass
+ */
+spndarray *spndarray_from_dense_with(const double *buf, const size_t ndim,
+                                     const size_t *dimsizes,
+                                     const double fill, const double tol,
+                                     const spndarray_allocator *allocator) {
+  size_t cells = 1;
+  if (ndim == 0) {
+    fprintf(stderr, "array must have at least one dimension\n");
+    return NULL;
+  }
+  for (size_t i = 0; i < ndim; i++) {
+    if (dimsizes[i] == 0 || cells > SIZE_MAX / dimsizes[i]) {
+      fprintf(stderr, "dimension sizes must be positive and fit memory\n");
+      return NULL;
+    }
+    cells *= dimsizes[i];
+  }
+
+  const size_t blocks =
+      (cells + SPNDARRAY_DENSE_BLOCK - 1) / SPNDARRAY_DENSE_BLOCK;
+  spnd_dense d = {buf, cells, fill, tol, malloc(blocks * sizeof(size_t))};
+  if (!d.counts) {
+    fprintf(stderr, "not enough space for dense conversion");
+    abort();
+  }
+
+  spndarray_parallel_for(blocks, 1, dense_count_range, &d);
+  size_t nz = spndarray_parallel_scan(d.counts, blocks);
+
+  d.m = spndarray_alloc_with(ndim, dimsizes, nz ? nz : 1, SPNDARRAY_NTUPLE,
+                             allocator);
+  if (!d.m) {
+    free(d.counts);
+    return NULL;
+  }
+  spndarray_set_fillvalue(d.m, fill);
+  spndarray_parallel_for(blocks, 1, dense_gather_range, &d);
+  d.m->nz = nz;
+  free(d.counts);
+
+  if (spndarray_tree_rebuild(d.m)) {
+    spndarray_free(d.m);
+    return NULL;
+  }
+  return d.m;
+} /* spndarray_from_dense_with() */
+
+static void dense_fill_range(void *param, size_t begin, size_t end) {
+  spnd_dense *d = (spnd_dense *)param;
+  double *buf = (double *)d->buf;
+  for (size_t c = begin; c < end; c++)
+    buf[c] = d->fill;
+}
+
+static void dense_scatter_range(void *param, size_t begin, size_t end) {
+  spnd_dense *d = (spnd_dense *)param;
+  const spndarray *m = d->m;
+  double *buf = (double *)d->buf;
+
+  for (size_t n = begin; n < end; n++) {
+    size_t off = 0;
+    for (size_t i = 0; i < m->ndim; i++)
+      off = off * m->dimsizes[i] + m->dims[i][n];
+    buf[off] = m->data[n];
+  }
+}
+
+/*
+ * spndarray_to_dense()
+ *
+ * Writes every cell of the array to a dense buffer
+ *
+ * Inputs
+ *  buf - room for the product of the dimension sizes, receiving the
+ *        cells in row-major (C) order
+ *
+ * Notes
+ *  the buffer is set to the fill value and the elements are then
+ *  scattered over it, both on the pool
+ *
+ * Return
+ *  0 on success
+ */
+int spndarray_to_dense(const spndarray *m, double *buf) {
+  if (!SPNDARRAY_ISNTUPLE(m)) {
+    fprintf(stderr, "array must be in the ntuple format");
+    return 1;
+  }
+  if (!SPNDARRAY_ISFLOAT64(m)) {
+    fprintf(stderr, "array must hold double values, see spndarray_convert()\n");
+    return 1;
+  }
+
+  size_t cells = 1;
+  for (size_t i = 0; i < m->ndim; i++) {
+    if (cells > SIZE_MAX / m->dimsizes[i]) {
+      fprintf(stderr, "array does not fit in a dense buffer\n");
+      return 1;
+    }
+    cells *= m->dimsizes[i];
+  }
+
+  spnd_dense d = {buf, cells, m->fill, 0, NULL, (spndarray *)m};
+  spndarray_parallel_for(cells, SPNDARRAY_DENSE_BLOCK, dense_fill_range, &d);
+  spndarray_parallel_for(m->nz, spndarray_get_grain_size(),
+                         dense_scatter_range, &d);
+  return 0;
+}
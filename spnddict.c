@@ -0,0 +1,303 @@
+#include "spndarray.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Dictionary arrays (SPNDARRAY_DICT8, SPNDARRAY_DICT16) keep a code
+ * per element, and their distinct values in a table indexed by the
+ * codes. The codes take 1 or 2 bytes instead of 8, and routines that
+ * map every value, like spndarray_fmap(), only go through the table.
+ *
+ * Values are matched by their bits, so 0.0 and -0.0 get codes of their
+ * own and a NaN matches itself. The codes are found back from the
+ * values through an open-addressing hash of the table
+ */
+
+/* initial room of the value table */
+#define SPNDARRAY_DICT_MIN 16
+
+static inline uint64_t value_bits(const double x) {
+  uint64_t u;
+  memcpy(&u, &x, sizeof(u));
+  return u;
+}
+
+/*
+ * dict_probe()
+ * Slot of the code holding the given bits, or the free slot where it
+ * would go
+ */
+static inline size_t dict_probe(const spndarray_dict *d, const uint64_t bits) {
+  size_t s = (size_t)((bits * 0x9e3779b97f4a7c15ull) >> 32) & (d->nslots - 1);
+
+  while (d->slots[s] && value_bits(d->values[d->slots[s] - 1]) != bits)
+    s = (s + 1) & (d->nslots - 1);
+  return s;
+}
+
+/*
+ * dict_hash()
+ * Hashes every code of the table again; when values repeat, the
+ * lowest code is the one found
+ */
+static void dict_hash(spndarray_dict *d) {
+  memset(d->slots, 0, d->nslots * sizeof(uint32_t));
+  for (size_t c = 0; c < d->n; c++) {
+    const size_t s = dict_probe(d, value_bits(d->values[c]));
+    if (!d->slots[s])
+      d->slots[s] = (uint32_t)c + 1;
+  }
+}
+
+/*
+ * dict_resize()
+ * Makes room for size codes in the table
+ */
+static int dict_resize(spndarray_dict *d, const size_t size) {
+  size_t nslots = 1;
+  while (nslots < 2 * size)
+    nslots <<= 1;
+
+  double *values = realloc(d->values, size * sizeof(double));
+  if (!values) {
+    fprintf(stderr, "not enough space for the value dictionary");
+    return 1;
+  }
+  d->values = values;
+  uint32_t *slots = malloc(nslots * sizeof(uint32_t));
+  if (!slots) {
+    fprintf(stderr, "not enough space for the value dictionary");
+    return 1;
+  }
+  free(d->slots);
+  d->slots = slots;
+  d->nslots = nslots;
+  d->size = size;
+  dict_hash(d);
+  return 0;
+}
+
+/*
+ * spndarray_dict_create()
+ *
+ * Attaches an empty value table to an array of a dictionary type;
+ * called by spndarray_alloc_with()
+ *
+ * Return
+ *  0 on success
+ */
+int spndarray_dict_create(spndarray *m) {
+  if (m->vtype != SPNDARRAY_DICT8 && m->vtype != SPNDARRAY_DICT16) {
+    fprintf(stderr, "array is not of a dictionary value type");
+    return 1;
+  }
+
+  spndarray_dict_free(m);
+  m->dict = calloc(1, sizeof(spndarray_dict));
+  if (!m->dict) {
+    fprintf(stderr, "not enough space for the value dictionary");
+    return 1;
+  }
+  m->dict->max = m->vtype == SPNDARRAY_DICT8 ? 1 << 8 : 1 << 16;
+  return dict_resize(m->dict, SPNDARRAY_DICT_MIN);
+}
+
+/*
+ * spndarray_dict_free()
+ * Drops the value table of the array, if any
+ */
+void spndarray_dict_free(spndarray *m) {
+  if (m->dict) {
+    free(m->dict->values);
+    free(m->dict->slots);
+    free(m->dict);
+    m->dict = NULL;
+  }
+}
+
+/*
+ * spndarray_dict_copy()
+ *
+ * Gives dst a copy of the value table of src, so that dst can hold the
+ * codes of src as they are
+ *
+ * Return
+ *  0 on success
+ */
+int spndarray_dict_copy(spndarray *dst, const spndarray *src) {
+  const spndarray_dict *s = src->dict;
+
+  if (!s || dst->vtype != src->vtype) {
+    fprintf(stderr, "dictionaries copy between arrays of the same "
+                    "dictionary type");
+    return 1;
+  }
+  spndarray_dict *d = calloc(1, sizeof(spndarray_dict));
+  if (!d) {
+    fprintf(stderr, "not enough space for the value dictionary");
+    return 1;
+  }
+  *d = *s;
+  d->values = malloc(s->size * sizeof(double));
+  d->slots = malloc(s->nslots * sizeof(uint32_t));
+  if (!d->values || !d->slots) {
+    fprintf(stderr, "not enough space for the value dictionary");
+    free(d->values);
+    free(d->slots);
+    free(d);
+    return 1;
+  }
+  memcpy(d->values, s->values, s->n * sizeof(double));
+  memcpy(d->slots, s->slots, s->nslots * sizeof(uint32_t));
+
+  spndarray_dict_free(dst);
+  dst->dict = d;
+  return 0;
+}
+
+/*
+ * spndarray_dict_clear()
+ * Empties the value table; only valid once no element uses it
+ */
+void spndarray_dict_clear(spndarray *m) {
+  if (m->dict) {
+    m->dict->n = 0;
+    memset(m->dict->slots, 0, m->dict->nslots * sizeof(uint32_t));
+  }
+}
+
+/*
+ * spndarray_dict_code()
+ *
+ * Finds the code of a value, adding it to the value table if needed
+ *
+ * Notes
+ *  when the table is full, the codes no element uses anymore are
+ *  dropped first, with spndarray_dict_compact()
+ *
+ * Return
+ *  the code, or SPNDARRAY_DICT_FULL if the table has no room left
+ */
+size_t spndarray_dict_code(spndarray *m, const double x) {
+  spndarray_dict *d = m->dict;
+  const uint64_t bits = value_bits(x);
+  const size_t s = dict_probe(d, bits);
+
+  if (d->slots[s])
+    return d->slots[s] - 1;
+  if (d->n == d->size) {
+    if (d->size < d->max) {
+      if (dict_resize(d, 2 * d->size < d->max ? 2 * d->size : d->max))
+        return SPNDARRAY_DICT_FULL;
+    } else if (spndarray_dict_compact(m) == d->max) {
+      fprintf(stderr, "the %zd values of the dictionary are all in use, "
+                      "see spndarray_convert()\n", d->max);
+      return SPNDARRAY_DICT_FULL;
+    }
+    // the slots moved
+    return spndarray_dict_code(m, x);
+  }
+
+  d->values[d->n] = x;
+  d->slots[s] = (uint32_t)++d->n;
+  return d->n - 1;
+}
+
+/*
+ * spndarray_dict_compact()
+ *
+ * Drops the codes of the value table that no element uses, and merges
+ * the codes holding the same value, in O(nnz)
+ *
+ * Notes
+ *  values are left behind in the table as elements are overwritten,
+ *  and spndarray_dict_map() can give codes the same value
+ *
+ * Return
+ *  the number of codes left
+ */
+size_t spndarray_dict_compact(spndarray *m) {
+  spndarray_dict *d = m->dict;
+
+  if (!d)
+    return 0;
+  uint32_t *remap = calloc(d->n ? d->n : 1, sizeof(uint32_t));
+  if (!remap) {
+    fprintf(stderr, "not enough space to compact the value dictionary");
+    return d->n;
+  }
+  spndarray_unshare(m);
+
+  switch (m->vtype) {
+#define SPND_MARK_CASE(V, T, S)                                            \
+  case V:                                                                  \
+    for (size_t n = 0; n < m->nz; n++)                                     \
+      remap[((const T *)m->values)[n]] = 1;                                \
+    break;
+    SPNDARRAY_FOREACH_DICT(SPND_MARK_CASE)
+#undef SPND_MARK_CASE
+  }
+
+  // values move down to their new code, which is never above the old
+  // one, and the hash is rebuilt over the codes already placed
+  size_t k = 0;
+  memset(d->slots, 0, d->nslots * sizeof(uint32_t));
+  for (size_t c = 0; c < d->n; c++) {
+    if (!remap[c])
+      continue;
+    const size_t s = dict_probe(d, value_bits(d->values[c]));
+    if (!d->slots[s]) {
+      d->values[k] = d->values[c];
+      d->slots[s] = (uint32_t)++k;
+    }
+    remap[c] = d->slots[s] - 1;
+  }
+  d->n = k;
+
+  switch (m->vtype) {
+#define SPND_REMAP_CASE(V, T, S)                                           \
+  case V:                                                                  \
+    for (size_t n = 0; n < m->nz; n++)                                     \
+      ((T *)m->values)[n] = (T)remap[((T *)m->values)[n]];                 \
+    break;
+    SPNDARRAY_FOREACH_DICT(SPND_REMAP_CASE)
+#undef SPND_REMAP_CASE
+  }
+  free(remap);
+  return k;
+}
+
+/*
+ * spndarray_dict_map()
+ * Applies f to every value of the table, in O(distinct values); the
+ * codes of the elements are left untouched
+ */
+void spndarray_dict_map(spndarray *m, const double_mapper f) {
+  spndarray_dict *d = m->dict;
+
+  if (!d)
+    return;
+  for (size_t c = 0; c < d->n; c++)
+    d->values[c] = f(d->values[c]);
+  dict_hash(d);
+}
+
+/*
+ * spndarray_dict_size()
+ * Number of codes in the value table, 0 for other arrays
+ */
+size_t spndarray_dict_size(const spndarray *m) {
+  return m->dict ? m->dict->n : 0;
+}
+
+/*
+ * spndarray_dict_bytes()
+ * Memory used by the value table, 0 for other arrays
+ */
+size_t spndarray_dict_bytes(const spndarray *m) {
+  if (!m->dict)
+    return 0;
+  return sizeof(spndarray_dict) + m->dict->size * sizeof(double) +
+         m->dict->nslots * sizeof(uint32_t);
+}
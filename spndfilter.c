@@ -0,0 +1,263 @@
+#include "spndarray.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * The membership filter is a blocked Bloom filter: every key sets k
+ * bits inside a single 512-bit (cache line sized) block, so a lookup
+ * touches one line of the filter no matter how many bits it checks
+ */
+
+#define SPNDARRAY_FILTER_BLOCK_WORDS 8
+#define SPNDARRAY_FILTER_BLOCK_BITS (64 * SPNDARRAY_FILTER_BLOCK_WORDS)
+
+/*
+ * filter_block()
+ * Picks the block of a key hash with a multiply-shift range reduction
+ */
+static inline uint64_t *filter_block(const spndarray_filter *f,
+                                     const uint64_t h) {
+  size_t b = (size_t)(((unsigned __int128)h * f->nblocks) >> 64);
+  return &f->blocks[b * SPNDARRAY_FILTER_BLOCK_WORDS];
+}
+
+/*
+ * the k bit positions of a key are derived by double hashing, taking
+ * the top 9 bits of h1 + i * h2; h2 is remixed so that it does not
+ * follow the high bits which already picked the block
+ */
+static void filter_add(spndarray_filter *f, const uint64_t h) {
+  uint64_t *block = filter_block(f, h);
+  const uint32_t h1 = (uint32_t)h;
+  const uint32_t h2 = (uint32_t)((h * 0x9e3779b97f4a7c15ull) >> 32) | 1;
+
+  for (uint32_t i = 0; i < f->k; i++) {
+    const uint32_t bit = (h1 + i * h2) >> 23;
+    block[bit / 64] |= 1ull << (bit % 64);
+  }
+}
+
+static int filter_test(const spndarray_filter *f, const uint64_t h) {
+  const uint64_t *block = filter_block(f, h);
+  const uint32_t h1 = (uint32_t)h;
+  const uint32_t h2 = (uint32_t)((h * 0x9e3779b97f4a7c15ull) >> 32) | 1;
+
+  for (uint32_t i = 0; i < f->k; i++) {
+    const uint32_t bit = (h1 + i * h2) >> 23;
+    if (!(block[bit / 64] & (1ull << (bit % 64))))
+      return 0;
+  }
+  return 1;
+}
+
+/*
+ * filter_size()
+ * (Re)allocates the filter blocks for the given number of keys
+ */
+static int filter_size(spndarray_filter *f, const size_t capacity) {
+  // bits per key of an ideal Bloom filter, plus a little extra to
+  // make up for the keys being confined to one block
+  double bits = -log(f->fp_rate) / (M_LN2 * M_LN2) * 1.1;
+  size_t nblocks = (size_t)ceil(capacity * bits / SPNDARRAY_FILTER_BLOCK_BITS);
+
+  if (nblocks == 0)
+    nblocks = 1;
+
+  uint64_t *blocks = calloc(nblocks, SPNDARRAY_FILTER_BLOCK_WORDS *
+                                         sizeof(uint64_t));
+  if (!blocks) {
+    fprintf(stderr, "not enough space for the membership filter");
+    return 1;
+  }
+  free(f->blocks);
+  f->blocks = blocks;
+  f->nblocks = nblocks;
+  f->capacity = capacity;
+  f->k = (unsigned)lround(bits / 1.1 * M_LN2);
+  if (f->k < 1)
+    f->k = 1;
+  else if (f->k > 16)
+    f->k = 16;
+  return 0;
+}
+
+/*
+ * spndarray_filter_enable()
+ *
+ * Attaches a membership filter to a ntuple array, which lets lookups
+ * of absent coordinates return the fill value without searching the
+ * tree
+ *
+ * Inputs
+ *  fp_rate  - target rate of false positives, in (0, 1); the filter
+ *             takes about 1.44 * log2(1 / fp_rate) bits per element
+ *  capacity - number of elements to size the filter for, 0 to use
+ *             the array's nzmax
+ *
+ * Notes
+ *  the filter is kept up to date by spndarray_set() and the bulk
+ *  routines, and is resized whenever the array grows past its
+ *  capacity
+ *
+ * Return
+ *  0 on success
+ */
+int spndarray_filter_enable(spndarray *m, const double fp_rate,
+                            const size_t capacity) {
+  if (!SPNDARRAY_ISNTUPLE(m)) {
+    fprintf(stderr, "array must be in the ntuple format");
+    return 1;
+  }
+  if (!(fp_rate > 0.0 && fp_rate < 1.0)) {
+    fprintf(stderr, "filter false positive rate must be in (0, 1)");
+    return 1;
+  }
+
+  spndarray_filter_disable(m);
+  m->filter = calloc(1, sizeof(spndarray_filter));
+  if (!m->filter) {
+    fprintf(stderr, "not enough space for the membership filter");
+    return 1;
+  }
+  m->filter->fp_rate = fp_rate;
+  m->filter->capacity = capacity;
+  return spndarray_filter_rebuild(m);
+}
+
+/*
+ * spndarray_filter_disable()
+ * Drops the membership filter of the array, if any
+ */
+void spndarray_filter_disable(spndarray *m) {
+  if (m->filter) {
+    free(m->filter->blocks);
+    free(m->filter);
+    m->filter = NULL;
+  }
+}
+
+/*
+ * spndarray_filter_rebuild()
+ *
+ * Refills the membership filter from the elements of the array,
+ * growing it first if the array outgrew it
+ */
+int spndarray_filter_rebuild(spndarray *m) {
+  spndarray_filter *f = m->filter;
+  size_t capacity;
+
+  if (!f)
+    return 0;
+
+  capacity = f->capacity > m->nzmax ? f->capacity : m->nzmax;
+  if (f->blocks && capacity == f->capacity)
+    memset(f->blocks, 0,
+           f->nblocks * SPNDARRAY_FILTER_BLOCK_WORDS * sizeof(uint64_t));
+  else if (filter_size(f, capacity))
+    return 1;
+
+  size_t idxs[m->ndim];
+  for (size_t n = 0; n < m->nz; n++) {
+    for (size_t i = 0; i < m->ndim; i++)
+      idxs[i] = m->dims[i][n];
+    filter_add(f, spndarray_hash_idx(m->ndim, idxs));
+  }
+  return 0;
+}
+
+/*
+ * spndarray_filter_copy()
+ * Gives dst a copy of the membership filter of src (or none, if src
+ * has none); the two arrays must hold the same elements
+ */
+int spndarray_filter_copy(spndarray *dst, const spndarray *src) {
+  const spndarray_filter *f = src->filter;
+
+  spndarray_filter_disable(dst);
+  if (!f)
+    return 0;
+
+  const size_t bytes =
+      f->nblocks * SPNDARRAY_FILTER_BLOCK_WORDS * sizeof(uint64_t);
+  dst->filter = calloc(1, sizeof(spndarray_filter));
+  if (!dst->filter || !(dst->filter->blocks = malloc(bytes))) {
+    fprintf(stderr, "not enough space for the membership filter");
+    spndarray_filter_disable(dst);
+    return 1;
+  }
+  memcpy(dst->filter->blocks, f->blocks, bytes);
+  dst->filter->nblocks = f->nblocks;
+  dst->filter->k = f->k;
+  dst->filter->capacity = f->capacity;
+  dst->filter->fp_rate = f->fp_rate;
+  return 0;
+}
+
+/*
+ * spndarray_filter_insert()
+ * Records the given coordinates in the membership filter
+ */
+void spndarray_filter_insert(spndarray *m, const size_t *idxs) {
+  if (m->filter)
+    filter_add(m->filter, spndarray_hash_idx(m->ndim, idxs));
+}
+
+/*
+ * spndarray_filter_contains()
+ *
+ * Checks the membership filter for the given coordinates
+ *
+ * Return
+ *  0 if the coordinates are certainly absent from the array, 1 if
+ *  they may be present (or if the array has no filter)
+ */
+int spndarray_filter_contains(const spndarray *m, const size_t *idxs) {
+  spndarray_filter *f = m->filter;
+
+  if (!f)
+    return 1;
+
+  __atomic_fetch_add(&f->lookups, 1, __ATOMIC_RELAXED);
+  if (filter_test(f, spndarray_hash_idx(m->ndim, idxs)))
+    return 1;
+
+  __atomic_fetch_add(&f->negatives, 1, __ATOMIC_RELAXED);
+  return 0;
+}
+
+/*
+ * spndarray_filter_false_positive()
+ * Counts a lookup that passed the filter but found no element
+ */
+void spndarray_filter_false_positive(const spndarray *m) {
+  if (m->filter)
+    __atomic_fetch_add(&m->filter->false_positives, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * spndarray_filter_get_stats()
+ *
+ * Reports the configuration and hit/miss counters of the filter
+ *
+ * Return
+ *  0 on success, 1 if the array has no filter
+ */
+int spndarray_filter_get_stats(const spndarray *m,
+                               spndarray_filter_stats *stats) {
+  const spndarray_filter *f = m->filter;
+
+  if (!f)
+    return 1;
+
+  stats->fp_rate = f->fp_rate;
+  stats->capacity = f->capacity;
+  stats->bytes = f->nblocks * SPNDARRAY_FILTER_BLOCK_WORDS * sizeof(uint64_t);
+  stats->hashes = f->k;
+  stats->lookups = __atomic_load_n(&f->lookups, __ATOMIC_RELAXED);
+  stats->negatives = __atomic_load_n(&f->negatives, __ATOMIC_RELAXED);
+  stats->false_positives =
+      __atomic_load_n(&f->false_positives, __ATOMIC_RELAXED);
+  return 0;
+}
@@ -0,0 +1,200 @@
+#include "spndarray.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* minimum number of probes handed to a single thread */
+#define SPNDARRAY_FROZEN_GRAIN 4096
+
+/*
+ * frozen_key()
+ * Writes the search key of the given coordinates: their row-major
+ * linear index if it fits in a size_t, the coordinates themselves
+ * otherwise
+ */
+static inline void frozen_key(const spndarray_frozen *f, const size_t *idxs,
+                              size_t *key) {
+  if (f->width == 1 && f->ndim > 1) {
+    size_t lin = idxs[0];
+    for (size_t i = 1; i < f->ndim; i++)
+      lin = lin * f->dimsizes[i] + idxs[i];
+    key[0] = lin;
+  } else
+    memcpy(key, idxs, f->width * sizeof(size_t));
+}
+
+/*
+ * eytzinger_fill()
+ * Lays out the sorted keys in breadth-first (Eytzinger) order: slot k
+ * has its children at 2k and 2k+1, slot 0 is left unused
+ */
+static size_t eytzinger_fill(spndarray_frozen *f, const size_t *sorted_keys,
+                             const double *sorted_data, size_t i,
+                             const size_t k) {
+  if (k <= f->nz) {
+    i = eytzinger_fill(f, sorted_keys, sorted_data, i, 2 * k);
+    memcpy(&f->keys[k * f->width], &sorted_keys[i * f->width],
+           f->width * sizeof(size_t));
+    f->data[k] = sorted_data[i++];
+    i = eytzinger_fill(f, sorted_keys, sorted_data, i, 2 * k + 1);
+  }
+  return i;
+}
+
+/*
+ * spndarray_freeze()
+ *
+ * Builds an immutable snapshot of a ntuple array for read-only use
+ *
+ * Inputs
+ *  m - the array to snapshot; it is not modified, and later changes
+ *      to it do not affect the snapshot
+ *
+ * Output
+ *  the snapshot, to be released with spndarray_frozen_free()
+ *
+ * Notes
+ *  the elements are stored in Eytzinger order and searched without
+ *  branches. When the product of the dimension sizes fits in a size_t,
+ *  each element is keyed by its linear index, so a snapshot costs
+ *  2 words per element against ndim + 5 for the tree form.
+ *
+ *  elements holding the fill value are dropped. Lookups only read
+ *  the snapshot, so any number of threads may query it at once
+ */
+spndarray_frozen *spndarray_freeze(const spndarray *m) {
+  if (!SPNDARRAY_ISNTUPLE(m)) {
+    fprintf(stderr, "array must be in the ntuple format");
+    return NULL;
+  }
+  if (!SPNDARRAY_ISFLOAT64(m)) {
+    fprintf(stderr, "array must hold double values, see spndarray_convert()\n");
+    return NULL;
+  }
+
+  spndarray_frozen *f = calloc(1, sizeof(*f));
+  size_t *order = malloc((m->nz ? m->nz : 1) * sizeof(size_t));
+  if (!f || !order) {
+    fprintf(stderr, "not enough space for frozen array");
+    abort();
+  }
+
+  f->ndim = m->ndim;
+  f->fill = m->fill;
+  f->dimsizes = malloc(m->ndim * sizeof(size_t));
+  if (!f->dimsizes) {
+    fprintf(stderr, "not enough space for frozen array");
+    abort();
+  }
+  memcpy(f->dimsizes, m->dimsizes, m->ndim * sizeof(size_t));
+
+  size_t span = 1;
+  f->width = 1;
+  for (size_t i = 0; i < m->ndim; i++)
+    if (__builtin_mul_overflow(span, m->dimsizes[i], &span))
+      f->width = m->ndim;
+
+  size_t nz = spndarray_tree_order(m, order), live = 0;
+  for (size_t k = 0; k < nz; k++)
+    if (m->data[order[k]] != m->fill)
+      order[live++] = order[k];
+  f->nz = live;
+
+  size_t *sorted_keys = malloc((live + 1) * f->width * sizeof(size_t));
+  double *sorted_data = malloc((live + 1) * sizeof(double));
+  f->keys = malloc((live + 1) * f->width * sizeof(size_t));
+  f->data = malloc((live + 1) * sizeof(double));
+  if (!sorted_keys || !sorted_data || !f->keys || !f->data) {
+    fprintf(stderr, "not enough space for frozen array");
+    abort();
+  }
+
+  size_t idxs[m->ndim];
+  for (size_t k = 0; k < live; k++) {
+    for (size_t i = 0; i < m->ndim; i++)
+      idxs[i] = m->dims[i][order[k]];
+    frozen_key(f, idxs, &sorted_keys[k * f->width]);
+    sorted_data[k] = m->data[order[k]];
+  }
+  eytzinger_fill(f, sorted_keys, sorted_data, 0, 1);
+
+  free(sorted_keys);
+  free(sorted_data);
+  free(order);
+  return f;
+} /* spndarray_freeze() */
+
+/*
+ * spndarray_frozen_free()
+ * Frees the given snapshot
+ */
+void spndarray_frozen_free(spndarray_frozen *f) {
+  free(f->dimsizes);
+  free(f->keys);
+  free(f->data);
+  free(f);
+}
+
+size_t spndarray_frozen_nnz(const spndarray_frozen *f) { return f->nz; }
+
+/*
+ * spndarray_frozen_get()
+ * Gets the element at the given coordinates of a snapshot
+ */
+double spndarray_frozen_get(const spndarray_frozen *f, const size_t *idxs) {
+  const size_t w = f->width;
+  size_t key[w], k = 1;
+
+  for (size_t i = 0; i < f->ndim; i++)
+    if (idxs[i] >= f->dimsizes[i])
+      return f->fill;
+  frozen_key(f, idxs, key);
+
+  if (w == 1) {
+    while (k <= f->nz) {
+      // the 16 descendants four levels down share two cache lines
+      __builtin_prefetch(&f->keys[16 * k]);
+      k = 2 * k + (f->keys[k] < key[0]);
+    }
+  } else {
+    while (k <= f->nz)
+      k = 2 * k + (spndarray_compare_idx(w, &f->keys[k * w], key) < 0);
+  }
+
+  // undo the right turns taken after the last left turn; k is then
+  // the smallest key not less than the probe, or 0 if there is none
+  k >>= __builtin_ffsll(~k);
+
+  if (k && spndarray_compare_idx(w, &f->keys[k * w], key) == 0)
+    return f->data[k];
+  return f->fill;
+}
+
+typedef struct {
+  const spndarray_frozen *f;
+  const size_t *idxs;
+  double *out;
+} spndarray_frozen_batch;
+
+static void frozen_get_range(void *param, size_t begin, size_t end) {
+  const spndarray_frozen_batch *b = (const spndarray_frozen_batch *)param;
+  for (size_t k = begin; k < end; k++)
+    b->out[k] = spndarray_frozen_get(b->f, &b->idxs[k * b->f->ndim]);
+}
+
+/*
+ * spndarray_frozen_get_batch()
+ *
+ * Looks up a batch of coordinates in a snapshot
+ *
+ * Inputs
+ *  count - number of coordinates
+ *  idxs  - the coordinates, ndim indices per coordinate, back to back
+ *  out   - array of size count receiving the values, in the same
+ *          order as idxs
+ */
+void spndarray_frozen_get_batch(const spndarray_frozen *f, const size_t count,
+                                const size_t *idxs, double *out) {
+  spndarray_frozen_batch b = {f, idxs, out};
+  spndarray_parallel_for(count, SPNDARRAY_FROZEN_GRAIN, frozen_get_range, &b);
+}
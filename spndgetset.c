@@ -1,31 +1,74 @@
+#define _GNU_SOURCE
 #include "spndarray.h"
 #include <math.h>
 #include <stdlib.h>
 
 #include "avl.c"
 
-static void *tree_find(const spndarray *m, const size_t ndim,
-                       const size_t *idxs);
-
-void spndarray_incr(spndarray *m, const size_t *idxs) {
-  if (m->nz == 0) {
-    spndarray_set(m, m->fill + 1.0, idxs); // degenerate case
-    return;
+/* batches of fewer probes than this are not worth sorting */
+#define SPNDARRAY_BATCH_MIN 32
+/* minimum number of probes handed to a single thread */
+#define SPNDARRAY_BATCH_GRAIN 4096
+/*
+ * sorting only pays off when the probes are dense enough to share
+ * most of their walk: below one probe per this many elements, batches
+ * go through spndarray_get_interleaved() instead
+ */
+#define SPNDARRAY_BATCH_SPARSITY 64
+/*
+ * incr_value()
+ * Adds one to the element at data index n, in its own value type so
+ * that integer counters stay exact
+ *
+ * Return
+ *  0, or 1 if the dictionary of the array has no room for the new value
+ */
+static inline int incr_value(spndarray *m, const size_t n) {
+  switch (m->vtype) {
+#define SPND_INCR_CASE(V, T, S)                                            \
+  case V:                                                                  \
+    ((T *)m->values)[n] += 1;                                              \
+    break;
+    SPNDARRAY_FOREACH_VTYPE(SPND_INCR_CASE)
+#undef SPND_INCR_CASE
+  case SPNDARRAY_DICT8:
+  case SPNDARRAY_DICT16:
+    return spndarray_store(m, n, spndarray_value(m, n) + 1);
   }
+  return 0;
+}
+
+/*
+ * spndarray_incr()
+ * Adds one to the element at the given coordinates, storing it first
+ * with the fill value plus one if there is none
+ *
+ * Return
+ *  0 on success, like spndarray_set()
+ */
+int spndarray_incr(spndarray *m, const size_t *idxs) {
+  if (m->nz == 0)
+    return spndarray_set(m, m->fill + 1.0, idxs); // degenerate case
 
   // out of order...?
   for (size_t i = 0; i < m->ndim; i++)
     if (idxs[i] >= m->dimsizes[i])
-      return (void)spndarray_set(m, m->fill + 1.0, idxs);
+      return spndarray_set(m, m->fill + 1.0, idxs);
 
   if (SPNDARRAY_ISNTUPLE(m)) {
-    double *ptr = spndarray_ptr(m, idxs);
-    if (!ptr)
-      return (void)spndarray_set(m, m->fill + 1.0, idxs);
-
-    ++*ptr;
+    if (!spndarray_filter_contains(m, idxs))
+      return spndarray_set(m, m->fill + 1.0, idxs);
 
-    return;
+    size_t n = m->rank->find(m, idxs);
+    if (n == SPNDARRAY_NOTFOUND) {
+      spndarray_filter_false_positive(m);
+      return spndarray_set(m, m->fill + 1.0, idxs);
+    }
+    if (m->shared) {
+      spndarray_unshare(m);
+      n = m->rank->find(m, idxs);
+    }
+    return incr_value(m, n);
   } else {
     // TODO
     fprintf(stderr, "Not implemented");
@@ -35,7 +78,7 @@ void spndarray_incr(spndarray *m, const size_t *idxs) {
 
 double spndarray_get(const spndarray *m, const size_t *idxs) {
   if (m->nz == 0)
-    return 0.0;
+    return m->fill;
 
   // out of order...?
   for (size_t i = 0; i < m->ndim; i++)
@@ -43,11 +86,15 @@ double spndarray_get(const spndarray *m, const size_t *idxs) {
       return m->fill;
 
   if (SPNDARRAY_ISNTUPLE(m)) {
-    void *ptr = tree_find(m, m->ndim, idxs);
-
-    double x = ptr ? *(double *)ptr : m->fill;
+    if (!spndarray_filter_contains(m, idxs))
+      return m->fill;
 
-    return x;
+    const size_t n = m->rank->find(m, idxs);
+    if (n == SPNDARRAY_NOTFOUND) {
+      spndarray_filter_false_positive(m);
+      return m->fill;
+    }
+    return spndarray_value(m, n);
   } else {
     // TODO
     fprintf(stderr, "Not implemented");
@@ -62,35 +109,45 @@ int spndarray_set(spndarray *m, const double x, const size_t *idxs) {
     fprintf(stderr, "array not in ntuple format");
     return 1;
   } else if (x == m->fill) {
-    void *ptr = tree_find(m, m->ndim, idxs);
+    if (!spndarray_filter_contains(m, idxs))
+      return 0;
+
+    size_t n = m->rank->find(m, idxs);
+    if (n == SPNDARRAY_NOTFOUND)
+      return 0;
+    if (m->vtype == SPNDARRAY_PATTERN) {
+      fprintf(stderr, "elements of pattern arrays cannot be cleared\n");
+      return 1;
+    }
+    if (m->shared) {
+      spndarray_unshare(m);
+      n = m->rank->find(m, idxs);
+    }
 
     /*
      * just set the data element to 0; it'd be simple to
      * delete the node from the avl tree, but deleting the
      * data from ->data is not so simple
      */
-    if (ptr)
-      *(double *)ptr = m->fill;
-
-    return 0;
+    return spndarray_store(m, n, m->fill);
   } else {
     int s = 0;
-    if (m->nz >= m->nzmax) {
-      s = spndarray_realloc(2 * m->nzmax, m);
-      if (s)
-        return s;
-    }
+    spndarray_unshare(m);
+    s = spndarray_reserve(m, m->nz + 1);
+    if (s)
+      return s;
 
     // store the ntuple
     for (size_t i = 0; i < m->ndim; i++)
       m->dims[i][m->nz] = idxs[i];
 
-    m->data[m->nz] = x;
+    if (spndarray_store(m, m->nz, x))
+      return 1;
 
-    void *ptr = avl_insert(m->tree_data->tree, &m->data[m->nz]);
+    void *ptr = avl_insert(m->tree_data->tree, &m->dims[0][m->nz]);
     if (ptr != NULL) {
       // found duplicate entry, replace it
-      *(double *)ptr = x;
+      s = spndarray_store(m, (size_t *)ptr - m->dims[0], x);
     } else {
       // no duplicate found, update indices as needed
       //
@@ -99,20 +156,47 @@ int spndarray_set(spndarray *m, const double x, const size_t *idxs) {
         m->dimsizes[i] =
             (m->dimsizes[i] > idxs[i] + 1) ? m->dimsizes[i] : idxs[i] + 1;
 
+      spndarray_filter_insert(m, idxs);
       ++(m->nz);
     }
     return s;
   }
 }
 
-double *spndarray_ptr(const spndarray *m, const size_t *idxs) {
+/*
+ * spndarray_ptr()
+ * Points at the value of the element at the given coordinates, or
+ * returns NULL if there is none; only arrays of doubles have one
+ *
+ * Notes
+ *  the value may be written through the pointer, so an array sharing
+ *  its storage with a copy-on-write clone gets its own copy first; use
+ *  spndarray_get() or spndarray_contains() on arrays not to modify
+ */
+double *spndarray_ptr(spndarray *m, const size_t *idxs) {
+  if (!SPNDARRAY_ISFLOAT64(m)) {
+    fprintf(stderr, "array must hold double values");
+    return NULL;
+  }
   for (size_t i = 0; i < m->ndim; i++)
     if (idxs[i] >= m->dimsizes[i])
       return NULL;
 
   if (SPNDARRAY_ISNTUPLE(m)) {
-    void *ptr = tree_find(m, m->ndim, idxs);
-    return (double *)ptr;
+    if (!spndarray_filter_contains(m, idxs))
+      return NULL;
+
+    size_t n = m->rank->find(m, idxs);
+    if (n == SPNDARRAY_NOTFOUND) {
+      spndarray_filter_false_positive(m);
+      return NULL;
+    }
+    if (m->shared) {
+      // the caller may write through the pointer
+      spndarray_unshare(m);
+      n = m->rank->find(m, idxs);
+    }
+    return &m->data[n];
   } else {
     // TODO
     fprintf(stderr, "Not implemented");
@@ -120,24 +204,548 @@ double *spndarray_ptr(const spndarray *m, const size_t *idxs) {
   }
 }
 
-static void *tree_find(const spndarray *m, const size_t ndim,
-                       const size_t *idxs) {
+/*
+ * spndarray_contains()
+ * Checks whether an element is stored at the given coordinates; unlike
+ * spndarray_ptr(), it never modifies the array
+ */
+int spndarray_contains(const spndarray *m, const size_t *idxs) {
+  for (size_t i = 0; i < m->ndim; i++)
+    if (idxs[i] >= m->dimsizes[i])
+      return 0;
+  if (!spndarray_filter_contains(m, idxs))
+    return 0;
+  if (m->rank->find(m, idxs) != SPNDARRAY_NOTFOUND)
+    return 1;
+  spndarray_filter_false_positive(m);
+  return 0;
+}
+
+/*
+ * state shared by the batched get/set/incr routines
+ *
+ * probes are stored back to back in idxs, ndim indices each, and are
+ * referred to by their position in the caller's batch
+ */
+typedef struct {
+  spndarray *m;
+  const size_t *idxs;   /* probe coordinates */
+  const double *vals;   /* values to store (set) */
+  const double *deltas; /* increments, NULL for +1 (incr) */
+  double *out;          /* results in caller order (get) */
+  size_t *order;        /* probe positions, sorted by coordinate */
+  size_t *runs;         /* start of each run of equal probes in order */
+  size_t *found;        /* data index of each probe/run, or NOTFOUND */
+} spndarray_batch;
+
+/*
+ * compare_probe()
+ * Compares a probe against the element stored at data index n
+ */
+static inline int compare_probe(const spndarray *m, const size_t *idxs,
+                                const size_t n) {
+  for (size_t i = 0; i < m->ndim; i++) {
+    const size_t pi = m->dims[i][n];
+    if (idxs[i] < pi)
+      return -1;
+    else if (idxs[i] > pi)
+      return 1;
+  }
+  return 0;
+}
+
+/*
+ * compare_probe_order()
+ * qsort_r() comparator sorting probe positions by coordinate; ties
+ * are broken by position so that equal probes keep the caller's order
+ */
+static int compare_probe_order(const void *pa, const void *pb, void *param) {
+  const spndarray_batch *b = (const spndarray_batch *)param;
+  const size_t a = *(const size_t *)pa, c = *(const size_t *)pb;
+  const size_t ndim = b->m->ndim;
+
+  int cmp = spndarray_compare_idx(ndim, &b->idxs[a * ndim], &b->idxs[c * ndim]);
+  if (cmp)
+    return cmp;
+  return (a > c) - (a < c);
+}
+
+/*
+ * batch_descend()
+ *
+ * Resolves the sorted probes order[lo..hi) against the subtree rooted
+ * at p in a single walk: every node splits the probe range in two by
+ * binary search, so each node is visited at most once no matter how
+ * many probes pass through it.
+ *
+ * The data index of the element matching order[k] is stored in
+ * found[k], or SPNDARRAY_NOTFOUND if there is none
+ */
+static void batch_descend(const spndarray *m, const struct avl_node *p,
+                          const size_t *idxs, const size_t *order, size_t lo,
+                          size_t hi, size_t *found) {
+  const size_t ndim = m->ndim;
+
+  while (lo < hi) {
+    if (!p) {
+      for (size_t k = lo; k < hi; k++)
+        found[k] = SPNDARRAY_NOTFOUND;
+      return;
+    }
+    const size_t n = (size_t *)p->avl_data - m->dims[0];
+
+    // first probe that is not smaller than the node
+    size_t l = lo, h = hi;
+    while (l < h) {
+      size_t mid = l + (h - l) / 2;
+      if (compare_probe(m, &idxs[order[mid] * ndim], n) < 0)
+        l = mid + 1;
+      else
+        h = mid;
+    }
+
+    size_t u = l;
+    while (u < hi && compare_probe(m, &idxs[order[u] * ndim], n) == 0)
+      found[u++] = n;
+
+    batch_descend(m, p->avl_link[0], idxs, order, lo, l, found);
+    p = p->avl_link[1];
+    lo = u;
+  }
+}
+
+static void get_batch_range(void *param, size_t begin, size_t end) {
+  spndarray_batch *b = (spndarray_batch *)param;
+  const spndarray *m = b->m;
   const struct avl_table *tree = (struct avl_table *)m->tree_data->tree;
-  const struct avl_node *p;
-
-  for (p = tree->avl_root; p != NULL;) {
-    size_t n = (double *)p->avl_data - m->data;
-    size_t pi[ndim];
-    for (size_t i = 0; i < ndim; i++)
-      pi[i] = m->dims[i][n];
-
-    int cmp = spndarray_compare_idx(ndim, idxs, pi);
-    if (cmp < 0)
-      p = p->avl_link[0];
-    else if (cmp > 0)
-      p = p->avl_link[1];
+  size_t *order = b->order + begin, *found = b->found + begin;
+  size_t count = 0;
+
+  // probes the filter rules out never reach the walk
+  for (size_t k = begin; k < end; k++)
+    if (spndarray_filter_contains(m, &b->idxs[k * m->ndim]))
+      order[count++] = k;
     else
-      return p->avl_data;
+      b->out[k] = m->fill;
+  qsort_r(order, count, sizeof(size_t), compare_probe_order, b);
+
+  batch_descend(m, tree->avl_root, b->idxs, order, 0, count, found);
+
+  switch (m->vtype) {
+#define SPND_GATHER_CASE(V, T, S, READ)                                    \
+  case V:                                                                  \
+    for (size_t k = 0; k < count; k++)                                     \
+      if (found[k] == SPNDARRAY_NOTFOUND) {                                \
+        spndarray_filter_false_positive(m);                                \
+        b->out[order[k]] = m->fill;                                        \
+      } else                                                               \
+        b->out[order[k]] = READ(T, m, found[k]);                           \
+    break;
+    SPNDARRAY_FOREACH_TYPE(SPND_GATHER_CASE)
+#undef SPND_GATHER_CASE
+  }
+}
+
+/*
+ * spndarray_get_batch()
+ *
+ * Looks up a batch of coordinates
+ *
+ * Inputs
+ *  count - number of coordinates
+ *  idxs  - the coordinates, ndim indices per coordinate, back to back
+ *  out   - array of size count receiving the values, in the same
+ *          order as idxs
+ *
+ * Notes
+ *  the probes are sorted and resolved with one merged walk over the
+ *  tree; large batches are split across spndarray_get_num_threads()
+ *  threads, each of which sorts and walks its own share. Batches that
+ *  are small next to the array are handed to
+ *  spndarray_get_interleaved()
+ *
+ * Return
+ *  0 on success
+ */
+int spndarray_get_batch(const spndarray *m, const size_t count,
+                        const size_t *idxs, double *out) {
+  if (!SPNDARRAY_ISNTUPLE(m)) {
+    fprintf(stderr, "array not in ntuple format");
+    return 1;
+  }
+
+  SPNDARRAY_OP_BEGIN();
+  if (count < SPNDARRAY_BATCH_MIN ||
+      count * SPNDARRAY_BATCH_SPARSITY < m->nz || m->nz == 0) {
+    int s = spndarray_get_interleaved(m, count, idxs, out);
+    SPNDARRAY_OP_END(SPNDARRAY_OP_GET_BATCH);
+    return s;
+  }
+
+  spndarray_batch b = {(spndarray *)m, idxs, NULL, NULL, out, NULL, NULL, NULL};
+  b.order = malloc(2 * count * sizeof(size_t));
+  if (!b.order) {
+    fprintf(stderr, "not enough space for batch workspace");
+    return 1;
+  }
+  b.found = b.order + count;
+
+  spndarray_parallel_for(count, SPNDARRAY_BATCH_GRAIN, get_batch_range, &b);
+
+  free(b.order);
+  SPNDARRAY_OP_END(SPNDARRAY_OP_GET_BATCH);
+  return 0;
+}
+
+static void find_runs_range(void *param, size_t begin, size_t end) {
+  spndarray_batch *b = (spndarray_batch *)param;
+  const struct avl_table *tree = (struct avl_table *)b->m->tree_data->tree;
+
+  // order[runs[r]] is the first probe of run r; gather them so the
+  // runs can be walked like any sorted batch. batch_descend() never
+  // reads a position again after resolving it, so the results can
+  // overwrite the heads in place
+  size_t *heads = b->found + begin;
+  for (size_t r = begin; r < end; r++)
+    heads[r - begin] = b->order[b->runs[r]];
+
+  batch_descend(b->m, tree->avl_root, b->idxs, heads, 0, end - begin, heads);
+}
+
+/*
+ * run_value()
+ * Folds the probes of one run into the value the element ends up with
+ */
+static inline double run_value(const spndarray_batch *b, const size_t r,
+                               double x) {
+  if (b->vals) // last write wins
+    return b->vals[b->order[b->runs[r + 1] - 1]];
+
+  for (size_t k = b->runs[r]; k < b->runs[r + 1]; k++)
+    x += b->deltas ? b->deltas[b->order[k]] : 1.0;
+  return x;
+}
+
+/*
+ * update_runs_*_range()
+ * Update the elements found for a range of runs, one routine per
+ * value type; plain increments of integer counters are added in their
+ * own type so that they stay exact
+ */
+#define SPND_UPDATE_RUNS(V, T, S)                                          \
+  static void update_runs_##S##_range(void *param, size_t begin,           \
+                                      size_t end) {                        \
+    spndarray_batch *b = (spndarray_batch *)param;                         \
+    T *data = (T *)b->m->values;                                           \
+                                                                           \
+    for (size_t r = begin; r < end; r++) {                                 \
+      const size_t n = b->found[r];                                        \
+      if (n == SPNDARRAY_NOTFOUND)                                         \
+        continue;                                                          \
+      if (!b->vals && !b->deltas)                                          \
+        data[n] += (T)(b->runs[r + 1] - b->runs[r]);                       \
+      else                                                                 \
+        data[n] = (T)run_value(b, r, (double)data[n]);                     \
+    }                                                                      \
+  }
+SPNDARRAY_FOREACH_VTYPE(SPND_UPDATE_RUNS)
+#undef SPND_UPDATE_RUNS
+
+/*
+ * update_batch()
+ *
+ * Common code for spndarray_set_batch() and spndarray_incr_batch()
+ *
+ * The probes are sorted and grouped into runs of equal coordinates,
+ * the runs are located with one merged walk, elements that already
+ * exist are updated in parallel and the missing ones are inserted
+ * after growing the array at most once
+ */
+static int update_batch(spndarray_batch *b, const size_t count) {
+  spndarray *m = b->m;
+  const size_t ndim = m->ndim;
+  int s = 0;
+
+  if (!SPNDARRAY_ISNTUPLE(m)) {
+    fprintf(stderr, "array not in ntuple format");
+    return 1;
+  }
+  if (count == 0)
+    return 0;
+  spndarray_unshare(m);
+
+  b->order = malloc(3 * count * sizeof(size_t) + sizeof(size_t));
+  if (!b->order) {
+    fprintf(stderr, "not enough space for batch workspace");
+    return 1;
+  }
+  b->found = b->order + count;
+  b->runs = b->found + count;
+
+  for (size_t k = 0; k < count; k++)
+    b->order[k] = k;
+  qsort_r(b->order, count, sizeof(size_t), compare_probe_order, b);
+
+  size_t nruns = 0;
+  for (size_t k = 0; k < count; k++)
+    if (k == 0 || spndarray_compare_idx(ndim, &b->idxs[b->order[k] * ndim],
+                                        &b->idxs[b->order[k - 1] * ndim]))
+      b->runs[nruns++] = k;
+  b->runs[nruns] = count;
+
+  if (m->nz == 0)
+    for (size_t r = 0; r < nruns; r++)
+      b->found[r] = SPNDARRAY_NOTFOUND;
+  else
+    spndarray_parallel_for(nruns, SPNDARRAY_BATCH_GRAIN, find_runs_range, b);
+
+  size_t missing = 0;
+  for (size_t r = 0; r < nruns; r++)
+    missing += b->found[r] == SPNDARRAY_NOTFOUND;
+
+  switch (m->vtype) {
+#define SPND_UPDATE_RUNS_CASE(V, T, S)                                     \
+  case V:                                                                  \
+    spndarray_parallel_for(nruns, SPNDARRAY_BATCH_GRAIN,                   \
+                           update_runs_##S##_range, b);                    \
+    break;
+    SPNDARRAY_FOREACH_VTYPE(SPND_UPDATE_RUNS_CASE)
+#undef SPND_UPDATE_RUNS_CASE
+  case SPNDARRAY_PATTERN:
+    // stored elements stay as they are, and cannot be cleared
+    for (size_t r = 0; b->vals && r < nruns; r++)
+      if (b->found[r] != SPNDARRAY_NOTFOUND &&
+          run_value(b, r, m->fill) == m->fill) {
+        fprintf(stderr, "elements of pattern arrays cannot be cleared\n");
+        free(b->order);
+        return 1;
+      }
+    break;
+  case SPNDARRAY_DICT8:
+  case SPNDARRAY_DICT16:
+    // new values go into the dictionary, one run after the other
+    for (size_t r = 0; r < nruns; r++) {
+      const size_t n = b->found[r];
+      if (n != SPNDARRAY_NOTFOUND &&
+          spndarray_store(m, n, run_value(b, r, spndarray_value(m, n)))) {
+        free(b->order);
+        return 1;
+      }
+    }
+  }
+
+  s = spndarray_reserve(m, m->nz + missing);
+
+  // insert in sorted order; runs of set() that store the fill value
+  // are skipped by spndarray_set() itself
+  for (size_t r = 0; !s && r < nruns; r++)
+    if (b->found[r] == SPNDARRAY_NOTFOUND)
+      s = spndarray_set(m, run_value(b, r, m->fill),
+                        &b->idxs[b->order[b->runs[r]] * ndim]);
+
+  free(b->order);
+  return s;
+}
+
+/*
+ * spndarray_set_batch()
+ *
+ * Sets a batch of elements
+ *
+ * Inputs
+ *  count - number of elements
+ *  vals  - the values to store
+ *  idxs  - the coordinates, ndim indices per coordinate, back to back
+ *
+ * Notes
+ *  if a coordinate appears more than once, the last value wins,
+ *  just as with repeated calls to spndarray_set()
+ */
+int spndarray_set_batch(spndarray *m, const size_t count, const double *vals,
+                        const size_t *idxs) {
+  SPNDARRAY_OP_BEGIN();
+  spndarray_batch b = {m, idxs, vals, NULL, NULL, NULL, NULL, NULL};
+  int s = update_batch(&b, count);
+  SPNDARRAY_OP_END(SPNDARRAY_OP_SET_BATCH);
+  return s;
+}
+
+/*
+ * spndarray_incr_batch()
+ *
+ * Increments a batch of elements
+ *
+ * Inputs
+ *  count  - number of coordinates
+ *  idxs   - the coordinates, ndim indices per coordinate, back to back
+ *  deltas - the increment of each coordinate, or NULL to increment
+ *           each of them by one
+ *
+ * Notes
+ *  repeated coordinates are accumulated, in the order given, before
+ *  touching the array
+ */
+int spndarray_incr_batch(spndarray *m, const size_t count, const size_t *idxs,
+                         const double *deltas) {
+  SPNDARRAY_OP_BEGIN();
+  spndarray_batch b = {m, idxs, NULL, deltas, NULL, NULL, NULL, NULL};
+  int s = update_batch(&b, count);
+  SPNDARRAY_OP_END(SPNDARRAY_OP_INCR_BATCH);
+  return s;
+}
+
+/* number of lookups kept in flight by spndarray_get_interleaved() */
+#ifndef SPNDARRAY_PREFETCH_GROUP
+#define SPNDARRAY_PREFETCH_GROUP 16
+#endif
+
+/*
+ * one in-flight lookup of spndarray_get_interleaved()
+ *
+ * a lane alternates between two steps: with n == NOTFOUND the node p
+ * has been prefetched and its avl_data is read to find the data index
+ * (prefetching the indices it points to); otherwise the indices of n
+ * have been prefetched and are compared to the probe, which moves the
+ * lane to (and prefetches) the next node
+ */
+typedef struct {
+  const struct avl_node *p; /* node being visited */
+  size_t n;                 /* data index of p, or NOTFOUND if not read yet */
+  size_t k;                 /* position of the probe in the batch */
+} spndarray_lane;
+
+/*
+ * lane_start()
+ * Starts the next probe of [*next, end) on a lane, answering probes
+ * that are out of bounds right away. Returns 0 once there are none left
+ */
+static inline int lane_start(const spndarray *m, spndarray_lane *lane,
+                             const size_t *idxs, size_t *next,
+                             const size_t end, size_t *found) {
+  const struct avl_table *tree = (struct avl_table *)m->tree_data->tree;
+
+  while (*next < end) {
+    const size_t k = (*next)++;
+    const size_t *probe = &idxs[k * m->ndim];
+    size_t i;
+
+    for (i = 0; i < m->ndim; i++)
+      if (probe[i] >= m->dimsizes[i])
+        break;
+    if (i < m->ndim || !tree->avl_root ||
+        !spndarray_filter_contains(m, probe)) {
+      found[k] = SPNDARRAY_NOTFOUND;
+      continue;
+    }
+
+    *lane = (spndarray_lane){tree->avl_root, SPNDARRAY_NOTFOUND, k};
+    return 1;
+  }
+  return 0;
+}
+
+typedef struct {
+  const spndarray *m;
+  const size_t *idxs;
+  double *out;
+  size_t *found; /* data index of the element of each probe */
+} spndarray_interleaved;
+
+static void get_interleaved_range(void *param, size_t begin, size_t end) {
+  const spndarray_interleaved *q = (const spndarray_interleaved *)param;
+  const spndarray *m = q->m;
+  spndarray_lane lanes[SPNDARRAY_PREFETCH_GROUP];
+  size_t active = 0, next = begin;
+
+  while (active < SPNDARRAY_PREFETCH_GROUP &&
+         lane_start(m, &lanes[active], q->idxs, &next, end, q->found))
+    active++;
+
+  while (active) {
+    for (size_t g = 0; g < active;) {
+      spndarray_lane *lane = &lanes[g];
+
+      if (lane->n == SPNDARRAY_NOTFOUND) {
+        lane->n = (size_t *)lane->p->avl_data - m->dims[0];
+        for (size_t i = 0; i < m->ndim; i++)
+          __builtin_prefetch(&m->dims[i][lane->n]);
+        g++;
+        continue;
+      }
+
+      int cmp = compare_probe(m, &q->idxs[lane->k * m->ndim], lane->n);
+      const struct avl_node *c = cmp ? lane->p->avl_link[cmp > 0] : NULL;
+      if (c) {
+        __builtin_prefetch(c);
+        *lane = (spndarray_lane){c, SPNDARRAY_NOTFOUND, lane->k};
+        g++;
+        continue;
+      }
+
+      if (cmp)
+        spndarray_filter_false_positive(m);
+      q->found[lane->k] = cmp ? SPNDARRAY_NOTFOUND : lane->n;
+      // refill the lane, or retire it by moving the last one in
+      if (!lane_start(m, lane, q->idxs, &next, end, q->found))
+        *lane = lanes[--active];
+      else
+        g++;
+    }
+  }
+
+  switch (m->vtype) {
+#define SPND_GATHER_CASE(V, T, S, READ)                                    \
+  case V:                                                                  \
+    for (size_t k = begin; k < end; k++)                                   \
+      q->out[k] = q->found[k] == SPNDARRAY_NOTFOUND                        \
+                      ? m->fill                                            \
+                      : READ(T, m, q->found[k]);                           \
+    break;
+    SPNDARRAY_FOREACH_TYPE(SPND_GATHER_CASE)
+#undef SPND_GATHER_CASE
+  }
+}
+
+/*
+ * spndarray_get_interleaved()
+ *
+ * Looks up a batch of coordinates, keeping SPNDARRAY_PREFETCH_GROUP
+ * independent tree walks in flight
+ *
+ * Inputs
+ *  count - number of coordinates
+ *  idxs  - the coordinates, ndim indices per coordinate, back to back
+ *  out   - array of size count receiving the values, in the same
+ *          order as idxs
+ *
+ * Notes
+ *  every walk is a chain of dependent loads (node, then its data
+ *  index, then the indices); the walks are advanced round-robin and
+ *  the next load of each is prefetched, so that the cache misses of
+ *  one walk overlap with the work on the others. Unlike
+ *  spndarray_get_batch() the probes are not sorted, which suits small
+ *  batches of random coordinates over large arrays. The walks only
+ *  note the data index they end at; the values are read afterwards in
+ *  one pass per value type
+ *
+ * Return
+ *  0 on success
+ */
+int spndarray_get_interleaved(const spndarray *m, const size_t count,
+                              const size_t *idxs, double *out) {
+  if (!SPNDARRAY_ISNTUPLE(m)) {
+    fprintf(stderr, "array not in ntuple format");
+    return 1;
+  }
+
+  spndarray_interleaved q = {m, idxs, out,
+                             malloc((count ? count : 1) * sizeof(size_t))};
+  if (!q.found) {
+    fprintf(stderr, "not enough space for batch workspace");
+    return 1;
   }
-  return NULL;
+  spndarray_parallel_for(count, SPNDARRAY_BATCH_GRAIN, get_interleaved_range,
+                         &q);
+  free(q.found);
+  return 0;
 }
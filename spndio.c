@@ -1,5 +1,153 @@
 #include "spndarray.h"
+#include <fcntl.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* bytes gathered before every write of a dense export */
+#define SPNDARRAY_DENSE_BUFFER (1 << 20)
+
+/*
+ * dense_cells()
+ * Number of cells of the array, or 0 if it does not fit in a size_t
+ */
+static size_t dense_cells(const spndarray *m) {
+  size_t cells = 1;
+  for (size_t i = 0; i < m->ndim; i++) {
+    if (cells > SIZE_MAX / m->dimsizes[i])
+      return 0;
+    cells *= m->dimsizes[i];
+  }
+  return cells;
+}
+
+/*
+ * dense_offsets()
+ *
+ * Lists the row-major offsets of the elements that are not the fill
+ * value, in increasing order, along with their data indices
+ *
+ * Return
+ *  number of elements listed
+ */
+static size_t dense_offsets(const spndarray *m, size_t *offsets,
+                            size_t *order) {
+  size_t nz = spndarray_tree_order(m, order), live = 0;
+
+  for (size_t k = 0; k < nz; k++) {
+    size_t n = order[k], off = 0;
+    if (m->data[n] == m->fill)
+      continue;
+    for (size_t i = 0; i < m->ndim; i++)
+      off = off * m->dimsizes[i] + m->dims[i][n];
+    offsets[live] = off;
+    order[live++] = n;
+  }
+  return live;
+}
+
+/*
+ * fwrite_dense_text()
+ * Writes every cell with fmt, separated by spaces, one row of the last
+ * dimension per line
+ */
+static int fwrite_dense_text(const spndarray *m, const char *fmt, FILE *fp,
+                             const size_t cells, const size_t *offsets,
+                             const size_t *order, const size_t live) {
+  const size_t row = m->dimsizes[m->ndim - 1];
+  char *buf = malloc(SPNDARRAY_DENSE_BUFFER), fill[64];
+  int err = 0;
+
+  if (!buf) {
+    fprintf(stderr, "not enough space to write the array");
+    return 1;
+  }
+
+  // the fill value is formatted once and copied for every fill cell
+  int fill_len = snprintf(fill, sizeof(fill), fmt, m->fill);
+  if (fill_len < 0 || (size_t)fill_len >= sizeof(fill)) {
+    fprintf(stderr, "format \"%s\" is too long\n", fmt);
+    free(buf);
+    return 1;
+  }
+
+  size_t len = 0;
+  for (size_t c = 0, k = 0; c < cells && !err; c++) {
+    if (SPNDARRAY_DENSE_BUFFER - len < 128) {
+      err = fwrite(buf, 1, len, fp) != len;
+      len = 0;
+    }
+    if (k < live && offsets[k] == c) {
+      int n = snprintf(buf + len, SPNDARRAY_DENSE_BUFFER - len - 1, fmt,
+                       m->data[order[k++]]);
+      if (n < 0 || (size_t)n >= SPNDARRAY_DENSE_BUFFER - len - 1) {
+        fprintf(stderr, "format \"%s\" is too long\n", fmt);
+        err = 1;
+        break;
+      }
+      len += n;
+    } else {
+      memcpy(buf + len, fill, fill_len);
+      len += fill_len;
+    }
+    buf[len++] = (c + 1) % row ? ' ' : '\n';
+  }
+  err = err || fwrite(buf, 1, len, fp) != len;
+  free(buf);
+  return err;
+}
+
+/*
+ * fwrite_npy()
+ * Writes the cells as a NumPy .npy file of doubles in C order
+ */
+static int fwrite_npy(const spndarray *m, FILE *fp, const size_t cells,
+                      const size_t *offsets, const size_t *order,
+                      const size_t live) {
+  const size_t chunk = SPNDARRAY_DENSE_BUFFER / sizeof(double);
+  char header[256 + 24 * m->ndim];
+  int len;
+
+  // version 1.0 header, padded so that the data is 64 byte aligned
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  len = sprintf(header, "\x93NUMPY\x01%c%c%c{'descr': '<f8', ", 0, 0, 0);
+#else
+  len = sprintf(header, "\x93NUMPY\x01%c%c%c{'descr': '>f8', ", 0, 0, 0);
+#endif
+  len += sprintf(header + len, "'fortran_order': False, 'shape': (");
+  for (size_t i = 0; i < m->ndim; i++)
+    len += sprintf(header + len, "%zu, ", m->dimsizes[i]);
+  len += sprintf(header + len, "), }");
+  while ((len + 1) % 64)
+    header[len++] = ' ';
+  header[len++] = '\n';
+  if (len - 10 > 65535) {
+    fprintf(stderr, "too many dimensions for a .npy file\n");
+    return 1;
+  }
+  header[8] = (len - 10) & 0xff;
+  header[9] = (len - 10) >> 8;
+
+  double *buf = malloc(chunk * sizeof(double));
+  if (!buf) {
+    fprintf(stderr, "not enough space to write the array");
+    return 1;
+  }
+
+  int err = fwrite(header, 1, len, fp) != (size_t)len;
+  for (size_t c = 0, k = 0; c < cells && !err; c += chunk) {
+    size_t n = cells - c < chunk ? cells - c : chunk;
+    for (size_t e = 0; e < n; e++)
+      buf[e] = m->fill;
+    for (; k < live && offsets[k] < c + n; k++)
+      buf[offsets[k] - c] = m->data[order[k]];
+    err = fwrite(buf, sizeof(double), n, fp) != n;
+  }
+  free(buf);
+  return err;
+}
 
 /*
  * spndarray_fwrite()
@@ -10,12 +158,28 @@
  * Inputs
  *  fmt - element format
  *  filepath - file to save to
- *  full - whether to save only nonzero elements (1) or all the elements (0)
+ *  full - SPNDARRAY_FWRITE_SPARSE to save only the stored elements,
+ *         one "[i,j,...] = " line each; SPNDARRAY_FWRITE_FULL to save
+ *         every element as text, rows of the last dimension on one
+ *         line; SPNDARRAY_FWRITE_NPY to save every element as a NumPy
+ *         .npy file, ignoring fmt
+ *
+ * Notes
+ *  the full modes merge the sorted elements with the runs of fill
+ *  value between them, and write through a 1MB buffer
  */
 int spndarray_fwrite(const spndarray* m, const char* fmt, const char* filepath, const int full) {
+  if (!SPNDARRAY_ISFLOAT64(m)) {
+    fprintf(stderr, "array must hold double values, see spndarray_convert()\n");
+    return 1;
+  }
   FILE* fp = fopen(filepath, "w+");
-  if (!fmt) fmt = "%f,\n";
-  if (!full) {
+  if (!fp) {
+    fprintf(stderr, "cannot open %s for writing\n", filepath);
+    return 1;
+  }
+  if (full == SPNDARRAY_FWRITE_SPARSE) {
+    if (!fmt) fmt = "%f,\n";
     size_t ndim = m->ndim;
     for (size_t s = 0; s < m->nz; s++) {
       fprintf(fp, "[");
@@ -25,8 +189,774 @@ int spndarray_fwrite(const spndarray* m, const char* fmt, const char* filepath,
     }
     fclose(fp);
     return 0;
+  }
+
+  size_t cells = dense_cells(m);
+  size_t *offsets = malloc((m->nz ? m->nz : 1) * sizeof(size_t));
+  size_t *order = malloc((m->nz ? m->nz : 1) * sizeof(size_t));
+  int err;
+
+  if (!SPNDARRAY_ISNTUPLE(m) || !cells) {
+    fprintf(stderr, "array cannot be written in full");
+    err = 1;
+  } else if (!offsets || !order) {
+    fprintf(stderr, "not enough space to write the array");
+    err = 1;
   } else {
-    fprintf(stderr, "nonsparse saving not implemented yet\n");
+    size_t live = dense_offsets(m, offsets, order);
+    if (full == SPNDARRAY_FWRITE_NPY)
+      err = fwrite_npy(m, fp, cells, offsets, order, live);
+    else
+      err = fwrite_dense_text(m, fmt ? fmt : "%g", fp, cells, offsets,
+                              order, live);
+  }
+
+  err |= fclose(fp) != 0;
+  free(offsets);
+  free(order);
+  return err;
+}
+
+/*
+ * Binary format, version 1
+ *
+ *   offset 0            spndarray_file_header (64 bytes)
+ *   offset 64           dimsizes, ndim uint64
+ *   dims_offset         index column of dimension 0, nz uint64,
+ *   + i * stride        ... then the columns of dimensions 1...ndim-1
+ *   data_offset         values, nz doubles
+ *
+ * The elements are sorted by dimension 0, then 1, and so on, and hold
+ * no fill values. Every section starts on a 64 byte boundary, so that a
+ * mapped file can be searched in place. Integers and doubles are stored
+ * in the byte order of the writer, which is recorded in the header
+ */
+#define SPNDARRAY_FILE_MAGIC "SPNDARR"
+#define SPNDARRAY_FILE_VERSION 1
+#define SPNDARRAY_FILE_BYTE_ORDER 0x01020304u
+#define SPNDARRAY_FILE_ALIGN 64
+/* elements gathered per column write */
+#define SPNDARRAY_FILE_CHUNK 65536
+
+typedef struct {
+  char magic[8];          /* SPNDARRAY_FILE_MAGIC */
+  uint32_t version;       /* SPNDARRAY_FILE_VERSION */
+  uint32_t byte_order;    /* SPNDARRAY_FILE_BYTE_ORDER as written */
+  uint64_t ndim;          /* number of dimensions */
+  uint64_t nz;            /* number of elements */
+  double fill;            /* fill value */
+  uint64_t dims_offset;   /* offset of the first index column */
+  uint64_t stride;        /* distance between index columns */
+  uint64_t data_offset;   /* offset of the values */
+} spndarray_file_header;
+
+_Static_assert(sizeof(spndarray_file_header) == 64,
+               "the file header must take 64 bytes");
+_Static_assert(sizeof(size_t) == sizeof(uint64_t),
+               "the binary format maps indices to size_t");
+
+static inline uint64_t file_align(const uint64_t x) {
+  return (x + SPNDARRAY_FILE_ALIGN - 1) / SPNDARRAY_FILE_ALIGN *
+         SPNDARRAY_FILE_ALIGN;
+}
+
+/*
+ * file_layout()
+ * Fills in the section offsets of a header from ndim and nz
+ */
+static void file_layout(spndarray_file_header *h) {
+  h->dims_offset = file_align(sizeof(*h) + h->ndim * sizeof(uint64_t));
+  h->stride = file_align(h->nz * sizeof(uint64_t));
+  h->data_offset = h->dims_offset + h->ndim * h->stride;
+}
+
+static int file_pad(FILE *fp, const uint64_t offset) {
+  static const char zeros[SPNDARRAY_FILE_ALIGN];
+  long pos = ftell(fp);
+  return pos < 0 || (uint64_t)pos > offset ||
+         fwrite(zeros, 1, offset - pos, fp) != offset - pos;
+}
+
+/*
+ * spndarray_fwrite_binary()
+ *
+ * Writes the array to the given file in the binary format
+ *
+ * Notes
+ *  the elements are written in coordinate order, one column at a time
+ *  through a buffer, so the file can be read back without sorting and
+ *  mapped with spndarray_mmap_open()
+ *
+ * Return
+ *  0 on success
+ */
+int spndarray_fwrite_binary(const spndarray *m, const char *filepath) {
+  if (!SPNDARRAY_ISNTUPLE(m)) {
+    fprintf(stderr, "array must be in the ntuple format");
+    return 1;
+  }
+  if (!SPNDARRAY_ISFLOAT64(m)) {
+    fprintf(stderr, "array must hold double values, see spndarray_convert()\n");
+    return 1;
+  }
+
+  size_t *order = malloc((m->nz ? m->nz : 1) * sizeof(size_t));
+  uint64_t *buf = malloc(SPNDARRAY_FILE_CHUNK * sizeof(uint64_t));
+  if (!order || !buf) {
+    fprintf(stderr, "not enough space to write the array");
+    free(order);
+    free(buf);
+    return 1;
+  }
+
+  size_t nz = spndarray_tree_order(m, order), live = 0;
+  for (size_t k = 0; k < nz; k++)
+    if (m->data[order[k]] != m->fill)
+      order[live++] = order[k];
+
+  spndarray_file_header h = {SPNDARRAY_FILE_MAGIC, SPNDARRAY_FILE_VERSION,
+                             SPNDARRAY_FILE_BYTE_ORDER, m->ndim, live,
+                             m->fill};
+  file_layout(&h);
+
+  FILE *fp = fopen(filepath, "wb");
+  if (!fp) {
+    fprintf(stderr, "cannot open %s for writing\n", filepath);
+    free(order);
+    free(buf);
+    return 1;
+  }
+
+  int err = fwrite(&h, sizeof(h), 1, fp) != 1;
+  for (size_t i = 0; i < m->ndim; i++)
+    buf[i] = m->dimsizes[i];
+  err |= fwrite(buf, sizeof(uint64_t), m->ndim, fp) != m->ndim;
+
+  for (size_t i = 0; i <= m->ndim && !err; i++) {
+    err |= file_pad(fp, i < m->ndim ? h.dims_offset + i * h.stride
+                                    : h.data_offset);
+    for (size_t k = 0; k < live && !err; k += SPNDARRAY_FILE_CHUNK) {
+      size_t len = live - k < SPNDARRAY_FILE_CHUNK ? live - k
+                                                   : SPNDARRAY_FILE_CHUNK;
+      for (size_t e = 0; e < len; e++)
+        if (i < m->ndim)
+          buf[e] = m->dims[i][order[k + e]];
+        else
+          ((double *)buf)[e] = m->data[order[k + e]];
+      err |= fwrite(buf, sizeof(uint64_t), len, fp) != len;
+    }
+  }
+
+  err |= fclose(fp) != 0;
+  if (err)
+    fprintf(stderr, "failed to write %s\n", filepath);
+  free(order);
+  free(buf);
+  return err;
+} /* spndarray_fwrite_binary() */
+
+/*
+ * file_align_checked()
+ * Rounds x * width up like file_align(), or fails if that overflows
+ */
+static inline int file_align_checked(const uint64_t x, const uint64_t width,
+                                     const uint64_t base, uint64_t *res) {
+  if (__builtin_mul_overflow(x, width, res) ||
+      __builtin_add_overflow(*res, base + SPNDARRAY_FILE_ALIGN - 1, res))
+    return 1;
+  *res = *res / SPNDARRAY_FILE_ALIGN * SPNDARRAY_FILE_ALIGN;
+  return 0;
+}
+
+/*
+ * file_check_layout()
+ * Checks the section offsets of a header against those file_layout()
+ * gives, and that all sections lie within size bytes; the offsets are
+ * recomputed without wrapping around, so that no header of huge ndim
+ * or nz can pass for a small one
+ */
+static int file_check_layout(const spndarray_file_header *h,
+                             const uint64_t size) {
+  uint64_t dims_offset, stride, columns, data_offset, data_end;
+
+  if (file_align_checked(h->ndim, sizeof(uint64_t), sizeof(*h),
+                         &dims_offset) ||
+      file_align_checked(h->nz, sizeof(uint64_t), 0, &stride) ||
+      __builtin_mul_overflow(h->ndim, stride, &columns) ||
+      __builtin_add_overflow(dims_offset, columns, &data_offset) ||
+      __builtin_mul_overflow(h->nz, sizeof(double), &data_end) ||
+      __builtin_add_overflow(data_offset, data_end, &data_end))
+    return 1;
+  return h->dims_offset != dims_offset || h->stride != stride ||
+         h->data_offset != data_offset || data_offset > size ||
+         data_end > size;
+}
+
+/*
+ * file_check_header()
+ * Validates a header read from a file of the given size
+ */
+static int file_check_header(const spndarray_file_header *h,
+                             const uint64_t size, const char *filepath) {
+  if (memcmp(h->magic, SPNDARRAY_FILE_MAGIC, sizeof(h->magic))) {
+    fprintf(stderr, "%s is not a spndarray file\n", filepath);
+    return 1;
+  }
+  if (h->byte_order != SPNDARRAY_FILE_BYTE_ORDER) {
+    fprintf(stderr, "%s was written with another byte order\n", filepath);
     return 1;
   }
+  if (h->version != SPNDARRAY_FILE_VERSION) {
+    fprintf(stderr, "%s has unsupported version %u\n", filepath, h->version);
+    return 1;
+  }
+
+  if (h->ndim == 0 || file_check_layout(h, size)) {
+    fprintf(stderr, "%s is truncated or corrupt\n", filepath);
+    return 1;
+  }
+  return 0;
 }
+
+/*
+ * spndarray_fread()
+ *
+ * Reads an array written by spndarray_fwrite_binary()
+ *
+ * Output
+ *  the array, or NULL on failure
+ *
+ * Notes
+ *  the columns are read straight into the array, and since they are
+ *  sorted its tree is linked up in one linear pass
+ */
+spndarray *spndarray_fread(const char *filepath) {
+  spndarray_file_header h;
+  FILE *fp = fopen(filepath, "rb");
+  long size;
+
+  if (!fp) {
+    fprintf(stderr, "cannot open %s\n", filepath);
+    return NULL;
+  }
+  if (fseek(fp, 0, SEEK_END) || (size = ftell(fp)) < 0 ||
+      fseek(fp, 0, SEEK_SET) || fread(&h, sizeof(h), 1, fp) != 1) {
+    fprintf(stderr, "cannot read %s\n", filepath);
+    fclose(fp);
+    return NULL;
+  }
+  if (file_check_header(&h, size, filepath)) {
+    fclose(fp);
+    return NULL;
+  }
+
+  size_t *dimsizes = malloc(h.ndim * sizeof(size_t));
+  if (!dimsizes) {
+    fprintf(stderr, "not enough space to read %s\n", filepath);
+    fclose(fp);
+    return NULL;
+  }
+  int err = fread(dimsizes, sizeof(size_t), h.ndim, fp) != h.ndim;
+  for (size_t i = 0; i < h.ndim && !err; i++)
+    err = dimsizes[i] == 0;
+  if (err) {
+    fprintf(stderr, "%s is truncated or corrupt\n", filepath);
+    free(dimsizes);
+    fclose(fp);
+    return NULL;
+  }
+
+  spndarray *m =
+      spndarray_alloc_nzmax(h.ndim, dimsizes, h.nz, SPNDARRAY_NTUPLE);
+  if (!m) {
+    free(dimsizes);
+    fclose(fp);
+    return NULL;
+  }
+  spndarray_set_fillvalue(m, h.fill);
+  for (size_t i = 0; i < h.ndim && !err; i++) {
+    err = fseek(fp, h.dims_offset + i * h.stride, SEEK_SET) ||
+          fread(m->dims[i], sizeof(size_t), h.nz, fp) != h.nz;
+    for (size_t n = 0; n < h.nz && !err; n++)
+      err = m->dims[i][n] >= dimsizes[i];
+  }
+  err = err || fseek(fp, h.data_offset, SEEK_SET) ||
+        fread(m->data, sizeof(double), h.nz, fp) != h.nz;
+  fclose(fp);
+  free(dimsizes);
+
+  m->nz = h.nz;
+  if (err) {
+    fprintf(stderr, "%s is truncated or corrupt\n", filepath);
+    spndarray_free(m);
+    return NULL;
+  }
+  if (spndarray_tree_rebuild(m)) {
+    spndarray_free(m);
+    return NULL;
+  }
+  return m;
+} /* spndarray_fread() */
+
+/*
+ * spndarray_mmap_open()
+ *
+ * Maps a file written by spndarray_fwrite_binary() for reading
+ *
+ * Output
+ *  a read-only handle, to be released with spndarray_mmap_close();
+ *  NULL on failure
+ *
+ * Notes
+ *  nothing is parsed or indexed: lookups binary search the sorted
+ *  columns in place, so opening costs the same for any file size and
+ *  only the pages a lookup touches are read from disk. The file must
+ *  not be modified while it is mapped
+ */
+spndarray_mapped *spndarray_mmap_open(const char *filepath) {
+  int fd = open(filepath, O_RDONLY);
+  struct stat st;
+
+  if (fd < 0) {
+    fprintf(stderr, "cannot open %s\n", filepath);
+    return NULL;
+  }
+  if (fstat(fd, &st) || (size_t)st.st_size < sizeof(spndarray_file_header)) {
+    fprintf(stderr, "%s is truncated or corrupt\n", filepath);
+    close(fd);
+    return NULL;
+  }
+
+  void *base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    fprintf(stderr, "cannot map %s\n", filepath);
+    return NULL;
+  }
+
+  const spndarray_file_header *h = (const spndarray_file_header *)base;
+  if (file_check_header(h, st.st_size, filepath)) {
+    munmap(base, st.st_size);
+    return NULL;
+  }
+
+  spndarray_mapped *f = calloc(1, sizeof(*f));
+  const size_t **dims = malloc(h->ndim * sizeof(size_t *));
+  if (!f || !dims) {
+    fprintf(stderr, "not enough space for mapped array");
+    abort();
+  }
+
+  const char *p = (const char *)base;
+  for (size_t i = 0; i < h->ndim; i++)
+    dims[i] = (const size_t *)(p + h->dims_offset + i * h->stride);
+  f->ndim = h->ndim;
+  f->dimsizes = (const size_t *)(p + sizeof(*h));
+  f->fill = h->fill;
+  f->nz = h->nz;
+  f->dims = dims;
+  f->data = (const double *)(p + h->data_offset);
+  f->base = base;
+  f->length = st.st_size;
+  return f;
+} /* spndarray_mmap_open() */
+
+/*
+ * spndarray_mmap_close()
+ * Unmaps the given file
+ */
+void spndarray_mmap_close(spndarray_mapped *f) {
+  munmap(f->base, f->length);
+  free(f->dims);
+  free(f);
+}
+
+size_t spndarray_mapped_nnz(const spndarray_mapped *f) { return f->nz; }
+
+/*
+ * spndarray_mapped_get()
+ *
+ * Gets the element at the given coordinates of a mapped file
+ *
+ * Notes
+ *  the elements sharing idxs[0] form a run of the first column; the
+ *  run is narrowed one column at a time, so every step of the search
+ *  reads a single column
+ */
+double spndarray_mapped_get(const spndarray_mapped *f, const size_t *idxs) {
+  size_t lo = 0, hi = f->nz;
+
+  for (size_t i = 0; i < f->ndim && lo < hi; i++) {
+    const size_t *col = f->dims[i], x = idxs[i];
+    size_t a = lo, b = hi;
+
+    // first position not below x
+    while (a < b) {
+      size_t mid = a + (b - a) / 2;
+      if (col[mid] < x)
+        a = mid + 1;
+      else
+        b = mid;
+    }
+    lo = a;
+    // first position above x
+    for (b = hi; a < b;) {
+      size_t mid = a + (b - a) / 2;
+      if (col[mid] <= x)
+        a = mid + 1;
+      else
+        b = mid;
+    }
+    hi = a;
+  }
+  return lo < hi ? f->data[lo] : f->fill;
+}
+
+typedef struct {
+  const spndarray_mapped *f;
+  const size_t *idxs;
+  double *out;
+} spndarray_mapped_batch;
+
+static void mapped_get_range(void *param, size_t begin, size_t end) {
+  const spndarray_mapped_batch *b = (const spndarray_mapped_batch *)param;
+  for (size_t k = begin; k < end; k++)
+    b->out[k] = spndarray_mapped_get(b->f, &b->idxs[k * b->f->ndim]);
+}
+
+/*
+ * spndarray_mapped_get_batch()
+ * Looks up a batch of coordinates, ndim indices per coordinate, in a
+ * mapped file, on the pool
+ */
+void spndarray_mapped_get_batch(const spndarray_mapped *f, const size_t count,
+                                const size_t *idxs, double *out) {
+  spndarray_mapped_batch b = {f, idxs, out};
+  spndarray_parallel_for(count, spndarray_get_grain_size(), mapped_get_range,
+                         &b);
+}
+
+/* smallest share of a text file given to one parsing task */
+#define SPNDARRAY_TNS_CHUNK (1 << 20)
+
+/*
+ * part of a text file parsed by one task, and what came out of it
+ */
+typedef struct {
+  const char *begin, *end; /* whole lines of the file */
+  size_t n, cap;           /* elements parsed, room in idxs/vals */
+  size_t *idxs;            /* ndim indices per element */
+  double *vals;            /* element values */
+  size_t *max;             /* largest index seen in each dimension */
+  size_t offset;           /* where the elements go in the array */
+  const char *error;       /* start of the line that failed to parse */
+} tns_chunk;
+
+typedef struct {
+  size_t ndim;       /* number of dimensions */
+  size_t base;       /* index of the first element, 0 or 1 */
+  tns_chunk *chunks; /* the chunks, in file order */
+  spndarray *m;      /* array being filled */
+} tns_ctx;
+
+/* whitespace, and the punctuation spndarray_fwrite() puts around indices */
+static inline int tns_is_sep(const char c) {
+  return c == ' ' || c == '\t' || c == '\r' || c == ',' || c == '[' ||
+         c == ']' || c == '=';
+}
+
+static inline const char *tns_skip(const char *p, const char *end) {
+  while (p < end && tns_is_sep(*p))
+    p++;
+  return p;
+}
+
+static const char *tns_parse_index(const char *p, const char *end,
+                                   size_t *x) {
+  size_t v = 0;
+  const char *s = p;
+
+  for (; p < end && *p >= '0' && *p <= '9'; p++) {
+    if (v > (SIZE_MAX - 9) / 10)
+      return NULL;
+    v = v * 10 + (*p - '0');
+  }
+  *x = v;
+  return p == s ? NULL : p;
+}
+
+/*
+ * tns_parse_value()
+ *
+ * Parses a double
+ *
+ * Notes
+ *  plain decimals of up to 15 digits, which is what tensor files are
+ *  made of, are exact as an integer over a power of ten and take the
+ *  fast path; anything else goes through strtod()
+ */
+static const char *tns_parse_value(const char *p, const char *end,
+                                   double *x) {
+  static const double pow10[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,
+                                 1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+                                 1e12, 1e13, 1e14, 1e15};
+  const char *s = p;
+  uint64_t mant = 0;
+  int digits = 0, frac = -1, neg = 0;
+
+  if (p < end && (*p == '-' || *p == '+'))
+    neg = *p++ == '-';
+  for (; p < end; p++) {
+    if (*p >= '0' && *p <= '9') {
+      mant = mant * 10 + (*p - '0');
+      digits++;
+      if (frac >= 0)
+        frac++;
+    } else if (*p == '.' && frac < 0)
+      frac = 0;
+    else
+      break;
+  }
+  if (digits > 0 && digits <= 15 &&
+      (p == end || *p == '\n' || tns_is_sep(*p))) {
+    *x = (double)mant / pow10[frac > 0 ? frac : 0];
+    if (neg)
+      *x = -*x;
+    return p;
+  }
+
+  // exponents, long mantissas, inf and nan
+  char buf[64], *e;
+  size_t len = 0;
+  for (p = s; p < end && *p != '\n' && !tns_is_sep(*p); p++)
+    if (len < sizeof(buf) - 1)
+      buf[len++] = *p;
+  buf[len] = '\0';
+  *x = strtod(buf, &e);
+  return len == 0 || e != buf + len ? NULL : p;
+}
+
+/*
+ * tns_count_fields()
+ * Counts the fields on the first line of the given text that is not
+ * blank or a comment
+ */
+static size_t tns_count_fields(const char *p, const char *end) {
+  size_t fields = 0;
+
+  while (p < end) {
+    p = tns_skip(p, end);
+    if (p == end || *p == '\n') {
+      if (fields)
+        break;
+      p++;
+    } else if (*p == '#' && !fields) {
+      const char *nl = memchr(p, '\n', end - p);
+      p = nl ? nl : end;
+    } else {
+      fields++;
+      while (p < end && *p != '\n' && !tns_is_sep(*p))
+        p++;
+    }
+  }
+  return fields;
+}
+
+static void tns_parse_range(void *param, size_t begin, size_t end) {
+  const tns_ctx *ctx = (const tns_ctx *)param;
+  const size_t ndim = ctx->ndim;
+
+  for (size_t c = begin; c < end; c++) {
+    tns_chunk *ch = &ctx->chunks[c];
+    const char *p = ch->begin;
+    size_t idxs[ndim];
+    double x;
+
+    while (p < ch->end) {
+      const char *line = p = tns_skip(p, ch->end);
+      if (p == ch->end)
+        break;
+      if (*p == '\n' || *p == '#') {
+        const char *nl = memchr(p, '\n', ch->end - p);
+        p = nl ? nl + 1 : ch->end;
+        continue;
+      }
+
+      for (size_t i = 0; i < ndim && p; i++) {
+        p = tns_parse_index(tns_skip(p, ch->end), ch->end, &idxs[i]);
+        if (p && idxs[i] < ctx->base)
+          p = NULL;
+        else if (p)
+          idxs[i] -= ctx->base;
+      }
+      if (p)
+        p = tns_parse_value(tns_skip(p, ch->end), ch->end, &x);
+      if (p)
+        p = tns_skip(p, ch->end);
+      if (!p || (p < ch->end && *p != '\n')) {
+        ch->error = line;
+        return;
+      }
+
+      for (size_t i = 0; i < ndim; i++)
+        if (idxs[i] > ch->max[i])
+          ch->max[i] = idxs[i];
+      if (x != 0.0) {
+        if (ch->n == ch->cap) {
+          ch->cap = ch->cap ? 2 * ch->cap : 1024;
+          ch->idxs = realloc(ch->idxs, ch->cap * ndim * sizeof(size_t));
+          ch->vals = realloc(ch->vals, ch->cap * sizeof(double));
+          if (!ch->idxs || !ch->vals) {
+            fprintf(stderr, "not enough space to parse the file");
+            abort();
+          }
+        }
+        memcpy(&ch->idxs[ch->n * ndim], idxs, sizeof(idxs));
+        ch->vals[ch->n++] = x;
+      }
+    }
+  }
+}
+
+static void tns_copy_range(void *param, size_t begin, size_t end) {
+  const tns_ctx *ctx = (const tns_ctx *)param;
+  spndarray *m = ctx->m;
+
+  for (size_t c = begin; c < end; c++) {
+    const tns_chunk *ch = &ctx->chunks[c];
+    for (size_t n = 0; n < ch->n; n++) {
+      for (size_t i = 0; i < ctx->ndim; i++)
+        m->dims[i][ch->offset + n] = ch->idxs[n * ctx->ndim + i];
+      m->data[ch->offset + n] = ch->vals[n];
+    }
+  }
+}
+
+/*
+ * spndarray_read_tns()
+ *
+ * Reads a text file of coordinates and values, FROSTT style: one
+ * element per line, its indices and then its value, separated by
+ * whitespace
+ *
+ * Inputs
+ *  filepath - file to read
+ *  flags    - SPNDARRAY_TNS_ONE_BASED for files whose indices start at
+ *             1, as .tns files do, or SPNDARRAY_TNS_ZERO_BASED
+ *
+ * Output
+ *  the array, with fill value 0 and every dimension just large enough
+ *  for the indices found; NULL on failure
+ *
+ * Notes
+ *  the file is mapped, cut at line boundaries into one chunk per task
+ *  and every chunk is parsed on the pool; the elements are then copied
+ *  into place and indexed with one spndarray_tree_rebuild(). The
+ *  number of dimensions is that of the first line. Blank lines and
+ *  lines starting with '#' are skipped, and so are the brackets,
+ *  commas and '=' of spndarray_fwrite(), whose files read back with
+ *  SPNDARRAY_TNS_ZERO_BASED when the values are printed in full
+ *  precision (e.g. "%.17g\n"). Zero values are dropped; a coordinate
+ *  given twice is an error
+ */
+spndarray *spndarray_read_tns(const char *filepath, const size_t flags) {
+  int fd = open(filepath, O_RDONLY);
+  struct stat st;
+
+  if (fd < 0) {
+    fprintf(stderr, "cannot open %s\n", filepath);
+    return NULL;
+  }
+  if (fstat(fd, &st) || st.st_size == 0) {
+    fprintf(stderr, "%s holds no elements\n", filepath);
+    close(fd);
+    return NULL;
+  }
+
+  const size_t len = st.st_size;
+  char *base = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    fprintf(stderr, "cannot map %s\n", filepath);
+    return NULL;
+  }
+  madvise(base, len, MADV_SEQUENTIAL);
+
+  const char *end = base + len;
+  size_t fields = tns_count_fields(base, end);
+  if (fields < 2) {
+    fprintf(stderr, "%s holds no elements\n", filepath);
+    munmap(base, len);
+    return NULL;
+  }
+
+  // a few chunks per thread to balance uneven lines, but not so small
+  // that the per-chunk buffers dominate
+  size_t nchunks = 4 * spndarray_get_num_threads();
+  if (len / nchunks < SPNDARRAY_TNS_CHUNK)
+    nchunks = (len + SPNDARRAY_TNS_CHUNK - 1) / SPNDARRAY_TNS_CHUNK;
+
+  tns_ctx ctx = {fields - 1, !(flags & SPNDARRAY_TNS_ZERO_BASED),
+                 calloc(nchunks, sizeof(tns_chunk)), NULL};
+  size_t *max = calloc(nchunks * ctx.ndim, sizeof(size_t));
+  if (!ctx.chunks || !max) {
+    fprintf(stderr, "not enough space to parse %s", filepath);
+    abort();
+  }
+  for (size_t c = 0; c < nchunks; c++) {
+    const char *p = base + c * (len / nchunks);
+    if (c > 0 && p[-1] != '\n') {
+      const char *nl = memchr(p, '\n', end - p);
+      p = nl ? nl + 1 : end;
+    }
+    ctx.chunks[c].begin = c ? p : base;
+    ctx.chunks[c].max = &max[c * ctx.ndim];
+    if (c > 0)
+      ctx.chunks[c - 1].end = ctx.chunks[c].begin;
+  }
+  ctx.chunks[nchunks - 1].end = end;
+
+  spndarray_parallel_for(nchunks, 1, tns_parse_range, &ctx);
+
+  size_t nz = 0, dimsizes[ctx.ndim];
+  const char *error = NULL;
+  for (size_t i = 0; i < ctx.ndim; i++)
+    dimsizes[i] = 1;
+  for (size_t c = 0; c < nchunks && !error; c++) {
+    ctx.chunks[c].offset = nz;
+    nz += ctx.chunks[c].n;
+    error = ctx.chunks[c].error;
+    for (size_t i = 0; i < ctx.ndim; i++)
+      if (ctx.chunks[c].max[i] >= dimsizes[i])
+        dimsizes[i] = ctx.chunks[c].max[i] + 1;
+  }
+
+  if (error) {
+    size_t line = 1;
+    for (const char *p = base; p < error; p++)
+      line += *p == '\n';
+    fprintf(stderr, "%s:%zu: expected %zu %s indices and a value\n",
+            filepath, line, ctx.ndim, ctx.base ? "1-based" : "0-based");
+  } else {
+    ctx.m = spndarray_alloc_nzmax(ctx.ndim, dimsizes, nz ? nz : 1,
+                                  SPNDARRAY_NTUPLE);
+    if (ctx.m) {
+      spndarray_parallel_for(nchunks, 1, tns_copy_range, &ctx);
+      ctx.m->nz = nz;
+    }
+  }
+
+  for (size_t c = 0; c < nchunks; c++) {
+    free(ctx.chunks[c].idxs);
+    free(ctx.chunks[c].vals);
+  }
+  free(ctx.chunks);
+  free(max);
+  munmap(base, len);
+
+  if (ctx.m && spndarray_tree_rebuild(ctx.m)) {
+    spndarray_free(ctx.m);
+    return NULL;
+  }
+  return ctx.m;
+} /* spndarray_read_tns() */
@@ -13,6 +13,143 @@ array_mul(const size_t len, const size_t *arr, const ssize_t skip) {
   return prod;
 }
 
+/*
+ * The kernels below run in two parallel passes over the elements of
+ * their inputs: the first computes the value each element contributes
+ * to the result, and counts those that are not the fill value. The
+ * result is then allocated with room for exactly that many elements,
+ * and the second pass gathers them into it, at the slots given by a
+ * prefix sum over the first pass. The result is then indexed with
+ * spndarray_tree_rebuild(). No step depends on how the elements were
+ * split between threads, so the result is the same for any thread
+ * count.
+ */
+typedef struct {
+  const spndarray *src; /* array whose elements are visited */
+  double *vals;         /* value of each element of src in the result */
+  size_t *pos;          /* slot of each element of src in the result */
+  size_t count;         /* elements of src kept in the result */
+} spnd_pass;
+
+typedef struct {
+  const spndarray *m; /* first operand */
+  const spndarray *n; /* second operand */
+  size_t d;           /* dimension argument of the kernel */
+  int sign;           /* +1 for add, -1 for sub */
+  double_mapper f;    /* function of fmap */
+  double fill;        /* fill value of the result */
+  spnd_pass *pass;    /* pass being run */
+  spndarray *res;     /* the result */
+} spnd_kernel;
+
+static inline void kernel_emit(spnd_kernel *k, const size_t i, const double x) {
+  k->pass->vals[i] = x;
+  k->pass->pos[i] = x != k->fill;
+}
+
+/*
+ * grow_dimsize()
+ * Raises a dimension size of the result to fit idx, for many threads
+ */
+static void grow_dimsize(size_t *dimsize, const size_t idx) {
+  size_t cur = __atomic_load_n(dimsize, __ATOMIC_RELAXED);
+  while (idx >= cur && !__atomic_compare_exchange_n(dimsize, &cur, idx + 1, 1,
+                                                     __ATOMIC_RELAXED,
+                                                     __ATOMIC_RELAXED))
+    ;
+}
+
+static void scatter_range(void *param, size_t begin, size_t end) {
+  spnd_kernel *k = (spnd_kernel *)param;
+  const spnd_pass *p = k->pass;
+  spndarray *res = k->res;
+  const size_t ndim = res->ndim, base = res->nz;
+  size_t maxidx[ndim];
+
+  memset(maxidx, 0, sizeof(maxidx));
+  for (size_t i = begin; i < end; i++) {
+    if (p->vals[i] == k->fill)
+      continue;
+    size_t slot = base + p->pos[i];
+    for (size_t j = 0; j < ndim; j++) {
+      size_t idx = p->src->dims[j][i];
+      res->dims[j][slot] = idx;
+      if (idx > maxidx[j])
+        maxidx[j] = idx;
+    }
+    res->data[slot] = p->vals[i];
+  }
+  for (size_t j = 0; j < ndim; j++)
+    grow_dimsize(&res->dimsizes[j], maxidx[j]);
+}
+
+/*
+ * kernel_count()
+ * Runs fn over the elements of src, counting the elements they give
+ * the result in p->count
+ */
+static void kernel_count(spnd_kernel *k, spnd_pass *p, const spndarray *src,
+                         const spndarray_task_fn fn) {
+  p->src = src;
+  p->vals = malloc((src->nz ? src->nz : 1) * sizeof(double));
+  p->pos = malloc((src->nz ? src->nz : 1) * sizeof(size_t));
+  if (!p->vals || !p->pos) {
+    fprintf(stderr, "not enough space for the kernel workspace");
+    abort();
+  }
+
+  k->pass = p;
+  spndarray_parallel_for(src->nz, spndarray_get_grain_size(), fn, k);
+  p->count = spndarray_parallel_scan(p->pos, src->nz);
+}
+
+/* kernel_discard() frees the workspace of a pass left unscattered */
+static void kernel_discard(spnd_pass *p) {
+  free(p->vals);
+  free(p->pos);
+}
+
+/*
+ * kernel_scatter()
+ * Appends the elements counted by a pass to the result, which must
+ * have room for p->count more of them
+ */
+static void kernel_scatter(spnd_kernel *k, spnd_pass *p) {
+  k->pass = p;
+  spndarray_parallel_for(p->src->nz, spndarray_get_grain_size(),
+                         scatter_range, k);
+  k->res->nz += p->count;
+  kernel_discard(p);
+}
+
+/*
+ * kernel_finish()
+ * Indexes the elements gathered by the passes, freeing the result on
+ * failure
+ */
+static spndarray *kernel_finish(spndarray *res) {
+  if (spndarray_tree_rebuild(res)) {
+    spndarray_free(res);
+    return NULL;
+  }
+  return res;
+}
+
+static void mul_range(void *param, size_t begin, size_t end) {
+  spnd_kernel *k = (spnd_kernel *)param;
+  const spndarray *m = k->m, *n = k->n;
+  const size_t d = k->d;
+  size_t midx[m->ndim];
+
+  memset(midx, 0, sizeof(midx));
+  for (size_t i = begin; i < end; i++) {
+    for (size_t j = 0; j < n->ndim; j++)
+      if (j != d)
+        midx[j - (j > d)] = n->dims[j][i];
+    kernel_emit(k, i, spndarray_get(m, midx) * n->data[i]);
+  }
+}
+
 /*
  * spndarray_mul()
  *
@@ -34,6 +171,10 @@ spndarray *spndarray_mul(const spndarray *xm, const spndarray *xn,
   spndarray *m = (spndarray *)xm;
   spndarray *n = (spndarray *)xn;
   ssize_t f = -1;
+  if (!SPNDARRAY_ISFLOAT64(xm) || !SPNDARRAY_ISFLOAT64(xn)) {
+    fprintf(stderr, "array must hold double values, see spndarray_convert()\n");
+    return NULL;
+  }
   if (n->ndim < m->ndim) {
     void *t = m;
     m = n;
@@ -60,22 +201,31 @@ sizecheck:;
     return NULL;
   }
   nosizecheck:;
-  res = spndarray_alloc_nzmax(n->ndim, n->dimsizes, n->nzmax, SPNDARRAY_NTUPLE);
-  size_t midx[m->ndim], nidx[n->ndim];
-  // TODO reshape
-  for (size_t i = 0; i < n->nz; i++) {
-    size_t ni = &n->data[i] - n->data;
-
-    for (size_t j = 0; j < n->ndim; j++) {
-      nidx[j] = n->dims[j][ni];
-      if (j != d)
-        midx[j - (j > d)] = nidx[j];
-    }
-    spndarray_set(res, spndarray_get(m, midx) * spndarray_get(n, nidx), nidx);
+  SPNDARRAY_OP_BEGIN();
+  spnd_kernel k = {.m = m, .n = n, .d = d};
+  spnd_pass p;
+  kernel_count(&k, &p, n, mul_range);
+  res = spndarray_alloc_with(n->ndim, n->dimsizes, p.count, SPNDARRAY_NTUPLE,
+                             m->allocator);
+  if (!res) {
+    kernel_discard(&p);
+    return NULL;
   }
+  // TODO reshape
+  k.res = res;
+  kernel_scatter(&k, &p);
+  res = kernel_finish(res);
+  SPNDARRAY_OP_END(SPNDARRAY_OP_MUL);
   return res;
 }
 
+static void mul_vec_range(void *param, size_t begin, size_t end) {
+  spnd_kernel *k = (spnd_kernel *)param;
+  for (size_t i = begin; i < end; i++)
+    kernel_emit(k, i,
+                k->m->data[i] * spndarray_get(k->n, &k->m->dims[k->d][i]));
+}
+
 /*
  * spndarray_mul_vec()
  *
@@ -96,6 +246,10 @@ spndarray *spndarray_mul_vec(const spndarray *xm, const spndarray *xn,
   spndarray *res;
   spndarray *m = (spndarray *)xm;
   spndarray *n = (spndarray *)xn;
+  if (!SPNDARRAY_ISFLOAT64(xm) || !SPNDARRAY_ISFLOAT64(xn)) {
+    fprintf(stderr, "array must hold double values, see spndarray_convert()\n");
+    return NULL;
+  }
   if (m->ndim < n->ndim) {
     void *t = m;
     m = n;
@@ -106,17 +260,84 @@ spndarray *spndarray_mul_vec(const spndarray *xm, const spndarray *xn,
             n->ndim);
     return NULL;
   }
-  res = spndarray_alloc_nzmax(m->ndim, m->dimsizes, m->nzmax, SPNDARRAY_NTUPLE);
-  size_t midx[m->ndim];
-  for (size_t i = 0; i < m->nz; i++) {
-    for (size_t j = 0; j < m->ndim; j++)
-      midx[j] = m->dims[j][i];
-    double nv = spndarray_get(n, &m->dims[d][i]);
-    spndarray_set(res, m->data[i] * nv, midx);
+  SPNDARRAY_OP_BEGIN();
+  spnd_kernel k = {.m = m, .n = n, .d = d};
+  spnd_pass p;
+  kernel_count(&k, &p, m, mul_vec_range);
+  res = spndarray_alloc_with(m->ndim, m->dimsizes, p.count, SPNDARRAY_NTUPLE,
+                             m->allocator);
+  if (!res) {
+    kernel_discard(&p);
+    return NULL;
   }
+  k.res = res;
+  kernel_scatter(&k, &p);
+  res = kernel_finish(res);
+  SPNDARRAY_OP_END(SPNDARRAY_OP_MUL_VEC);
   return res;
 }
 
+/*
+ * add_n_range() / add_m_range()
+ * Values of m + n (or m - n): every element of n is combined with the
+ * matching value of m, and the elements of m missing from n with the
+ * fill value of n
+ */
+static void add_n_range(void *param, size_t begin, size_t end) {
+  spnd_kernel *k = (spnd_kernel *)param;
+  const spndarray *m = k->m, *n = k->n;
+  size_t idx[n->ndim];
+
+  for (size_t i = begin; i < end; i++) {
+    for (size_t j = 0; j < n->ndim; j++)
+      idx[j] = n->dims[j][i];
+    double x = spndarray_get(m, idx);
+    kernel_emit(k, i, k->sign > 0 ? x + n->data[i] : x - n->data[i]);
+  }
+}
+
+static void add_m_range(void *param, size_t begin, size_t end) {
+  spnd_kernel *k = (spnd_kernel *)param;
+  const spndarray *m = k->m, *n = k->n;
+  size_t idx[m->ndim];
+
+  for (size_t i = begin; i < end; i++) {
+    for (size_t j = 0; j < m->ndim; j++)
+      idx[j] = m->dims[j][i];
+    if (spndarray_contains(n, idx))
+      kernel_emit(k, i, k->fill); // already visited through n
+    else
+      kernel_emit(k, i, k->sign > 0 ? m->data[i] + n->fill
+                                    : m->data[i] - n->fill);
+  }
+}
+
+static spndarray *add_kernel(const spndarray *m, const spndarray *n,
+                             const int sign) {
+  const double fill = sign > 0 ? m->fill + n->fill : m->fill - n->fill;
+  spnd_kernel k = {.m = m, .n = n, .sign = sign, .fill = fill};
+  spnd_pass pn, pm;
+
+  // both passes are counted first, so the result is sized to the union
+  // of the operands less the elements that come out as the fill value
+  kernel_count(&k, &pn, n, add_n_range);
+  kernel_count(&k, &pm, m, add_m_range);
+  spndarray *res = spndarray_alloc_with(n->ndim, n->dimsizes,
+                                        pn.count + pm.count,
+                                        SPNDARRAY_NTUPLE, m->allocator);
+  if (!res) {
+    kernel_discard(&pn);
+    kernel_discard(&pm);
+    return NULL;
+  }
+  spndarray_set_fillvalue(res, fill);
+  // TODO reshape
+  k.res = res;
+  kernel_scatter(&k, &pn);
+  kernel_scatter(&k, &pm);
+  return kernel_finish(res);
+}
+
 /*
  * spndarray_add()
  *
@@ -128,10 +349,11 @@ spndarray *spndarray_mul_vec(const spndarray *xm, const spndarray *xn,
  * Outputs
  *  m + n
  */
-spndarray *spndarray_add(const spndarray *xm, const spndarray *xn) {
-  spndarray *res;
-  spndarray *m = (spndarray *)xm;
-  spndarray *n = (spndarray *)xn;
+spndarray *spndarray_add(const spndarray *m, const spndarray *n) {
+  if (!SPNDARRAY_ISFLOAT64(m) || !SPNDARRAY_ISFLOAT64(n)) {
+    fprintf(stderr, "array must hold double values, see spndarray_convert()\n");
+    return NULL;
+  }
   if (m->ndim != n->ndim) {
     fprintf(stderr,
             "add requires dimensions to be equal, but got %zd and %zd\n",
@@ -147,29 +369,9 @@ spndarray *spndarray_add(const spndarray *xm, const spndarray *xn) {
             ms, ns);
     return NULL;
   }
-  res = spndarray_alloc_nzmax(n->ndim, n->dimsizes, n->nzmax, SPNDARRAY_NTUPLE);
-  spndarray_set_fillvalue(res, n->fill + m->fill);
-  size_t midx[m->ndim], nidx[n->ndim];
-  // TODO reshape
-  for (size_t i = 0; i < n->nz; i++) {
-    size_t ni = &n->data[i] - n->data;
-
-    for (size_t j = 0; j < n->ndim; j++) {
-      nidx[j] = n->dims[j][ni];
-      midx[j] = nidx[j];
-    }
-    spndarray_set(res, spndarray_get(m, midx) + spndarray_get(n, nidx), nidx);
-  }
-
-  for (size_t i = 0; i < m->nz; i++) {
-    size_t mi = &m->data[i] - m->data;
-
-    for (size_t j = 0; j < m->ndim; j++) {
-      midx[j] = m->dims[j][mi];
-      nidx[j] = midx[j];
-    }
-    spndarray_set(res, spndarray_get(m, midx) + spndarray_get(n, nidx), nidx);
-  }
+  SPNDARRAY_OP_BEGIN();
+  spndarray *res = add_kernel(m, n, 1);
+  SPNDARRAY_OP_END(SPNDARRAY_OP_ADD);
   return res;
 }
 
@@ -184,10 +386,11 @@ spndarray *spndarray_add(const spndarray *xm, const spndarray *xn) {
  * Outputs
  *  m - n
  */
-spndarray *spndarray_sub(const spndarray *xm, const spndarray *xn) {
-  spndarray *res;
-  spndarray *m = (spndarray *)xm;
-  spndarray *n = (spndarray *)xn;
+spndarray *spndarray_sub(const spndarray *m, const spndarray *n) {
+  if (!SPNDARRAY_ISFLOAT64(m) || !SPNDARRAY_ISFLOAT64(n)) {
+    fprintf(stderr, "array must hold double values, see spndarray_convert()\n");
+    return NULL;
+  }
   if (m->ndim != n->ndim) {
     fprintf(stderr,
             "sub requires dimensions to be equal, but got %zd and %zd\n",
@@ -203,32 +406,18 @@ spndarray *spndarray_sub(const spndarray *xm, const spndarray *xn) {
             ms, ns);
     return NULL;
   }
-  res = spndarray_alloc_nzmax(n->ndim, n->dimsizes, n->nzmax, SPNDARRAY_NTUPLE);
-  spndarray_set_fillvalue(res, n->fill + m->fill);
-  size_t midx[m->ndim], nidx[n->ndim];
-  // TODO reshape
-  for (size_t i = 0; i < n->nz; i++) {
-    size_t ni = &n->data[i] - n->data;
-
-    for (size_t j = 0; j < n->ndim; j++) {
-      nidx[j] = n->dims[j][ni];
-      midx[j] = nidx[j];
-    }
-    spndarray_set(res, spndarray_get(m, midx) - spndarray_get(n, nidx), nidx);
-  }
-
-  for (size_t i = 0; i < m->nz; i++) {
-    size_t mi = &m->data[i] - m->data;
-
-    for (size_t j = 0; j < m->ndim; j++) {
-      midx[j] = m->dims[j][mi];
-      nidx[j] = midx[j];
-    }
-    spndarray_set(res, spndarray_get(m, midx) - spndarray_get(n, nidx), nidx);
-  }
+  SPNDARRAY_OP_BEGIN();
+  spndarray *res = add_kernel(m, n, -1);
+  SPNDARRAY_OP_END(SPNDARRAY_OP_SUB);
   return res;
 }
 
+static void copy_range(void *param, size_t begin, size_t end) {
+  spnd_kernel *k = (spnd_kernel *)param;
+  for (size_t i = begin; i < end; i++)
+    kernel_emit(k, i, k->pass->src->data[i]);
+}
+
 /*
  * spndarray_memcpy()
  *
@@ -245,37 +434,108 @@ spndarray *spndarray_sub(const spndarray *xm, const spndarray *xn) {
  *  if a dst is provided, it must have the same dimensionality as the
  *  source array
  *
- *  the fillvalues of the source array will _not_ be transferred over,
- *  they will be simply tranformed to the new fillvalue
- *  [doing so would cause this array to mostly dense]
+ *  without a dst, the copy is exact (fill value included) and made
+ *  with spndarray_clone(). The same bulk copy is used when dst has the
+ *  fill value of src
+ *
+ *  otherwise, the fillvalues of the source array will _not_ be
+ *  transferred over, they will be simply tranformed to the new
+ *  fillvalue [doing so would cause this array to mostly dense]
  */
 spndarray *spndarray_memcpy(const spndarray *src, spndarray *dst) {
+  SPNDARRAY_OP_BEGIN();
   if (!dst) {
-    dst = spndarray_alloc_nzmax(src->ndim, src->dimsizes, src->nzmax, SPNDARRAY_NTUPLE);
+    dst = spndarray_clone(src);
+    SPNDARRAY_OP_END(SPNDARRAY_OP_MEMCPY);
+    return dst;
   } else if (dst->ndim != src->ndim) {
     fprintf(stderr,
             "memcpy requires dimensionality to be equal between the source and "
             "the destination array\n");
     return NULL;
   }
-  size_t idx[src->ndim];
+  if (dst->fill == src->fill) {
+    if (spndarray_copy_into(dst, src))
+      return NULL;
+    SPNDARRAY_OP_END(SPNDARRAY_OP_MEMCPY);
+    return dst;
+  }
+  if (!SPNDARRAY_ISFLOAT64(src) || !SPNDARRAY_ISFLOAT64(dst)) {
+    fprintf(stderr, "array must hold double values, see spndarray_convert()\n");
+    return NULL;
+  }
+
+  spnd_kernel k = {.fill = dst->fill, .res = dst};
+  spnd_pass p;
+  kernel_count(&k, &p, src, copy_range);
+
   spndarray_set_zero(dst);
-  for (size_t i = 0; i < src->nz; i++) {
-    for (size_t j = 0; j < src->ndim; j++)
-      idx[j] = src->dims[j][i];
-    spndarray_set(dst, src->data[i], idx);
+  if (dst->nzmax < p.count && spndarray_realloc(p.count, dst)) {
+    kernel_discard(&p);
+    return NULL;
   }
+  kernel_scatter(&k, &p);
+  if (spndarray_tree_rebuild(dst))
+    return NULL;
+  SPNDARRAY_OP_END(SPNDARRAY_OP_MEMCPY);
   return dst;
 }
 
+static double negate_value(double x) { return -x; }
+static double mulinverse_value(double x) { return 1 / x; }
+
+static void fmap_range(void *param, size_t begin, size_t end) {
+  spnd_kernel *k = (spnd_kernel *)param;
+  for (size_t i = begin; i < end; i++)
+    k->res->data[i] = k->f(k->res->data[i]);
+}
+
+static void negate_range(void *param, size_t begin, size_t end) {
+  spndarray *m = (spndarray *)param;
+  for (size_t i = begin; i < end; i++)
+    m->data[i] = -m->data[i];
+}
+
+static void mulinverse_range(void *param, size_t begin, size_t end) {
+  spndarray *m = (spndarray *)param;
+  for (size_t i = begin; i < end; i++)
+    m->data[i] = 1 / m->data[i];
+}
+
+/*
+ * spndarray_fmap()
+ * Applies f to every stored value of the array, in place
+ *
+ * Notes
+ *  f is called from several threads at once on large arrays, so it
+ *  must not keep state between calls. On dictionary arrays, f is only
+ *  applied to the distinct values
+ */
 void spndarray_fmap(spndarray *m, double_mapper f) {
-  for (size_t i = 0; i < m->nz; i++)
-    m->data[i] = f(m->data[i]);
+  if (SPNDARRAY_ISDICT(m)) {
+    spndarray_dict_map(m, f);
+    return;
+  }
+  if (!SPNDARRAY_ISFLOAT64(m)) {
+    fprintf(stderr, "array must hold double values, see spndarray_convert()\n");
+    return;
+  }
+  spndarray_unshare(m);
+  spnd_kernel k = {.f = f, .res = m};
+  spndarray_parallel_for(m->nz, spndarray_get_grain_size(), fmap_range, &k);
 }
 
 void spndarray_negate(spndarray *m) {
-  for (size_t i = 0; i < m->nz; i++)
-    m->data[i] = -m->data[i];
+  if (SPNDARRAY_ISDICT(m)) {
+    spndarray_dict_map(m, negate_value);
+    return;
+  }
+  if (!SPNDARRAY_ISFLOAT64(m)) {
+    fprintf(stderr, "array must hold double values, see spndarray_convert()\n");
+    return;
+  }
+  spndarray_unshare(m);
+  spndarray_parallel_for(m->nz, spndarray_get_grain_size(), negate_range, m);
 }
 
 
@@ -285,11 +545,20 @@ void spndarray_negate(spndarray *m) {
  * applies 1/x for each value in the array, used for division
  */
 void spndarray_mulinverse(spndarray *m) {
+  if (!SPNDARRAY_ISFLOAT64(m) && !SPNDARRAY_ISDICT(m)) {
+    fprintf(stderr, "array must hold double values, see spndarray_convert()\n");
+    return;
+  }
   if (m->fill == 0.0 && m->nz != array_mul(m->ndim, m->dimsizes, -1)) {
     fprintf(stderr, "multiplicativeInverse applied to zero will generate inf\n");
     m->fill = 1.0 / 0.0;
   }
 
-  for (size_t s = 0; s < m->nz; s++)
-    m->data[s] = 1/m->data[s];
+  if (SPNDARRAY_ISDICT(m)) {
+    spndarray_dict_map(m, mulinverse_value);
+    return;
+  }
+  spndarray_unshare(m);
+  spndarray_parallel_for(m->nz, spndarray_get_grain_size(), mulinverse_range,
+                         m);
 }
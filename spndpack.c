@@ -0,0 +1,401 @@
+#include "spndarray.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Packed format, version 1
+ *
+ *   spndarray_pack_header
+ *   dimsizes            ndim uint64
+ *   dictionary          ndict doubles, sorted (SPNDARRAY_PACK_DICT only)
+ *   blocks              ceil(nz / block) blocks of `block` elements,
+ *                       the last one possibly shorter
+ *
+ * Every block stands alone. It holds one packed column per dimension
+ * and then the values, either as doubles or as packed codes into the
+ * dictionary. A packed column is a width byte b followed by the
+ * column's values in b bits each, low bits first, in little-endian
+ * 64-bit words.
+ *
+ * The elements are sorted by dimension 0, then 1, and so on. Index i
+ * of an element is stored as its difference with index i of the
+ * element before it when both agree on every dimension before i, and
+ * as is otherwise, so the column of the last dimension mostly holds
+ * small gaps and the leading columns mostly zeros. The first element
+ * of a block is compared with all zeros.
+ */
+
+#define SPNDARRAY_PACK_MAGIC "SPNDPAK"
+#define SPNDARRAY_PACK_VERSION 1
+#define SPNDARRAY_PACK_BYTE_ORDER 0x01020304u
+/* elements per block */
+#define SPNDARRAY_PACK_BLOCK 4096
+/* largest dictionary, so that codes take at most 16 bits */
+#define SPNDARRAY_PACK_MAX_DICT (1 << 16)
+
+typedef struct {
+  char magic[8];       /* SPNDARRAY_PACK_MAGIC */
+  uint32_t version;    /* SPNDARRAY_PACK_VERSION */
+  uint32_t byte_order; /* SPNDARRAY_PACK_BYTE_ORDER as written */
+  uint64_t ndim;       /* number of dimensions */
+  uint64_t nz;         /* number of elements */
+  double fill;         /* fill value */
+  uint64_t block;      /* elements per block */
+  uint64_t ndict;      /* dictionary entries, 0 for plain values */
+  uint64_t reserved;
+} spndarray_pack_header;
+
+_Static_assert(sizeof(spndarray_pack_header) == 64,
+               "the pack header must take 64 bytes");
+
+static inline unsigned pack_width(const uint64_t max) {
+  return max ? 64 - __builtin_clzll(max) : 0;
+}
+
+static inline size_t pack_words(const size_t n, const unsigned b) {
+  return (n * b + 63) / 64;
+}
+
+/*
+ * pack_bits()
+ * Packs n values of b bits each into out, which must hold
+ * pack_words(n, b) words
+ */
+static void pack_bits(const uint64_t *in, const size_t n, const unsigned b,
+                      uint64_t *out) {
+  memset(out, 0, pack_words(n, b) * sizeof(uint64_t));
+  if (b == 0)
+    return;
+  for (size_t k = 0, bit = 0; k < n; k++, bit += b) {
+    size_t w = bit / 64, s = bit % 64;
+    out[w] |= in[k] << s;
+    if (s + b > 64)
+      out[w + 1] = in[k] >> (64 - s);
+  }
+}
+
+static void unpack_bits(const uint64_t *in, const size_t n, const unsigned b,
+                        uint64_t *out) {
+  if (b == 0) {
+    memset(out, 0, n * sizeof(uint64_t));
+    return;
+  }
+  if (b == 64) {
+    memcpy(out, in, n * sizeof(uint64_t));
+    return;
+  }
+  const uint64_t mask = ((uint64_t)1 << b) - 1;
+  for (size_t k = 0, bit = 0; k < n; k++, bit += b) {
+    size_t w = bit / 64, s = bit % 64;
+    uint64_t v = in[w] >> s;
+    if (s + b > 64)
+      v |= in[w + 1] << (64 - s);
+    out[k] = v & mask;
+  }
+}
+
+static int pack_column(FILE *fp, const uint64_t *col, const size_t n,
+                       uint64_t *words) {
+  uint64_t max = 0;
+  for (size_t k = 0; k < n; k++)
+    max |= col[k];
+
+  unsigned char b = pack_width(max);
+  size_t len = pack_words(n, b);
+  pack_bits(col, n, b, words);
+  return fwrite(&b, 1, 1, fp) != 1 || fwrite(words, 8, len, fp) != len;
+}
+
+static int unpack_column(FILE *fp, const size_t n, uint64_t *words,
+                         uint64_t *col) {
+  unsigned char b;
+  if (fread(&b, 1, 1, fp) != 1 || b > 64)
+    return 1;
+
+  size_t len = pack_words(n, b);
+  if (fread(words, 8, len, fp) != len)
+    return 1;
+  unpack_bits(words, n, b, col);
+  return 0;
+}
+
+static int compare_double(const void *pa, const void *pb) {
+  double a = *(const double *)pa, b = *(const double *)pb;
+  return (a > b) - (a < b);
+}
+
+/*
+ * pack_dictionary()
+ * Lists the distinct values of the given elements in *dict, sorted
+ *
+ * Return
+ *  number of distinct values, or 0 when there are more than
+ *  SPNDARRAY_PACK_MAX_DICT of them
+ */
+static size_t pack_dictionary(const spndarray *m, const size_t *order,
+                              const size_t nz, double **dict) {
+  double *d = malloc((nz ? nz : 1) * sizeof(double));
+  size_t n = 0;
+
+  if (!d) {
+    fprintf(stderr, "not enough space for the value dictionary");
+    abort();
+  }
+  for (size_t k = 0; k < nz; k++)
+    d[k] = m->data[order[k]];
+  qsort(d, nz, sizeof(double), compare_double);
+  for (size_t k = 0; k < nz && n <= SPNDARRAY_PACK_MAX_DICT; k++)
+    if (n == 0 || d[k] != d[n - 1])
+      d[n++] = d[k];
+
+  if (n > SPNDARRAY_PACK_MAX_DICT) {
+    free(d);
+    return 0;
+  }
+  *dict = d;
+  return n;
+}
+
+static uint64_t dictionary_code(const double *dict, const size_t ndict,
+                                const double x) {
+  size_t lo = 0, hi = ndict;
+  while (hi - lo > 1) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (dict[mid] <= x)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/*
+ * spndarray_pack()
+ *
+ * Writes the array to a stream in the packed format
+ *
+ * Inputs
+ *  fp    - stream to write to, which need not be seekable
+ *  flags - SPNDARRAY_PACK_DICT to store the values as codes into a
+ *          dictionary of the distinct values, which is only done when
+ *          there are at most 65536 of them; 0 to store them as is
+ *
+ * Notes
+ *  the elements are delta encoded and bit packed one block at a time,
+ *  so the encoder only needs room for one block besides the sort order.
+ *  Fill-valued elements are left out. A memory buffer can be written
+ *  with open_memstream()
+ *
+ * Return
+ *  0 on success
+ */
+int spndarray_pack(const spndarray *m, FILE *fp, const size_t flags) {
+  const size_t ndim = m->ndim, B = SPNDARRAY_PACK_BLOCK;
+
+  if (!SPNDARRAY_ISNTUPLE(m)) {
+    fprintf(stderr, "array must be in the ntuple format");
+    return 1;
+  }
+  if (!SPNDARRAY_ISFLOAT64(m)) {
+    fprintf(stderr, "array must hold double values, see spndarray_convert()\n");
+    return 1;
+  }
+
+  size_t *order = malloc((m->nz ? m->nz : 1) * sizeof(size_t));
+  uint64_t *col = malloc(B * sizeof(uint64_t));
+  uint64_t *words = malloc((B + 1) * sizeof(uint64_t));
+  size_t *pre = malloc(B * sizeof(size_t));
+  if (!order || !col || !words || !pre) {
+    fprintf(stderr, "not enough space to pack the array");
+    abort();
+  }
+
+  size_t nz = spndarray_tree_order(m, order), live = 0;
+  for (size_t k = 0; k < nz; k++)
+    if (m->data[order[k]] != m->fill)
+      order[live++] = order[k];
+
+  double *dict = NULL;
+  size_t ndict = 0;
+  if (flags & SPNDARRAY_PACK_DICT)
+    ndict = pack_dictionary(m, order, live, &dict);
+
+  spndarray_pack_header h = {SPNDARRAY_PACK_MAGIC, SPNDARRAY_PACK_VERSION,
+                             SPNDARRAY_PACK_BYTE_ORDER, ndim, live,
+                             m->fill, B, ndict};
+  int err = fwrite(&h, sizeof(h), 1, fp) != 1;
+  err |= fwrite(m->dimsizes, sizeof(size_t), ndim, fp) != ndim;
+  if (ndict)
+    err |= fwrite(dict, sizeof(double), ndict, fp) != ndict;
+
+  for (size_t start = 0; start < live && !err; start += B) {
+    const size_t n = live - start < B ? live - start : B;
+    const size_t *o = &order[start];
+
+    // the first dimension in which each element differs from the one
+    // before it
+    for (size_t k = 1; k < n; k++) {
+      size_t i = 0;
+      while (i < ndim - 1 && m->dims[i][o[k]] == m->dims[i][o[k - 1]])
+        i++;
+      pre[k] = i;
+    }
+
+    for (size_t i = 0; i < ndim && !err; i++) {
+      const size_t *idx = m->dims[i];
+      col[0] = idx[o[0]];
+      for (size_t k = 1; k < n; k++)
+        col[k] = idx[o[k]] - (i <= pre[k] ? idx[o[k - 1]] : 0);
+      err |= pack_column(fp, col, n, words);
+    }
+
+    if (ndict) {
+      for (size_t k = 0; k < n; k++)
+        col[k] = dictionary_code(dict, ndict, m->data[o[k]]);
+      err |= pack_column(fp, col, n, words);
+    } else {
+      for (size_t k = 0; k < n; k++)
+        ((double *)col)[k] = m->data[o[k]];
+      err |= fwrite(col, sizeof(double), n, fp) != n;
+    }
+  }
+
+  if (err)
+    fprintf(stderr, "failed to write the packed array\n");
+  free(order);
+  free(col);
+  free(words);
+  free(pre);
+  free(dict);
+  return err;
+} /* spndarray_pack() */
+
+/*
+ * spndarray_unpack()
+ *
+ * Reads an array written by spndarray_pack() from a stream
+ *
+ * Output
+ *  the array, or NULL on failure
+ *
+ * Notes
+ *  the stream is read one block at a time and every block is decoded
+ *  straight into the index columns; the elements arrive sorted, so
+ *  the tree is then linked up in one linear pass
+ */
+spndarray *spndarray_unpack(FILE *fp) {
+  spndarray_pack_header h;
+
+  if (fread(&h, sizeof(h), 1, fp) != 1 ||
+      memcmp(h.magic, SPNDARRAY_PACK_MAGIC, sizeof(h.magic))) {
+    fprintf(stderr, "not a packed spndarray\n");
+    return NULL;
+  }
+  if (h.byte_order != SPNDARRAY_PACK_BYTE_ORDER ||
+      h.version != SPNDARRAY_PACK_VERSION) {
+    fprintf(stderr, "packed spndarray of unsupported version %u or byte "
+                    "order\n",
+            h.version);
+    return NULL;
+  }
+  if (h.ndim == 0 || h.ndim > 1024 || h.block == 0 ||
+      h.block > (1 << 24) || h.ndict > SPNDARRAY_PACK_MAX_DICT ||
+      h.nz > SIZE_MAX / sizeof(size_t)) {
+    fprintf(stderr, "packed spndarray is corrupt\n");
+    return NULL;
+  }
+
+  const size_t ndim = h.ndim, B = h.block;
+  size_t dimsizes[ndim];
+  double *dict = malloc((h.ndict ? h.ndict : 1) * sizeof(double));
+  uint64_t *col = malloc(B * sizeof(uint64_t));
+  uint64_t *words = malloc((B + 1) * sizeof(uint64_t));
+  size_t *pre = malloc(B * sizeof(size_t));
+  if (!dict || !col || !words || !pre) {
+    fprintf(stderr, "not enough space to unpack the array");
+    abort();
+  }
+
+  int err = fread(dimsizes, sizeof(size_t), ndim, fp) != ndim ||
+            fread(dict, sizeof(double), h.ndict, fp) != h.ndict;
+  for (size_t i = 0; i < ndim && !err; i++)
+    err = dimsizes[i] == 0;
+
+  // the stream may end well before h.nz elements, so the array only
+  // grows as blocks arrive
+  spndarray *m = NULL;
+  if (!err) {
+    const size_t first = h.nz < B ? h.nz : B;
+    m = spndarray_alloc_nzmax(ndim, dimsizes, first ? first : 1,
+                              SPNDARRAY_NTUPLE);
+    if (!m) {
+      free(dict);
+      free(col);
+      free(words);
+      free(pre);
+      return NULL;
+    }
+    spndarray_set_fillvalue(m, h.fill);
+  }
+
+  for (size_t start = 0; start < h.nz && !err; start += B) {
+    const size_t n = h.nz - start < B ? h.nz - start : B;
+    if (spndarray_reserve(m, start + n)) {
+      err = 1;
+      break;
+    }
+
+    // until a column says otherwise, every element matches the one
+    // before it
+    for (size_t k = 1; k < n; k++)
+      pre[k] = ndim;
+
+    for (size_t i = 0; i < ndim && !err; i++) {
+      size_t *idx = &m->dims[i][start];
+      err = unpack_column(fp, n, words, col);
+      if (err)
+        break;
+
+      size_t bad = (idx[0] = col[0]) >= dimsizes[i];
+      for (size_t k = 1; k < n; k++) {
+        if (i <= pre[k]) {
+          idx[k] = idx[k - 1] + col[k];
+          if (col[k])
+            pre[k] = i;
+        } else
+          idx[k] = col[k];
+        bad |= idx[k] >= dimsizes[i];
+      }
+      err = bad != 0;
+    }
+
+    if (!err && h.ndict) {
+      err = unpack_column(fp, n, words, col);
+      for (size_t k = 0; k < n && !err; k++) {
+        err = col[k] >= h.ndict;
+        m->data[start + k] = err ? 0 : dict[col[k]];
+      }
+    } else if (!err)
+      err = fread(&m->data[start], sizeof(double), n, fp) != n;
+    m->nz = start + n;
+  }
+
+  free(dict);
+  free(col);
+  free(words);
+  free(pre);
+  if (err) {
+    fprintf(stderr, "packed spndarray is truncated or corrupt\n");
+    if (m)
+      spndarray_free(m);
+    return NULL;
+  }
+
+  if (spndarray_tree_rebuild(m)) {
+    spndarray_free(m);
+    return NULL;
+  }
+  return m;
+} /* spndarray_unpack() */
@@ -0,0 +1,93 @@
+#include "spndarray.h"
+#include <stdlib.h>
+
+#include "avl.c"
+
+/*
+ * The tree comparators and lookups walk every dimension of the
+ * coordinates they compare. They are generated once per rank up to
+ * SPNDARRAY_RANK_MAX, where the rank is a constant and the loops
+ * unroll, and once more for any rank; spndarray_alloc_with() picks
+ * them through spndarray_rank_ops_for()
+ *
+ * compare_ntuple_*() compares tree nodes, which point to dims[0][n]
+ * of their element since arrays need not have data; compare_element_*()
+ * compares data indices, for sorting
+ */
+
+#define SPND_RANK(S, R)                                                    \
+  static inline int compare_at_##S(const spndarray *m, const size_t a,     \
+                                   const size_t b) {                       \
+    for (size_t i = 0; i < (R); i++)                                       \
+      if (m->dims[i][a] != m->dims[i][b])                                  \
+        return m->dims[i][a] < m->dims[i][b] ? -1 : 1;                     \
+    return 0;                                                              \
+  }                                                                        \
+                                                                           \
+  static int compare_ntuple_##S(const void *pa, const void *pb,            \
+                                void *param) {                             \
+    const spndarray *m = (const spndarray *)param;                         \
+    SPNDARRAY_STATS_ADD(compares, 1);                                      \
+    return compare_at_##S(m, (const size_t *)pa - m->dims[0],              \
+                          (const size_t *)pb - m->dims[0]);                \
+  }                                                                        \
+                                                                           \
+  static int compare_element_##S(const void *pa, const void *pb,           \
+                                 void *param) {                            \
+    return compare_at_##S((const spndarray *)param, *(const size_t *)pa,   \
+                          *(const size_t *)pb);                            \
+  }                                                                        \
+                                                                           \
+  static size_t tree_find_##S(const spndarray *m, const size_t *idxs) {    \
+    const struct avl_table *tree = (struct avl_table *)m->tree_data->tree; \
+    const struct avl_node *p;                                              \
+    size_t depth = 0, n = SPNDARRAY_NOTFOUND;                              \
+                                                                           \
+    for (p = tree->avl_root; p != NULL; depth++) {                         \
+      n = (size_t *)p->avl_data - m->dims[0];                              \
+      int cmp = 0;                                                         \
+      for (size_t i = 0; i < (R) && !cmp; i++) {                           \
+        const size_t pi = m->dims[i][n];                                   \
+        cmp = (idxs[i] > pi) - (idxs[i] < pi);                             \
+      }                                                                    \
+      if (cmp < 0)                                                         \
+        p = p->avl_link[0];                                                \
+      else if (cmp > 0)                                                    \
+        p = p->avl_link[1];                                                \
+      else                                                                 \
+        break;                                                             \
+    }                                                                      \
+    SPNDARRAY_STATS_ADD(finds, 1);                                         \
+    SPNDARRAY_STATS_ADD(find_depth, depth + (p != NULL));                  \
+    SPNDARRAY_STATS_MAX(find_depth_max, depth + (p != NULL));              \
+    (void)depth;                                                           \
+    return p ? n : SPNDARRAY_NOTFOUND;                                     \
+  }
+
+SPND_RANK(any, m->ndim)
+SPND_RANK(1, 1)
+SPND_RANK(2, 2)
+SPND_RANK(3, 3)
+SPND_RANK(4, 4)
+#undef SPND_RANK
+
+#define SPND_RANK_OPS(S, R)                                                \
+  { R, compare_ntuple_##S, compare_element_##S, tree_find_##S }
+
+static const spndarray_rank_ops rank_ops[SPNDARRAY_RANK_MAX + 1] = {
+    SPND_RANK_OPS(any, 0), SPND_RANK_OPS(1, 1), SPND_RANK_OPS(2, 2),
+    SPND_RANK_OPS(3, 3), SPND_RANK_OPS(4, 4)};
+#undef SPND_RANK_OPS
+
+/*
+ * spndarray_rank_ops_for()
+ *
+ * Routines for arrays of the given number of dimensions
+ *
+ * Return
+ *  those built for ndim, or the generic ones (of ndim 0) if ndim is 0
+ *  or above SPNDARRAY_RANK_MAX
+ */
+const spndarray_rank_ops *spndarray_rank_ops_for(const size_t ndim) {
+  return &rank_ops[ndim <= SPNDARRAY_RANK_MAX ? ndim : 0];
+}
@@ -1,6 +1,7 @@
 #include "spndarray.h"
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "avl.c"
 
@@ -12,6 +13,250 @@ double reduce_mean(double acc, double x, int count) {
   return acc + (x / count);
 }
 
+/*
+ * spndarray_reduce() walks the elements grouped by their coordinates
+ * outside of the reduced dimension; each group becomes one element of
+ * the result, folded in increasing order along the reduced dimension
+ * so that every thread count gives bit-identical results
+ */
+typedef struct {
+  const spndarray *m;
+  size_t dim;                   /* reduced dimension */
+  reduction_function reduce_fn;
+  int rdimsize;                 /* size of the reduced dimension */
+  size_t live;                  /* number of nonzero elements */
+  size_t count;                 /* number of groups */
+  size_t *order;                /* data index of the visited elements */
+  size_t *head;                 /* group of each element, then ngroups */
+  size_t *gstart;               /* first element of each group */
+  double *vals;                 /* reduced value of each group */
+  size_t *pos;                  /* slot of each group in the result */
+  spndarray *res;
+} spnd_reduce;
+
+/*
+ * compare_reduce()
+ * Orders data indices by every dimension but the reduced one, then by
+ * the reduced one
+ */
+static int compare_reduce(const void *pa, const void *pb, void *param) {
+  const spnd_reduce *r = (const spnd_reduce *)param;
+  const size_t a = *(const size_t *)pa, b = *(const size_t *)pb;
+
+  for (size_t i = 0; i <= r->m->ndim; i++) {
+    size_t d = i < r->m->ndim ? i : r->dim;
+    if (i == r->dim)
+      continue;
+    if (r->m->dims[d][a] != r->m->dims[d][b])
+      return r->m->dims[d][a] < r->m->dims[d][b] ? -1 : 1;
+  }
+  return 0;
+}
+
+/*
+ * live_flag_*_range(), live_gather_*_range()
+ * List the elements that are not zero, one pair of routines per value
+ * type; every element of a pattern array is, and dictionary arrays
+ * look their codes up in their value table
+ */
+#define SPND_LIVE(V, T, S)                                                 \
+  static void live_flag_##S##_range(void *param, size_t begin,             \
+                                    size_t end) {                          \
+    spnd_reduce *r = (spnd_reduce *)param;                                 \
+    const T *data = (const T *)r->m->values;                               \
+    for (size_t n = begin; n < end; n++)                                   \
+      r->head[n] = data[n] != 0;                                           \
+  }                                                                        \
+                                                                           \
+  static void live_gather_##S##_range(void *param, size_t begin,           \
+                                      size_t end) {                        \
+    spnd_reduce *r = (spnd_reduce *)param;                                 \
+    const T *data = (const T *)r->m->values;                               \
+    for (size_t n = begin; n < end; n++)                                   \
+      if (data[n] != 0)                                                    \
+        r->order[r->head[n]] = n;                                          \
+  }
+SPNDARRAY_FOREACH_VTYPE(SPND_LIVE)
+#undef SPND_LIVE
+
+static void live_flag_pattern_range(void *param, size_t begin, size_t end) {
+  spnd_reduce *r = (spnd_reduce *)param;
+  for (size_t n = begin; n < end; n++)
+    r->head[n] = 1;
+}
+
+static void live_gather_pattern_range(void *param, size_t begin,
+                                      size_t end) {
+  spnd_reduce *r = (spnd_reduce *)param;
+  for (size_t n = begin; n < end; n++)
+    r->order[r->head[n]] = n;
+}
+
+#define SPND_LIVE_DICT(V, T, S)                                            \
+  static void live_flag_##S##_range(void *param, size_t begin,             \
+                                    size_t end) {                          \
+    spnd_reduce *r = (spnd_reduce *)param;                                 \
+    const T *codes = (const T *)r->m->values;                              \
+    const double *values = r->m->dict->values;                             \
+    for (size_t n = begin; n < end; n++)                                   \
+      r->head[n] = values[codes[n]] != 0;                                  \
+  }                                                                        \
+                                                                           \
+  static void live_gather_##S##_range(void *param, size_t begin,           \
+                                      size_t end) {                        \
+    spnd_reduce *r = (spnd_reduce *)param;                                 \
+    const T *codes = (const T *)r->m->values;                              \
+    const double *values = r->m->dict->values;                             \
+    for (size_t n = begin; n < end; n++)                                   \
+      if (values[codes[n]] != 0)                                           \
+        r->order[r->head[n]] = n;                                          \
+  }
+SPNDARRAY_FOREACH_DICT(SPND_LIVE_DICT)
+#undef SPND_LIVE_DICT
+
+static void head_flag_range(void *param, size_t begin, size_t end) {
+  spnd_reduce *r = (spnd_reduce *)param;
+  const spndarray *m = r->m;
+
+  for (size_t p = begin; p < end; p++) {
+    int head = p == 0;
+    for (size_t i = 0; i < m->ndim && !head; i++)
+      head = i != r->dim &&
+             m->dims[i][r->order[p]] != m->dims[i][r->order[p - 1]];
+    r->head[p] = head;
+  }
+}
+
+static void group_start_range(void *param, size_t begin, size_t end) {
+  spnd_reduce *r = (spnd_reduce *)param;
+  for (size_t p = begin; p < end; p++)
+    if (r->head[p + 1] != r->head[p])
+      r->gstart[r->head[p]] = p;
+}
+
+/*
+ * group_fold_*_range()
+ * Fold the elements of each group, one routine per value type
+ */
+#define SPND_FOLD(V, T, S, READ)                                           \
+  static void group_fold_##S##_range(void *param, size_t begin,            \
+                                     size_t end) {                         \
+    spnd_reduce *r = (spnd_reduce *)param;                                 \
+                                                                           \
+    for (size_t g = begin; g < end; g++) {                                 \
+      size_t last = g + 1 < r->count ? r->gstart[g + 1] : r->live;         \
+      double acc = 0;                                                      \
+                                                                           \
+      for (size_t p = r->gstart[g]; p < last; p++)                         \
+        acc = r->reduce_fn(acc, READ(T, r->m, r->order[p]), r->rdimsize);  \
+      r->vals[g] = acc;                                                    \
+      r->pos[g] = acc != 0.0;                                              \
+    }                                                                      \
+  }
+SPNDARRAY_FOREACH_TYPE(SPND_FOLD)
+#undef SPND_FOLD
+
+static void group_scatter_range(void *param, size_t begin, size_t end) {
+  spnd_reduce *r = (spnd_reduce *)param;
+  const spndarray *m = r->m;
+
+  for (size_t g = begin; g < end; g++) {
+    if (r->vals[g] == 0.0)
+      continue;
+    size_t n = r->order[r->gstart[g]], slot = r->pos[g];
+    for (size_t i = 0, j = 0; i < m->ndim; i++)
+      if (i != r->dim)
+        r->res->dims[j++][slot] = m->dims[i][n];
+    r->res->data[slot] = r->vals[g];
+  }
+}
+
+/*
+ * reduce_sparse()
+ * Reduces the nonzero elements of m; only valid when its fill value
+ * is zero, as the fill value takes no part in the reduction then
+ */
+static spndarray *reduce_sparse(spnd_reduce *r, const size_t *dims) {
+  const spndarray *m = r->m;
+  const size_t grain = spndarray_get_grain_size();
+  size_t ngroups;
+
+  r->order = malloc((m->nz ? m->nz : 1) * sizeof(size_t));
+  r->head = malloc((m->nz + 1) * sizeof(size_t));
+  if (!r->order || !r->head) {
+    fprintf(stderr, "not enough space to reduce the array");
+    abort();
+  }
+
+  // list the nonzero elements, grouped by their output coordinates
+  spndarray_task_fn flag = live_flag_pattern_range;
+  spndarray_task_fn gather = live_gather_pattern_range;
+  spndarray_task_fn fold = group_fold_f64_range;
+  switch (m->vtype) {
+#define SPND_FOLD_CASE(V, T, S, READ)                                      \
+  case V:                                                                  \
+    fold = group_fold_##S##_range;                                         \
+    break;
+    SPNDARRAY_FOREACH_TYPE(SPND_FOLD_CASE)
+#undef SPND_FOLD_CASE
+  }
+  switch (m->vtype) {
+#define SPND_LIVE_CASE(V, T, S)                                            \
+  case V:                                                                  \
+    flag = live_flag_##S##_range;                                          \
+    gather = live_gather_##S##_range;                                      \
+    break;
+    SPNDARRAY_FOREACH_VTYPE(SPND_LIVE_CASE)
+    SPNDARRAY_FOREACH_DICT(SPND_LIVE_CASE)
+#undef SPND_LIVE_CASE
+  }
+  spndarray_parallel_for(m->nz, grain, flag, r);
+  const size_t live = spndarray_parallel_scan(r->head, m->nz);
+  spndarray_parallel_for(m->nz, grain, gather, r);
+  if (spndarray_sort_indices(r->order, live, compare_reduce, r)) {
+    free(r->order);
+    free(r->head);
+    return NULL;
+  }
+
+  // number the groups and find where each starts
+  spndarray_parallel_for(live, grain, head_flag_range, r);
+  ngroups = spndarray_parallel_scan(r->head, live);
+  r->head[live] = ngroups;
+  r->live = live;
+  r->count = ngroups;
+  r->gstart = malloc((ngroups ? ngroups : 1) * sizeof(size_t));
+  r->vals = malloc((ngroups ? ngroups : 1) * sizeof(double));
+  r->pos = malloc((ngroups ? ngroups : 1) * sizeof(size_t));
+  if (!r->gstart || !r->vals || !r->pos) {
+    fprintf(stderr, "not enough space to reduce the array");
+    abort();
+  }
+  spndarray_parallel_for(live, grain, group_start_range, r);
+
+  spndarray_parallel_for(ngroups, grain, fold, r);
+  size_t nz = spndarray_parallel_scan(r->pos, ngroups);
+  r->res = spndarray_alloc_with(m->ndim - 1, dims, nz, SPNDARRAY_NTUPLE,
+                                m->allocator);
+  if (r->res) {
+    spndarray_parallel_for(ngroups, grain, group_scatter_range, r);
+    r->res->nz = nz;
+  }
+
+  free(r->order);
+  free(r->head);
+  free(r->gstart);
+  free(r->vals);
+  free(r->pos);
+
+  // the groups come out in coordinate order, so this does not sort
+  if (r->res && spndarray_tree_rebuild(r->res)) {
+    spndarray_free(r->res);
+    return NULL;
+  }
+  return r->res;
+}
+
 /*
  * spndarray_reduce()
  * Reduce a dimension by applying a reduction function over it
@@ -21,7 +266,13 @@ double reduce_mean(double acc, double x, int count) {
  *   reduce_fn - the function with which to reduce
  *
  * Output
- *   the new reduced spndarray.
+ *   the new reduced spndarray, or NULL if the fill value is nonzero and
+ *   the positions of the result do not fit memory.
+ *
+ * Notes
+ *   zeros do not take part in the reduction. With a zero fill value only
+ *   the stored elements are visited, in parallel; otherwise every
+ *   position of the array is.
  */
 spndarray *spndarray_reduce(spndarray *m, const size_t dim,
                             const reduction_function reduce_fn) {
@@ -45,8 +296,30 @@ spndarray *spndarray_reduce(spndarray *m, const size_t dim,
   }
 
   size_t rdimsize = m->dimsizes[dim];
-  spndarray *newm =
-      spndarray_alloc_nzmax(ndim, dims, m->nzmax, SPNDARRAY_NTUPLE);
+  if (m->fill == 0.0) {
+    spnd_reduce r = {m, dim, reduce_fn, (int)rdimsize};
+    SPNDARRAY_OP_BEGIN();
+    spndarray *res = reduce_sparse(&r, dims);
+    SPNDARRAY_OP_END(SPNDARRAY_OP_REDUCE);
+    return res;
+  }
+
+  // every position off the stored elements holds the nonzero fill
+  // value, so every element of the result is set
+  size_t cells = 1;
+  for (size_t i = 0; i < ndim; i++) {
+    if (dims[i] && cells > SIZE_MAX / dims[i]) {
+      fprintf(stderr, "the positions of the reduced array do not fit "
+                      "memory\n");
+      return NULL;
+    }
+    cells *= dims[i];
+  }
+  SPNDARRAY_OP_BEGIN();
+  spndarray *newm = spndarray_alloc_with(ndim, dims, cells, SPNDARRAY_NTUPLE,
+                                         m->allocator);
+  if (!newm)
+    return NULL;
   while (counters[ndim] < lastdimsize) {
     size_t i;
     /*
@@ -67,7 +340,7 @@ spndarray *spndarray_reduce(spndarray *m, const size_t dim,
     *pacc = reduce_fn(*pacc, x, rdimsize);
 
   next:;
-    for (i = 0; counters[i] == m->dimsizes[i]; i++)
+    for (i = 0; i < ndim && counters[i] + 1 == m->dimsizes[i]; i++)
       counters[i] = 0;
     ++counters[i];
     size_t j;
@@ -78,9 +351,32 @@ spndarray *spndarray_reduce(spndarray *m, const size_t dim,
       else
         tidx[j] = counters[i];
   }
+  SPNDARRAY_OP_END(SPNDARRAY_OP_REDUCE);
   return newm;
 }
 
+/*
+ * extract_*()
+ * Set the elements of m at index idx of dim into ex, one routine per
+ * value type
+ */
+#define SPND_EXTRACT(V, T, S, READ)                                        \
+  static void extract_##S(const spndarray *m, const size_t dim,            \
+                          const size_t idx, spndarray *ex) {               \
+    size_t newdims[m->ndim - 1];                                           \
+                                                                           \
+    for (size_t x = 0; x < m->nz; x++) {                                   \
+      if (m->dims[dim][x] != idx)                                          \
+        continue;                                                          \
+      for (size_t i = 0, j = 0; i < m->ndim; i++)                          \
+        if (i != dim)                                                      \
+          newdims[j++] = m->dims[i][x];                                    \
+      spndarray_set(ex, READ(T, m, x), newdims);                           \
+    }                                                                      \
+  }
+SPNDARRAY_FOREACH_TYPE(SPND_EXTRACT)
+#undef SPND_EXTRACT
+
 /*
  * spndarray_reduce_dimension()
  *
@@ -89,23 +385,28 @@ spndarray *spndarray_reduce(spndarray *m, const size_t dim,
  * Inputs
  *  dim - the dimension to reduce
  *  idx - the selected index
+ *
+ * Notes
+ *  the result has the value type of m
  */
 spndarray *spndarray_reduce_dimension(spndarray *m, const size_t dim, const size_t idx) {
-  size_t newdims[m->ndim-1];
+  size_t newdims[m->ndim-1], count = 0;
   for (size_t t = 0; t < m->ndim-1; t++)
     newdims[t] = 1;
-  spndarray *ex = spndarray_alloc_nzmax(m->ndim-1, newdims, m->nz * 0.3, SPNDARRAY_NTUPLE);
-  for (size_t x = 0; x < m->nz; x++) {
-    if (m->dims[dim][x] != idx)
-      continue;
-    double val = m->data[x];
-    for (size_t i = 0, j = 0; i < m->ndim; i++, j++) {
-      if (i != dim) {
-        newdims[j] = m->dims[i][x];
-      } else
-        j--;
-    }
-    spndarray_set(ex, val, newdims);
+  for (size_t x = 0; x < m->nz; x++)
+    count += m->dims[dim][x] == idx;
+  spndarray *ex = spndarray_alloc_with(m->ndim-1, newdims, count,
+                                       SPNDARRAY_NTUPLE | m->vtype,
+                                       m->allocator);
+  if (!ex)
+    return NULL;
+  switch (m->vtype) {
+#define SPND_EXTRACT_CASE(V, T, S, READ)                                   \
+  case V:                                                                  \
+    extract_##S(m, dim, idx, ex);                                          \
+    break;
+    SPNDARRAY_FOREACH_TYPE(SPND_EXTRACT_CASE)
+#undef SPND_EXTRACT_CASE
   }
   return ex;
 }
@@ -0,0 +1,438 @@
+#include "spndarray.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+  const spndarray *m;
+  size_t dim;
+  size_t *hist; /* live elements per slice of dim */
+} spnd_histogram;
+
+static void histogram_range(void *param, size_t begin, size_t end) {
+  spnd_histogram *h = (spnd_histogram *)param;
+  const spndarray *m = h->m;
+
+  for (size_t n = begin; n < end; n++)
+    if (spndarray_value(m, n) != m->fill)
+      __atomic_fetch_add(&h->hist[m->dims[h->dim][n]], 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * spndarray_partition_points()
+ *
+ * Picks k ranges of a dimension holding about the same number of
+ * elements each
+ *
+ * Inputs
+ *  dim    - the dimension to split
+ *  k      - number of ranges
+ *  bounds - array of size k + 1; range p covers the slices
+ *           bounds[p] <= i < bounds[p + 1] of dim
+ *
+ * Notes
+ *  the split points come from a histogram of the elements per slice:
+ *  range p ends at the slice boundary closest to p + 1 k-ths of the
+ *  elements. A slice is never split, so a single slice holding more
+ *  than 1/k of the elements leaves its range heavier than the others,
+ *  and ranges may be empty when there are fewer slices than k
+ *
+ * Return
+ *  0 on success
+ */
+int spndarray_partition_points(const spndarray *m, const size_t dim,
+                               const size_t k, size_t *bounds) {
+  if (dim >= m->ndim || k == 0) {
+    fprintf(stderr, "cannot split dimension %zd of %zd into %zd ranges\n",
+            dim, m->ndim, k);
+    return 1;
+  }
+
+  const size_t nslices = m->dimsizes[dim];
+  spnd_histogram h = {m, dim, calloc(nslices, sizeof(size_t))};
+  if (!h.hist) {
+    fprintf(stderr, "not enough space for the slice histogram");
+    return 1;
+  }
+  spndarray_parallel_for(m->nz, spndarray_get_grain_size(), histogram_range,
+                         &h);
+
+  size_t total = 0;
+  for (size_t s = 0; s < nslices; s++)
+    total += h.hist[s];
+
+  // walk the cumulative histogram once, closing range p at the
+  // boundary nearest to its share of the elements
+  size_t s = 0, below = 0;
+  bounds[0] = 0;
+  for (size_t p = 1; p < k; p++) {
+    const double target = (double)total * p / k;
+    while (s < nslices && below + h.hist[s] <= target)
+      below += h.hist[s++];
+    if (s < nslices && h.hist[s] &&
+        below + h.hist[s] - target < target - below)
+      below += h.hist[s++];
+    bounds[p] = s;
+  }
+  bounds[k] = nslices;
+
+  free(h.hist);
+  return 0;
+} /* spndarray_partition_points() */
+
+/*
+ * spndarray_partition()
+ *
+ * Splits an array along a dimension into k arrays with about the same
+ * number of elements each
+ *
+ * Inputs
+ *  dim - the dimension to split
+ *  k   - number of parts
+ *
+ * Output
+ *  an array of k new arrays, to be freed with free() after freeing
+ *  each part; NULL on failure
+ *
+ * Notes
+ *  the ranges are picked by spndarray_partition_points(). The parts
+ *  keep the coordinates and dimension sizes of m, so part p holds
+ *  exactly the elements of m whose index along dim falls in range p;
+ *  elements holding the fill value are dropped. Every part comes out
+ *  sorted and is indexed in one linear pass
+ */
+spndarray **spndarray_partition(const spndarray *m, const size_t dim,
+                                const size_t k) {
+  if (!SPNDARRAY_ISNTUPLE(m)) {
+    fprintf(stderr, "array must be in the ntuple format");
+    return NULL;
+  }
+  if (!SPNDARRAY_ISFLOAT64(m)) {
+    fprintf(stderr, "array must hold double values, see spndarray_convert()\n");
+    return NULL;
+  }
+
+  size_t bounds[k + 1];
+  if (spndarray_partition_points(m, dim, k, bounds))
+    return NULL;
+
+  spndarray **parts = malloc(k * sizeof(spndarray *));
+  size_t *order = malloc((m->nz ? m->nz : 1) * sizeof(size_t));
+  size_t *part = malloc(m->dimsizes[dim] * sizeof(size_t));
+  size_t *count = calloc(k, sizeof(size_t));
+  if (!parts || !order || !part || !count) {
+    fprintf(stderr, "not enough space to partition the array");
+    abort();
+  }
+
+  for (size_t p = 0; p < k; p++)
+    for (size_t s = bounds[p]; s < bounds[p + 1]; s++)
+      part[s] = p;
+
+  const size_t nz = spndarray_tree_order(m, order);
+  for (size_t e = 0; e < nz; e++)
+    if (m->data[order[e]] != m->fill)
+      count[part[m->dims[dim][order[e]]]]++;
+
+  for (size_t p = 0; p < k; p++) {
+    parts[p] = spndarray_alloc_with(m->ndim, m->dimsizes, count[p],
+                                    SPNDARRAY_NTUPLE, m->allocator);
+    if (!parts[p]) {
+      while (p-- > 0)
+        spndarray_free(parts[p]);
+      free(parts);
+      free(order);
+      free(part);
+      free(count);
+      return NULL;
+    }
+    spndarray_set_fillvalue(parts[p], m->fill);
+  }
+
+  // visiting the elements in order keeps every part sorted
+  for (size_t e = 0; e < nz; e++) {
+    const size_t n = order[e];
+    if (m->data[n] == m->fill)
+      continue;
+    spndarray *a = parts[part[m->dims[dim][n]]];
+    for (size_t i = 0; i < m->ndim; i++)
+      a->dims[i][a->nz] = m->dims[i][n];
+    a->data[a->nz++] = m->data[n];
+  }
+
+  free(order);
+  free(part);
+  free(count);
+
+  for (size_t p = 0; p < k; p++)
+    if (spndarray_tree_rebuild(parts[p])) {
+      for (size_t q = 0; q < k; q++)
+        spndarray_free(parts[q]);
+      free(parts);
+      return NULL;
+    }
+  return parts;
+} /* spndarray_partition() */
+
+typedef struct {
+  const spndarray *a; /* input array */
+  size_t *order;      /* its elements in coordinate order */
+  size_t nz;          /* number of entries in order */
+  size_t next;        /* first element not merged yet */
+  size_t offset;      /* shift of its indices along the merged dimension */
+} spnd_cursor;
+
+/*
+ * cursor_less()
+ * Compares the current elements of two cursors, with their indices
+ * along dim shifted to their place in the result
+ */
+static int cursor_less(const spnd_cursor *x, const spnd_cursor *y,
+                       const size_t dim) {
+  const size_t n = x->order[x->next], o = y->order[y->next];
+
+  for (size_t i = 0; i < x->a->ndim; i++) {
+    size_t a = x->a->dims[i][n] + (i == dim ? x->offset : 0);
+    size_t b = y->a->dims[i][o] + (i == dim ? y->offset : 0);
+    if (a != b)
+      return a < b;
+  }
+  return 0;
+}
+
+static void heap_sift_down(spnd_cursor **heap, const size_t len, size_t k,
+                           const size_t dim) {
+  for (;;) {
+    size_t c = 2 * k + 1;
+    if (c >= len)
+      return;
+    if (c + 1 < len && cursor_less(heap[c + 1], heap[c], dim))
+      c++;
+    if (!cursor_less(heap[c], heap[k], dim))
+      return;
+    spnd_cursor *t = heap[k];
+    heap[k] = heap[c];
+    heap[c] = t;
+    k = c;
+  }
+}
+
+/*
+ * cursor_skip_fill()
+ * Moves a cursor past the elements holding the fill value; returns
+ * whether any element is left
+ */
+static int cursor_skip_fill(spnd_cursor *c) {
+  while (c->next < c->nz && c->a->data[c->order[c->next]] == c->a->fill)
+    c->next++;
+  return c->next < c->nz;
+}
+
+/*
+ * cursor_append()
+ * Appends the current element of a cursor to the result and advances
+ * the cursor
+ */
+static void cursor_append(spndarray *res, spnd_cursor *c, const size_t dim) {
+  const size_t n = c->order[c->next++];
+
+  for (size_t i = 0; i < res->ndim; i++)
+    res->dims[i][res->nz] = c->a->dims[i][n] + (i == dim ? c->offset : 0);
+  res->data[res->nz++] = c->a->data[n];
+}
+
+/*
+ * spndarray_concat()
+ *
+ * Concatenates arrays along an existing dimension
+ *
+ * Inputs
+ *  arrays - the arrays, all with the same number of dimensions and
+ *           fill value
+ *  k      - number of arrays
+ *  dim    - the dimension to concatenate along
+ *
+ * Output
+ *  a new array where arrays[a] starts at the sum of the sizes of
+ *  arrays[0...a-1] along dim; the other dimensions are as large as
+ *  the largest input's. It takes its buffers from the allocator of
+ *  arrays[0]
+ *
+ * Notes
+ *  every input is walked in coordinate order and the inputs are
+ *  combined with a k-way merge, so the result is built sorted and
+ *  indexed in one linear pass: O(total nnz * log k), without any
+ *  search. Along dimension 0 the inputs are simply appended
+ */
+spndarray *spndarray_concat(spndarray *const *arrays, const size_t k,
+                            const size_t dim) {
+  if (k == 0) {
+    fprintf(stderr, "concat requires at least one array\n");
+    return NULL;
+  }
+
+  const size_t ndim = arrays[0]->ndim;
+  size_t dimsizes[ndim], total = 0;
+  memset(dimsizes, 0, sizeof(dimsizes));
+
+  if (dim >= ndim) {
+    fprintf(stderr, "cannot concatenate along dimension %zd of %zd\n", dim,
+            ndim);
+    return NULL;
+  }
+  for (size_t a = 0; a < k; a++) {
+    const spndarray *m = arrays[a];
+    if (!SPNDARRAY_ISNTUPLE(m) || !SPNDARRAY_ISFLOAT64(m) ||
+        m->ndim != ndim || m->fill != arrays[0]->fill) {
+      fprintf(stderr, "concat requires ntuple arrays of doubles with the same "
+                      "number of dimensions and fill value\n");
+      return NULL;
+    }
+    for (size_t i = 0; i < ndim; i++)
+      if (i == dim)
+        dimsizes[i] += m->dimsizes[i];
+      else if (m->dimsizes[i] > dimsizes[i])
+        dimsizes[i] = m->dimsizes[i];
+    total += m->nz;
+  }
+
+  spndarray *res = spndarray_alloc_with(ndim, dimsizes, total,
+                                        SPNDARRAY_NTUPLE,
+                                        arrays[0]->allocator);
+  if (!res)
+    return NULL;
+  spndarray_set_fillvalue(res, arrays[0]->fill);
+
+  spnd_cursor *cursors = calloc(k, sizeof(spnd_cursor));
+  spnd_cursor **heap = malloc(k * sizeof(spnd_cursor *));
+  if (!cursors || !heap) {
+    fprintf(stderr, "not enough space to concatenate the arrays");
+    abort();
+  }
+
+  size_t len = 0;
+  for (size_t a = 0, offset = 0; a < k; a++) {
+    spnd_cursor *c = &cursors[a];
+    c->a = arrays[a];
+    c->offset = offset;
+    offset += arrays[a]->dimsizes[dim];
+    c->order = malloc((c->a->nz ? c->a->nz : 1) * sizeof(size_t));
+    if (!c->order) {
+      fprintf(stderr, "not enough space to concatenate the arrays");
+      abort();
+    }
+    c->nz = spndarray_tree_order(c->a, c->order);
+    if (cursor_skip_fill(c))
+      heap[len++] = c;
+  }
+
+  if (dim == 0) {
+    // the inputs cover consecutive ranges of dimension 0, so they
+    // never interleave
+    for (size_t h = 0; h < len; h++)
+      do
+        cursor_append(res, heap[h], dim);
+      while (cursor_skip_fill(heap[h]));
+  } else {
+    for (size_t h = len / 2; h-- > 0;)
+      heap_sift_down(heap, len, h, dim);
+    while (len) {
+      cursor_append(res, heap[0], dim);
+      if (!cursor_skip_fill(heap[0]))
+        heap[0] = heap[--len];
+      heap_sift_down(heap, len, 0, dim);
+    }
+  }
+
+  for (size_t a = 0; a < k; a++)
+    free(cursors[a].order);
+  free(cursors);
+  free(heap);
+
+  if (spndarray_tree_rebuild(res)) {
+    spndarray_free(res);
+    return NULL;
+  }
+  return res;
+} /* spndarray_concat() */
+
+/*
+ * spndarray_stack()
+ *
+ * Stacks arrays of the same shape along a new leading dimension
+ *
+ * Inputs
+ *  arrays - the arrays, all with the same number of dimensions and
+ *           fill value
+ *  k      - number of arrays
+ *
+ * Output
+ *  a new array of ndim + 1 dimensions, with arrays[a] at index a of
+ *  dimension 0, taking its buffers from the allocator of arrays[0]
+ *
+ * Notes
+ *  the inputs are appended one after the other in coordinate order,
+ *  which is the order of the result, so it is indexed in one linear
+ *  pass
+ */
+spndarray *spndarray_stack(spndarray *const *arrays, const size_t k) {
+  if (k == 0) {
+    fprintf(stderr, "stack requires at least one array\n");
+    return NULL;
+  }
+
+  const size_t ndim = arrays[0]->ndim;
+  size_t dimsizes[ndim + 1], total = 0, maxnz = 1;
+  memset(dimsizes, 0, sizeof(dimsizes));
+  dimsizes[0] = k;
+
+  for (size_t a = 0; a < k; a++) {
+    const spndarray *m = arrays[a];
+    if (!SPNDARRAY_ISNTUPLE(m) || !SPNDARRAY_ISFLOAT64(m) ||
+        m->ndim != ndim || m->fill != arrays[0]->fill) {
+      fprintf(stderr, "stack requires ntuple arrays of doubles with the same "
+                      "number of dimensions and fill value\n");
+      return NULL;
+    }
+    for (size_t i = 0; i < ndim; i++)
+      if (m->dimsizes[i] > dimsizes[i + 1])
+        dimsizes[i + 1] = m->dimsizes[i];
+    total += m->nz;
+    if (m->nz > maxnz)
+      maxnz = m->nz;
+  }
+
+  spndarray *res = spndarray_alloc_with(ndim + 1, dimsizes, total,
+                                        SPNDARRAY_NTUPLE,
+                                        arrays[0]->allocator);
+  if (!res)
+    return NULL;
+  spndarray_set_fillvalue(res, arrays[0]->fill);
+  size_t *order = malloc(maxnz * sizeof(size_t));
+  if (!order) {
+    fprintf(stderr, "not enough space to stack the arrays");
+    abort();
+  }
+
+  for (size_t a = 0; a < k; a++) {
+    const spndarray *m = arrays[a];
+    const size_t nz = spndarray_tree_order(m, order);
+
+    for (size_t e = 0; e < nz; e++) {
+      const size_t n = order[e];
+      if (m->data[n] == m->fill)
+        continue;
+      res->dims[0][res->nz] = a;
+      for (size_t i = 0; i < ndim; i++)
+        res->dims[i + 1][res->nz] = m->dims[i][n];
+      res->data[res->nz++] = m->data[n];
+    }
+  }
+  free(order);
+
+  if (spndarray_tree_rebuild(res)) {
+    spndarray_free(res);
+    return NULL;
+  }
+  return res;
+} /* spndarray_stack() */
@@ -0,0 +1,293 @@
+#include "spndarray.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * one shard: a regular array and the lock guarding it, padded to a
+ * cache line so that threads working on neighbouring shards do not
+ * contend for the same line
+ */
+typedef struct {
+  pthread_mutex_t lock;
+  spndarray *array;
+} __attribute__((aligned(64))) spndarray_shard;
+
+struct spndarray_sharded {
+  size_t ndim;             /* number of dimensions */
+  size_t *dimsizes;        /* dimension sizes at allocation */
+  double fill;             /* fill value of the array */
+  size_t nshards;          /* number of shards */
+  size_t mode;             /* SPNDARRAY_SHARD_HASH or SPNDARRAY_SHARD_RANGE */
+  size_t span;             /* leading indices per shard (range mode) */
+  spndarray_shard *shards; /* the shards */
+};
+
+/*
+ * shard_of()
+ * Picks the shard that owns the given coordinates
+ */
+static inline size_t shard_of(const spndarray_sharded *s, const size_t *idxs) {
+  if (s->mode == SPNDARRAY_SHARD_RANGE) {
+    size_t k = idxs[0] / s->span;
+    return k < s->nshards ? k : s->nshards - 1;
+  }
+  return (size_t)(((unsigned __int128)spndarray_hash_idx(s->ndim, idxs) *
+                   s->nshards) >>
+                  64);
+}
+
+/*
+ * spndarray_sharded_alloc()
+ *
+ * Allocate an array that can be updated by many threads at once
+ *
+ * Inputs
+ *  ndims    - number of dimensions
+ *  dimsizes - list of dimension sizes
+ *  nshards  - number of shards, 0 for four per thread
+ *  flags    - SPNDARRAY_SHARD_HASH to spread the elements by a hash of
+ *             their coordinates, SPNDARRAY_SHARD_RANGE to give each
+ *             shard an equal range of dimension 0
+ *
+ * Notes
+ *  every shard is an independent ntuple array with its own lock, so
+ *  threads only contend when they hit the same shard. The hash mode
+ *  spreads any workload evenly; the range mode keeps each shard
+ *  sorted relative to the others, which makes spndarray_sharded_merge()
+ *  skip the sort
+ */
+spndarray_sharded *spndarray_sharded_alloc(const size_t ndims,
+                                           const size_t *dimsizes,
+                                           const size_t nshards,
+                                           const size_t flags) {
+  spndarray_sharded *s = calloc(1, sizeof(*s));
+  if (!s) {
+    fprintf(stderr, "not enough space for sharded array");
+    abort();
+  }
+
+  s->ndim = ndims;
+  s->mode = flags;
+  s->nshards = nshards ? nshards : 4 * spndarray_get_num_threads();
+  s->dimsizes = malloc(ndims * sizeof(size_t));
+  s->shards = aligned_alloc(64, s->nshards * sizeof(spndarray_shard));
+  if (!s->dimsizes || !s->shards) {
+    fprintf(stderr, "not enough space for sharded array");
+    abort();
+  }
+  memcpy(s->dimsizes, dimsizes, ndims * sizeof(size_t));
+  s->span = (dimsizes[0] + s->nshards - 1) / s->nshards;
+  if (s->span == 0)
+    s->span = 1;
+
+  for (size_t k = 0; k < s->nshards; k++) {
+    pthread_mutex_init(&s->shards[k].lock, NULL);
+    s->shards[k].array =
+        spndarray_alloc_nzmax(ndims, dimsizes, 16, SPNDARRAY_NTUPLE);
+  }
+  return s;
+} /* spndarray_sharded_alloc() */
+
+/*
+ * spndarray_sharded_free()
+ * Frees the given sharded array
+ */
+void spndarray_sharded_free(spndarray_sharded *s) {
+  for (size_t k = 0; k < s->nshards; k++) {
+    pthread_mutex_destroy(&s->shards[k].lock);
+    spndarray_free(s->shards[k].array);
+  }
+  free(s->shards);
+  free(s->dimsizes);
+  free(s);
+}
+
+/*
+ * spndarray_sharded_set_fillvalue()
+ * Sets the fill value of every shard; not safe to call while other
+ * threads use the array
+ */
+void spndarray_sharded_set_fillvalue(spndarray_sharded *s, const double fill) {
+  s->fill = fill;
+  for (size_t k = 0; k < s->nshards; k++)
+    spndarray_set_fillvalue(s->shards[k].array, fill);
+}
+
+size_t spndarray_sharded_ndim(const spndarray_sharded *s) { return s->ndim; }
+
+size_t spndarray_sharded_nshards(const spndarray_sharded *s) {
+  return s->nshards;
+}
+
+/*
+ * spndarray_sharded_shard()
+ * Returns the index of the shard owning the given coordinates, for
+ * callers that want to route work by shard
+ */
+size_t spndarray_sharded_shard(const spndarray_sharded *s,
+                               const size_t *idxs) {
+  return shard_of(s, idxs);
+}
+
+size_t spndarray_sharded_nnz(spndarray_sharded *s) {
+  size_t nz = 0;
+  for (size_t k = 0; k < s->nshards; k++) {
+    pthread_mutex_lock(&s->shards[k].lock);
+    nz += s->shards[k].array->nz;
+    pthread_mutex_unlock(&s->shards[k].lock);
+  }
+  return nz;
+}
+
+double spndarray_sharded_get(spndarray_sharded *s, const size_t *idxs) {
+  spndarray_shard *shard = &s->shards[shard_of(s, idxs)];
+
+  pthread_mutex_lock(&shard->lock);
+  double x = spndarray_get(shard->array, idxs);
+  pthread_mutex_unlock(&shard->lock);
+  return x;
+}
+
+int spndarray_sharded_set(spndarray_sharded *s, const double x,
+                          const size_t *idxs) {
+  spndarray_shard *shard = &s->shards[shard_of(s, idxs)];
+
+  pthread_mutex_lock(&shard->lock);
+  int r = spndarray_set(shard->array, x, idxs);
+  pthread_mutex_unlock(&shard->lock);
+  return r;
+}
+
+int spndarray_sharded_incr(spndarray_sharded *s, const size_t *idxs) {
+  spndarray_shard *shard = &s->shards[shard_of(s, idxs)];
+
+  pthread_mutex_lock(&shard->lock);
+  int r = spndarray_incr(shard->array, idxs);
+  pthread_mutex_unlock(&shard->lock);
+  return r;
+}
+
+/*
+ * spndarray_sharded_incr_batch()
+ *
+ * Increments a batch of elements, taking the lock of every shard
+ * involved only once
+ *
+ * Inputs
+ *  count  - number of coordinates
+ *  idxs   - the coordinates, ndim indices per coordinate, back to back
+ *  deltas - the increment of each coordinate, or NULL to increment
+ *           each of them by one
+ */
+int spndarray_sharded_incr_batch(spndarray_sharded *s, const size_t count,
+                                 const size_t *idxs, const double *deltas) {
+  const size_t ndim = s->ndim;
+  size_t *start = calloc(s->nshards + 1, sizeof(size_t));
+  size_t *bidxs = malloc((count ? count : 1) * ndim * sizeof(size_t));
+  double *bdeltas = malloc((count ? count : 1) * sizeof(double));
+  int r = 0;
+
+  if (!start || !bidxs || !bdeltas) {
+    fprintf(stderr, "not enough space for batch workspace");
+    free(start);
+    free(bidxs);
+    free(bdeltas);
+    return 1;
+  }
+
+  // bucket the batch by shard, keeping the order within each shard
+  for (size_t k = 0; k < count; k++)
+    start[shard_of(s, &idxs[k * ndim]) + 1]++;
+  for (size_t k = 0; k < s->nshards; k++)
+    start[k + 1] += start[k];
+  for (size_t k = 0; k < count; k++) {
+    size_t pos = start[shard_of(s, &idxs[k * ndim])]++;
+    memcpy(&bidxs[pos * ndim], &idxs[k * ndim], ndim * sizeof(size_t));
+    bdeltas[pos] = deltas ? deltas[k] : 1.0;
+  }
+
+  for (size_t k = 0, begin = 0; k < s->nshards; k++) {
+    size_t end = start[k];
+    if (end == begin)
+      continue;
+
+    pthread_mutex_lock(&s->shards[k].lock);
+    r |= spndarray_incr_batch(s->shards[k].array, end - begin,
+                              &bidxs[begin * ndim], &bdeltas[begin]);
+    pthread_mutex_unlock(&s->shards[k].lock);
+    begin = end;
+  }
+
+  free(start);
+  free(bidxs);
+  free(bdeltas);
+  return r;
+}
+
+/*
+ * spndarray_sharded_merge()
+ *
+ * Gathers the shards into a regular ntuple array
+ *
+ * Output
+ *  a new array holding every element of the shards that is not the
+ *  fill value
+ *
+ * Notes
+ *  every shard is locked for the duration of the merge, so the result
+ *  is a consistent snapshot. The shards own disjoint coordinates, so
+ *  their elements are simply appended and indexed with one
+ *  spndarray_tree_rebuild()
+ */
+spndarray *spndarray_sharded_merge(spndarray_sharded *s) {
+  size_t dimsizes[s->ndim], nz = 0, maxnz = 1;
+  spndarray *res;
+
+  for (size_t k = 0; k < s->nshards; k++) {
+    pthread_mutex_lock(&s->shards[k].lock);
+    nz += s->shards[k].array->nz;
+    if (s->shards[k].array->nz > maxnz)
+      maxnz = s->shards[k].array->nz;
+  }
+
+  memcpy(dimsizes, s->dimsizes, sizeof(dimsizes));
+  res = spndarray_alloc_nzmax(s->ndim, dimsizes, nz, SPNDARRAY_NTUPLE);
+  if (res)
+    spndarray_set_fillvalue(res, s->fill);
+  size_t *order = malloc(maxnz * sizeof(size_t));
+  if (!order) {
+    fprintf(stderr, "not enough space to merge the shards");
+    abort();
+  }
+
+  for (size_t k = 0; res && k < s->nshards; k++) {
+    const spndarray *a = s->shards[k].array;
+
+    // in range mode, shard k only holds coordinates below those of
+    // shard k + 1, so visiting every shard in order keeps res sorted
+    spndarray_tree_order(a, order);
+    for (size_t e = 0; e < a->nz; e++) {
+      size_t n = order[e];
+      if (a->data[n] == a->fill)
+        continue;
+      for (size_t i = 0; i < s->ndim; i++) {
+        res->dims[i][res->nz] = a->dims[i][n];
+        if (a->dims[i][n] >= res->dimsizes[i])
+          res->dimsizes[i] = a->dims[i][n] + 1;
+      }
+      res->data[res->nz++] = a->data[n];
+    }
+  }
+
+  for (size_t k = 0; k < s->nshards; k++)
+    pthread_mutex_unlock(&s->shards[k].lock);
+  free(order);
+
+  if (res && spndarray_tree_rebuild(res)) {
+    spndarray_free(res);
+    return NULL;
+  }
+  return res;
+}
@@ -0,0 +1,149 @@
+#define _GNU_SOURCE
+#include "spndarray.h"
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* names of the timed operations in the JSON dump */
+static const char *const op_names[SPNDARRAY_NOPS] = {
+    "add",       "sub",       "mul",        "mul_vec",    "reduce",
+    "memcpy",    "get_batch", "set_batch",  "incr_batch", "tree_rebuild"};
+
+#ifdef SPNDARRAY_STATS
+/*
+ * Every thread counts into its own block, so the hot paths neither
+ * lock nor share cache lines; the blocks are chained here when a
+ * thread first counts, and summed when the counters are read. Blocks
+ * outlive their thread, so nothing counted is lost
+ */
+typedef struct stats_block {
+  spndarray_stats s;
+  struct stats_block *next;
+} stats_block;
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static stats_block *stats_blocks;
+
+__thread spndarray_stats *spndarray_stats_tls
+    __attribute__((tls_model("initial-exec")));
+
+/*
+ * spndarray_stats_thread()
+ * Registers the counters of the calling thread
+ */
+spndarray_stats *spndarray_stats_thread(void) {
+  stats_block *b = aligned_alloc(64, (sizeof(*b) + 63) & ~(size_t)63);
+  if (!b) {
+    fprintf(stderr, "not enough space for statistics");
+    abort();
+  }
+  memset(b, 0, sizeof(*b));
+
+  pthread_mutex_lock(&stats_lock);
+  b->next = stats_blocks;
+  stats_blocks = b;
+  pthread_mutex_unlock(&stats_lock);
+  return spndarray_stats_tls = &b->s;
+}
+
+uint64_t spndarray_stats_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void spndarray_stats_op(const size_t op, const uint64_t start) {
+  const uint64_t ns = spndarray_stats_now() - start;
+  SPNDARRAY_STATS_ADD(op_calls[op], 1);
+  SPNDARRAY_STATS_ADD(op_ns[op], ns);
+}
+#endif
+
+/*
+ * spndarray_get_stats()
+ *
+ * Sums the counters of every thread
+ *
+ * Notes
+ *  the counters are only kept when the library is built with
+ *  SPNDARRAY_STATS defined; otherwise they read as zero. Counts made
+ *  while this runs may or may not be included
+ *
+ * Return
+ *  0 on success, 1 if the counters are compiled out
+ */
+int spndarray_get_stats(spndarray_stats *stats) {
+  memset(stats, 0, sizeof(*stats));
+#ifdef SPNDARRAY_STATS
+  const size_t words = sizeof(*stats) / sizeof(uint64_t);
+  uint64_t *sum = (uint64_t *)stats, max = 0;
+
+  pthread_mutex_lock(&stats_lock);
+  for (stats_block *b = stats_blocks; b; b = b->next) {
+    const uint64_t *w = (const uint64_t *)&b->s;
+    for (size_t i = 0; i < words; i++)
+      sum[i] += __atomic_load_n(&w[i], __ATOMIC_RELAXED);
+    uint64_t depth = __atomic_load_n(&b->s.find_depth_max, __ATOMIC_RELAXED);
+    if (depth > max)
+      max = depth;
+  }
+  stats->find_depth_max = max;
+  pthread_mutex_unlock(&stats_lock);
+  return 0;
+#else
+  return 1;
+#endif
+}
+
+/*
+ * spndarray_reset_stats()
+ * Sets every counter back to zero
+ *
+ * Notes
+ *  counts made by threads running at the time may survive the reset
+ */
+void spndarray_reset_stats(void) {
+#ifdef SPNDARRAY_STATS
+  pthread_mutex_lock(&stats_lock);
+  for (stats_block *b = stats_blocks; b; b = b->next) {
+    uint64_t *w = (uint64_t *)&b->s;
+    for (size_t i = 0; i < sizeof(b->s) / sizeof(uint64_t); i++)
+      __atomic_store_n(&w[i], 0, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&stats_lock);
+#endif
+}
+
+/*
+ * spndarray_fwrite_stats()
+ *
+ * Writes the counters to fp as one JSON object
+ *
+ * Notes
+ *  "enabled" is false, and every counter zero, when the counters are
+ *  compiled out. Times are in nanoseconds and include the operations
+ *  called from within an operation, such as the tree rebuild of add
+ *
+ * Return
+ *  0 on success
+ */
+int spndarray_fwrite_stats(FILE *fp) {
+  spndarray_stats s;
+  const int disabled = spndarray_get_stats(&s);
+
+  fprintf(fp, "{\"enabled\": %s, \"compares\": %" PRIu64 ", "
+              "\"finds\": %" PRIu64 ", \"find_depth_avg\": %.3f, "
+              "\"find_depth_max\": %" PRIu64 ", \"reallocs\": %" PRIu64 ", "
+              "\"realloc_bytes\": %" PRIu64 ", \"rebuilds\": %" PRIu64 ", "
+              "\"ops\": {",
+          disabled ? "false" : "true", s.compares, s.finds,
+          s.finds ? (double)s.find_depth / s.finds : 0.0, s.find_depth_max,
+          s.reallocs, s.realloc_bytes, s.rebuilds);
+  for (size_t op = 0; op < SPNDARRAY_NOPS; op++)
+    fprintf(fp, "%s\"%s\": {\"calls\": %" PRIu64 ", \"ns\": %" PRIu64 "}",
+            op ? ", " : "", op_names[op], s.op_calls[op], s.op_ns[op]);
+  return fprintf(fp, "}}\n") < 0;
+}
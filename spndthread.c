@@ -0,0 +1,545 @@
+#define _GNU_SOURCE
+#include "spndarray.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Library-wide worker pool
+ *
+ * spndarray_parallel_for() cuts its range into tasks and deals them
+ * out over one deque per thread. Every thread pops tasks from the
+ * bottom of its own deque and, once that runs dry, steals from the top
+ * of the others', so uneven tasks balance out. The calling thread
+ * takes part until all of its tasks are done, which also makes nested
+ * calls from inside a task safe.
+ *
+ * The pool is started on first use with spndarray_get_num_threads()
+ * threads (the caller counts as one of them). It is only resized or
+ * stopped while no spndarray_parallel_for() call is in flight; until
+ * then, calls keep running on the pool as it is
+ */
+
+/* number of items per run sorted on its own by spndarray_sort_indices() */
+#define SPNDARRAY_SORT_RUN 16384
+/* number of items per block of spndarray_parallel_scan() */
+#define SPNDARRAY_SCAN_BLOCK 65536
+/* tasks created per thread by spndarray_parallel_for() */
+#define SPNDARRAY_TASKS_PER_THREAD 4
+
+typedef struct {
+  size_t remaining; /* tasks not finished yet */
+} spnd_job;
+
+typedef struct {
+  spndarray_task_fn fn;
+  void *ctx;
+  size_t begin;
+  size_t end;
+  spnd_job *job;
+} spnd_task;
+
+typedef struct {
+  pthread_mutex_t lock;
+  spnd_task *tasks; /* ring buffer of cap tasks */
+  size_t cap;
+  size_t top;    /* oldest task, taken by thieves */
+  size_t bottom; /* one past the newest task, taken by the owner */
+} __attribute__((aligned(64))) spnd_deque;
+
+static struct {
+  pthread_mutex_t lock; /* guards startup, shutdown, jobs and sleeping */
+  pthread_cond_t wake;
+  size_t nthreads;     /* threads in the pool, the caller included */
+  size_t size;         /* threads asked for when the pool was started */
+  spnd_deque *deques;  /* one per thread; deque 0 is shared by callers */
+  pthread_t *threads;  /* workers 1...nthreads-1 */
+  size_t queued;       /* tasks waiting in the deques */
+  size_t jobs;         /* spndarray_parallel_for() calls in flight */
+  int shutdown;
+} pool = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+/*
+ * number of threads used by the parallel kernels; 0 means
+ * "not configured yet", in which case the number of online
+ * processors is used
+ */
+static size_t spnd_num_threads = 0;
+
+/* items below which the kernels stay serial */
+static size_t spnd_grain_size = 16384;
+
+/* deque owned by the current thread; callers outside the pool use 0 */
+static __thread size_t spnd_self = 0;
+
+static void deque_push(spnd_deque *d, const spnd_task *t) {
+  pthread_mutex_lock(&d->lock);
+  if (d->bottom - d->top == d->cap) {
+    size_t cap = d->cap ? 2 * d->cap : 64;
+    spnd_task *tasks = malloc(cap * sizeof(spnd_task));
+    if (!tasks) {
+      fprintf(stderr, "not enough space for the task queue");
+      abort();
+    }
+    for (size_t i = d->top; i < d->bottom; i++)
+      tasks[i - d->top] = d->tasks[i % d->cap];
+    free(d->tasks);
+    d->tasks = tasks;
+    d->bottom -= d->top;
+    d->top = 0;
+    d->cap = cap;
+  }
+  d->tasks[d->bottom++ % d->cap] = *t;
+  pthread_mutex_unlock(&d->lock);
+}
+
+/*
+ * deque_take()
+ * Takes a task from the bottom (own deque) or the top (stealing)
+ */
+static int deque_take(spnd_deque *d, spnd_task *t, const int steal) {
+  int found = 0;
+
+  pthread_mutex_lock(&d->lock);
+  if (d->bottom != d->top) {
+    *t = steal ? d->tasks[d->top++ % d->cap] : d->tasks[--d->bottom % d->cap];
+    found = 1;
+  }
+  pthread_mutex_unlock(&d->lock);
+  return found;
+}
+
+static int find_task(spnd_task *t) {
+  const size_t self = spnd_self;
+  const size_t n = __atomic_load_n(&pool.nthreads, __ATOMIC_RELAXED);
+
+  if (__atomic_load_n(&pool.queued, __ATOMIC_ACQUIRE) == 0)
+    return 0;
+
+  for (size_t i = 0; i < n; i++)
+    if (deque_take(&pool.deques[(self + i) % n], t, i != 0)) {
+      __atomic_fetch_sub(&pool.queued, 1, __ATOMIC_RELAXED);
+      return 1;
+    }
+  return 0;
+}
+
+static void run_task(const spnd_task *t) {
+  t->fn(t->ctx, t->begin, t->end);
+  __atomic_fetch_sub(&t->job->remaining, 1, __ATOMIC_RELEASE);
+}
+
+static void *worker_main(void *param) {
+  spnd_task t;
+
+  spnd_self = (size_t)param;
+  for (;;) {
+    if (find_task(&t)) {
+      run_task(&t);
+      continue;
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    while (!pool.shutdown &&
+           __atomic_load_n(&pool.queued, __ATOMIC_ACQUIRE) == 0)
+      pthread_cond_wait(&pool.wake, &pool.lock);
+    if (pool.shutdown) {
+      pthread_mutex_unlock(&pool.lock);
+      return NULL;
+    }
+    pthread_mutex_unlock(&pool.lock);
+  }
+}
+
+/*
+ * pool_stop()
+ * Joins the workers and frees the pool; must be called with the pool
+ * lock held and no work in flight
+ */
+static void pool_stop() {
+  if (!pool.nthreads)
+    return;
+
+  pool.shutdown = 1;
+  pthread_cond_broadcast(&pool.wake);
+  pthread_mutex_unlock(&pool.lock);
+  for (size_t t = 1; t < pool.nthreads; t++)
+    pthread_join(pool.threads[t], NULL);
+  pthread_mutex_lock(&pool.lock);
+
+  for (size_t t = 0; t < pool.nthreads; t++) {
+    pthread_mutex_destroy(&pool.deques[t].lock);
+    free(pool.deques[t].tasks);
+  }
+  free(pool.deques);
+  free(pool.threads);
+  pool.deques = NULL;
+  pool.threads = NULL;
+  pool.nthreads = 0;
+  pool.size = 0;
+  pool.shutdown = 0;
+  pthread_cond_broadcast(&pool.wake);
+}
+
+/*
+ * pool_wait_stop()
+ * Waits, with the pool lock held, for a pool_stop() running on another
+ * thread, which lets go of the lock while it joins the workers
+ */
+static void pool_wait_stop() {
+  while (pool.shutdown)
+    pthread_cond_wait(&pool.wake, &pool.lock);
+}
+
+/*
+ * pool_enter()
+ *
+ * Registers a job on the pool, first (re)starting the pool with the
+ * configured number of threads if no other job is running
+ *
+ * Notes
+ *  with jobs in flight, possibly the caller's own when nested, the
+ *  pool keeps its size; waiting for them instead could wait forever
+ *
+ *  when the system refuses to start a thread, the pool keeps the ones
+ *  that did start, down to the caller alone
+ */
+static void pool_enter() {
+  const size_t n = spndarray_get_num_threads();
+
+  pthread_mutex_lock(&pool.lock);
+  pool_wait_stop();
+  if (pool.size == n || pool.jobs) {
+    pool.jobs++;
+    pthread_mutex_unlock(&pool.lock);
+    return;
+  }
+  pool_stop();
+
+  pool.deques = aligned_alloc(64, n * sizeof(spnd_deque));
+  pool.threads = calloc(n, sizeof(pthread_t));
+  if (!pool.deques || !pool.threads) {
+    fprintf(stderr, "not enough space for the thread pool");
+    abort();
+  }
+  memset(pool.deques, 0, n * sizeof(spnd_deque));
+  for (size_t t = 0; t < n; t++)
+    pthread_mutex_init(&pool.deques[t].lock, NULL);
+
+  // the workers read nthreads, so it is set before any of them starts
+  pool.nthreads = n;
+  pool.size = n;
+  for (size_t t = 1; t < n; t++)
+    if (pthread_create(&pool.threads[t], NULL, worker_main, (void *)t)) {
+      fprintf(stderr, "could only start %zd of %zd threads\n", t, n);
+      for (size_t u = t; u < n; u++)
+        pthread_mutex_destroy(&pool.deques[u].lock);
+      // the workers that did start are idle, as nothing is queued yet
+      __atomic_store_n(&pool.nthreads, t, __ATOMIC_RELAXED);
+      break;
+    }
+  pool.jobs++;
+  pthread_mutex_unlock(&pool.lock);
+}
+
+/*
+ * pool_leave()
+ * Ends a job started with pool_enter(); the last one out stops the
+ * pool if the kernels were set to run serially in the meantime
+ */
+static void pool_leave() {
+  pthread_mutex_lock(&pool.lock);
+  if (!--pool.jobs && spndarray_get_num_threads() == 1) {
+    pool_wait_stop();
+    if (!pool.jobs)
+      pool_stop();
+  }
+  pthread_mutex_unlock(&pool.lock);
+}
+
+/*
+ * spndarray_set_num_threads()
+ * Sets the number of threads used by the parallel kernels
+ *
+ * Inputs
+ *  n - number of threads, 0 to use the number of online processors
+ *
+ * Notes
+ *  safe to call while kernels are running, from any thread: the pool
+ *  is restarted with the new size on the first use after every
+ *  running kernel is done, and stopped then if n is 1
+ */
+void spndarray_set_num_threads(const size_t n) {
+  __atomic_store_n(&spnd_num_threads, n, __ATOMIC_RELAXED);
+  if (spndarray_get_num_threads() == 1) {
+    pthread_mutex_lock(&pool.lock);
+    pool_wait_stop();
+    if (!pool.jobs)
+      pool_stop();
+    pthread_mutex_unlock(&pool.lock);
+  }
+}
+
+/*
+ * spndarray_get_num_threads()
+ * Returns the number of threads used by the parallel kernels
+ */
+size_t spndarray_get_num_threads(void) {
+  const size_t n_set = __atomic_load_n(&spnd_num_threads, __ATOMIC_RELAXED);
+  if (n_set)
+    return n_set;
+
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? (size_t)n : 1;
+}
+
+/*
+ * spndarray_set_grain_size()
+ * Sets the number of elements below which the array kernels run
+ * serially; results do not depend on it, only speed does
+ */
+void spndarray_set_grain_size(const size_t grain) {
+  spnd_grain_size = grain ? grain : 1;
+}
+
+size_t spndarray_get_grain_size(void) { return spnd_grain_size; }
+
+/*
+ * spndarray_parallel_for()
+ *
+ * Runs fn over [0, count) split into contiguous ranges on the pool
+ *
+ * Inputs
+ *  count - number of items
+ *  grain - minimum number of items per range; inputs of at most
+ *          this many items are run serially on the calling thread
+ *  fn    - function to call with each range
+ *  ctx   - opaque argument passed to fn
+ *
+ * Notes
+ *  the ranges are run in no particular order and on any thread; the
+ *  call returns only once every range is finished
+ */
+void spndarray_parallel_for(const size_t count, const size_t grain,
+                            const spndarray_task_fn fn, void *ctx) {
+  size_t nthreads = spndarray_get_num_threads();
+  size_t g = grain ? grain : 1;
+
+  if (count == 0)
+    return;
+  if (nthreads <= 1 || count <= g) {
+    fn(ctx, 0, count);
+    return;
+  }
+
+  pool_enter();
+  nthreads = pool.nthreads;
+  if (nthreads <= 1) {
+    // no worker could be started
+    fn(ctx, 0, count);
+    pool_leave();
+    return;
+  }
+
+  size_t ntasks = (count + g - 1) / g;
+  if (ntasks > nthreads * SPNDARRAY_TASKS_PER_THREAD)
+    ntasks = nthreads * SPNDARRAY_TASKS_PER_THREAD;
+  const size_t step = count / ntasks, rem = count % ntasks;
+
+  // count the tasks before they become visible, so that the counter
+  // never drops below the number of tasks actually queued
+  __atomic_fetch_add(&pool.queued, ntasks - 1, __ATOMIC_RELEASE);
+
+  spnd_job job = {ntasks};
+  spnd_task first = {fn, ctx, 0, step + (rem > 0), &job};
+  for (size_t t = 1, begin = first.end; t < ntasks; t++) {
+    size_t len = step + (t < rem);
+    spnd_task task = {fn, ctx, begin, begin + len, &job};
+    deque_push(&pool.deques[(spnd_self + t) % nthreads], &task);
+    begin += len;
+  }
+
+  pthread_mutex_lock(&pool.lock);
+  pthread_cond_broadcast(&pool.wake);
+  pthread_mutex_unlock(&pool.lock);
+
+  run_task(&first);
+
+  // help out until the last range is done
+  spnd_task t;
+  while (__atomic_load_n(&job.remaining, __ATOMIC_ACQUIRE)) {
+    if (find_task(&t))
+      run_task(&t);
+    else
+      sched_yield();
+  }
+  pool_leave();
+}
+
+typedef struct {
+  size_t *a;
+  size_t *tmp;
+  size_t count;
+  size_t width; /* length of the sorted runs being merged */
+  spndarray_compare_fn cmp;
+  void *param;
+} spnd_sort;
+
+static void sort_runs_range(void *param, size_t begin, size_t end) {
+  spnd_sort *s = (spnd_sort *)param;
+  for (size_t r = begin; r < end; r++) {
+    size_t lo = r * SPNDARRAY_SORT_RUN;
+    size_t len = s->count - lo < SPNDARRAY_SORT_RUN ? s->count - lo
+                                                    : SPNDARRAY_SORT_RUN;
+    qsort_r(&s->a[lo], len, sizeof(size_t), s->cmp, s->param);
+  }
+}
+
+static void merge_runs_range(void *param, size_t begin, size_t end) {
+  spnd_sort *s = (spnd_sort *)param;
+  for (size_t p = begin; p < end; p++) {
+    size_t lo = 2 * p * s->width;
+    size_t mid = lo + s->width < s->count ? lo + s->width : s->count;
+    size_t hi = mid + s->width < s->count ? mid + s->width : s->count;
+    size_t i = lo, j = mid, k = lo;
+
+    while (i < mid && j < hi)
+      s->tmp[k++] =
+          s->cmp(&s->a[j], &s->a[i], s->param) < 0 ? s->a[j++] : s->a[i++];
+    while (i < mid)
+      s->tmp[k++] = s->a[i++];
+    while (j < hi)
+      s->tmp[k++] = s->a[j++];
+  }
+}
+
+/*
+ * spndarray_sort_indices()
+ *
+ * Sorts an array of indices on the pool
+ *
+ * Inputs
+ *  a     - the indices
+ *  count - number of indices
+ *  cmp   - qsort_r() style comparison function
+ *  param - passed through to cmp
+ *
+ * Notes
+ *  runs of fixed size are sorted in parallel and then merged pairwise;
+ *  since the runs do not depend on the number of threads, neither does
+ *  the order of elements that compare equal
+ *
+ * Return
+ *  0 on success
+ */
+int spndarray_sort_indices(size_t *a, const size_t count,
+                           const spndarray_compare_fn cmp, void *param) {
+  spnd_sort s = {a, NULL, count, SPNDARRAY_SORT_RUN, cmp, param};
+  size_t nruns = (count + SPNDARRAY_SORT_RUN - 1) / SPNDARRAY_SORT_RUN;
+
+  if (nruns <= 1) {
+    qsort_r(a, count, sizeof(size_t), cmp, param);
+    return 0;
+  }
+
+  s.tmp = malloc(count * sizeof(size_t));
+  if (!s.tmp) {
+    fprintf(stderr, "not enough space to sort");
+    return 1;
+  }
+
+  spndarray_parallel_for(nruns, 1, sort_runs_range, &s);
+  for (; s.width < count; s.width *= 2) {
+    size_t npairs = (count + 2 * s.width - 1) / (2 * s.width);
+    spndarray_parallel_for(npairs, 1, merge_runs_range, &s);
+    size_t *t = s.a;
+    s.a = s.tmp;
+    s.tmp = t;
+  }
+
+  if (s.a != a) {
+    memcpy(a, s.a, count * sizeof(size_t));
+    s.tmp = s.a;
+  }
+  free(s.tmp);
+  return 0;
+}
+
+typedef struct {
+  size_t *a;
+  size_t count;
+  size_t *sums; /* total of each block, then its offset */
+} spnd_scan;
+
+static void scan_sum_range(void *param, size_t begin, size_t end) {
+  spnd_scan *s = (spnd_scan *)param;
+  for (size_t b = begin; b < end; b++) {
+    size_t lo = b * SPNDARRAY_SCAN_BLOCK, sum = 0;
+    size_t hi = lo + SPNDARRAY_SCAN_BLOCK < s->count ? lo + SPNDARRAY_SCAN_BLOCK
+                                                     : s->count;
+    for (size_t i = lo; i < hi; i++)
+      sum += s->a[i];
+    s->sums[b] = sum;
+  }
+}
+
+static void scan_fill_range(void *param, size_t begin, size_t end) {
+  spnd_scan *s = (spnd_scan *)param;
+  for (size_t b = begin; b < end; b++) {
+    size_t lo = b * SPNDARRAY_SCAN_BLOCK, sum = s->sums[b];
+    size_t hi = lo + SPNDARRAY_SCAN_BLOCK < s->count ? lo + SPNDARRAY_SCAN_BLOCK
+                                                     : s->count;
+    for (size_t i = lo; i < hi; i++) {
+      size_t x = s->a[i];
+      s->a[i] = sum;
+      sum += x;
+    }
+  }
+}
+
+/*
+ * spndarray_parallel_scan()
+ *
+ * Replaces every item of a with the sum of the items before it (an
+ * exclusive prefix sum), on the pool
+ *
+ * Notes
+ *  kernels use it to find where each of their outputs goes: set a[i]
+ *  to the number of outputs of input i, scan, and write them from
+ *  a[i] on in parallel
+ *
+ * Return
+ *  the sum of all items
+ */
+size_t spndarray_parallel_scan(size_t *a, const size_t count) {
+  const size_t nblocks =
+      (count + SPNDARRAY_SCAN_BLOCK - 1) / SPNDARRAY_SCAN_BLOCK;
+  spnd_scan s = {a, count, NULL};
+  size_t total = 0;
+
+  if (nblocks <= 1) {
+    for (size_t i = 0; i < count; i++) {
+      size_t x = a[i];
+      a[i] = total;
+      total += x;
+    }
+    return total;
+  }
+
+  s.sums = malloc(nblocks * sizeof(size_t));
+  if (!s.sums) {
+    fprintf(stderr, "not enough space for the prefix sums");
+    abort();
+  }
+  spndarray_parallel_for(nblocks, 1, scan_sum_range, &s);
+  for (size_t b = 0; b < nblocks; b++) {
+    size_t x = s.sums[b];
+    s.sums[b] = total;
+    total += x;
+  }
+  spndarray_parallel_for(nblocks, 1, scan_fill_range, &s);
+  free(s.sums);
+  return total;
+}
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "spndarray.h"
 
@@ -58,6 +59,17 @@ static void test_reduce() {
                spndarray_get(mm, (size_t[]){j, k}));
   spndarray_free(m);
   spndarray_free(mm);
+
+  // with a nonzero fill, a result of more positions than fit memory is
+  // refused
+  m = spndarray_alloc_nzmax(3, (size_t[]){(size_t)1 << 33, (size_t)1 << 33, 2},
+                            1, SPNDARRAY_NTUPLE);
+  spndarray_set_fillvalue(m, 1.0);
+  mm = spndarray_reduce(m, 2, fmean);
+  printf("huge reduction: %s\n", mm ? "accepted" : "rejected");
+  spndarray_free(m);
+  if (mm)
+    spndarray_free(mm);
   printf("\n>> %s Finished <<\n\n", __FUNCTION__);
 }
 
@@ -107,9 +119,1390 @@ static void test_op() {
   printf("\n>> %s Finished <<\n\n", __FUNCTION__);
 }
 
+static void test_batch() {
+  printf(">> Running %s <<\n\n", __FUNCTION__);
+  const size_t count = 20000;
+  spndarray_set_num_threads(4);
+  spndarray *m =
+      spndarray_alloc_nzmax(3, (size_t[]){20, 50, 50}, 10, SPNDARRAY_NTUPLE),
+            *n =
+      spndarray_alloc_nzmax(3, (size_t[]){20, 50, 50}, 10, SPNDARRAY_NTUPLE);
+  size_t *idxs = malloc(3 * count * sizeof(size_t));
+  double *vals = malloc(count * sizeof(double));
+  double *got = malloc(count * sizeof(double));
+  for (size_t i = 0; i < count; i++) {
+    idxs[3 * i] = (i * 7) % 20;
+    idxs[3 * i + 1] = (i * 13) % 50;
+    idxs[3 * i + 2] = (i * i) % 50;
+    vals[i] = (double)(i % 17);
+  }
+  spndarray_set_batch(m, count, vals, idxs);
+  for (size_t i = 0; i < count; i++)
+    spndarray_set(n, vals[i], &idxs[3 * i]);
+  printf("batch set has %zd nonzero elements\n", m->nz);
+
+  spndarray_incr_batch(m, count / 2, idxs, NULL);
+  for (size_t i = 0; i < count / 2; i++)
+    spndarray_incr(n, &idxs[3 * i]);
+
+  // probe every set coordinate and as many absent ones
+  for (size_t i = 0; i < count; i++)
+    idxs[3 * i + 2] = (i % 2) ? (i * i) % 50 : 49 - (i * i) % 50;
+  spndarray_get_batch(m, count, idxs, got);
+  size_t mismatches = 0;
+  for (size_t i = 0; i < count; i++)
+    mismatches += got[i] != spndarray_get(n, &idxs[3 * i]);
+  printf("batch get of %zd coordinates, %zd mismatches\n", count, mismatches);
+  spndarray_get_interleaved(m, count, idxs, got);
+  mismatches = 0;
+  for (size_t i = 0; i < count; i++)
+    mismatches += got[i] != spndarray_get(n, &idxs[3 * i]);
+  printf("interleaved get of %zd coordinates, %zd mismatches\n", count,
+         mismatches);
+  for (size_t i = 0; i < 5; i++)
+    printf("idx %zd,%zd,%zd value got: %f, expected: %f\n", idxs[3 * i],
+           idxs[3 * i + 1], idxs[3 * i + 2], got[i],
+           spndarray_get(n, &idxs[3 * i]));
+  free(idxs);
+  free(vals);
+  free(got);
+  spndarray_free(m);
+  spndarray_free(n);
+  spndarray_set_num_threads(0);
+  printf("\n>> %s Finished <<\n\n", __FUNCTION__);
+}
+
+static void test_freeze() {
+  printf(">> Running %s <<\n\n", __FUNCTION__);
+  const double val[] = {4.454, 324, -1231231};
+  spndarray *m =
+      spndarray_alloc_nzmax(3, (size_t[]){2, 10, 10}, 10, SPNDARRAY_NTUPLE);
+  spndarray_set_fillvalue(m, -1);
+  for (int i = 0; i < 2; i++)
+    for (int j = 0; j < 10; j++)
+      for (int k = 0; k < 10; k++)
+        if (!j || (j && (i + k) % j == 0))
+          spndarray_set(m, val[(i + j + k) % 3], (size_t[]){i, j, k});
+  spndarray_set(m, -1, (size_t[]){0, 0, 0});
+  spndarray_frozen *f = spndarray_freeze(m);
+  printf("frozen copy of %zd elements has %zd elements\n", m->nz,
+         spndarray_frozen_nnz(f));
+  size_t mismatches = 0;
+  for (int i = 0; i < 3; i++)
+    for (int j = 0; j < 11; j++)
+      for (int k = 0; k < 11; k++)
+        mismatches += spndarray_get(m, (size_t[]){i, j, k}) !=
+                      spndarray_frozen_get(f, (size_t[]){i, j, k});
+  printf("%zd mismatches against the array\n", mismatches);
+  for (int k = 0; k < 4; k++)
+    printf("idx 1,1,%d value got: %f, frozen: %f\n", k,
+           spndarray_get(m, (size_t[]){1, 1, k}),
+           spndarray_frozen_get(f, (size_t[]){1, 1, k}));
+  spndarray_frozen_free(f);
+  spndarray_free(m);
+  printf("\n>> %s Finished <<\n\n", __FUNCTION__);
+}
+
+static void test_filter() {
+  printf(">> Running %s <<\n\n", __FUNCTION__);
+  spndarray *m = spndarray_alloc_nzmax(3, (size_t[]){1000, 1000, 1000}, 10,
+                                       SPNDARRAY_NTUPLE);
+  spndarray_filter_enable(m, 0.01, 0);
+  for (size_t i = 0; i < 1000; i++)
+    spndarray_set(m, (double)i + 1, (size_t[]){i, (i * 7) % 1000, 3});
+  size_t mismatches = 0;
+  for (size_t i = 0; i < 1000; i++)
+    mismatches += spndarray_get(m, (size_t[]){i, (i * 7) % 1000, 3}) != i + 1;
+  for (size_t i = 0; i < 100000; i++)
+    mismatches += spndarray_get(m, (size_t[]){i % 1000, i / 1000, 4}) != 0;
+  spndarray_filter_stats stats;
+  spndarray_filter_get_stats(m, &stats);
+  printf("%zd mismatches, filter of %zd bytes for %zd elements\n", mismatches,
+         stats.bytes, stats.capacity);
+  printf("%zd lookups, %zd answered by the filter, %zd false positives\n",
+         stats.lookups, stats.negatives, stats.false_positives);
+  spndarray_free(m);
+  printf("\n>> %s Finished <<\n\n", __FUNCTION__);
+}
+
+static void sharded_incr_range(void *ctx, size_t begin, size_t end) {
+  spndarray_sharded *s = ctx;
+  for (size_t i = begin; i < end; i++)
+    spndarray_sharded_incr(s, (size_t[]){i % 7, (i * i) % 13, i % 5});
+}
+
+static void accum_incr_range(void *ctx, size_t begin, size_t end) {
+  spndarray_accum *a = spndarray_accum_alloc(ctx, 64);
+  spndarray_accum_stats stats;
+  for (size_t i = begin; i < end; i++)
+    spndarray_accum_incr(a, (size_t[]){i % 7, (i * i) % 13, i % 5});
+  spndarray_accum_flush(a);
+  spndarray_accum_get_stats(a, &stats);
+  if (begin == 0)
+    printf("thread 0: %zd increments, %zd flushes, %zd locks avoided, "
+           "%zd updates avoided\n",
+           stats.incrs, stats.flushes, stats.locks_avoided,
+           stats.updates_avoided);
+  spndarray_accum_free(a);
+}
+
+static void test_sharded() {
+  printf(">> Running %s <<\n\n", __FUNCTION__);
+  const size_t count = 100000;
+  spndarray_set_num_threads(4);
+  for (size_t mode = SPNDARRAY_SHARD_HASH; mode <= SPNDARRAY_SHARD_RANGE;
+       mode++) {
+    spndarray_sharded *s =
+        spndarray_sharded_alloc(3, (size_t[]){7, 13, 5}, 0, mode);
+    spndarray *n =
+        spndarray_alloc_nzmax(3, (size_t[]){7, 13, 5}, 10, SPNDARRAY_NTUPLE);
+    spndarray_parallel_for(count, 1000, sharded_incr_range, s);
+    for (size_t i = 0; i < count; i++)
+      spndarray_incr(n, (size_t[]){i % 7, (i * i) % 13, i % 5});
+
+    spndarray *m = spndarray_sharded_merge(s);
+    size_t mismatches = 0;
+    for (size_t i = 0; i < 7; i++)
+      for (size_t j = 0; j < 13; j++)
+        for (size_t k = 0; k < 5; k++)
+          mismatches += spndarray_get(m, (size_t[]){i, j, k}) !=
+                        spndarray_get(n, (size_t[]){i, j, k});
+    printf("%s sharding: merged %zd elements, %zd mismatches\n",
+           mode == SPNDARRAY_SHARD_HASH ? "hash" : "range", m->nz,
+           mismatches);
+    spndarray_free(m);
+
+    // the same counts through thread-local buffers
+    spndarray_sharded_free(s);
+    s = spndarray_sharded_alloc(3, (size_t[]){7, 13, 5}, 0, mode);
+    spndarray_parallel_for(count, 1000, accum_incr_range, s);
+    m = spndarray_sharded_merge(s);
+    mismatches = 0;
+    for (size_t i = 0; i < 7; i++)
+      for (size_t j = 0; j < 13; j++)
+        for (size_t k = 0; k < 5; k++)
+          mismatches += spndarray_get(m, (size_t[]){i, j, k}) !=
+                        spndarray_get(n, (size_t[]){i, j, k});
+    printf("buffered increments: merged %zd elements, %zd mismatches\n",
+           m->nz, mismatches);
+    spndarray_free(m);
+    spndarray_free(n);
+    spndarray_sharded_free(s);
+  }
+  spndarray_set_num_threads(0);
+
+  // a key displaced from its home slot right before a flush must be
+  // found again once the buffer is empty: fill the 8 entries of a
+  // 16-slot buffer, one of them on the home slot of the next key
+  spndarray_sharded *s =
+      spndarray_sharded_alloc(1, (size_t[]){1000}, 0, SPNDARRAY_SHARD_HASH);
+  spndarray_accum *a = spndarray_accum_alloc(s, 8);
+  const size_t key = 999, home = spndarray_hash_idx(1, &key) & 15;
+  size_t buffered = 0, mismatches = 0;
+  for (size_t i = 0; buffered < 7; i++)
+    if ((spndarray_hash_idx(1, &i) & 15) != home) {
+      spndarray_accum_incr(a, &i);
+      buffered++;
+    }
+  for (size_t i = 0;; i++)
+    if (i != key && (spndarray_hash_idx(1, &i) & 15) == home) {
+      spndarray_accum_incr(a, &i);
+      break;
+    }
+  spndarray_accum_incr(a, &key);
+  spndarray_accum_incr(a, &key);
+  spndarray_accum_stats stats;
+  spndarray_accum_get_stats(a, &stats);
+  mismatches += stats.buffered != 1;
+  spndarray_accum_free(a);
+  spndarray *m = spndarray_sharded_merge(s);
+  mismatches += spndarray_get(m, &key) != 2;
+  printf("flush with a displaced key: %zd buffered, %zd mismatches\n",
+         stats.buffered, mismatches);
+  spndarray_free(m);
+  spndarray_sharded_free(s);
+  printf("\n>> %s Finished <<\n\n", __FUNCTION__);
+}
+
+static double square(double x) { return x * x; }
+
+/*
+ * run_kernels()
+ * Applies every parallel kernel to m and n, in a fixed order
+ */
+static void run_kernels(const spndarray *m, const spndarray *n,
+                        const spndarray *v, spndarray **out) {
+  out[0] = spndarray_add(m, n);
+  out[1] = spndarray_sub(m, n);
+  out[2] = spndarray_mul(m, n, -1);
+  out[3] = spndarray_mul_vec(m, v, 1);
+  out[4] = spndarray_reduce((spndarray *)m, 1, reduce_mean);
+  out[5] = spndarray_memcpy(m, NULL);
+  spndarray_fmap(out[5], square);
+}
+
+static size_t count_differences(const spndarray *a, const spndarray *b) {
+  size_t *oa = malloc((a->nz + 1) * sizeof(size_t));
+  size_t *ob = malloc((b->nz + 1) * sizeof(size_t));
+  size_t diff = a->nz != b->nz;
+
+  spndarray_tree_order(a, oa);
+  spndarray_tree_order(b, ob);
+  for (size_t k = 0; !diff && k < a->nz; k++) {
+    diff += a->data[oa[k]] != b->data[ob[k]];
+    for (size_t i = 0; i < a->ndim; i++)
+      diff += a->dims[i][oa[k]] != b->dims[i][ob[k]];
+  }
+  free(oa);
+  free(ob);
+  return diff;
+}
+
+static void count_range(void *param, size_t begin, size_t end) {
+  __atomic_fetch_add((size_t *)param, end - begin, __ATOMIC_RELAXED);
+}
+
+/*
+ * resize_count_range()
+ * Counts 64 items per item of the range through a nested
+ * parallel_for, resizing the pool on the way
+ */
+static void resize_count_range(void *param, size_t begin, size_t end) {
+  for (size_t i = begin; i < end; i++) {
+    spndarray_set_num_threads(1 + i % 4);
+    spndarray_parallel_for(64, 4, count_range, param);
+  }
+}
+
+static void test_parallel() {
+  printf(">> Running %s <<\n\n", __FUNCTION__);
+  const char *names[] = {"add", "sub", "mul", "mul_vec", "reduce", "memcpy"};
+  const size_t dimsizes[] = {60, 70, 80};
+  spndarray *m = spndarray_alloc_nzmax(3, dimsizes, 16, SPNDARRAY_NTUPLE);
+  spndarray *n = spndarray_alloc_nzmax(3, dimsizes, 16, SPNDARRAY_NTUPLE);
+  spndarray *v = spndarray_alloc_nzmax(1, (size_t[]){70}, 16, SPNDARRAY_NTUPLE);
+  spndarray *serial[6], *parallel[6];
+  uint64_t x = 42;
+
+  spndarray_set_fillvalue(n, 0.5);
+  for (size_t k = 0; k < 40000; k++) {
+    x ^= x << 13, x ^= x >> 7, x ^= x << 17;
+    size_t idx[] = {x % 60, (x >> 16) % 70, (x >> 32) % 80};
+    spndarray_set(k % 2 ? m : n, (double)(x % 1000) / 7.0, idx);
+  }
+  for (size_t k = 0; k < 70; k += 2)
+    spndarray_set(v, k + 0.25, &k);
+
+  spndarray_set_num_threads(1);
+  run_kernels(m, n, v, serial);
+  spndarray_set_num_threads(4);
+  spndarray_set_grain_size(100);
+  run_kernels(m, n, v, parallel);
+  spndarray_set_grain_size(16384);
+  spndarray_set_num_threads(0);
+
+  for (size_t k = 0; k < 6; k++) {
+    printf("%s: %zd elements, %zd differences between 1 and 4 threads\n",
+           names[k], serial[k]->nz, count_differences(serial[k], parallel[k]));
+    spndarray_free(serial[k]);
+    spndarray_free(parallel[k]);
+  }
+  spndarray_free(m);
+  spndarray_free(n);
+  spndarray_free(v);
+
+  // the pool is resized while jobs run on it
+  size_t counted = 0;
+  spndarray_set_num_threads(4);
+  spndarray_parallel_for(400, 1, resize_count_range, &counted);
+  spndarray_set_num_threads(0);
+  printf("resizing while running: counted %zd items, %zd mismatches\n",
+         counted, (size_t)(counted != 400 * 64));
+  printf("\n>> %s Finished <<\n\n", __FUNCTION__);
+}
+
+static void test_partition() {
+  printf(">> Running %s <<\n\n", __FUNCTION__);
+  const size_t k = 4;
+  spndarray *m =
+      spndarray_alloc_nzmax(2, (size_t[]){1000, 100}, 16, SPNDARRAY_NTUPLE);
+
+  // power-law rows: row i holds about 1000 / (i + 1) elements
+  for (size_t i = 0; i < 1000; i++)
+    for (size_t j = 0; j < 100 && j * (i + 1) < 1000; j++)
+      spndarray_set(m, i + j / 100.0, (size_t[]){i, j});
+
+  spndarray **parts = spndarray_partition(m, 0, k);
+  size_t total = 0, mismatches = 0;
+  for (size_t p = 0; p < k; p++) {
+    printf("part %zd: %zd elements\n", p, parts[p]->nz);
+    total += parts[p]->nz;
+    for (size_t n = 0; n < parts[p]->nz; n++) {
+      size_t idx[] = {parts[p]->dims[0][n], parts[p]->dims[1][n]};
+      mismatches += spndarray_get(m, idx) != parts[p]->data[n];
+    }
+    spndarray_free(parts[p]);
+  }
+  printf("%zd of %zd elements in the parts, %zd mismatches\n", total, m->nz,
+         mismatches);
+  free(parts);
+  spndarray_free(m);
+  printf("\n>> %s Finished <<\n\n", __FUNCTION__);
+}
+
+static void test_concat() {
+  printf(">> Running %s <<\n\n", __FUNCTION__);
+  spndarray *days[3];
+  for (size_t a = 0; a < 3; a++) {
+    days[a] =
+        spndarray_alloc_nzmax(2, (size_t[]){20, 30}, 16, SPNDARRAY_NTUPLE);
+    for (size_t i = 0; i < 20; i++)
+      for (size_t j = 0; j < 30; j++)
+        if ((i * 7 + j * 3 + a) % 5 == 0)
+          spndarray_set(days[a], 100.0 * a + i + j / 100.0, (size_t[]){i, j});
+  }
+
+  for (size_t dim = 0; dim < 2; dim++) {
+    spndarray *c = spndarray_concat(days, 3, dim);
+    size_t mismatches = 0;
+    for (size_t a = 0; a < 3; a++)
+      for (size_t i = 0; i < 20; i++)
+        for (size_t j = 0; j < 30; j++) {
+          size_t idx[] = {i + (dim == 0) * 20 * a, j + (dim == 1) * 30 * a};
+          mismatches += spndarray_get(c, idx) !=
+                        spndarray_get(days[a], (size_t[]){i, j});
+        }
+    printf("concat along %zd: %zdx%zd, %zd elements, %zd mismatches\n", dim,
+           c->dimsizes[0], c->dimsizes[1], c->nz, mismatches);
+    spndarray_free(c);
+  }
+
+  spndarray *s = spndarray_stack(days, 3);
+  size_t mismatches = 0;
+  for (size_t a = 0; a < 3; a++)
+    for (size_t i = 0; i < 20; i++)
+      for (size_t j = 0; j < 30; j++)
+        mismatches += spndarray_get(s, (size_t[]){a, i, j}) !=
+                      spndarray_get(days[a], (size_t[]){i, j});
+  printf("stack: %zd elements, %zd mismatches\n", s->nz, mismatches);
+  spndarray_free(s);
+  for (size_t a = 0; a < 3; a++)
+    spndarray_free(days[a]);
+  printf("\n>> %s Finished <<\n\n", __FUNCTION__);
+}
+
+static size_t count_mismatches(const spndarray *a, const spndarray *b) {
+  size_t mismatches = a->fill != b->fill;
+  for (size_t i = 0; i < 50; i++)
+    for (size_t j = 0; j < 40; j++)
+      mismatches += spndarray_get(a, (size_t[]){i, j}) !=
+                    spndarray_get(b, (size_t[]){i, j});
+  return mismatches;
+}
+
+static void test_clone() {
+  printf(">> Running %s <<\n\n", __FUNCTION__);
+  spndarray *m =
+      spndarray_alloc_nzmax(2, (size_t[]){50, 40}, 8, SPNDARRAY_NTUPLE);
+  spndarray_set_fillvalue(m, 2.5);
+  spndarray_filter_enable(m, 0.01, 0);
+  for (size_t i = 0; i < 50; i++)
+    for (size_t j = 0; j < 40; j++)
+      if ((i * 13 + j * 7) % 9 == 0)
+        spndarray_set(m, i * 0.5 - j, (size_t[]){i, j});
+
+  spndarray *c = spndarray_clone(m);
+  printf("clone: %zd of %zd elements, fill %f, filter %s, %zd mismatches\n",
+         c->nz, m->nz, c->fill, c->filter ? "copied" : "missing",
+         count_mismatches(m, c));
+  spndarray_free(c);
+
+  spndarray *w = spndarray_clone_cow(m);
+  spndarray *unused = spndarray_clone_cow(m);
+  printf("cow clone: shares data %s, %zd mismatches\n",
+         w->data == m->data ? "yes" : "no", count_mismatches(m, w));
+  spndarray_free(unused);
+
+  spndarray_set(w, 100.0, (size_t[]){0, 0});
+  spndarray_incr(m, (size_t[]){49, 39});
+  printf("after writes: shares data %s, m(0,0) = %f, w(0,0) = %f, "
+         "m(49,39) = %f, w(49,39) = %f\n",
+         w->data == m->data ? "yes" : "no",
+         spndarray_get(m, (size_t[]){0, 0}),
+         spndarray_get(w, (size_t[]){0, 0}),
+         spndarray_get(m, (size_t[]){49, 39}),
+         spndarray_get(w, (size_t[]){49, 39}));
+
+  // the original may go first
+  spndarray *v = spndarray_clone_cow(w);
+  spndarray_free(w);
+  spndarray_incr(v, (size_t[]){1, 1});
+  printf("clone of a freed clone: %zd elements, v(1,1) = %f\n", v->nz,
+         spndarray_get(v, (size_t[]){1, 1}));
+  spndarray_free(v);
+  spndarray_free(m);
+  printf("\n>> %s Finished <<\n\n", __FUNCTION__);
+}
+
+static void test_binary() {
+  printf(">> Running %s <<\n\n", __FUNCTION__);
+  const char *path = "test_binary.spnd";
+  spndarray *m =
+      spndarray_alloc_nzmax(3, (size_t[]){30, 20, 10}, 8, SPNDARRAY_NTUPLE);
+  spndarray_set_fillvalue(m, -1.0);
+  for (size_t i = 0; i < 30; i++)
+    for (size_t j = 0; j < 20; j++)
+      for (size_t k = 0; k < 10; k++)
+        if ((i * 7 + j * 3 + k * 11) % 13 == 0)
+          spndarray_set(m, i + j * 0.25 - k, (size_t[]){i, j, k});
+  // a dead element is not written
+  spndarray_set(m, -1.0, (size_t[]){0, 0, 0});
+
+  int r = spndarray_fwrite_binary(m, path);
+  spndarray *c = spndarray_fread(path);
+  spndarray_mapped *f = spndarray_mmap_open(path);
+  size_t batch[30 * 20 * 10 * 3], mismatches = 0, differences = 0, count = 0;
+  double out[30 * 20 * 10];
+  for (size_t i = 0; i < 30; i++)
+    for (size_t j = 0; j < 20; j++)
+      for (size_t k = 0; k < 10; k++) {
+        size_t *idxs = &batch[3 * count++];
+        idxs[0] = i, idxs[1] = j, idxs[2] = k;
+        if (spndarray_get(c, idxs) != spndarray_get(m, idxs))
+          mismatches++;
+        if (spndarray_mapped_get(f, idxs) != spndarray_get(m, idxs))
+          differences++;
+      }
+  printf("fread: write %s, %zd of %zd elements, fill %f, %zd mismatches\n",
+         r ? "failed" : "ok", c->nz, m->nz, c->fill, mismatches);
+  spndarray_mapped_get_batch(f, count, batch, out);
+  for (size_t n = 0; n < count; n++)
+    if (out[n] != spndarray_get(m, &batch[3 * n]))
+      differences++;
+  printf("mmap: %zd elements, %zd differences\n", spndarray_mapped_nnz(f),
+         differences);
+  spndarray_mmap_close(f);
+
+  // a header whose sizes only fit the file once they wrap around is
+  // rejected: nz * 8 wraps to a stride of 0
+  uint64_t header[8];
+  FILE *fp = fopen(path, "r+b");
+  r = fread(header, sizeof(header), 1, fp) != 1;
+  header[3] = (uint64_t)1 << 61;
+  header[6] = 0;
+  header[7] = header[5];
+  rewind(fp);
+  r |= fwrite(header, sizeof(header), 1, fp) != 1;
+  fclose(fp);
+  printf("forged header: fread %s, mmap %s\n",
+         r || spndarray_fread(path) ? "accepted" : "rejected",
+         r || spndarray_mmap_open(path) ? "accepted" : "rejected");
+
+  // a damaged file is rejected
+  fp = fopen(path, "r+b");
+  fputc('X', fp);
+  fclose(fp);
+  printf("damaged file: fread %s, mmap %s\n",
+         spndarray_fread(path) ? "accepted" : "rejected",
+         spndarray_mmap_open(path) ? "accepted" : "rejected");
+  remove(path);
+
+  spndarray_free(c);
+  spndarray_free(m);
+  printf("\n>> %s Finished <<\n\n", __FUNCTION__);
+}
+
+static void test_tns() {
+  printf(">> Running %s <<\n\n", __FUNCTION__);
+  const char *path = "test_tns.tns";
+  FILE *fp = fopen(path, "w");
+  fprintf(fp, "# a FROSTT tensor\n1 1 1 1.5\n\n2 3 1 -2\n  4 1 2\t1e-3\n"
+              "3 3 3 0\n");
+  fclose(fp);
+  spndarray *m = spndarray_read_tns(path, SPNDARRAY_TNS_ONE_BASED);
+  printf("tns: %zd elements, %zdx%zdx%zd, (0,0,0) = %f, (1,2,0) = %f, "
+         "(3,0,1) = %f\n",
+         m->nz, m->dimsizes[0], m->dimsizes[1], m->dimsizes[2],
+         spndarray_get(m, (size_t[]){0, 0, 0}),
+         spndarray_get(m, (size_t[]){1, 2, 0}),
+         spndarray_get(m, (size_t[]){3, 0, 1}));
+  spndarray_free(m);
+
+  // large enough to be cut into several chunks
+  m = spndarray_alloc_nzmax(3, (size_t[]){200, 150, 100}, 8,
+                            SPNDARRAY_NTUPLE);
+  for (size_t i = 0; i < 200; i++)
+    for (size_t j = 0; j < 150; j++)
+      for (size_t k = 0; k < 100; k++)
+        if ((i * 7 + j * 3 + k * 11) % 29 == 0)
+          spndarray_set(m, i / 3.0 - j * 0.125 + k, (size_t[]){i, j, k});
+  spndarray_fwrite(m, "%.17g\n", path, 0);
+  spndarray *c = spndarray_read_tns(path, SPNDARRAY_TNS_ZERO_BASED);
+  size_t mismatches = 0;
+  for (size_t n = 0; n < m->nz; n++) {
+    size_t idxs[3] = {m->dims[0][n], m->dims[1][n], m->dims[2][n]};
+    mismatches += spndarray_get(c, idxs) != m->data[n];
+  }
+  printf("fwrite round trip: %zd of %zd elements, %zd mismatches\n", c->nz,
+         m->nz, mismatches);
+  spndarray_free(c);
+  spndarray_free(m);
+
+  fp = fopen(path, "w");
+  fprintf(fp, "1 1 1.0\n2 x 2.0\n");
+  fclose(fp);
+  printf("malformed file: %s\n",
+         spndarray_read_tns(path, SPNDARRAY_TNS_ONE_BASED) ? "accepted"
+                                                           : "rejected");
+  remove(path);
+  printf("\n>> %s Finished <<\n\n", __FUNCTION__);
+}
+
+static void test_pack() {
+  printf(">> Running %s <<\n\n", __FUNCTION__);
+  spndarray *m =
+      spndarray_alloc_nzmax(3, (size_t[]){300, 200, 100}, 8, SPNDARRAY_NTUPLE);
+  spndarray_set_fillvalue(m, 1.0);
+  for (size_t i = 0; i < 300; i++)
+    for (size_t j = 0; j < 200; j += 2)
+      for (size_t k = 0; k < 100; k++)
+        if ((i * 7 + j * 3 + k * 11) % 17 == 0)
+          spndarray_set(m, (double)((i + j + k) % 10), (size_t[]){i, j, k});
+  spndarray_set(m, 5.0, (size_t[]){299, 199, 99});
+
+  for (size_t flags = 0; flags <= SPNDARRAY_PACK_DICT; flags++) {
+    char *buf;
+    size_t len, mismatches = 0;
+    FILE *fp = open_memstream(&buf, &len);
+    int r = spndarray_pack(m, fp, flags);
+    fclose(fp);
+
+    fp = fmemopen(buf, len, "rb");
+    spndarray *c = spndarray_unpack(fp);
+    fclose(fp);
+    for (size_t n = 0; n < m->nz; n++) {
+      size_t idxs[3] = {m->dims[0][n], m->dims[1][n], m->dims[2][n]};
+      mismatches += spndarray_get(c, idxs) != m->data[n];
+    }
+    printf("%s: pack %s, %zd of %zd elements, %.2f bytes per element, "
+           "%zd mismatches\n",
+           flags ? "dictionary" : "plain", r ? "failed" : "ok", c->nz, m->nz,
+           (double)len / c->nz, mismatches);
+    spndarray_free(c);
+
+    // a cut stream is rejected
+    fp = fmemopen(buf, len / 2, "rb");
+    printf("truncated: %s\n", spndarray_unpack(fp) ? "accepted" : "rejected");
+    fclose(fp);
+
+    // so is a header announcing more elements than the stream holds,
+    // whether their buffers would overflow size_t or not
+    const uint64_t forged[] = {((uint64_t)1 << 61) + 1, (uint64_t)1 << 40};
+    for (size_t f = 0; f < 2; f++) {
+      memcpy(buf + 24, &forged[f], sizeof(uint64_t));
+      fp = fmemopen(buf, len, "rb");
+      printf("%zd elements announced: %s\n", (size_t)forged[f],
+             spndarray_unpack(fp) ? "accepted" : "rejected");
+      fclose(fp);
+    }
+    free(buf);
+  }
+  spndarray_free(m);
+  printf("\n>> %s Finished <<\n\n", __FUNCTION__);
+}
+
+static void test_dense_fwrite() {
+  printf(">> Running %s <<\n\n", __FUNCTION__);
+  const char *path = "test_dense.out";
+  spndarray *m =
+      spndarray_alloc_nzmax(3, (size_t[]){4, 5, 6}, 8, SPNDARRAY_NTUPLE);
+  spndarray_set_fillvalue(m, 0.5);
+  for (size_t i = 0; i < 4; i++)
+    for (size_t j = 0; j < 5; j++)
+      for (size_t k = 0; k < 6; k++)
+        if ((i + 2 * j + 3 * k) % 7 == 0)
+          spndarray_set(m, i * 100.0 + j * 10.0 + k, (size_t[]){i, j, k});
+
+  spndarray_fwrite(m, NULL, path, SPNDARRAY_FWRITE_FULL);
+  FILE *fp = fopen(path, "r");
+  size_t lines = 0, mismatches = 0;
+  for (size_t i = 0; i < 4; i++)
+    for (size_t j = 0; j < 5; j++) {
+      for (size_t k = 0; k < 6; k++) {
+        double x;
+        if (fscanf(fp, "%lf", &x) != 1 ||
+            x != spndarray_get(m, (size_t[]){i, j, k}))
+          mismatches++;
+      }
+      lines += fgetc(fp) == '\n';
+    }
+  fclose(fp);
+  printf("text: %zd lines, %zd mismatches\n", lines, mismatches);
+
+  spndarray_fwrite(m, NULL, path, SPNDARRAY_FWRITE_NPY);
+  fp = fopen(path, "rb");
+  unsigned char magic[10];
+  char header[256];
+  double cells[4 * 5 * 6];
+  size_t n = fread(magic, 1, 10, fp), hlen = magic[8] | magic[9] << 8;
+  n = fread(header, 1, hlen, fp);
+  header[n] = '\0';
+  n = fread(cells, sizeof(double), 4 * 5 * 6, fp);
+  fclose(fp);
+  mismatches = n != 4 * 5 * 6;
+  for (size_t i = 0; i < 4; i++)
+    for (size_t j = 0; j < 5; j++)
+      for (size_t k = 0; k < 6; k++)
+        mismatches += cells[(i * 5 + j) * 6 + k] !=
+                      spndarray_get(m, (size_t[]){i, j, k});
+  printf("npy: data at %zd, shape %s, %zd mismatches\n", 10 + hlen,
+         strstr(header, "(4, 5, 6, )") ? "ok" : "wrong", mismatches);
+
+  remove(path);
+  spndarray_free(m);
+  printf("\n>> %s Finished <<\n\n", __FUNCTION__);
+}
+
+static void test_dense() {
+  printf(">> Running %s <<\n\n", __FUNCTION__);
+  const size_t dimsizes[3] = {70, 60, 50}, cells = 70 * 60 * 50;
+  double *buf = malloc(cells * sizeof(double));
+  double *back = malloc(cells * sizeof(double));
+  size_t expect = 0, mismatches = 0;
+
+  for (size_t c = 0; c < cells; c++) {
+    buf[c] = c % 11 == 0 ? c * 0.5 : c % 13 == 0 ? 1e-9 : 0.0;
+    expect += c % 11 == 0 && c;
+  }
+  spndarray *m = spndarray_from_dense(buf, 3, dimsizes, 0.0, 1e-6);
+  for (size_t i = 0, c = 0; i < 70; i++)
+    for (size_t j = 0; j < 60; j++)
+      for (size_t k = 0; k < 50; k++, c++)
+        mismatches += spndarray_get(m, (size_t[]){i, j, k}) !=
+                      (c % 11 == 0 ? c * 0.5 : 0.0);
+  printf("from_dense: %zd of %zd elements, %zd mismatches\n", m->nz, expect,
+         mismatches);
+
+  spndarray_set_fillvalue(m, -1.0);
+  spndarray_set(m, 3.0, (size_t[]){69, 59, 49});
+  spndarray_to_dense(m, back);
+  mismatches = 0;
+  for (size_t i = 0, c = 0; i < 70; i++)
+    for (size_t j = 0; j < 60; j++)
+      for (size_t k = 0; k < 50; k++, c++)
+        mismatches += back[c] != spndarray_get(m, (size_t[]){i, j, k});
+  printf("to_dense: %zd mismatches\n", mismatches);
+
+  spndarray_free(m);
+  free(buf);
+  free(back);
+  printf("\n>> %s Finished <<\n\n", __FUNCTION__);
+}
+
+static int count_visit(void *ctx, const size_t *idxs, double x) {
+  // count, last coordinates, then elements visited out of order
+  size_t *state = (size_t *)ctx, i = 0;
+  while (i < 2 && idxs[i] == state[1 + i])
+    i++;
+  state[4] += state[0] && idxs[i] <= state[1 + i];
+  state[0]++;
+  memcpy(&state[1], idxs, 3 * sizeof(size_t));
+  (void)x;
+  return 0;
+}
+
+static void remove_chunked(const char *dirpath, const size_t nchunks) {
+  char path[256];
+  for (size_t k = 0; k < nchunks; k++) {
+    snprintf(path, sizeof(path), "%s/chunk-%06zu.spnd", dirpath, k);
+    remove(path);
+  }
+  snprintf(path, sizeof(path), "%s/index", dirpath);
+  remove(path);
+  remove(dirpath);
+}
+
+static void test_chunked() {
+  printf(">> Running %s <<\n\n", __FUNCTION__);
+  spndarray *m =
+      spndarray_alloc_nzmax(3, (size_t[]){40, 30, 20}, 8, SPNDARRAY_NTUPLE);
+  spndarray *n =
+      spndarray_alloc_nzmax(3, (size_t[]){40, 30, 20}, 8, SPNDARRAY_NTUPLE);
+  for (size_t i = 0; i < 40; i++)
+    for (size_t j = 0; j < 30; j++)
+      for (size_t k = 0; k < 20; k++) {
+        if ((i * 7 + j * 3 + k * 11) % 5 == 0)
+          spndarray_set(m, i + j * 0.5 - k, (size_t[]){i, j, k});
+        if ((i + j + k) % 4 == 0)
+          spndarray_set(n, 1.0 + k, (size_t[]){i, j, k});
+      }
+
+  spndarray_chunked_write(m, "test_chunked_m", 500);
+  spndarray_chunked_write(n, "test_chunked_n", 700);
+  spndarray_chunked *cm = spndarray_chunked_open("test_chunked_m", 2);
+  spndarray_chunked *cn = spndarray_chunked_open("test_chunked_n", 2);
+  size_t mismatches = 0, most_mapped = 0;
+  for (size_t i = 0; i < 40; i++)
+    for (size_t j = 0; j < 30; j++)
+      for (size_t k = 0; k < 20; k++) {
+        size_t idxs[3] = {i, j, k};
+        mismatches += spndarray_chunked_get(cm, idxs) != spndarray_get(m, idxs);
+        if (spndarray_chunked_nmapped(cm) > most_mapped)
+          most_mapped = spndarray_chunked_nmapped(cm);
+      }
+  printf("get: %zd elements in %zd chunks, at most %zd mapped, %zd "
+         "mismatches\n",
+         spndarray_chunked_nnz(cm), spndarray_chunked_nchunks(cm),
+         most_mapped, mismatches);
+
+  size_t state[5] = {0};
+  spndarray_chunked_foreach(cm, count_visit, state);
+  printf("foreach: %zd elements, %zd out of order\n", state[0], state[4]);
+
+  spndarray *r = spndarray_chunked_reduce(cm, 1, reduce_sum);
+  spndarray *e = spndarray_reduce(m, 1, reduce_sum);
+  mismatches = r->nz != e->nz;
+  for (size_t i = 0; i < 40; i++)
+    for (size_t k = 0; k < 20; k++)
+      mismatches += spndarray_get(r, (size_t[]){i, k}) !=
+                    spndarray_get(e, (size_t[]){i, k});
+  printf("reduce: %zd elements, %zd mismatches\n", r->nz, mismatches);
+  spndarray_free(r);
+  spndarray_free(e);
+
+  spndarray_chunked_add(cm, cn, "test_chunked_s", 300);
+  spndarray_chunked *cs = spndarray_chunked_open("test_chunked_s", 3);
+  e = spndarray_add(m, n);
+  mismatches = 0;
+  for (size_t i = 0; i < 40; i++)
+    for (size_t j = 0; j < 30; j++)
+      for (size_t k = 0; k < 20; k++) {
+        size_t idxs[3] = {i, j, k};
+        mismatches += spndarray_chunked_get(cs, idxs) != spndarray_get(e, idxs);
+      }
+  printf("add: %zd elements, %zd mismatches\n", spndarray_chunked_nnz(cs),
+         mismatches);
+  spndarray_free(e);
+
+  // a missing chunk fails every access that needs it without aborting
+  spndarray_chunked *cb = spndarray_chunked_open("test_chunked_n", 2);
+  remove("test_chunked_n/chunk-000001.spnd");
+  size_t looked_up = 0;
+  for (double x; looked_up < 40 * 30 * 20; looked_up++)
+    if (spndarray_chunked_lookup(cb,
+                                 (size_t[]){looked_up / 600,
+                                            looked_up / 20 % 30,
+                                            looked_up % 20},
+                                 &x))
+      break;
+  memset(state, 0, sizeof(state));
+  mismatches = looked_up == 40 * 30 * 20;
+  mismatches += spndarray_chunked_foreach(cb, count_visit, state) != -1;
+  if ((r = spndarray_chunked_reduce(cb, 1, reduce_sum))) {
+    mismatches++;
+    spndarray_free(r);
+  }
+  mismatches += !spndarray_chunked_add(cm, cb, "test_chunked_f", 300);
+  printf("missing chunk: lookup %zd failed, %zd mismatches\n", looked_up,
+         mismatches);
+  spndarray_chunked_close(cb);
+  remove_chunked("test_chunked_f", 16);
+
+  remove_chunked("test_chunked_m", spndarray_chunked_nchunks(cm));
+  remove_chunked("test_chunked_n", spndarray_chunked_nchunks(cn));
+  remove_chunked("test_chunked_s", spndarray_chunked_nchunks(cs));
+  spndarray_chunked_close(cm);
+  spndarray_chunked_close(cn);
+  spndarray_chunked_close(cs);
+  spndarray_free(m);
+  spndarray_free(n);
+  printf("\n>> %s Finished <<\n\n", __FUNCTION__);
+}
+
+static void *counting_alloc(size_t size, void *state) {
+  *(size_t *)state += size;
+  return malloc(size);
+}
+
+static void *counting_realloc(void *ptr, size_t old_size, size_t size,
+                              void *state) {
+  *(size_t *)state += size - old_size;
+  return realloc(ptr, size);
+}
+
+static void counting_free(void *ptr, size_t size, void *state) {
+  *(size_t *)state -= size;
+  free(ptr);
+}
+
+static size_t fill_and_check(spndarray *m) {
+  size_t mismatches = 0;
+  for (size_t i = 0; i < 300; i++)
+    for (size_t j = 0; j < 200; j++)
+      if ((i * 3 + j * 5) % 7 == 0)
+        spndarray_set(m, i - 0.5 * j, (size_t[]){i, j});
+
+  spndarray *c = spndarray_clone(m);
+  spndarray *w = spndarray_clone_cow(m);
+  spndarray_incr(w, (size_t[]){0, 1});
+  spndarray_tree_rebuild(c);
+  for (size_t i = 0; i < 300; i++)
+    for (size_t j = 0; j < 200; j++) {
+      double x = (i * 3 + j * 5) % 7 == 0 ? i - 0.5 * j : 0.0;
+      mismatches += spndarray_get(m, (size_t[]){i, j}) != x;
+      mismatches += spndarray_get(c, (size_t[]){i, j}) != x;
+      mismatches += spndarray_get(w, (size_t[]){i, j}) !=
+                    x + (i == 0 && j == 1);
+    }
+  spndarray_free(c);
+  spndarray_free(w);
+  return mismatches;
+}
+
+static void test_allocator() {
+  printf(">> Running %s <<\n\n", __FUNCTION__);
+  size_t outstanding = 0;
+  spndarray_allocator counting = {counting_alloc, counting_realloc,
+                                  counting_free, &outstanding};
+
+  spndarray *m = spndarray_alloc_with(2, (size_t[]){300, 200}, 4,
+                                      SPNDARRAY_NTUPLE, &counting);
+  size_t mismatches = fill_and_check(m);
+  size_t peak = outstanding;
+  spndarray_free(m);
+  printf("counting: %zd mismatches, %s at peak, %zd bytes left\n",
+         mismatches, peak ? "in use" : "unused", outstanding);
+
+  spndarray_allocator *arena = spndarray_arena_create(1 << 16);
+  m = spndarray_alloc_with(2, (size_t[]){300, 200}, 4, SPNDARRAY_NTUPLE,
+                           arena);
+  mismatches = fill_and_check(m);
+  spndarray_free(m);
+  printf("arena: %zd mismatches, %zd bytes left\n", mismatches,
+         spndarray_arena_used(arena));
+
+  // results computed from arena arrays come from the arena too
+  m = spndarray_alloc_with(2, (size_t[]){300, 200}, 4, SPNDARRAY_NTUPLE,
+                           arena);
+  fill_and_check(m);
+  double dense[6] = {0, 1.5, 0, 0, -2, 0};
+  spndarray *results[] = {
+      spndarray_add(m, m),
+      spndarray_mul(m, m, -1),
+      spndarray_reduce(m, 1, reduce_sum),
+      spndarray_reduce_dimension(m, 0, 3),
+      spndarray_concat(&m, 1, 0),
+      spndarray_from_dense_with(dense, 2, (size_t[]){2, 3}, 0, 0, arena)};
+  mismatches = 0;
+  for (size_t k = 0; k < sizeof(results) / sizeof(results[0]); k++) {
+    mismatches += !results[k] || results[k]->allocator != arena;
+    spndarray_free(results[k]);
+  }
+  spndarray_free(m);
+  printf("arena results: %zd mismatches, %zd bytes left\n", mismatches,
+         spndarray_arena_used(arena));
+  spndarray_arena_reset(arena);
+  spndarray_arena_destroy(arena);
+
+  m = spndarray_alloc_with(2, (size_t[]){300, 200}, 100000, SPNDARRAY_NTUPLE,
+                           &spndarray_hugepage_allocator);
+  mismatches = fill_and_check(m);
+  spndarray_realloc(400000, m);
+  spndarray_realloc(8000, m);
+  mismatches += fill_and_check(m);
+  spndarray_free(m);
+  printf("hugepage: %zd mismatches\n", mismatches);
+  printf("\n>> %s Finished <<\n\n", __FUNCTION__);
+}
+
+static void test_sizing() {
+  printf(">> Running %s <<\n\n", __FUNCTION__);
+  const size_t dimsizes[] = {400, 300, 200};
+  spndarray *m = spndarray_alloc(3, (size_t[]){1000000, 1000000, 1000000});
+  printf("alloc: nzmax %zd for 10^18 cells\n", m->nzmax);
+  spndarray_free(m);
+
+  size_t sizes[3];
+  const int policies[] = {SPNDARRAY_GROWTH_FACTOR, SPNDARRAY_GROWTH_CHUNKED,
+                          SPNDARRAY_GROWTH_EXACT};
+  for (size_t p = 0; p < 3; p++) {
+    spndarray_set_growth(policies[p], p == 0 ? 1.5 : 100);
+    m = spndarray_alloc_nzmax(1, (size_t[]){1000}, 10, SPNDARRAY_NTUPLE);
+    for (size_t k = 0; k < 250; k++)
+      spndarray_set(m, k + 1.0, &k);
+    sizes[p] = m->nzmax;
+    spndarray_free(m);
+  }
+  spndarray_set_growth(SPNDARRAY_GROWTH_FACTOR, 0);
+  printf("growth: nzmax %zd by factor, %zd chunked, %zd exact\n", sizes[0],
+         sizes[1], sizes[2]);
+
+  m = spndarray_alloc_nzmax(3, dimsizes, 16, SPNDARRAY_NTUPLE);
+  spndarray *n = spndarray_alloc_nzmax(3, dimsizes, 16, SPNDARRAY_NTUPLE);
+  uint64_t x = 7;
+  size_t common = 0;
+  for (size_t k = 0; k < 200000; k++) {
+    x ^= x << 13, x ^= x >> 7, x ^= x << 17;
+    size_t idx[] = {x % 400, (x >> 16) % 300, (x >> 32) % 200};
+    spndarray_set(k % 2 ? m : n, 1.0 + x % 5, idx);
+  }
+  for (size_t k = 0; k < n->nz; k++)
+    common += spndarray_contains(m, (size_t[]){n->dims[0][k], n->dims[1][k],
+                                               n->dims[2][k]});
+
+  // the counted passes size the results exactly
+  spndarray *sum = spndarray_add(m, n);
+  size_t mismatches = sum->nzmax != sum->nz;
+  mismatches += sum->nz > m->nz + n->nz - common;
+  spndarray_free(sum);
+  spndarray *slice = spndarray_reduce_dimension(m, 0, 17);
+  mismatches += slice->nzmax != slice->nz;
+  spndarray_free(slice);
+  printf("result sizes: %zd mismatches\n", mismatches);
+
+  spndarray_free(m);
+  spndarray_free(n);
+  printf("\n>> %s Finished <<\n\n", __FUNCTION__);
+}
+
+static void test_memory() {
+  printf(">> Running %s <<\n\n", __FUNCTION__);
+  const size_t dimsizes[] = {100, 100, 100};
+  const size_t base = spndarray_memory_in_use();
+  spndarray_memory st;
+  size_t mismatches = 0;
+
+  spndarray *m = spndarray_alloc_nzmax(3, dimsizes, 1000, SPNDARRAY_NTUPLE);
+  for (size_t k = 0; k < 600; k++)
+    spndarray_set(m, k + 1.0, (size_t[]){k % 100, k / 100, k % 7});
+  spndarray_memory_stats(m, &st);
+  mismatches += st.dims != 3 * 1000 * sizeof(size_t);
+  mismatches += st.data != 1000 * sizeof(double);
+  mismatches += st.slack != 400 || st.shared != 0;
+  mismatches += st.total !=
+                st.dims + st.data + st.nodes + st.filter + st.header;
+  mismatches += spndarray_memory_in_use() - base !=
+                st.dims + st.data + st.nodes;
+
+  spndarray *c = spndarray_clone_cow(m);
+  spndarray_memory_stats(c, &st);
+  mismatches += st.shared != st.dims + st.data + st.nodes;
+  spndarray_free(c);
+  spndarray_free(m);
+  mismatches += spndarray_memory_in_use() != base;
+  printf("stats and tally: %zd mismatches, peak of %zd bytes\n", mismatches,
+         spndarray_memory_peak());
+
+  // a budget 4MB above what is in use refuses 40MB, but not 1.5MB
+  spndarray_set_memory_budget(base + (4 << 20));
+  m = spndarray_alloc_nzmax(3, dimsizes, 1000000, SPNDARRAY_NTUPLE);
+  mismatches = m != NULL;
+  m = spndarray_alloc_nzmax(3, dimsizes, 1000, SPNDARRAY_NTUPLE);
+  mismatches += spndarray_realloc(1000000, m) == 0;
+  mismatches += spndarray_realloc(20000, m) != 0;
+  spndarray_free(m);
+  spndarray_set_memory_budget(0);
+  printf("budget: %zd mismatches\n", mismatches);
+  printf("\n>> %s Finished <<\n\n", __FUNCTION__);
+}
+
+static void test_stats() {
+  printf(">> Running %s <<\n\n", __FUNCTION__);
+  const size_t dimsizes[] = {50, 50};
+  spndarray *m = spndarray_alloc_nzmax(2, dimsizes, 4, SPNDARRAY_NTUPLE);
+  spndarray_stats st;
+
+  spndarray_reset_stats();
+  for (size_t k = 0; k < 1000; k++)
+    spndarray_set(m, k + 1.0, (size_t[]){k % 50, k / 50});
+  double sum = 0;
+  for (size_t k = 0; k < 2500; k++)
+    sum += spndarray_get(m, (size_t[]){k % 50, k / 50});
+  spndarray *r = spndarray_add(m, m);
+  spndarray_free(r);
+
+  if (spndarray_get_stats(&st)) {
+    printf("counters compiled out\n");
+  } else {
+    size_t mismatches = st.compares == 0 || st.finds < 2500;
+    mismatches += st.find_depth_max == 0 || st.find_depth_max > 2 * 11;
+    mismatches += st.reallocs == 0 || st.realloc_bytes == 0;
+    mismatches += st.rebuilds != 1 || st.op_calls[SPNDARRAY_OP_ADD] != 1;
+    mismatches += st.op_calls[SPNDARRAY_OP_TREE_REBUILD] != 1;
+    printf("counters: %zd mismatches, %.2f nodes per lookup\n", mismatches,
+           (double)st.find_depth / st.finds);
+  }
+
+  FILE *fp = tmpfile();
+  char json[16];
+  spndarray_fwrite_stats(fp);
+  rewind(fp);
+  size_t len = fread(json, 1, sizeof(json) - 1, fp);
+  json[len] = 0;
+  fclose(fp);
+  printf("json: %s, sum %g\n", strncmp(json, "{\"enabled\": ", 12) ? "bad"
+                                                                   : "ok",
+         sum);
+  spndarray_free(m);
+  printf("\n>> %s Finished <<\n\n", __FUNCTION__);
+}
+
+/*
+ * blocked_mismatches()
+ * Counts the cells of a 48 x 40 x 36 blocked array that differ from m
+ */
+static size_t blocked_mismatches(const spndarray_blocked *b,
+                                 const spndarray *m) {
+  size_t mismatches = 0;
+  for (size_t i = 0; i < 48; i++)
+    for (size_t j = 0; j < 40; j++)
+      for (size_t k = 0; k < 36; k++) {
+        size_t idxs[3] = {i, j, k};
+        mismatches += spndarray_blocked_get(b, idxs) != spndarray_get(m, idxs);
+      }
+  return mismatches;
+}
+
+static void test_blocked() {
+  printf(">> Running %s <<\n\n", __FUNCTION__);
+  size_t dims[3] = {48, 40, 36};
+  spndarray *m = spndarray_alloc_nzmax(3, dims, 8, SPNDARRAY_NTUPLE);
+  spndarray *n = spndarray_alloc_nzmax(3, dims, 8, SPNDARRAY_NTUPLE);
+  spndarray_blocked *b = spndarray_blocked_alloc(3, dims, 8, 0);
+
+  // a few full rows on top of a sparse background
+  for (size_t i = 0; i < 48; i++)
+    for (size_t j = 0; j < 40; j++)
+      for (size_t k = 0; k < 36; k++) {
+        size_t idxs[3] = {i, j, k};
+        double x = (i < 8 && j < 16) || (i * 7 + j * 3 + k) % 97 == 0
+                       ? 1.0 + (i + j + k) % 5
+                       : 0.0;
+        if (x != 0.0) {
+          spndarray_set(m, x, idxs);
+          spndarray_blocked_set(b, x, idxs);
+        }
+        if ((i * 5 + j + k * 3) % 31 == 0 || (i < 16 && j < 8))
+          spndarray_set(n, 1.0 + (i * j + k) % 3, idxs);
+      }
+  spndarray_memory mem;
+  spndarray_memory_stats(m, &mem);
+  printf("%zd elements in %zd blocks, %zd dense, %zd bytes against %zd\n",
+         spndarray_blocked_nnz(b), spndarray_blocked_nblocks(b),
+         spndarray_blocked_ndense(b), spndarray_blocked_bytes(b), mem.total);
+  printf("get: %zd mismatches, nnz %s\n", blocked_mismatches(b, m),
+         spndarray_blocked_nnz(b) == m->nz ? "ok" : "bad");
+
+  // the operations, against the ones of the plain arrays
+  spndarray_blocked *c = spndarray_blocked_from_array(n, 8, 0);
+  spndarray_blocked *r = spndarray_blocked_add(b, c);
+  spndarray *s = spndarray_add(m, n);
+  printf("add: %zd mismatches\n", blocked_mismatches(r, s));
+  spndarray_blocked_free(r);
+  spndarray_free(s);
+
+  r = spndarray_blocked_mul(b, c);
+  s = spndarray_mul(m, n, -1);
+  printf("mul: %zd mismatches\n", blocked_mismatches(r, s));
+  spndarray_blocked_free(r);
+  spndarray_free(s);
+
+  size_t mismatches = 0;
+  for (size_t dim = 0; dim < 3; dim++) {
+    spndarray *x = spndarray_blocked_reduce(b, dim, reduce_sum);
+    spndarray *y = spndarray_reduce(m, dim, reduce_sum);
+    size_t rdims[2] = {dims[dim == 0], dims[dim == 2 ? 1 : 2]};
+    for (size_t i = 0; i < rdims[0]; i++)
+      for (size_t j = 0; j < rdims[1]; j++)
+        mismatches += spndarray_get(x, (size_t[]){i, j}) !=
+                      spndarray_get(y, (size_t[]){i, j});
+    spndarray_free(x);
+    spndarray_free(y);
+  }
+  printf("reduce: %zd mismatches\n", mismatches);
+
+  // emptying the rows turns their blocks back to sparse
+  for (size_t i = 0; i < 8; i++)
+    for (size_t j = 0; j < 16; j++)
+      for (size_t k = 0; k < 36; k++) {
+        size_t idxs[3] = {i, j, k};
+        spndarray_set(m, 0.0, idxs);
+        spndarray_blocked_set(b, 0.0, idxs);
+      }
+  for (size_t k = 0; k < 36; k++) {
+    spndarray_incr(m, (size_t[]){47, 39, k});
+    spndarray_blocked_incr(b, (size_t[]){47, 39, k});
+  }
+  spndarray *back = spndarray_blocked_to_array(b);
+  printf("cleared: %zd dense, %zd mismatches, %zd after conversion\n",
+         spndarray_blocked_ndense(b), blocked_mismatches(b, m),
+         blocked_mismatches(b, back));
+
+  spndarray_free(back);
+  spndarray_blocked_free(b);
+  spndarray_blocked_free(c);
+  spndarray_free(m);
+  spndarray_free(n);
+  printf("\n>> %s Finished <<\n\n", __FUNCTION__);
+}
+
+static void test_vtypes() {
+  printf(">> Running %s <<\n\n", __FUNCTION__);
+  const size_t dimsizes[] = {40, 30, 20};
+  const size_t count = 5000;
+  size_t *idxs = malloc(count * 3 * sizeof(size_t));
+  size_t mismatches = 0;
+
+  for (size_t k = 0; k < count; k++) {
+    idxs[3 * k] = (k * 7) % 40;
+    idxs[3 * k + 1] = (k * 13) % 30;
+    idxs[3 * k + 2] = (k * k) % 20;
+  }
+
+  // counters of every type against a double array
+  const size_t vtypes[] = {SPNDARRAY_FLOAT32, SPNDARRAY_INT64,
+                           SPNDARRAY_UINT32};
+  spndarray *d = spndarray_alloc_nzmax(3, dimsizes, 16, SPNDARRAY_NTUPLE);
+  spndarray_incr_batch(d, count, idxs, NULL);
+  for (size_t t = 0; t < 3; t++) {
+    spndarray *m = spndarray_alloc_nzmax(3, dimsizes, 16,
+                                         SPNDARRAY_NTUPLE | vtypes[t]);
+    spndarray_incr_batch(m, count / 2, idxs, NULL);
+    for (size_t k = count / 2; k < count; k++)
+      spndarray_incr(m, &idxs[3 * k]);
+    mismatches += m->nz != d->nz || m->vtype != vtypes[t];
+    for (size_t k = 0; k < count; k++)
+      mismatches += spndarray_get(m, &idxs[3 * k]) !=
+                    spndarray_get(d, &idxs[3 * k]);
+
+    spndarray *r = spndarray_reduce(m, 1, reduce_sum);
+    spndarray *rd = spndarray_reduce(d, 1, reduce_sum);
+    mismatches += r->nz != rd->nz || r->vtype != SPNDARRAY_FLOAT64;
+    for (size_t n = 0; n < rd->nz; n++)
+      mismatches += spndarray_get(r, (size_t[]){rd->dims[0][n],
+                                                rd->dims[1][n]}) !=
+                    rd->data[n];
+    spndarray_free(r);
+    spndarray_free(rd);
+
+    spndarray *c = spndarray_convert(m, SPNDARRAY_FLOAT64);
+    spndarray *cm = spndarray_clone(m);
+    mismatches += cm->vtype != vtypes[t] || spndarray_tree_rebuild(cm);
+    for (size_t k = 0; k < count; k++)
+      mismatches += *spndarray_ptr(c, &idxs[3 * k]) !=
+                        spndarray_get(d, &idxs[3 * k]) ||
+                    spndarray_get(cm, &idxs[3 * k]) !=
+                        spndarray_get(d, &idxs[3 * k]);
+    mismatches += spndarray_ptr(m, idxs) != NULL;
+    spndarray_free(cm);
+    spndarray_free(c);
+    spndarray_free(m);
+  }
+  printf("typed counters: %zd mismatches against double ones\n", mismatches);
+
+  // float32 keeps values to single precision, and halves the data
+  spndarray_memory st;
+  spndarray *f = spndarray_convert(d, SPNDARRAY_FLOAT32);
+  spndarray_set(f, 0.1, (size_t[]){1, 2, 3});
+  mismatches = spndarray_get(f, (size_t[]){1, 2, 3}) != (double)0.1f;
+  spndarray_memory_stats(f, &st);
+  mismatches += st.data != f->nzmax * sizeof(float);
+  spndarray_free(f);
+
+  // pattern arrays store no values, and read every element as one
+  spndarray *p = spndarray_convert(d, SPNDARRAY_PATTERN);
+  spndarray_memory_stats(p, &st);
+  mismatches += st.data != 0 || p->nz != d->nz;
+  for (size_t k = 0; k < count; k++)
+    mismatches += spndarray_get(p, &idxs[3 * k]) != 1.0;
+  mismatches += spndarray_set(p, 0.0, idxs) != 1;
+  mismatches += spndarray_set(p, 5.0, (size_t[]){0, 0, 1}) != 0 ||
+                spndarray_get(p, (size_t[]){0, 0, 1}) != 1.0;
+  mismatches += spndarray_add(p, d) != NULL;
+  spndarray_free(p);
+  spndarray_free(d);
+  printf("float32 and pattern: %zd mismatches\n", mismatches);
+  free(idxs);
+  printf("\n>> %s Finished <<\n\n", __FUNCTION__);
+}
+
+static void test_dict() {
+  printf(">> Running %s <<\n\n", __FUNCTION__);
+  const size_t dimsizes[] = {50, 40, 30};
+  const double levels[] = {1.5, 2.5, 3.5};
+  const size_t count = 6000;
+  size_t *idxs = malloc(count * 3 * sizeof(size_t));
+  double *vals = malloc(count * sizeof(double));
+  spndarray_memory sd, sm;
+  size_t mismatches = 0;
+
+  for (size_t k = 0; k < count; k++) {
+    idxs[3 * k] = (k * 7) % 50;
+    idxs[3 * k + 1] = (k * 13) % 40;
+    idxs[3 * k + 2] = (k * k) % 30;
+    vals[k] = levels[k % 3];
+  }
+
+  // a few distinct values, against a double array
+  spndarray *d = spndarray_alloc_nzmax(3, dimsizes, count, SPNDARRAY_NTUPLE);
+  spndarray *m = spndarray_alloc_nzmax(3, dimsizes, count,
+                                       SPNDARRAY_NTUPLE | SPNDARRAY_DICT8);
+  spndarray_set_batch(d, count, vals, idxs);
+  spndarray_set_batch(m, count / 2, vals, idxs);
+  for (size_t k = count / 2; k < count; k++)
+    spndarray_set(m, vals[k], &idxs[3 * k]);
+  spndarray_incr_batch(d, 100, idxs, NULL);
+  spndarray_incr_batch(m, 100, idxs, NULL);
+  spndarray_incr(d, &idxs[300]);
+  spndarray_incr(m, &idxs[300]);
+  mismatches += m->nz != d->nz;
+  for (size_t k = 0; k < count; k++)
+    mismatches += spndarray_get(m, &idxs[3 * k]) !=
+                  spndarray_get(d, &idxs[3 * k]);
+  spndarray_memory_stats(d, &sd);
+  spndarray_memory_stats(m, &sm);
+  mismatches += sm.data * 4 > sd.data;
+
+  // mapping the values only goes through the dictionary, and the
+  // copy-on-write clone keeps the values of m
+  spndarray *c = spndarray_clone_cow(m);
+  const size_t distinct = spndarray_dict_size(m);
+  spndarray_negate(d);
+  spndarray_negate(c);
+  spndarray_mulinverse(d);
+  spndarray_mulinverse(c);
+  spndarray_fmap(d, square);
+  spndarray_fmap(c, square);
+  mismatches += spndarray_dict_size(c) != distinct || c->shared == NULL;
+  for (size_t k = 0; k < count; k++)
+    mismatches += spndarray_get(c, &idxs[3 * k]) !=
+                      spndarray_get(d, &idxs[3 * k]) ||
+                  spndarray_get(m, &idxs[3 * k]) ==
+                      spndarray_get(d, &idxs[3 * k]);
+
+  spndarray *r = spndarray_reduce(c, 2, reduce_sum);
+  spndarray *rd = spndarray_reduce(d, 2, reduce_sum);
+  mismatches += r->nz != rd->nz;
+  for (size_t n = 0; n < rd->nz; n++)
+    mismatches += spndarray_get(r, (size_t[]){rd->dims[0][n],
+                                              rd->dims[1][n]}) != rd->data[n];
+  spndarray_free(r);
+  spndarray_free(rd);
+  spndarray_free(c);
+  printf("dictionary of %zd values: %zd mismatches\n", distinct, mismatches);
+
+  // 256 values at most, but values that are not used anymore make room
+  mismatches = 0;
+  spndarray *small = spndarray_alloc_nzmax(1, (size_t[]){300}, 300,
+                                           SPNDARRAY_NTUPLE | SPNDARRAY_DICT8);
+  for (size_t k = 0; k < 256; k++)
+    mismatches += spndarray_set(small, k + 0.5, (size_t[]){k}) != 0;
+  mismatches += spndarray_set(small, 1000.0, (size_t[]){256}) != 1;
+  mismatches += spndarray_get(small, (size_t[]){256}) != 0.0;
+  spndarray_set(small, 100.5, (size_t[]){0});
+  spndarray_set(small, 100.5, (size_t[]){1});
+  mismatches += spndarray_set(small, 1000.0, (size_t[]){256}) != 0;
+  mismatches += spndarray_dict_size(small) != 255;
+  for (size_t k = 2; k < 256; k++)
+    mismatches += spndarray_get(small, (size_t[]){k}) != k + 0.5;
+  mismatches += spndarray_get(small, (size_t[]){256}) != 1000.0;
+  // an increment needing a 257th value fails and keeps the old one
+  mismatches += spndarray_set(small, 5000.0, (size_t[]){257}) != 0;
+  mismatches += spndarray_incr(small, (size_t[]){257}) != 1;
+  mismatches += spndarray_get(small, (size_t[]){257}) != 5000.0;
+
+  spndarray *wide = spndarray_convert(small, SPNDARRAY_DICT16);
+  mismatches += spndarray_set(wide, 2000.0, (size_t[]){257}) != 0;
+  mismatches += spndarray_set(wide, 3000.0, (size_t[]){258}) != 0;
+  mismatches += spndarray_convert(wide, SPNDARRAY_DICT8) != NULL;
+  spndarray *back = spndarray_convert(wide, SPNDARRAY_FLOAT64);
+  mismatches += spndarray_tree_rebuild(wide) || back->nz != wide->nz;
+  for (size_t k = 0; k < 259; k++)
+    mismatches += spndarray_get(back, (size_t[]){k}) !=
+                  spndarray_get(wide, (size_t[]){k});
+  spndarray_free(back);
+  spndarray_free(wide);
+  spndarray_free(small);
+  printf("full dictionaries: %zd mismatches\n", mismatches);
+
+  spndarray_free(m);
+  spndarray_free(d);
+  free(vals);
+  free(idxs);
+  printf("\n>> %s Finished <<\n\n", __FUNCTION__);
+}
+
+static void test_rank() {
+  printf(">> Running %s <<\n\n", __FUNCTION__);
+  const size_t count = 3000;
+  size_t mismatches = 0;
+
+  // the same elements, inserted out of order, through the routines of
+  // every rank and through the generic ones past SPNDARRAY_RANK_MAX
+  for (size_t ndim = 1; ndim <= SPNDARRAY_RANK_MAX + 2; ndim++) {
+    size_t dimsizes[ndim], idxs[ndim];
+    for (size_t i = 0; i < ndim; i++)
+      dimsizes[i] = 1;
+    spndarray *m = spndarray_alloc(ndim, dimsizes);
+    mismatches += m->rank != spndarray_rank_ops_for(ndim) ||
+                  m->rank->ndim != (ndim <= SPNDARRAY_RANK_MAX ? ndim : 0);
+
+    for (size_t k = 0; k < count; k++) {
+      const size_t key = (k * 7919) % count;
+      for (size_t i = 0; i < ndim; i++)
+        idxs[i] = key / (i + 1) % 11;
+      spndarray_set(m, key + 1.0, idxs);
+    }
+    // the elements again, appended in reverse and sorted by a rebuild
+    spndarray *bulk = spndarray_alloc_nzmax(ndim, m->dimsizes, m->nz,
+                                            SPNDARRAY_NTUPLE);
+    for (size_t n = 0; n < m->nz; n++) {
+      for (size_t i = 0; i < ndim; i++)
+        bulk->dims[i][n] = m->dims[i][m->nz - 1 - n];
+      bulk->data[n] = m->data[m->nz - 1 - n];
+    }
+    bulk->nz = m->nz;
+    mismatches += spndarray_tree_rebuild(bulk) || bulk->nz != m->nz;
+    for (size_t n = 0; n < m->nz; n++) {
+      for (size_t i = 0; i < ndim; i++)
+        idxs[i] = m->dims[i][n];
+      mismatches += spndarray_get(bulk, idxs) != m->data[n];
+    }
+    idxs[ndim - 1] = 11;
+    mismatches += spndarray_contains(m, idxs);
+    spndarray_free(bulk);
+    spndarray_free(m);
+  }
+  printf("ranks 1 to %d: %zd mismatches\n", SPNDARRAY_RANK_MAX + 2,
+         mismatches);
+  printf("\n>> %s Finished <<\n\n", __FUNCTION__);
+}
+
 int main() {
   test_getset();
   test_incr();
   test_reduce();
   test_op();
+  test_batch();
+  test_freeze();
+  test_filter();
+  test_sharded();
+  test_parallel();
+  test_partition();
+  test_concat();
+  test_clone();
+  test_binary();
+  test_tns();
+  test_pack();
+  test_dense_fwrite();
+  test_dense();
+  test_chunked();
+  test_allocator();
+  test_sizing();
+  test_memory();
+  test_stats();
+  test_blocked();
+  test_vtypes();
+  test_dict();
+  test_rank();
 }
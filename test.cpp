@@ -0,0 +1,59 @@
+#include "spndarray.hpp"
+#include <cstdio>
+
+/*
+ * Checks the typed C++ wrapper against the C routines
+ */
+template <size_t N, typename T> static size_t check_array() {
+  typename spnd::array<N, T>::index idx;
+  idx.fill(1);
+  spnd::array<N, T> a(idx, 16);
+  size_t mismatches = 0;
+
+  for (size_t k = 0; k < 2000; k++) {
+    for (size_t i = 0; i < N; i++)
+      idx[i] = (k * (2 * i + 3)) % 17;
+    a.set(idx, static_cast<T>(k % 5 + 1));
+    a.incr(idx);
+  }
+  mismatches += a.raw()->rank->ndim != (N <= SPNDARRAY_RANK_MAX ? N : 0);
+
+  spnd::array<N, T> c = a.clone();
+  a.for_each([&](const typename spnd::array<N, T>::index &i, const T x) {
+    mismatches += c.get(i) != x || !c.contains(i) ||
+                  spndarray_get(c.raw(), i.data()) != static_cast<double>(x);
+  });
+  idx.fill(20);
+  mismatches += a.get(idx) != 0 || a.contains(idx);
+  return mismatches;
+}
+
+static void test_cxx() {
+  printf(">> Running %s <<\n\n", __FUNCTION__);
+  size_t mismatches = check_array<1, double>() + check_array<2, float>() +
+                      check_array<3, int64_t>() + check_array<4, uint32_t>() +
+                      check_array<5, double>();
+
+  spnd::array<3, uint32_t> counts({4, 4, 4});
+  mismatches += counts.incr({1, 2, 3}) != 0 || counts.incr({1, 2, 3}) != 0;
+  mismatches += counts(1, 2, 3) != 2 || counts(0, 0, 0) != 0;
+
+  // arrays of another rank, value type or storage are refused
+  const size_t dims[] = {4, 4, 4};
+  const auto refused = [&](const size_t ndim, const size_t flags) {
+    try {
+      spnd::array<3, double> a(spndarray_alloc_nzmax(ndim, dims, 1, flags));
+    } catch (const std::invalid_argument &) {
+      return true;
+    }
+    return false;
+  };
+  mismatches += !refused(2, SPNDARRAY_NTUPLE);
+  mismatches += !refused(3, SPNDARRAY_NTUPLE | SPNDARRAY_FLOAT32);
+  mismatches += !refused(3, SPNDARRAY_NTUPLE | SPNDARRAY_DICT8);
+  mismatches += refused(3, SPNDARRAY_NTUPLE);
+  printf("%zd mismatches\n", mismatches);
+  printf("\n>> %s Finished <<\n\n", __FUNCTION__);
+}
+
+int main() { test_cxx(); }